@@ -0,0 +1,155 @@
+#include "apic.h"
+#include "x86.h"
+#include "memory.h"
+#include "memareas.h"
+#include "debug.h"
+
+#include "support/assert.h"
+
+// Register offsets
+#define LAPIC_REG_ID         0x020
+#define LAPIC_REG_VERSION    0x030
+#define LAPIC_REG_TPR        0x080
+#define LAPIC_REG_EOI        0x0B0
+#define LAPIC_REG_SVR        0x0F0
+#define LAPIC_REG_ICR_LOW    0x300
+#define LAPIC_REG_ICR_HIGH   0x310
+#define LAPIC_REG_LVT_TIMER  0x320
+#define LAPIC_REG_LVT_LINT0  0x350
+#define LAPIC_REG_LVT_LINT1  0x360
+#define LAPIC_REG_LVT_ERROR  0x370
+#define LAPIC_REG_TIMER_INIT 0x380
+#define LAPIC_REG_TIMER_CUR  0x390
+#define LAPIC_REG_TIMER_DIV  0x3E0
+
+#define LAPIC_SVR_ENABLE        0x00000100
+#define LAPIC_LVT_MASKED        0x00010000
+#define LAPIC_LVT_PERIODIC      0x00020000
+#define LAPIC_LVT_EXTINT        0x00000700
+#define LAPIC_LVT_NMI           0x00000400
+#define LAPIC_ICR_INIT          0x00000500
+#define LAPIC_ICR_STARTUP       0x00000600
+#define LAPIC_ICR_ASSERT        0x00004000
+#define LAPIC_ICR_PENDING       0x00001000
+#define LAPIC_TIMER_DIV_16      0x3
+
+#define PIT_FREQUENCY        1193182
+
+// Global state
+static uint32_t ticks_per_ms = 0;
+
+static inline uint32_t read_reg(uint32_t reg)
+{
+  return *(volatile uint32_t *)(LAPIC_VIRTUAL_BASE + reg);
+}
+
+static inline void write_reg(uint32_t reg, uint32_t value)
+{
+  *(volatile uint32_t *)(LAPIC_VIRTUAL_BASE + reg) = value;
+}
+
+void lapic_init(uintptr_t phys_address)
+{
+  mem_map_kernel_device(LAPIC_VIRTUAL_BASE, phys_address, 0x1000);
+  log(apic, "local apic at %p, version %x", phys_address, read_reg(LAPIC_REG_VERSION) & 0xFF);
+}
+
+//
+// lapic_enable - enables the local APIC of the executing CPU. The
+// BSP keeps receiving the PIC's interrupts through LINT0.
+//
+void lapic_enable(bool bootstrap)
+{
+  write_reg(LAPIC_REG_TPR, 0);
+  write_reg(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED);
+  write_reg(LAPIC_REG_LVT_ERROR, LAPIC_LVT_MASKED);
+  write_reg(LAPIC_REG_LVT_LINT0, bootstrap ? LAPIC_LVT_EXTINT : LAPIC_LVT_MASKED);
+  write_reg(LAPIC_REG_LVT_LINT1, bootstrap ? LAPIC_LVT_NMI : LAPIC_LVT_MASKED);
+  write_reg(LAPIC_REG_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+  lapic_eoi();
+}
+
+uint8_t lapic_id()
+{
+  return read_reg(LAPIC_REG_ID) >> 24;
+}
+
+void lapic_eoi()
+{
+  write_reg(LAPIC_REG_EOI, 0);
+}
+
+static void send_icr(uint8_t apic_id, uint32_t command)
+{
+  write_reg(LAPIC_REG_ICR_HIGH, (uint32_t)apic_id << 24);
+  write_reg(LAPIC_REG_ICR_LOW, command);
+
+  while (read_reg(LAPIC_REG_ICR_LOW) & LAPIC_ICR_PENDING)
+    cpu_relax();
+}
+
+void lapic_send_init(uint8_t apic_id)
+{
+  send_icr(apic_id, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT);
+}
+
+void lapic_send_startup(uint8_t apic_id, uintptr_t trampoline_phys)
+{
+  // The vector is the page number of the real mode entry point
+  assert(!(trampoline_phys & 0xFFF) && trampoline_phys < 0x100000);
+  send_icr(apic_id, LAPIC_ICR_STARTUP | LAPIC_ICR_ASSERT | (trampoline_phys >> 12));
+}
+
+void lapic_send_ipi(uint8_t apic_id, uint8_t vector)
+{
+  send_icr(apic_id, LAPIC_ICR_ASSERT | vector);
+}
+
+void lapic_calibrate_timer()
+{
+  const int calibration_ms = 10;
+  const uint16_t pit_count = PIT_FREQUENCY * calibration_ms / 1000;
+
+  // PIT channel 2 isn't connected to any IRQ, but its output can be
+  // polled in port 0x61. Gate on, speaker off.
+  outb(0x61, (inb(0x61) & ~0x02) | 0x01);
+  outb(0x43, 0xB0);  // Channel 2, lo/hi byte, mode 0
+  outb(0x42, pit_count & 0xFF);
+  outb(0x42, pit_count >> 8);
+
+  write_reg(LAPIC_REG_TIMER_DIV, LAPIC_TIMER_DIV_16);
+  write_reg(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED);
+  write_reg(LAPIC_REG_TIMER_INIT, 0xFFFFFFFF);
+
+  while (!(inb(0x61) & 0x20))
+    cpu_relax();
+
+  uint32_t elapsed = 0xFFFFFFFF - read_reg(LAPIC_REG_TIMER_CUR);
+  write_reg(LAPIC_REG_TIMER_INIT, 0);
+
+  ticks_per_ms = p2::max<uint32_t>(elapsed / calibration_ms, 1);
+  log(apic, "timer runs at %d ticks/ms", ticks_per_ms);
+}
+
+void lapic_start_timer(int hz)
+{
+  assert(ticks_per_ms && "the timer needs to be calibrated");
+  write_reg(LAPIC_REG_TIMER_DIV, LAPIC_TIMER_DIV_16);
+  write_reg(LAPIC_REG_LVT_TIMER, LAPIC_LVT_PERIODIC | LAPIC_TIMER_VECTOR);
+  write_reg(LAPIC_REG_TIMER_INIT, ticks_per_ms * 1000 / hz);
+}
+
+//
+// lapic_delay_us - busy-waits using the timer in one-shot mode. Only
+// for CPUs that haven't started their periodic timer.
+//
+void lapic_delay_us(uint32_t microseconds)
+{
+  assert(ticks_per_ms && "the timer needs to be calibrated");
+  write_reg(LAPIC_REG_TIMER_DIV, LAPIC_TIMER_DIV_16);
+  write_reg(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED);
+  write_reg(LAPIC_REG_TIMER_INIT, p2::max<uint32_t>((uint64_t)ticks_per_ms * microseconds / 1000, 1));
+
+  while (read_reg(LAPIC_REG_TIMER_CUR) != 0)
+    cpu_relax();
+}
@@ -0,0 +1,34 @@
+// -*- c++ -*-
+//
+// Local APIC: per-CPU interrupt controller used for inter-processor
+// interrupts and the per-CPU timer. Device IRQs still go through the
+// legacy PIC to the bootstrap processor.
+//
+
+#ifndef PEOS2_APIC_H
+#define PEOS2_APIC_H
+
+#include <stdint.h>
+
+#define LAPIC_TIMER_VECTOR     0x40
+#define LAPIC_SHOOTDOWN_VECTOR 0x41
+#define LAPIC_SPURIOUS_VECTOR  0xFF
+
+void    lapic_init(uintptr_t phys_address);
+void    lapic_enable(bool bootstrap);
+uint8_t lapic_id();
+void    lapic_eoi();
+
+void    lapic_send_init(uint8_t apic_id);
+void    lapic_send_startup(uint8_t apic_id, uintptr_t trampoline_phys);
+void    lapic_send_ipi(uint8_t apic_id, uint8_t vector);
+
+//
+// lapic_calibrate_timer - measures the timer frequency using PIT
+// channel 2. Needed before `lapic_start_timer` and `lapic_delay_us`.
+//
+void    lapic_calibrate_timer();
+void    lapic_start_timer(int hz);
+void    lapic_delay_us(uint32_t microseconds);
+
+#endif // !PEOS2_APIC_H
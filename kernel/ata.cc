@@ -0,0 +1,192 @@
+// ata - PIO driver for the master disk on the primary ATA bus
+//
+// Commands are polled with the device's interrupt masked. A request
+// from the buffer cache is a single READ/WRITE SECTORS command of up
+// to 256 sectors, so merged runs of blocks cost one command each.
+// Only 28 bit LBA is supported, which covers the first 128 GiB.
+//
+
+#include "ata.h"
+#include "blockdev.h"
+#include "x86.h"
+#include "debug.h"
+
+// Declarations
+#define ATA_IO_BASE        0x1F0
+#define ATA_CONTROL        0x3F6
+
+#define ATA_DATA           (ATA_IO_BASE + 0)
+#define ATA_ERROR          (ATA_IO_BASE + 1)
+#define ATA_SECTOR_COUNT   (ATA_IO_BASE + 2)
+#define ATA_LBA_LOW        (ATA_IO_BASE + 3)
+#define ATA_LBA_MID        (ATA_IO_BASE + 4)
+#define ATA_LBA_HIGH       (ATA_IO_BASE + 5)
+#define ATA_DRIVE          (ATA_IO_BASE + 6)
+#define ATA_STATUS         (ATA_IO_BASE + 7)
+#define ATA_COMMAND        (ATA_IO_BASE + 7)
+
+#define ATA_STATUS_ERR     0x01
+#define ATA_STATUS_DRQ     0x08
+#define ATA_STATUS_DF      0x20
+#define ATA_STATUS_BSY     0x80
+
+#define ATA_CONTROL_NIEN   0x02  // No interrupts
+
+#define ATA_DRIVE_LBA      0xE0  // Master, LBA addressing
+
+#define ATA_CMD_READ       0x20
+#define ATA_CMD_WRITE      0x30
+#define ATA_CMD_FLUSH      0xE7
+#define ATA_CMD_IDENTIFY   0xEC
+
+#define ATA_SECTOR_SIZE    512
+#define ATA_SECTORS_PER_BLOCK (BLOCK_SIZE / ATA_SECTOR_SIZE)
+#define ATA_POLL_LIMIT     10000000
+
+static_assert(BLOCK_MAX_RUN * ATA_SECTORS_PER_BLOCK <= 256, "a run has to fit in one command");
+
+static int read_blocks(block_device *device, uint32_t block, int count, char *const *buffers);
+static int write_blocks(block_device *device, uint32_t block, int count, const char *const *buffers);
+
+// Global state
+static block_device disk = {
+  .name = "hda",
+  .block_count = 0,
+  .read_blocks = read_blocks,
+  .write_blocks = write_blocks
+};
+
+// Definitions
+
+// Reading the alternate status four times gives the drive its 400 ns
+static void select_delay()
+{
+  for (int i = 0; i < 4; ++i)
+    inb(ATA_CONTROL);
+}
+
+//
+// wait_status - polls until BSY clears and, if @drq, data is ready
+//
+static int wait_status(bool drq)
+{
+  for (int i = 0; i < ATA_POLL_LIMIT; ++i) {
+    uint8_t status = inb(ATA_STATUS);
+
+    if (status & ATA_STATUS_BSY)
+      continue;
+
+    if (status & (ATA_STATUS_ERR|ATA_STATUS_DF))
+      return EIO;
+
+    if (!drq || (status & ATA_STATUS_DRQ))
+      return 0;
+  }
+
+  return ETIMEOUT;
+}
+
+static int issue(uint8_t command, uint32_t lba, int sectors)
+{
+  if (int ret = wait_status(false); ret < 0)
+    return ret;
+
+  outb(ATA_DRIVE, ATA_DRIVE_LBA | ((lba >> 24) & 0x0F));
+  select_delay();
+
+  // A count of 0 means 256
+  outb(ATA_SECTOR_COUNT, sectors & 0xFF);
+  outb(ATA_LBA_LOW, lba & 0xFF);
+  outb(ATA_LBA_MID, (lba >> 8) & 0xFF);
+  outb(ATA_LBA_HIGH, (lba >> 16) & 0xFF);
+  outb(ATA_COMMAND, command);
+  return 0;
+}
+
+void ata_init()
+{
+  // A floating bus reads as all ones
+  if (inb(ATA_STATUS) == 0xFF) {
+    log(ata, "no drives on the primary bus");
+    return;
+  }
+
+  outb(ATA_CONTROL, ATA_CONTROL_NIEN);
+  outb(ATA_DRIVE, ATA_DRIVE_LBA);
+  select_delay();
+
+  outb(ATA_SECTOR_COUNT, 0);
+  outb(ATA_LBA_LOW, 0);
+  outb(ATA_LBA_MID, 0);
+  outb(ATA_LBA_HIGH, 0);
+  outb(ATA_COMMAND, ATA_CMD_IDENTIFY);
+
+  if (inb(ATA_STATUS) == 0) {
+    log(ata, "no master drive");
+    return;
+  }
+
+  // ATAPI and SATA devices abort IDENTIFY and set a signature instead
+  for (int i = 0; i < ATA_POLL_LIMIT && (inb(ATA_STATUS) & ATA_STATUS_BSY); ++i) {}
+
+  if (inb(ATA_LBA_MID) != 0 || inb(ATA_LBA_HIGH) != 0) {
+    log(ata, "master isn't an ATA disk");
+    return;
+  }
+
+  if (wait_status(true) < 0) {
+    log(ata, "IDENTIFY failed");
+    return;
+  }
+
+  uint16_t identity[256];
+  insw(ATA_DATA, identity, ARRAY_SIZE(identity));
+
+  // Words 60 and 61 are the number of LBA28 addressable sectors
+  const uint32_t sectors = identity[60] | ((uint32_t)identity[61] << 16);
+  disk.block_count = sectors / ATA_SECTORS_PER_BLOCK;
+
+  if (disk.block_count == 0) {
+    log(ata, "disk is smaller than a block");
+    return;
+  }
+
+  bdev_register(&disk);
+}
+
+static int read_blocks(block_device *, uint32_t block, int count, char *const *buffers)
+{
+  if (int ret = issue(ATA_CMD_READ, block * ATA_SECTORS_PER_BLOCK, count * ATA_SECTORS_PER_BLOCK); ret < 0)
+    return ret;
+
+  for (int i = 0; i < count * ATA_SECTORS_PER_BLOCK; ++i) {
+    if (int ret = wait_status(true); ret < 0)
+      return ret;
+
+    char *sector = buffers[i / ATA_SECTORS_PER_BLOCK] + (i % ATA_SECTORS_PER_BLOCK) * ATA_SECTOR_SIZE;
+    insw(ATA_DATA, sector, ATA_SECTOR_SIZE / 2);
+  }
+
+  return 0;
+}
+
+static int write_blocks(block_device *, uint32_t block, int count, const char *const *buffers)
+{
+  if (int ret = issue(ATA_CMD_WRITE, block * ATA_SECTORS_PER_BLOCK, count * ATA_SECTORS_PER_BLOCK); ret < 0)
+    return ret;
+
+  for (int i = 0; i < count * ATA_SECTORS_PER_BLOCK; ++i) {
+    if (int ret = wait_status(true); ret < 0)
+      return ret;
+
+    const char *sector = buffers[i / ATA_SECTORS_PER_BLOCK] + (i % ATA_SECTORS_PER_BLOCK) * ATA_SECTOR_SIZE;
+    outsw(ATA_DATA, sector, ATA_SECTOR_SIZE / 2);
+  }
+
+  // Written data may sit in the drive's cache until it's flushed
+  if (int ret = wait_status(false); ret < 0)
+    return ret;
+
+  outb(ATA_COMMAND, ATA_CMD_FLUSH);
+  return wait_status(false);
+}
@@ -0,0 +1,12 @@
+// -*- c++ -*-
+
+#ifndef PEOS2_ATA_H
+#define PEOS2_ATA_H
+
+//
+// ata_init - registers the master disk of the primary ATA bus as the
+// block device "hda", if there is one
+//
+void ata_init();
+
+#endif // !PEOS2_ATA_H
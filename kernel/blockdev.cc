@@ -0,0 +1,753 @@
+#include "blockdev.h"
+#include "filesystem.h"
+#include "memory.h"
+#include "timer.h"
+#include "workqueue.h"
+#include "process.h"
+#include "locks.h"
+#include "debug.h"
+
+#include "support/pool.h"
+#include "support/queue.h"
+#include "support/utils.h"
+
+// Declarations
+#define BCACHE_BUFFERS       1024    // 4 MiB of blocks
+#define BCACHE_HASH_SLOTS    2048    // Power of two
+#define BCACHE_NONE          0xFFFF
+#define BCACHE_WRITEBACK_MS  5000
+#define BDEV_MAX_DEVICES     4
+#define BDEV_MAX_PREFETCHES  32
+
+struct bcache_buffer {
+  block_device *device;  // nullptr while unused
+  uint32_t block;
+  char *data;            // A kernel page, allocated on first use
+  bool dirty;
+  bool readahead;        // Prefetched and not used yet
+  uint16_t prev, next;   // LRU list, most recently used first
+  uint16_t next_in_slot;
+};
+
+struct bdev_opened_file {
+  block_device *device;
+  uint32_t position;
+  bdev_readahead readahead;
+};
+
+struct prefetch_request {
+  block_device *device;
+  uint32_t block;
+  uint32_t count;
+};
+
+static int read(int handle, char *data, int length);
+static int write(int handle, const char *data, int length);
+static int open(vfs_device *device, const char *path, uint32_t flags);
+static int close(int handle);
+static int control(int handle, uint32_t function, uint32_t param1, uint32_t param2);
+static int seek(int handle, int offset, int relative);
+static int tell(int handle, int *position);
+static int advise(int handle, uint32_t offset, uint32_t length, int advice);
+
+static void writeback_tick(int milliseconds);
+static void writeback_work(uintptr_t);
+static void readahead_main(uintptr_t);
+
+// Global state
+static bcache_buffer buffers[BCACHE_BUFFERS];
+static uint16_t slots[BCACHE_HASH_SLOTS];
+static uint16_t lru_head = BCACHE_NONE, lru_tail = BCACHE_NONE;
+static uint32_t dirty_count = 0;
+static bcache_stats stats;
+
+static block_device *devices[BDEV_MAX_DEVICES];
+static p2::fixed_pool<bdev_opened_file, 16> opened_files;
+
+static int writeback_elapsed = 0;
+static bool writeback_scheduled = false;
+
+static p2::queue<prefetch_request, BDEV_MAX_PREFETCHES> pending_prefetches;
+static condition_variable<1> prefetch_scheduled;
+static uint32_t drop_generation = 0;    // Bumped by every bdev_drop
+
+// Definitions
+static void lru_unlink(uint16_t idx)
+{
+  bcache_buffer &buf = buffers[idx];
+
+  if (buf.prev != BCACHE_NONE)
+    buffers[buf.prev].next = buf.next;
+  else
+    lru_head = buf.next;
+
+  if (buf.next != BCACHE_NONE)
+    buffers[buf.next].prev = buf.prev;
+  else
+    lru_tail = buf.prev;
+}
+
+static void lru_push_front(uint16_t idx)
+{
+  buffers[idx].prev = BCACHE_NONE;
+  buffers[idx].next = lru_head;
+
+  if (lru_head != BCACHE_NONE)
+    buffers[lru_head].prev = idx;
+  else
+    lru_tail = idx;
+
+  lru_head = idx;
+}
+
+static void lru_push_back(uint16_t idx)
+{
+  buffers[idx].prev = lru_tail;
+  buffers[idx].next = BCACHE_NONE;
+
+  if (lru_tail != BCACHE_NONE)
+    buffers[lru_tail].next = idx;
+  else
+    lru_head = idx;
+
+  lru_tail = idx;
+}
+
+static void touch(uint16_t idx)
+{
+  lru_unlink(idx);
+  lru_push_front(idx);
+}
+
+void bdev_init()
+{
+  for (auto &slot : slots)
+    slot = BCACHE_NONE;
+
+  for (uint16_t i = 0; i < BCACHE_BUFFERS; ++i) {
+    buffers[i].next_in_slot = BCACHE_NONE;
+    lru_push_back(i);
+  }
+
+  timer_register_tick_callback(writeback_tick);
+
+  proc_handle readahead_pid = proc_create_kernel_thread(readahead_main, 0);
+  proc_set_name(readahead_pid, "readahead");
+  proc_enqueue(readahead_pid);
+}
+
+void bdev_register(block_device *device)
+{
+  block_device **slot = nullptr;
+
+  for (auto &candidate : devices) {
+    if (!candidate) {
+      slot = &candidate;
+      break;
+    }
+  }
+
+  if (!slot) {
+    log(bdev, "too many devices, ignoring %s", device->name);
+    return;
+  }
+
+  *slot = device;
+
+  static vfs_device_driver interface = {
+    .write = write,
+    .read = read,
+    .open = open,
+    .close = close,
+    .control = control,
+    .seek = seek,
+    .tell = tell,
+    .mkdir = nullptr,
+    .poll = nullptr,
+    .readv = nullptr,
+    .writev = nullptr,
+    .readdir = nullptr,
+    .frame = nullptr,
+    .view = nullptr,
+    .advise = advise
+  };
+
+  vfs_node_handle node = vfs_create_node(VFS_FILESYSTEM);
+  vfs_set_driver(node, &interface, device);
+  vfs_add_dirent(vfs_lookup("/dev/"), device->name, node);
+
+  log(bdev, "%s: %d blocks", device->name, device->block_count);
+}
+
+block_device *bdev_find(const char *name)
+{
+  for (auto device : devices) {
+    if (device && strncmp(device->name, name, strlen(name) + 1) == 0)
+      return device;
+  }
+
+  return nullptr;
+}
+
+static uint16_t &slot_for(const block_device *device, uint32_t block)
+{
+  uint32_t key = (block * 2654435761u) ^ ((uintptr_t)device >> 4);
+  return slots[(key ^ (key >> 16)) & (BCACHE_HASH_SLOTS - 1)];
+}
+
+static uint16_t find(const block_device *device, uint32_t block)
+{
+  for (uint16_t idx = slot_for(device, block); idx != BCACHE_NONE; idx = buffers[idx].next_in_slot) {
+    if (buffers[idx].device == device && buffers[idx].block == block)
+      return idx;
+  }
+
+  return BCACHE_NONE;
+}
+
+static void unhash(uint16_t idx)
+{
+  uint16_t *link = &slot_for(buffers[idx].device, buffers[idx].block);
+
+  while (*link != idx)
+    link = &buffers[*link].next_in_slot;
+
+  *link = buffers[idx].next_in_slot;
+  buffers[idx].next_in_slot = BCACHE_NONE;
+}
+
+//
+// release - forgets what @idx holds and makes it the first to be
+// reused. Dirty data is lost.
+//
+static void release(uint16_t idx)
+{
+  bcache_buffer &buf = buffers[idx];
+
+  if (buf.dirty)
+    --dirty_count;
+
+  if (buf.readahead)
+    ++stats.readahead_wasted;
+
+  unhash(idx);
+  buf.device = nullptr;
+  buf.dirty = false;
+  buf.readahead = false;
+
+  lru_unlink(idx);
+  lru_push_back(idx);
+}
+
+//
+// write_back - writes dirty @idx together with the dirty blocks next to
+// it, as a single request
+//
+static int write_back(uint16_t idx)
+{
+  block_device *device = buffers[idx].device;
+  const uint32_t block = buffers[idx].block;
+  uint32_t first = block;
+
+  while (first > 0 && block - first < BLOCK_MAX_RUN - 1) {
+    uint16_t prev = find(device, first - 1);
+
+    if (prev == BCACHE_NONE || !buffers[prev].dirty)
+      break;
+
+    --first;
+  }
+
+  uint16_t run[BLOCK_MAX_RUN];
+  const char *data[BLOCK_MAX_RUN];
+  int count = 0;
+
+  for (; count < BLOCK_MAX_RUN; ++count) {
+    uint16_t next = find(device, first + count);
+
+    if (next == BCACHE_NONE || !buffers[next].dirty)
+      break;
+
+    run[count] = next;
+    data[count] = buffers[next].data;
+  }
+
+  ++stats.requests;
+
+  if (int ret = device->write_blocks(device, first, count, data); ret < 0) {
+    log(bdev, "%s: writing %d blocks at %d failed (%d)", device->name, count, first, ret);
+    return ret;
+  }
+
+  for (int i = 0; i < count; ++i)
+    buffers[run[i]].dirty = false;
+
+  dirty_count -= count;
+  stats.writebacks += count;
+  return 0;
+}
+
+//
+// take_buffer - reuses the least recently used buffer for @block,
+// writing back what it held if needed. A buffer that can't be written
+// back is moved to the front, for writeback to retry later, and the
+// least recently used clean buffer is taken instead. Returns the
+// buffer, which holds garbage, or a negative error.
+//
+static int take_buffer(block_device *device, uint32_t block)
+{
+  uint16_t idx = lru_tail;
+
+  if (buffers[idx].dirty) {
+    if (int ret = write_back(idx); ret < 0) {
+      touch(idx);
+
+      for (idx = lru_tail; idx != BCACHE_NONE && buffers[idx].dirty; idx = buffers[idx].prev) {}
+
+      if (idx == BCACHE_NONE)
+        return ret;
+    }
+  }
+
+  bcache_buffer &buf = buffers[idx];
+
+  if (!buf.data) {
+    buf.data = (char *)mem_alloc_kernel_page();
+
+    if (!buf.data)
+      return ENOSPACE;
+  }
+
+  if (buf.device)
+    unhash(idx);
+
+  if (buf.readahead)
+    ++stats.readahead_wasted;
+
+  buf.device = device;
+  buf.block = block;
+  buf.readahead = false;
+
+  uint16_t &slot = slot_for(device, block);
+  buf.next_in_slot = slot;
+  slot = idx;
+
+  touch(idx);
+  return idx;
+}
+
+//
+// read_run - reads @block and the blocks after it, up to @count in
+// total or the first one that's cached, in one request. @prefetch
+// marks the buffers for the readahead counters. Returns the buffer of
+// @block or a negative error.
+//
+static int read_run(block_device *device, uint32_t block, uint32_t count, bool prefetch)
+{
+  count = p2::min<uint32_t>(count, BLOCK_MAX_RUN);
+  uint32_t missing = 1;
+
+  while (missing < count &&
+         block + missing < device->block_count &&
+         find(device, block + missing) == BCACHE_NONE) {
+    ++missing;
+  }
+
+  uint16_t run[BLOCK_MAX_RUN];
+  char *data[BLOCK_MAX_RUN];
+
+  for (uint32_t i = 0; i < missing; ++i) {
+    int idx = take_buffer(device, block + i);
+
+    if (idx < 0) {
+      for (uint32_t j = 0; j < i; ++j)
+        release(run[j]);
+
+      return idx;
+    }
+
+    run[i] = idx;
+    data[i] = buffers[idx].data;
+  }
+
+  ++stats.requests;
+
+  if (int ret = device->read_blocks(device, block, missing, data); ret < 0) {
+    log(bdev, "%s: reading %d blocks at %d failed (%d)", device->name, missing, block, ret);
+
+    for (uint32_t i = 0; i < missing; ++i)
+      release(run[i]);
+
+    return ret;
+  }
+
+  if (prefetch) {
+    for (uint32_t i = 0; i < missing; ++i)
+      buffers[run[i]].readahead = true;
+
+    stats.readahead_blocks += missing;
+  }
+
+  return run[0];
+}
+
+//
+// get_block - the buffer holding @block. A miss is read from the
+// device together with the rest of the @count blocks the caller needs,
+// unless @overwrite says the caller replaces the whole block anyway.
+//
+static int get_block(block_device *device, uint32_t block, uint32_t count, bool overwrite)
+{
+  if (uint16_t idx = find(device, block); idx != BCACHE_NONE) {
+    ++stats.hits;
+
+    if (buffers[idx].readahead) {
+      buffers[idx].readahead = false;
+      ++stats.readahead_hits;
+    }
+
+    touch(idx);
+    return idx;
+  }
+
+  ++stats.misses;
+  return overwrite ? take_buffer(device, block) : read_run(device, block, count, false);
+}
+
+bool bdev_prefetch(block_device *device, uint32_t offset, uint32_t length)
+{
+  const uint64_t end = p2::min<uint64_t>((uint64_t)offset + length, (uint64_t)device->block_count * BLOCK_SIZE);
+
+  if (length == 0 || offset >= end)
+    return true;
+
+  const uint32_t first = offset / BLOCK_SIZE;
+  const uint32_t last = (end - 1) / BLOCK_SIZE;
+
+  if (!pending_prefetches.push_back(prefetch_request{device, first, last - first + 1})) {
+    dbg_puts(bdev, "prefetch queue full, dropping %d blocks", last - first + 1);
+    return false;
+  }
+
+  prefetch_scheduled.notify_one();
+  return true;
+}
+
+//
+// update_readahead - called after a read of [@offset, @end). A read
+// that continues where the previous one stopped doubles the window,
+// anything else closes it. Prefetching is topped up when less than
+// half a window is left ahead of the reader.
+//
+static void update_readahead(block_device *device, bdev_readahead *ra, uint32_t offset, uint32_t end)
+{
+  const bool sequential = offset == ra->next_offset;
+  ra->next_offset = end;
+
+  if (ra->advice == FADV_RANDOM)
+    return;
+
+  if (ra->advice == FADV_SEQUENTIAL)
+    ra->window = BLOCK_MAX_READAHEAD;
+  else if (sequential)
+    ra->window = p2::clamp<uint32_t>(ra->window * 2, 4, BLOCK_MAX_READAHEAD);
+  else
+    ra->window = ra->prefetched = 0;
+
+  if (ra->window == 0 || end >= ra->end)
+    return;
+
+  const uint32_t next_block = ALIGN_UP(end, BLOCK_SIZE) / BLOCK_SIZE;
+
+  if (ra->prefetched >= next_block + ra->window / 2)
+    return;
+
+  const uint32_t from = p2::max(ra->prefetched, next_block);
+  const uint32_t to = p2::min<uint32_t>(next_block + ra->window, ALIGN_UP(ra->end, BLOCK_SIZE) / BLOCK_SIZE);
+
+  // When the queue is full, the next read tries again
+  if (from < to && bdev_prefetch(device, from * BLOCK_SIZE, (to - from) * BLOCK_SIZE))
+    ra->prefetched = to;
+}
+
+int bdev_advise(block_device *device, bdev_readahead *ra, uint32_t offset, uint32_t length, int advice)
+{
+  switch (advice) {
+  case FADV_NORMAL:
+  case FADV_SEQUENTIAL:
+  case FADV_RANDOM:
+    ra->advice = advice;
+    ra->window = ra->prefetched = 0;
+    return 0;
+
+  case FADV_WILLNEED:
+    // Up to the end, like a length of 0 means for files
+    if (length == 0 && offset < ra->end)
+      length = ra->end - offset;
+
+    bdev_prefetch(device, offset, p2::min(length, ra->end - p2::min(offset, ra->end)));
+    return 0;
+
+  default:
+    return EINVVAL;
+  }
+}
+
+int bdev_read(block_device *device, uint32_t offset, char *data, int length, bdev_readahead *ra)
+{
+  const uint64_t size = (uint64_t)device->block_count * BLOCK_SIZE;
+
+  if (offset >= size || length <= 0)
+    return 0;
+
+  length = p2::min<uint64_t>(length, size - offset);
+  const uint32_t last_block = (offset + length - 1) / BLOCK_SIZE;
+  int done = 0;
+
+  while (done < length) {
+    const uint32_t block = (offset + done) / BLOCK_SIZE;
+    const uint32_t block_offset = (offset + done) % BLOCK_SIZE;
+    const int chunk = p2::min<int>(BLOCK_SIZE - block_offset, length - done);
+
+    int idx = get_block(device, block, last_block - block + 1, false);
+
+    if (idx < 0)
+      return done > 0 ? done : idx;
+
+    memcpy(data + done, buffers[idx].data + block_offset, chunk);
+    done += chunk;
+  }
+
+  if (ra)
+    update_readahead(device, ra, offset, offset + done);
+
+  return done;
+}
+
+int bdev_write(block_device *device, uint32_t offset, const char *data, int length)
+{
+  const uint64_t size = (uint64_t)device->block_count * BLOCK_SIZE;
+
+  if (offset >= size || length <= 0)
+    return length < 0 ? EINVVAL : ENOSPACE;
+
+  length = p2::min<uint64_t>(length, size - offset);
+  int done = 0;
+
+  while (done < length) {
+    const uint32_t block = (offset + done) / BLOCK_SIZE;
+    const uint32_t block_offset = (offset + done) % BLOCK_SIZE;
+    const int chunk = p2::min<int>(BLOCK_SIZE - block_offset, length - done);
+
+    int idx = get_block(device, block, 1, chunk == BLOCK_SIZE);
+
+    if (idx < 0)
+      return done > 0 ? done : idx;
+
+    bcache_buffer &buf = buffers[idx];
+    memcpy(buf.data + block_offset, data + done, chunk);
+
+    if (!buf.dirty) {
+      buf.dirty = true;
+      ++dirty_count;
+    }
+
+    done += chunk;
+  }
+
+  return done;
+}
+
+int bdev_sync(block_device *device)
+{
+  int ret = 0;
+
+  for (uint16_t idx = 0; idx < BCACHE_BUFFERS && dirty_count > 0; ++idx) {
+    if (buffers[idx].device == device && buffers[idx].dirty) {
+      if (int err = write_back(idx); err < 0)
+        ret = err;
+    }
+  }
+
+  return ret;
+}
+
+int bdev_drop(block_device *device)
+{
+  if (int ret = bdev_sync(device); ret < 0)
+    return ret;
+
+  // Queued prefetches would fill the cache right back up
+  for (size_t i = pending_prefetches.size(); i > 0; --i) {
+    prefetch_request request = pending_prefetches.pop_front();
+
+    if (request.device != device)
+      pending_prefetches.push_back(request);
+  }
+
+  // And so would the one being read
+  ++drop_generation;
+
+  for (uint16_t idx = 0; idx < BCACHE_BUFFERS; ++idx) {
+    if (buffers[idx].device == device)
+      release(idx);
+  }
+
+  return 0;
+}
+
+void bcache_get_stats(bcache_stats *out)
+{
+  *out = stats;
+}
+
+//
+// writeback_tick - dirty blocks don't stay in memory for more than a
+// few seconds
+//
+static void writeback_tick(int milliseconds)
+{
+  writeback_elapsed += milliseconds;
+
+  if (writeback_elapsed < BCACHE_WRITEBACK_MS)
+    return;
+
+  writeback_elapsed = 0;
+
+  if (dirty_count > 0 && !writeback_scheduled)
+    writeback_scheduled = workq_schedule(writeback_work, 0);
+}
+
+static void writeback_work(uintptr_t)
+{
+  interrupt_guard guard;
+  writeback_scheduled = false;
+
+  for (auto device : devices) {
+    if (device)
+      bdev_sync(device);
+  }
+}
+
+//
+// readahead_main - reads prefetch requests into the cache, one run of
+// blocks at a time so readers get the lock in between
+//
+static void readahead_main(uintptr_t)
+{
+  prefetch_request current = {nullptr, 0, 0};
+  uint32_t generation = drop_generation;
+
+  while (true) {
+    interrupt_guard guard;
+
+    // A drop came in between two runs, it may have been for this device
+    if (generation != drop_generation)
+      current.count = 0;
+
+    if (current.count == 0) {
+      while (pending_prefetches.size() == 0)
+        prefetch_scheduled.wait();
+
+      current = pending_prefetches.pop_front();
+      generation = drop_generation;
+    }
+
+    // Skip what readers got to first
+    while (current.count > 0 && find(current.device, current.block) != BCACHE_NONE) {
+      ++current.block;
+      --current.count;
+    }
+
+    if (current.count > 0) {
+      // Errors are left for the reader to run into
+      if (read_run(current.device, current.block, current.count, true) < 0)
+        current.count = 0;
+    }
+  }
+}
+
+// Raw device files
+static int open(vfs_device *device, const char *path, uint32_t)
+{
+  if (*path && strncmp(path, "/", 2) != 0)
+    return ENOENT;
+
+  if (opened_files.full())
+    return ENOSPACE;
+
+  block_device *disk = (block_device *)vfs_get_opaque(device);
+  const uint32_t size = p2::min<uint64_t>((uint64_t)disk->block_count * BLOCK_SIZE, 0xFFFFFFFF);
+
+  return opened_files.emplace_anywhere(bdev_opened_file{disk, 0, {0, size, 0, 0, FADV_NORMAL}});
+}
+
+static int close(int handle)
+{
+  opened_files.erase(handle);
+  return 0;
+}
+
+static int read(int handle, char *data, int length)
+{
+  bdev_opened_file &file = opened_files[handle];
+  int ret = bdev_read(file.device, file.position, data, length, &file.readahead);
+
+  if (ret > 0)
+    file.position += ret;
+
+  return ret;
+}
+
+static int write(int handle, const char *data, int length)
+{
+  bdev_opened_file &file = opened_files[handle];
+  int ret = bdev_write(file.device, file.position, data, length);
+
+  if (ret > 0)
+    file.position += ret;
+
+  return ret;
+}
+
+static int control(int handle, uint32_t function, uint32_t, uint32_t)
+{
+  block_device *device = opened_files[handle].device;
+
+  if (function == CTRL_BLOCK_SYNC)
+    return bdev_sync(device);
+
+  if (function == CTRL_BLOCK_DROP_CACHE)
+    return bdev_drop(device);
+
+  return ENOSUPPORT;
+}
+
+static int seek(int handle, int offset, int relative)
+{
+  bdev_opened_file &file = opened_files[handle];
+  int64_t position = file.position;
+
+  if (relative == SEEK_CUR)
+    position += offset;
+  else if (relative == SEEK_BEG)
+    position = offset;
+  else
+    return EINVVAL;
+
+  const int64_t size = (int64_t)file.device->block_count * BLOCK_SIZE;
+  file.position = p2::clamp<int64_t>(position, 0, p2::min<int64_t>(size, 0x7FFFFFFF));
+  return 0;
+}
+
+static int tell(int handle, int *position)
+{
+  *position = opened_files[handle].position;
+  return 0;
+}
+
+static int advise(int handle, uint32_t offset, uint32_t length, int advice)
+{
+  bdev_opened_file &file = opened_files[handle];
+  return bdev_advise(file.device, &file.readahead, offset, length, advice);
+}
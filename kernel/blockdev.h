@@ -0,0 +1,112 @@
+// -*- c++ -*-
+//
+// Block devices and the buffer cache. A driver describes its disk
+// with a `block_device` and registers it, which makes it available as
+// /dev/<name>. Everything else, raw device files and filesystems
+// alike, goes through `bdev_read` and `bdev_write`.
+//
+// Blocks are cached in page sized buffers and evicted in least
+// recently used order. Writes only dirty the buffers, which are
+// written back when they're evicted, on `bdev_sync` and every few
+// seconds. Misses are filled with a single request for all the missing
+// blocks of a read, and write-back merges neighbouring dirty blocks
+// the same way.
+//
+// Readers that pass a `bdev_readahead` get blocks prefetched ahead of
+// them by the "readahead" kernel thread, in a window that grows while
+// they read sequentially and closes when they don't.
+//
+
+#ifndef PEOS2_BLOCKDEV_H
+#define PEOS2_BLOCKDEV_H
+
+#include <stdint.h>
+
+#define BLOCK_SIZE           0x1000
+#define BLOCK_MAX_RUN        32      // Most blocks the cache asks for in one request
+#define BLOCK_MAX_READAHEAD  64      // Largest readahead window, in blocks
+
+struct block_device {
+  const char *name;
+  uint32_t block_count;
+
+  //
+  // read_blocks, write_blocks - transfer @count consecutive blocks
+  // starting at @block, one BLOCK_SIZE buffer per block. @count is
+  // at most BLOCK_MAX_RUN. Return 0 or a negative error.
+  //
+  int (*read_blocks)(block_device *device, uint32_t block, int count, char *const *buffers);
+  int (*write_blocks)(block_device *device, uint32_t block, int count, const char *const *buffers);
+};
+
+//
+// bdev_readahead - access pattern of one reader, usually an open file.
+// Set `next_offset` to where the file starts, so reading from the
+// start counts as sequential, and `end` to where it ends, as nothing
+// after it is prefetched.
+//
+struct bdev_readahead {
+  uint32_t next_offset;  // Where a sequential read continues
+  uint32_t end;
+  uint32_t window;       // Blocks to keep prefetched ahead of the reader
+  uint32_t prefetched;   // Block that prefetching has been asked up to
+  int advice;            // FADV_*
+};
+
+struct bcache_stats {
+  uint32_t hits;
+  uint32_t misses;
+  uint32_t requests;          // Reads and writes issued to drivers
+  uint32_t readahead_blocks;  // Prefetched ahead of a reader
+  uint32_t readahead_hits;    // ...and later used
+  uint32_t readahead_wasted;  // ...and evicted without being used
+  uint32_t writebacks;        // Dirty blocks written
+};
+
+void bdev_init();
+
+//
+// bdev_register - adds @device as /dev/<name>. @device has to outlive
+// the kernel.
+//
+void          bdev_register(block_device *device);
+block_device *bdev_find(const char *name);
+
+//
+// bdev_read, bdev_write - copy between the device at byte @offset and
+// kernel memory. Stop at the end of the device. Return the number of
+// bytes transferred or a negative error.
+//
+// Reads update @readahead, if set, and queue prefetching accordingly.
+//
+int bdev_read(block_device *device, uint32_t offset, char *data, int length, bdev_readahead *readahead);
+int bdev_write(block_device *device, uint32_t offset, const char *data, int length);
+
+//
+// bdev_prefetch - queues reading [@offset, @offset + @length) into the
+// cache, without waiting for it. Returns false if the request was
+// dropped because too many are queued.
+//
+bool bdev_prefetch(block_device *device, uint32_t offset, uint32_t length);
+
+//
+// bdev_advise - applies FADV_* @advice to @readahead. FADV_WILLNEED
+// prefetches [@offset, @offset + @length) of @device, or up to the
+// reader's end if @length is 0.
+//
+int bdev_advise(block_device *device, bdev_readahead *readahead, uint32_t offset, uint32_t length, int advice);
+
+//
+// bdev_sync - writes back every dirty block of @device
+//
+int bdev_sync(block_device *device);
+
+//
+// bdev_drop - syncs @device and forgets its cached blocks, so the next
+// reads go to the device
+//
+int bdev_drop(block_device *device);
+
+void bcache_get_stats(bcache_stats *stats);
+
+#endif // !PEOS2_BLOCKDEV_H
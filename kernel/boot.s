@@ -156,17 +156,31 @@ switch_task:
         mov 36(%esp), %ebx
         mov %esp, (%ebx)
 
-        // Change esp and cr3, 40 = 2nd argument
+        // Change esp and cr3, 40 = 2nd argument. Kernel threads share
+        // a space, so skip the TLB flush if cr3 doesn't change
         mov 40(%esp), %eax
         mov 44(%esp), %ebx
+        mov %cr3, %ecx
+        cmp %ebx, %ecx
+        je 1f
         mov %ebx, %cr3
-        mov %eax, %esp
+1:      mov %eax, %esp
 
         popal
         ret
 
 .global switch_task_iret
 switch_task_iret:
+        // Leave the kernel, the lock was taken by the interrupt or
+        // switch that brought us here
+        push %eax
+        push %ecx
+        push %edx
+        call kernel_lock_release
+        pop %edx
+        pop %ecx
+        pop %eax
+
         // This function is special; return IP comes *after* arguments
         push %eax
         mov 4(%esp), %ax
@@ -181,7 +195,7 @@ switch_task_iret:
 
         iret
 
-.macro isr_routine_common handler
+.macro isr_routine_common handler, locked=1
         // Save GRPs and caller DS
         pushal
         xor %eax, %eax
@@ -195,10 +209,18 @@ switch_task_iret:
         mov %ax, %fs
         mov %ax, %gs
 
+        .if \locked
+        call kernel_lock_acquire
+        .endif
+
         push %esp  // isr_registers pointer
         call \handler
         add $4, %esp
 
+        .if \locked
+        call kernel_lock_release
+        .endif
+
         // Restore caller DS and GPRs
         pop %eax
         mov %ax, %ds
@@ -231,6 +253,15 @@ switch_task_iret:
         isr_routine_common \handler
 .endm
 
+// For IPIs that are sent by a CPU holding the kernel lock
+.macro isr_routine_nolock name,handler
+.extern \handler
+.global \name
+\name:
+        push $0x0
+        isr_routine_common \handler, 0
+.endm
+
         isr_routine     isr_divzero,     int_divzero
         isr_routine     isr_debug,       int_debug
         isr_routine     isr_nmi,         int_nmi
@@ -260,3 +291,6 @@ switch_task_iret:
 
         isr_routine     isr_com1,        int_com1
         isr_routine     isr_rtl8139,     int_rtl8139
+
+        isr_routine     isr_lapic_timer, int_lapic_timer
+        isr_routine_nolock isr_tlb_shootdown, int_tlb_shootdown
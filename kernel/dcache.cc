@@ -0,0 +1,124 @@
+#include "dcache.h"
+
+#include "support/string.h"
+
+// Declarations
+#define DCACHE_SETS 256  // Power of two
+#define DCACHE_WAYS 4
+
+struct dcache_entry {
+  const void *owner;         // nullptr if the entry is free
+  uint32_t hash;
+  uint32_t last_used;
+  uint16_t parent;
+  uint16_t node;
+  uint8_t length;
+  char name[DCACHE_NAME_MAX];
+};
+
+// Global state
+static dcache_entry entries[DCACHE_SETS][DCACHE_WAYS];
+static uint32_t clock = 0;
+static dcache_stats stats;
+
+// Definitions
+dcache_name::dcache_name(const char *data, size_t length)
+  : data(data), length(length), hash(2166136261u)
+{
+  // FNV-1a
+  for (size_t i = 0; i < length; ++i) {
+    hash ^= (uint8_t)data[i];
+    hash *= 16777619u;
+  }
+}
+
+dcache_name path_segment(const char *path, const char **rest)
+{
+  const char *start = path + 1;
+  const char *end = start;
+
+  while (*end && *end != '/')
+    ++end;
+
+  *rest = end;
+  return dcache_name(start, end - start);
+}
+
+static dcache_entry *set_for(const void *owner, uint16_t parent, uint32_t hash)
+{
+  uint32_t key = hash ^ ((uintptr_t)owner >> 4) ^ (parent * 2654435761u);
+  return entries[(key ^ (key >> 16)) & (DCACHE_SETS - 1)];
+}
+
+static bool matches(const dcache_entry &entry, const void *owner, uint16_t parent, const dcache_name &name)
+{
+  return entry.owner == owner &&
+    entry.hash == name.hash &&
+    entry.parent == parent &&
+    entry.length == name.length &&
+    strncmp(entry.name, name.data, name.length) == 0;
+}
+
+dcache_result dcache_lookup(const void *owner, uint16_t parent, const dcache_name &name, uint16_t *node)
+{
+  if (name.length <= DCACHE_NAME_MAX) {
+    dcache_entry *set = set_for(owner, parent, name.hash);
+
+    for (int i = 0; i < DCACHE_WAYS; ++i) {
+      dcache_entry &entry = set[i];
+
+      if (!matches(entry, owner, parent, name))
+        continue;
+
+      entry.last_used = ++clock;
+
+      if (entry.node == DCACHE_NEGATIVE) {
+        ++stats.negative_hits;
+        return DCACHE_NOT_FOUND;
+      }
+
+      ++stats.hits;
+      *node = entry.node;
+      return DCACHE_FOUND;
+    }
+  }
+
+  ++stats.misses;
+  return DCACHE_MISS;
+}
+
+void dcache_insert(const void *owner, uint16_t parent, const dcache_name &name, uint16_t node)
+{
+  if (name.length > DCACHE_NAME_MAX)
+    return;
+
+  dcache_entry *set = set_for(owner, parent, name.hash);
+  dcache_entry *victim = &set[0];
+
+  for (int i = 0; i < DCACHE_WAYS; ++i) {
+    dcache_entry &entry = set[i];
+
+    if (matches(entry, owner, parent, name)) {
+      victim = &entry;
+      break;
+    }
+
+    if (!entry.owner && victim->owner)
+      victim = &entry;
+    else if (victim->owner && entry.last_used < victim->last_used)
+      victim = &entry;
+  }
+
+  victim->owner = owner;
+  victim->hash = name.hash;
+  victim->last_used = ++clock;
+  victim->parent = parent;
+  victim->node = node;
+  victim->length = name.length;
+  memcpy(victim->name, name.data, name.length);
+}
+
+void dcache_get_stats(dcache_stats *out)
+{
+  *out = stats;
+}
@@ -0,0 +1,69 @@
+// -*- c++ -*-
+//
+// Directory entry cache - remembers what a name in a directory
+// resolved to, or that it didn't resolve at all, so path lookups don't
+// have to scan directory lists. Used by the VFS and by filesystem
+// drivers alike: entries are keyed on an owner (any pointer unique to
+// the filesystem), the owner's handle of the parent directory and the
+// name.
+//
+// The cache has a fixed number of entries and evicts the least
+// recently used ones, so owners must be able to answer every lookup
+// themselves. They have to call `dcache_insert` whenever they add an
+// entry to a directory, as there might be a negative entry for it.
+//
+
+#ifndef PEOS2_DCACHE_H
+#define PEOS2_DCACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define DCACHE_NAME_MAX  31      // Longer names are never cached
+#define DCACHE_NEGATIVE  0xFFFF  // Node of entries for missing names
+
+enum dcache_result {
+  DCACHE_MISS,      // Not cached, ask the owner
+  DCACHE_FOUND,     // The name resolves to the returned node
+  DCACHE_NOT_FOUND  // The name is known not to exist
+};
+
+struct dcache_stats {
+  uint32_t hits;
+  uint32_t negative_hits;
+  uint32_t misses;
+};
+
+//
+// dcache_name - a path segment, not necessarily terminated
+//
+struct dcache_name {
+  dcache_name(const char *data, size_t length);
+
+  const char *data;
+  size_t length;
+  uint32_t hash;
+};
+
+//
+// dcache_lookup - looks up @name in @parent of @owner. Sets @node if
+// the result is DCACHE_FOUND.
+//
+dcache_result dcache_lookup(const void *owner, uint16_t parent, const dcache_name &name, uint16_t *node);
+
+//
+// dcache_insert - caches that @name in @parent is @node, or that it's
+// missing if @node is DCACHE_NEGATIVE. Replaces what was there before.
+//
+void dcache_insert(const void *owner, uint16_t parent, const dcache_name &name, uint16_t node);
+
+void dcache_get_stats(dcache_stats *stats);
+
+//
+// path_segment - splits the first segment off @path, which has to
+// start with a slash. Returns the segment and sets @rest to what
+// follows it, "/a/b" gives "a" and "/b".
+//
+dcache_name path_segment(const char *path, const char **rest);
+
+#endif // !PEOS2_DCACHE_H
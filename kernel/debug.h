@@ -4,6 +4,7 @@
 #define PEOS2_DEBUG_H
 
 #include "screen.h"
+#include "serial.h"
 #include "process.h"
 #include "support/string.h"
 #include "x86.h"
@@ -37,6 +38,7 @@ static inline void mute_fun(const char *, ...) {}
 
 static inline void dbg_break()
 {
+  com_flush();  // The emulator might exit
   asm volatile("xchg bx, bx");  // "magical breakpoint"
   outw(0xB004, 0x2000); // Bochs and older versions of QEMU
   outw(0x604, 0x2000);  // Newer versions of QEMU
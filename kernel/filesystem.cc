@@ -4,11 +4,17 @@
 #include "process.h"
 #include "debug.h"
 #include "syscall_utils.h"
+#include "locks.h"
+#include "timer.h"
+#include "dcache.h"
+#include "memory.h"
 
 #include "support/pool.h"
 #include "support/string.h"
 #include "support/utils.h"
 #include "support/assert.h"
+#include "support/slab.h"
+#include "support/index_bitmap.h"
 
 #include "filesystem_private.h"
 
@@ -22,8 +28,15 @@ static int syscall_seek(int fd, int offset, int relative);
 static int syscall_tell(int fd, int *position);
 static int syscall_mkdir(const char *path);
 static int syscall_dup2(int fd, int alias_fd);
+static int syscall_poll(pollfd_t *fds, int count, int timeout);
+static int syscall_readv(int fd, const iovec_t *iov, int count);
+static int syscall_writev(int fd, const iovec_t *iov, int count);
+static int syscall_readdir(int fd, dirent_t *entries, int count);
+static int syscall_sendfile(int out_fd, int in_fd, int *offset, int count);
+static int syscall_fadvise(int fd, int offset, int length, int advice);
 
 static int read_locally(int handle, char *data, int length);
+static int readdir_locally(int handle, dirent_t *entries, int count);
 static int open_locally(vfs_device *device, const char *path, uint32_t flags);
 static int close_locally(int handle);
 
@@ -34,11 +47,17 @@ static p2::fixed_pool<vfs_device, 64, decltype(vfs_node::info_node)> drivers;
 static vfs_node_handle root_dir;
 
 static p2::fixed_pool<context, 64, vfs_context> contexts;
-static p2::fixed_pool<opened_file, 64, opened_file_handle> opened_files;
-static p2::fixed_pool<locally_opened_file, 64, opened_file_handle> locally_opened_files;
+// Grow a page at a time, so open files are limited by memory rather
+// than by a fixed share of the whole system
+static p2::slab_pool<opened_file, 64, opened_file_handle> opened_files(mem_alloc_kernel_page);
+static p2::slab_pool<locally_opened_file, 16, opened_file_handle> locally_opened_files(mem_alloc_kernel_page);
 
 static vfs_node_handle local_driver_handle;
 
+// Everybody in `poll` waits here, and is woken up to check their fds
+// whenever any driver reports a change in readiness
+static condition_variable<32> poll_waiters;
+
 // Definitions
 vfs_node_handle vfs_create_node(uint8_t type)
 {
@@ -50,6 +69,10 @@ void vfs_add_dirent(vfs_node_handle dir_node, const char *name, vfs_node_handle
   vfs_node &parent = nodes[dir_node];
   assert(parent.type == VFS_DIRECTORY);
   parent.info_node = directories.emplace_anywhere(name, node, parent.info_node);
+
+  // Replaces any negative entry
+  const vfs_dirent &dirent = directories[parent.info_node];
+  dcache_insert(&nodes, dir_node, dcache_name(dirent.name.c_str(), dirent.name.size()), node);
 }
 
 void vfs_set_driver(vfs_node_handle driver_node, vfs_device_driver *driver, void *opaque)
@@ -71,6 +94,12 @@ void vfs_init()
   syscall_register(SYSCALL_NUM_TELL, (syscall_fun)syscall_tell);
   syscall_register(SYSCALL_NUM_MKDIR, (syscall_fun)syscall_mkdir);
   syscall_register(SYSCALL_NUM_DUP2, (syscall_fun)syscall_dup2);
+  syscall_register(SYSCALL_NUM_POLL, (syscall_fun)syscall_poll);
+  syscall_register(SYSCALL_NUM_READV, (syscall_fun)syscall_readv);
+  syscall_register(SYSCALL_NUM_WRITEV, (syscall_fun)syscall_writev);
+  syscall_register(SYSCALL_NUM_READDIR, (syscall_fun)syscall_readdir);
+  syscall_register(SYSCALL_NUM_SENDFILE, (syscall_fun)syscall_sendfile);
+  syscall_register(SYSCALL_NUM_FADVISE, (syscall_fun)syscall_fadvise);
 
   // Setup the VFS driver so it's easy to manipulate and read the VFS
   // TODO: set this on the root node instead, and change "find_first_driver" to "find_deepest_driver"
@@ -82,24 +111,32 @@ void vfs_init()
     .control = nullptr,
     .seek = nullptr,
     .tell = nullptr,
-    .mkdir = nullptr
+    .mkdir = nullptr,
+    .poll = nullptr,
+    .readv = nullptr,
+    .writev = nullptr,
+    .readdir = readdir_locally,
+    .frame = nullptr,
+    .view = nullptr,
+    .advise = nullptr
   };
 
   local_driver_handle = vfs_create_node(VFS_FILESYSTEM);
   vfs_set_driver(local_driver_handle, &local_driver, nullptr);
 }
 
-static vfs_dirent *find_dirent(vfs_node_handle dir_node, const p2::string<32> &name)
+static vfs_dirent *find_dirent(vfs_node_handle dir_node, const dcache_name &name)
 {
   const vfs_node &node = nodes[dir_node];
-  assert(node.type == VFS_DIRECTORY);
+  if (node.type != VFS_DIRECTORY)
+    return nullptr;
 
   uint16_t dirent_idx = node.info_node;
   while (dirent_idx != directories.end_sentinel()) {
     vfs_dirent &dirent = directories[dirent_idx];
 
-    // TODO: compare strings without doing a copy
-    if (name == p2::string<32>(dirent.name)) {
+    if (dirent.name.size() == (int)name.length &&
+        strncmp(dirent.name.c_str(), name.data, name.length) == 0) {
       return &dirent;
     }
 
@@ -109,31 +146,55 @@ static vfs_dirent *find_dirent(vfs_node_handle dir_node, const p2::string<32> &n
   return nullptr;
 }
 
-static vfs_node_handle vfs_lookup_aux(vfs_node_handle parent, const char *path)
+//
+// lookup_child - resolves @name in the directory @parent through the
+// dentry cache
+//
+static p2::opt<vfs_node_handle> lookup_child(vfs_node_handle parent, dcache_name name)
 {
-  // TODO: make this non-recursive to save on kernel stack space
+  vfs_node_handle child;
 
-  // Empty string or / references the parent
-  if (!*path || (path[0] == '/' && path[1] == '\0')) {
-    return parent;
-  }
+  // Names are stored truncated, so they're compared that way too
+  if (name.length > VFS_NAME_MAX)
+    name = dcache_name(name.data, VFS_NAME_MAX);
 
-  if (path[0] != '/')
-    return nodes.end_sentinel();
+  switch (dcache_lookup(&nodes, parent, name, &child)) {
+  case DCACHE_FOUND:
+    return child;
 
-  // TODO: cleanup string handling using string_view or similar
-  const char *seg_start = path + 1;
-  const char *next_segment = strchr((char *)seg_start, '/');
-  if (!next_segment) {
-    next_segment = strchr((char *)path, '\0');
-  }
+  case DCACHE_NOT_FOUND:
+    return {};
 
-  const p2::string<32> segment(seg_start, next_segment - seg_start);
-  if (const vfs_dirent *dirent = find_dirent(parent, segment)) {
-    return vfs_lookup_aux(dirent->node, next_segment);
+  case DCACHE_MISS:
+    break;
   }
 
-  return nodes.end_sentinel();
+  const vfs_dirent *dirent = find_dirent(parent, name);
+  dcache_insert(&nodes, parent, name, dirent ? dirent->node : DCACHE_NEGATIVE);
+
+  if (!dirent)
+    return {};
+
+  return dirent->node;
+}
+
+static vfs_node_handle vfs_lookup_aux(vfs_node_handle parent, const char *path)
+{
+  while (true) {
+    // Empty string or / references the parent
+    if (!*path || (path[0] == '/' && path[1] == '\0')) {
+      return parent;
+    }
+
+    if (path[0] != '/')
+      return nodes.end_sentinel();
+
+    auto child = lookup_child(parent, path_segment(path, &path));
+    if (!child)
+      return nodes.end_sentinel();
+
+    parent = *child;
+  }
 }
 
 vfs_node_handle vfs_lookup(const char *path)
@@ -179,32 +240,20 @@ struct ffd_retval {
 
 static p2::opt<ffd_retval> find_first_driver_aux(vfs_node_handle parent_idx, const char *path)
 {
-  // TODO: make this non-recursive to save on stack space
-
-  if (nodes[parent_idx].type & VFS_DRIVER) {
-    return {parent_idx, path};
-  }
-
-  // Empty string or / references the parent
-  if (!*path || (path[0] == '/' && path[1] == '\0') || path[0] != '/') {
-    return {};
-  }
-
-  // TODO: cleanup string handling using string_view or similar
-  const char *seg_start = path + 1;
-  const char *next_segment = strchr((char *)seg_start, '/');
+  while (!(nodes[parent_idx].type & VFS_DRIVER)) {
+    // Empty string or / references the parent
+    if (!*path || (path[0] == '/' && path[1] == '\0') || path[0] != '/') {
+      return {};
+    }
 
-  if (!next_segment) {
-    next_segment = strchr((char *)path, '\0');
-  }
+    auto child = lookup_child(parent_idx, path_segment(path, &path));
+    if (!child)
+      return {};
 
-  const p2::string<32> segment(seg_start, next_segment - seg_start);
-  if (const vfs_dirent *dirent = find_dirent(parent_idx, segment)) {
-    return find_first_driver_aux(dirent->node, next_segment);
+    parent_idx = *child;
   }
 
-  // Fall back to the local driver for manipulating and reading the VFS
-  return {};
+  return {parent_idx, path};
 }
 
 static p2::opt<ffd_retval> find_first_driver(vfs_node_handle parent_idx, const char *path)
@@ -213,6 +262,7 @@ static p2::opt<ffd_retval> find_first_driver(vfs_node_handle parent_idx, const c
     return ret;
   }
   else {
+    // Fall back to the local driver for manipulating and reading the VFS
     return {local_driver_handle, path};
   }
 }
@@ -222,14 +272,63 @@ void *vfs_get_opaque(vfs_device *device)
   return device->opaque;
 }
 
+//
+// find_descriptor - where the opened file of @fd is kept, or nullptr
+// if @fd isn't open
+//
+static opened_file_handle *find_descriptor(context &context_, vfs_fd fd)
+{
+  if (!context_.descriptors.used.test(fd))
+    return nullptr;
+
+  return &context_.descriptors.pages[fd / VFS_FDS_PER_PAGE][fd % VFS_FDS_PER_PAGE];
+}
+
+//
+// set_descriptor - points @fd to @file, allocating the page of the
+// table that holds it if needed
+//
+static bool set_descriptor(context &context_, vfs_fd fd, opened_file_handle file)
+{
+  opened_file_handle *&page = context_.descriptors.pages[fd / VFS_FDS_PER_PAGE];
+
+  if (!page && !(page = (opened_file_handle *)mem_alloc_kernel_page()))
+    return false;
+
+  context_.descriptors.used.set(fd);
+  page[fd % VFS_FDS_PER_PAGE] = file;
+  return true;
+}
+
+// add_descriptor - points the lowest free fd to @file
+static p2::res<vfs_fd> add_descriptor(context &context_, opened_file_handle file)
+{
+  int fd = context_.descriptors.used.take_lowest();
+
+  if (fd < 0)
+    return p2::failure(ENOSPACE);
+
+  if (!set_descriptor(context_, fd, file)) {
+    context_.descriptors.used.clear(fd);
+    return p2::failure(ENOSPACE);
+  }
+
+  return p2::success((vfs_fd)fd);
+}
+
 int vfs_close(vfs_context context_handle, vfs_fd local_fd)
 {
   context &context_ = contexts[context_handle];
-  opened_file_handle file_handle = context_.descriptors[local_fd];
+  opened_file_handle *descriptor = find_descriptor(context_, local_fd);
+
+  if (!descriptor)
+    return ENOENT;
+
+  opened_file_handle file_handle = *descriptor;
   opened_file &file_info = opened_files[file_handle];
 
   assert(file_info.device && file_info.device->driver);
-  context_.descriptors.erase(local_fd);
+  context_.descriptors.used.clear(local_fd);
 
   if (--file_info.ref_count == 0) {
     dbg_puts(vfs, "closing global opened file %d", file_handle);
@@ -253,12 +352,12 @@ static p2::res<opened_file *> fetch_opened_file(vfs_context context_handle, vfs_
   if (!contexts.valid(context_handle))
     return p2::failure(ENOENT);
 
-  context &context_ = contexts[context_handle];
+  opened_file_handle *descriptor = find_descriptor(contexts[context_handle], fd);
 
-  if (!context_.descriptors.valid(fd))
+  if (!descriptor)
     return p2::failure(ENOENT);
 
-  opened_file_handle file_handle = context_.descriptors[fd];
+  opened_file_handle file_handle = *descriptor;
 
   if (!opened_files.valid(file_handle))
     return p2::failure(ENOENT);
@@ -274,8 +373,12 @@ static p2::res<opened_file *> fetch_opened_file(vfs_context context_handle, vfs_
 static int syscall_write(int fd, const char *data, int length)
 {
   verify_ptr(vfs, data);
+  return vfs_write(proc_get_file_context(*proc_current_pid()), fd, data, length);
+}
 
-  p2::res<opened_file *> file = fetch_opened_file(proc_get_file_context(*proc_current_pid()), fd);
+int vfs_write(vfs_context context_handle, vfs_fd fd, const char *data, int length)
+{
+  p2::res<opened_file *> file = fetch_opened_file(context_handle, fd);
   if (!file)
     return file.error();
 
@@ -320,6 +423,334 @@ p2::res<size_t> vfs_read(vfs_context context_handle, vfs_fd fd, char *data, int
 }
 
 
+//
+// copy_iovec - copies @count iovecs from userspace to @dest so they
+// can't change while a driver uses them. Kills the caller if any of
+// the buffers are invalid.
+//
+static int copy_iovec(iovec_t *dest, const iovec_t *iov, int count)
+{
+  if (count < 1 || count > IOV_MAX)
+    return EINVVAL;
+
+  verify_buf(vfs, iov, count * sizeof(iovec_t));
+  memcpy(dest, iov, count * sizeof(iovec_t));
+
+  for (int i = 0; i < count; ++i) {
+    verify_buf(vfs, dest[i].base, dest[i].length);
+  }
+
+  return 0;
+}
+
+static int syscall_readv(int fd, const iovec_t *iov, int count)
+{
+  iovec_t vec[IOV_MAX];
+
+  if (int ret = copy_iovec(vec, iov, count); ret < 0)
+    return ret;
+
+  return vfs_readv(proc_get_file_context(*proc_current_pid()), fd, vec, count);
+}
+
+int vfs_readv(vfs_context context_handle, vfs_fd fd, const iovec_t *iov, int count)
+{
+  p2::res<opened_file *> file = fetch_opened_file(context_handle, fd);
+  if (!file)
+    return file.error();
+
+  const vfs_device_driver *driver = (*file)->device->driver;
+  const int handle = (*file)->device_local_handle;
+
+  if (driver->readv)
+    return driver->readv(handle, iov, count);
+
+  if (!driver->read)
+    return ENOSUPPORT;
+
+  int total = 0;
+
+  for (int i = 0; i < count; ++i) {
+    if (iov[i].length == 0)
+      continue;
+
+    // Only the first read is allowed to block
+    if (total > 0 && driver->poll && !(driver->poll(handle, POLL_IN) & POLL_IN))
+      break;
+
+    int ret = driver->read(handle, (char *)iov[i].base, iov[i].length);
+
+    if (ret < 0)
+      return total > 0 ? total : ret;
+
+    total += ret;
+
+    if ((uint32_t)ret < iov[i].length)
+      break;
+  }
+
+  return total;
+}
+
+static int syscall_writev(int fd, const iovec_t *iov, int count)
+{
+  iovec_t vec[IOV_MAX];
+
+  if (int ret = copy_iovec(vec, iov, count); ret < 0)
+    return ret;
+
+  return vfs_writev(proc_get_file_context(*proc_current_pid()), fd, vec, count);
+}
+
+int vfs_writev(vfs_context context_handle, vfs_fd fd, const iovec_t *iov, int count)
+{
+  p2::res<opened_file *> file = fetch_opened_file(context_handle, fd);
+  if (!file)
+    return file.error();
+
+  const vfs_device_driver *driver = (*file)->device->driver;
+  const int handle = (*file)->device_local_handle;
+
+  if (driver->writev)
+    return driver->writev(handle, iov, count);
+
+  if (!driver->write)
+    return ENOSUPPORT;
+
+  int total = 0;
+
+  for (int i = 0; i < count; ++i) {
+    if (iov[i].length == 0)
+      continue;
+
+    int ret = driver->write(handle, (const char *)iov[i].base, iov[i].length);
+
+    if (ret < 0)
+      return total > 0 ? total : ret;
+
+    total += ret;
+
+    if ((uint32_t)ret < iov[i].length)
+      break;
+  }
+
+  return total;
+}
+
+static int syscall_readdir(int fd, dirent_t *entries, int count)
+{
+  // Keeps the size of the buffer from wrapping
+  if (count < 1 || (uint32_t)count > p2::numeric_limits<uint32_t>::max() / sizeof(dirent_t))
+    return EINVVAL;
+
+  verify_buf(vfs, entries, count * sizeof(dirent_t));
+  return vfs_readdir(proc_get_file_context(*proc_current_pid()), fd, entries, count);
+}
+
+int vfs_readdir(vfs_context context_handle, vfs_fd fd, dirent_t *entries, int count)
+{
+  p2::res<opened_file *> file = fetch_opened_file(context_handle, fd);
+
+  if (!file)
+    return file.error();
+
+  if (!(*file)->device->driver->readdir)
+    return ENOSUPPORT;
+
+  return (*file)->device->driver->readdir((*file)->device_local_handle, entries, count);
+}
+
+static int syscall_sendfile(int out_fd, int in_fd, int *offset, int count)
+{
+  if (offset) {
+    verify_ptr(vfs, offset);
+  }
+
+  if (count < 0)
+    return EINVVAL;
+
+  int position = offset ? *offset : 0;
+  int ret = vfs_sendfile(proc_get_file_context(*proc_current_pid()), out_fd, in_fd, offset ? &position : nullptr, count);
+
+  if (offset)
+    *offset = position;
+
+  return ret;
+}
+
+//
+// write_all - writes @length bytes unless the driver fails or stops
+// taking them. Returns the number written, or the error if none were.
+//
+static int write_all(const opened_file *file, const char *data, int length)
+{
+  int total = 0;
+
+  while (total < length) {
+    int ret = file->device->driver->write(file->device_local_handle, data + total, length - total);
+
+    if (ret <= 0)
+      return total > 0 ? total : ret;
+
+    total += ret;
+  }
+
+  return total;
+}
+
+int vfs_sendfile(vfs_context context_handle, vfs_fd out_fd, vfs_fd in_fd, int *offset, int count)
+{
+  p2::res<opened_file *> out = fetch_opened_file(context_handle, out_fd);
+  if (!out)
+    return out.error();
+
+  p2::res<opened_file *> in = fetch_opened_file(context_handle, in_fd);
+  if (!in)
+    return in.error();
+
+  const vfs_device_driver *source = (*in)->device->driver;
+  const int handle = (*in)->device_local_handle;
+
+  if (!(*out)->device->driver->write || !source->read)
+    return ENOSUPPORT;
+
+  // Reading at an offset has to put the position back afterwards
+  int original_position = 0;
+
+  if (offset) {
+    if (!source->seek || !source->tell)
+      return ENOSUPPORT;
+
+    source->tell(handle, &original_position);
+    source->seek(handle, *offset, SEEK_BEG);
+  }
+
+  char buffer[2048];
+  int total = 0, error = 0;
+
+  while (total < count) {
+    const int wanted = count - total;
+    const char *data = nullptr;
+    int available = source->view && source->seek ? source->view(handle, &data) : ENOSUPPORT;
+
+    if (available == 0)
+      break;
+
+    if (available > 0) {
+      // Straight from the file's memory, no copy on our side
+      int written = write_all(*out, data, p2::min(available, wanted));
+
+      if (written <= 0) {
+        error = written;
+        break;
+      }
+
+      source->seek(handle, written, SEEK_CUR);
+      total += written;
+
+      if (written < p2::min(available, wanted))
+        break;
+
+      continue;
+    }
+
+    // Only the first read is allowed to block
+    if (total > 0 && source->poll && !(source->poll(handle, POLL_IN) & POLL_IN))
+      break;
+
+    int bytes_read = source->read(handle, buffer, p2::min<int>(sizeof(buffer), wanted));
+
+    if (bytes_read <= 0) {
+      error = bytes_read;
+      break;
+    }
+
+    int written = write_all(*out, buffer, bytes_read);
+
+    if (written < bytes_read) {
+      // Give back what wasn't sent, if the source can rewind
+      if (source->seek)
+        source->seek(handle, -(bytes_read - p2::max(written, 0)), SEEK_CUR);
+
+      if (written <= 0)
+        error = written;
+      else
+        total += written;
+
+      break;
+    }
+
+    total += written;
+  }
+
+  if (offset) {
+    *offset += total;
+    source->seek(handle, original_position, SEEK_BEG);
+  }
+
+  return total > 0 ? total : error;
+}
+
+int vfs_frame(vfs_context context_handle, vfs_fd fd, uint32_t offset, uintptr_t *phys_address)
+{
+  p2::res<opened_file *> file = fetch_opened_file(context_handle, fd);
+
+  if (!file)
+    return file.error();
+
+  if (!(*file)->device->driver->frame)
+    return ENOSUPPORT;
+
+  return (*file)->device->driver->frame((*file)->device_local_handle, offset, phys_address);
+}
+
+static int syscall_fadvise(int fd, int offset, int length, int advice)
+{
+  if (offset < 0 || length < 0)
+    return EINVVAL;
+
+  return vfs_advise(proc_get_file_context(*proc_current_pid()), fd, offset, length, advice);
+}
+
+int vfs_advise(vfs_context context_handle, vfs_fd fd, uint32_t offset, uint32_t length, int advice)
+{
+  p2::res<opened_file *> file = fetch_opened_file(context_handle, fd);
+
+  if (!file)
+    return file.error();
+
+  if (advice < FADV_NORMAL || advice > FADV_WILLNEED)
+    return EINVVAL;
+
+  // Just a hint
+  if (!(*file)->device->driver->advise)
+    return 0;
+
+  return (*file)->device->driver->advise((*file)->device_local_handle, offset, length, advice);
+}
+
+//
+// install_handle - gives the driver's @handle an opened file and the
+// lowest free fd. Closes @handle if that fails.
+//
+static p2::res<vfs_fd> install_handle(context &context_, vfs_device &device_node, int handle, uint32_t flags)
+{
+  opened_file_handle ofh = opened_files.emplace_anywhere(&device_node, handle, flags);
+  p2::res<vfs_fd> fd = ofh == opened_files.end_sentinel() ? p2::failure(ENOSPACE) : add_descriptor(context_, ofh);
+
+  if (!fd) {
+    if (ofh != opened_files.end_sentinel())
+      opened_files.erase(ofh);
+
+    if (device_node.driver->close)
+      device_node.driver->close(handle);
+
+    return p2::failure(fd.error());
+  }
+
+  return fd;
+}
+
 p2::res<vfs_fd> vfs_open(vfs_context context_handle, const char *filename, uint32_t flags)
 {
   context &context_ = contexts[context_handle];
@@ -343,10 +774,22 @@ p2::res<vfs_fd> vfs_open(vfs_context context_handle, const char *filename, uint3
   if (device_local_handle < 0)
     return p2::failure(device_local_handle);
 
-  opened_file_handle ofh = opened_files.emplace_anywhere(&device_node, device_local_handle, flags);
-  vfs_fd fd = context_.descriptors.emplace_anywhere(ofh);
-  dbg_puts(vfs, "opened %s at %d.%d", filename, context_handle, fd);
-  return p2::success(fd);
+  p2::res<vfs_fd> fd = install_handle(context_, device_node, device_local_handle, flags);
+
+  if (fd) {
+    dbg_puts(vfs, "opened %s at %d.%d", filename, context_handle, *fd);
+  }
+
+  return fd;
+}
+
+p2::res<vfs_fd> vfs_open_handle(vfs_context context_handle, vfs_node_handle driver_node_handle, int handle, uint32_t flags)
+{
+  const vfs_node &driver_node = nodes[driver_node_handle];
+  assert(driver_node.type & VFS_DRIVER);
+  assert(driver_node.info_node != drivers.end_sentinel());
+
+  return install_handle(contexts[context_handle], drivers[driver_node.info_node], handle, flags);
 }
 
 int vfs_seek(vfs_context context_handle, vfs_fd fd, int offset, int relative)
@@ -375,9 +818,12 @@ void vfs_destroy_context(vfs_context context_handle)
 
   context &context_ = contexts[context_handle];
 
-  for (int i = 0; i < context_.descriptors.watermark(); ++i) {
-    if (context_.descriptors.valid(i))
-      vfs_close(context_handle, i);
+  for (int fd = context_.descriptors.used.next(0); fd >= 0; fd = context_.descriptors.used.next(fd + 1))
+    vfs_close(context_handle, fd);
+
+  for (opened_file_handle *page : context_.descriptors.pages) {
+    if (page)
+      mem_free_kernel_page(page);
   }
 
   contexts.erase(context_handle);
@@ -387,13 +833,10 @@ void vfs_close_not_matching(vfs_context context_handle, uint32_t flags)
 {
   context &context_ = contexts[context_handle];
 
-  for (int i = 0; i < context_.descriptors.watermark(); ++i) {
-    if (!context_.descriptors.valid(i))
-      continue;
-
-    opened_file &file = opened_files[context_.descriptors[i]];
+  for (int fd = context_.descriptors.used.next(0); fd >= 0; fd = context_.descriptors.used.next(fd + 1)) {
+    opened_file &file = opened_files[*find_descriptor(context_, fd)];
     if (!(file.flags & flags))
-      vfs_close(context_handle, i);
+      vfs_close(context_handle, fd);
   }
 }
 
@@ -405,9 +848,10 @@ p2::res<vfs_context> vfs_fork_context(vfs_context context_handle)
 
   context &source_context = contexts[context_handle];
 
-  for (int i = 0; i < source_context.descriptors.watermark(); ++i) {
-    if (source_context.descriptors.valid(i)) {
-      vfs_alias_fd(context_handle, i, *new_context, i);
+  for (int fd = source_context.descriptors.used.next(0); fd >= 0; fd = source_context.descriptors.used.next(fd + 1)) {
+    if (int ret = vfs_alias_fd(context_handle, fd, *new_context, fd); ret < 0) {
+      vfs_destroy_context(*new_context);
+      return p2::failure(ret);
     }
   }
 
@@ -480,7 +924,12 @@ static int syscall_tell(int fd, int *position)
 
 static int syscall_control(int fd, uint32_t function, uint32_t param1, uint32_t param2)
 {
-  p2::res<opened_file *> file = fetch_opened_file(proc_get_file_context(*proc_current_pid()), fd);
+  return vfs_control(proc_get_file_context(*proc_current_pid()), fd, function, param1, param2);
+}
+
+int vfs_control(vfs_context context_handle, vfs_fd fd, uint32_t function, uint32_t param1, uint32_t param2)
+{
+  p2::res<opened_file *> file = fetch_opened_file(context_handle, fd);
 
   if (!file)
     return file.error();
@@ -491,6 +940,83 @@ static int syscall_control(int fd, uint32_t function, uint32_t param1, uint32_t
   return (*file)->device->driver->control((*file)->device_local_handle, function, param1, param2);
 }
 
+uint32_t vfs_poll(vfs_context context_handle, vfs_fd fd, uint32_t events)
+{
+  p2::res<opened_file *> file = fetch_opened_file(context_handle, fd);
+
+  if (!file)
+    return POLL_NVAL;
+
+  if (!(*file)->device->driver->poll)
+    return events & (POLL_IN|POLL_OUT);
+
+  return (*file)->device->driver->poll((*file)->device_local_handle, events) & events;
+}
+
+//
+// vfs_poll_wait - blocks until some driver calls `vfs_poll_notify` or
+// @timeout ms have passed (-1 to wait forever). Check readiness before
+// calling this, the kernel lock makes sure no notification is lost in
+// between.
+//
+int vfs_poll_wait(int timeout)
+{
+  if (poll_waiters.full())
+    return EBUSY;
+
+  return poll_waiters.wait_timeout(timeout);
+}
+
+//
+// vfs_poll_notify - wakes everybody in `poll`. Safe to call from
+// interrupt handlers.
+//
+void vfs_poll_notify()
+{
+  if (poll_waiters.has_waiters())
+    poll_waiters.notify_all();
+}
+
+static int syscall_poll(pollfd_t *fds, int count, int timeout)
+{
+  if (count < 0 || count > 64)
+    return EINVVAL;
+
+  if (count > 0)
+    verify_buf(vfs, fds, count * sizeof(pollfd_t));
+
+  vfs_context context = proc_get_file_context(*proc_current_pid());
+  const uint64_t deadline = timer_current_time() + timeout;
+
+  while (true) {
+    int ready = 0;
+
+    for (int i = 0; i < count; ++i) {
+      fds[i].revents = vfs_poll(context, fds[i].fd, fds[i].events);
+
+      if (fds[i].revents)
+        ++ready;
+    }
+
+    if (ready > 0 || timeout == 0)
+      return ready;
+
+    int time_left = -1;
+
+    if (timeout > 0) {
+      const uint64_t now = timer_current_time();
+
+      if (now >= deadline)
+        return 0;
+
+      time_left = deadline - now;
+    }
+
+    if (int ret = vfs_poll_wait(time_left); ret < 0 && ret != ETIMEOUT)
+      return ret;
+  }
+}
+
 int vfs_alias_fd(vfs_context src_ctx_handle, vfs_fd src_fd, vfs_context dst_ctx_handle, vfs_fd dst_fd)
 {
   context &source_context = contexts[src_ctx_handle];
@@ -498,20 +1024,28 @@ int vfs_alias_fd(vfs_context src_ctx_handle, vfs_fd src_fd, vfs_context dst_ctx_
 
   dbg_puts(vfs, "dup2: src_fd=%d, dest_fd=%d, src_ctx=%d, dest_ctx=%d", src_fd, dst_fd, src_ctx_handle, dst_ctx_handle);
 
-  if (!source_context.descriptors.valid(src_fd))
+  opened_file_handle *source = find_descriptor(source_context, src_fd);
+
+  if (!source)
     return ENOENT;
 
-  if (dest_context.descriptors.valid(dst_fd) &&
-      dest_context.descriptors[dst_fd] == source_context.descriptors[src_fd])
-    return 0;
+  if (dst_fd >= VFS_MAX_FDS)
+    return EINVVAL;
+
+  const opened_file_handle file_handle = *source;
+
+  if (opened_file_handle *dest = find_descriptor(dest_context, dst_fd)) {
+    if (*dest == file_handle)
+      return 0;
 
-  if (dest_context.descriptors.valid(dst_fd)) {
     // If the alias fd already exists, close it
     vfs_close(dst_ctx_handle, dst_fd);
   }
 
-  dest_context.descriptors.emplace(dst_fd, source_context.descriptors[src_fd]);
-  ++opened_files[source_context.descriptors[src_fd]].ref_count;
+  if (!set_descriptor(dest_context, dst_fd, file_handle))
+    return ENOSPACE;
+
+  ++opened_files[file_handle].ref_count;
   return 0;
 }
 
@@ -524,44 +1058,51 @@ static int syscall_dup2(int fd, int alias_fd)
 static int read_locally(int handle, char *data, int length)
 {
   locally_opened_file &opened_file = locally_opened_files[handle];
+  int bytes_written = 0;
 
-  vfs_node &node_ = nodes[opened_file.node];
-  assert(node_.type & VFS_DIRECTORY);
+  // `cursor` is the entry that `position` is in
+  while (opened_file.cursor != directories.end_sentinel() && length > 0) {
+    const vfs_dirent &entry = directories[opened_file.cursor];
+    int block_offset = opened_file.position % sizeof(dirent_t);
+    int copy_length = p2::min((int)sizeof(dirent_t) - block_offset, length);
 
-  if (node_.info_node == directories.end_sentinel()) {
-    // No entries to read
-    return 0;
-  }
+    dirent_t block = {};
+    memcpy(block.name, entry.name.c_str(), entry.name.size() + 1);
+    memcpy(data, (char *)&block + block_offset, copy_length);
 
-  uint16_t dirent_idx = node_.info_node;
-  int byte_offset = 0;
-  int bytes_written = 0;
+    data += copy_length;
+    opened_file.position += copy_length;
+    length -= copy_length;
+    bytes_written += copy_length;
 
-  while (dirent_idx != directories.end_sentinel() && length > 0) {
-    vfs_dirent &entry = directories[dirent_idx];
+    if (opened_file.position % sizeof(dirent_t) == 0)
+      opened_file.cursor = entry.next_dirent;
+  }
 
-    if (opened_file.position >= byte_offset &&
-        opened_file.position < byte_offset + (int)sizeof(dirent_t)) {
+  return bytes_written;
+}
+
+static int readdir_locally(int handle, dirent_t *entries, int count)
+{
+  locally_opened_file &opened_file = locally_opened_files[handle];
 
-      // Add this data
-      int block_offset = opened_file.position % sizeof(dirent_t);
-      int copy_length = p2::min((int)sizeof(dirent_t) - block_offset, length);
+  if (opened_file.position % sizeof(dirent_t) != 0 && opened_file.cursor != directories.end_sentinel()) {
+    opened_file.cursor = directories[opened_file.cursor].next_dirent;
+    opened_file.position += sizeof(dirent_t) - opened_file.position % sizeof(dirent_t);
+  }
 
-      dirent_t block;
-      memcpy(block.name, entry.name.c_str(), p2::min(entry.name.size() + 1, (int)sizeof(block.name)));
-      memcpy(data, (char *)&block + block_offset, copy_length);
+  int filled = 0;
 
-      data += copy_length;
-      opened_file.position += copy_length;
-      length -= copy_length;
-      bytes_written += copy_length;
-    }
+  while (opened_file.cursor != directories.end_sentinel() && filled < count) {
+    const vfs_dirent &entry = directories[opened_file.cursor];
+    dirent_t &out = entries[filled++];
 
-    byte_offset += sizeof(dirent_t);
-    dirent_idx = entry.next_dirent;
+    memcpy(out.name, entry.name.c_str(), entry.name.size() + 1);
+    opened_file.cursor = entry.next_dirent;
+    opened_file.position += sizeof(dirent_t);
   }
 
-  return bytes_written;
+  return filled;
 }
 
 static int open_locally(vfs_device */*device*/, const char *path, uint32_t /*flags*/)
@@ -573,7 +1114,9 @@ static int open_locally(vfs_device */*device*/, const char *path, uint32_t /*fla
 
   dbg_puts(vfs, "opened %s (node %d)", path, dir_handle);
 
-  return locally_opened_files.emplace_anywhere(dir_handle);
+  // Only directories are found through the local driver
+  opened_file_handle handle = locally_opened_files.emplace_anywhere(dir_handle, nodes[dir_handle].info_node);
+  return handle == locally_opened_files.end_sentinel() ? ENOSPACE : handle;
 }
 
 static int close_locally(int handle)
@@ -7,12 +7,15 @@
 #include <stddef.h>
 
 #include "support/result.h"
+#include "syscall_decls.h"
 
 #define VFS_DIRECTORY    0x01
 #define VFS_DRIVER       0x02
 #define VFS_CHAR_DEVICE  (0x10|VFS_DRIVER)
 #define VFS_FILESYSTEM   (0x20|VFS_DRIVER|VFS_DIRECTORY)
 
+#define VFS_MAX_FDS      4096   // Per context
+
 // Types
 typedef uint16_t vfs_node_handle;
 typedef uint16_t vfs_context;
@@ -96,6 +99,93 @@ struct vfs_device_driver {
   int (*tell)(int handle, int *position);
 
   int (*mkdir)(const char *path);
+
+  //
+  // poll - which of @events (POLL_*) @handle is ready for
+  // @handle: file handle to check
+  // @events: POLL_IN and/or POLL_OUT
+  //
+  // Must not block. Drivers where reads or writes can block have to
+  // call `vfs_poll_notify` whenever a handle might have become ready.
+  // Handles of drivers without `poll` are always ready.
+  //
+  // Returns the ready subset of @events.
+  //
+  uint32_t (*poll)(int handle, uint32_t events);
+
+  //
+  // readv, writev - scatter/gather versions of `read` and `write`
+  // @handle: file handle
+  // @iov: @count buffers, valid for the process
+  // @count: 1 to IOV_MAX
+  //
+  // Optional, for drivers that can do better than one `read` or
+  // `write` per buffer. Without them the VFS loops over the buffers.
+  //
+  // Returns the total number of bytes transferred or a negative error.
+  //
+  int (*readv)(int handle, const iovec_t *iov, int count);
+  int (*writev)(int handle, const iovec_t *iov, int count);
+
+  //
+  // readdir - fills the next entries of a directory
+  // @handle: file handle of an opened directory
+  // @entries: room for @count entries, valid for the process
+  // @count: at least 1
+  //
+  // Continues where the previous `readdir` or `read` stopped, so
+  // listing a directory is linear in its size however small the
+  // batches are. A partially read entry counts as read.
+  //
+  // Returns the number of entries filled in, 0 at the end of the
+  // directory, or a negative error.
+  //
+  int (*readdir)(int handle, dirent_t *entries, int count);
+
+  //
+  // frame - finds the physical page that holds part of a file
+  // @handle: file handle
+  // @offset: page aligned offset into the file
+  // @phys_address: set to the address of the page
+  //
+  // Optional, lets read-only file mappings use the file's own memory
+  // instead of a copy. Only for memory that is never freed or reused,
+  // as mappings don't hold references. The whole page must belong to
+  // the file, so a page shared with other data can't be returned.
+  //
+  // Returns 0 if @phys_address was set, or a negative error, in which
+  // case the caller copies the page using `read`.
+  //
+  int (*frame)(int handle, uint32_t offset, uintptr_t *phys_address);
+
+  //
+  // view - points out the file's data at the current position
+  // @handle: file handle
+  // @data: set to where the data is, in kernel memory
+  //
+  // Optional, lets `sendfile` write straight from the file's memory
+  // instead of reading into a buffer first. The data must stay valid
+  // while the destination's `write` blocks. The caller moves past what
+  // it used with `seek`.
+  //
+  // Returns how many bytes are contiguous at @data, 0 at the end of
+  // the file, or a negative error, in which case the caller uses
+  // `read`.
+  //
+  int (*view)(int handle, const char **data);
+
+  //
+  // advise - takes a hint about how the file is going to be read
+  // @handle: file handle
+  // @offset, @length: range for FADV_WILLNEED, 0 length means to the end
+  // @advice: FADV_*
+  //
+  // Optional, for drivers that read ahead. Without it the hint is
+  // ignored.
+  //
+  // Returns 0 or a negative error.
+  //
+  int (*advise)(int handle, uint32_t offset, uint32_t length, int advice);
 };
 
 // Filesystem management; creating nodes, registering drivers, etc.
@@ -109,7 +199,27 @@ void            *vfs_get_opaque(vfs_device *device);
 
 // Syscall-like functions but for the kernel
 p2::res<vfs_fd> vfs_open(vfs_context context_handle, const char *filename, uint32_t flags);
+
+//
+// vfs_open_handle - gives a handle that a driver created itself, not
+// through `open`, an fd in the context. For files without a path,
+// like pipes. @handle is closed on failure.
+//
+p2::res<vfs_fd> vfs_open_handle(vfs_context context_handle, vfs_node_handle driver_node, int handle, uint32_t flags);
 p2::res<size_t> vfs_read(vfs_context context_handle, vfs_fd fd, char *data, int length);
+int             vfs_write(vfs_context context_handle, vfs_fd fd, const char *data, int length);
+int             vfs_readv(vfs_context context_handle, vfs_fd fd, const iovec_t *iov, int count);
+int             vfs_writev(vfs_context context_handle, vfs_fd fd, const iovec_t *iov, int count);
+int             vfs_readdir(vfs_context context_handle, vfs_fd fd, dirent_t *entries, int count);
+int             vfs_sendfile(vfs_context context_handle, vfs_fd out_fd, vfs_fd in_fd, int *offset, int count);
+int             vfs_frame(vfs_context context_handle, vfs_fd fd, uint32_t offset, uintptr_t *phys_address);
+int             vfs_advise(vfs_context context_handle, vfs_fd fd, uint32_t offset, uint32_t length, int advice);
+int             vfs_control(vfs_context context_handle, vfs_fd fd, uint32_t function, uint32_t param1, uint32_t param2);
+
+// Readiness
+uint32_t        vfs_poll(vfs_context context_handle, vfs_fd fd, uint32_t events);
+int             vfs_poll_wait(int timeout);
+void            vfs_poll_notify();
 int             vfs_seek(vfs_context context_handle, vfs_fd fd, int offset, int relative);
 int             vfs_close(vfs_context context_handle, vfs_fd fd);
 void            vfs_close_not_matching(vfs_context context_handle, uint32_t flags);
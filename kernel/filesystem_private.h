@@ -5,6 +5,9 @@
 
 typedef uint16_t opened_file_handle;
 
+#define VFS_NAME_MAX 31  // Longer names are truncated
+#define VFS_FDS_PER_PAGE (0x1000 / sizeof(opened_file_handle))
+
 struct vfs_node {
   vfs_node(uint8_t type, vfs_node_handle info_node)
     : type(type),
@@ -23,7 +26,7 @@ struct vfs_dirent {
       next_dirent(next_dirent)
   {}
 
-  p2::string<32> name;
+  p2::string<VFS_NAME_MAX + 1> name;
   vfs_node_handle node;
   uint16_t next_dirent;
 };
@@ -49,14 +52,25 @@ struct opened_file {
 };
 
 struct locally_opened_file {
-  locally_opened_file(vfs_node_handle node) : node(node), position(0) {}
+  locally_opened_file(vfs_node_handle node, uint16_t cursor) : node(node), position(0), cursor(cursor) {}
 
   vfs_node_handle node;
   int position;
+  uint16_t cursor;  // Dirent at `position`
+};
+
+//
+// descriptor_table - the fds of a context. The opened file handles are
+// kept in pages allocated as the table grows, and `used` hands out the
+// lowest free fd.
+//
+struct descriptor_table {
+  p2::index_bitmap<VFS_MAX_FDS> used;
+  opened_file_handle *pages[VFS_MAX_FDS / VFS_FDS_PER_PAGE] = {};
 };
 
 struct context {
-  p2::fixed_pool<opened_file_handle, 16, vfs_fd> descriptors;
+  descriptor_table descriptors;
 };
 
 #endif // !PEOS2_FILESYSTEM_PRIVATE_H
@@ -0,0 +1,173 @@
+#include "fpu.h"
+#include "x86.h"
+#include "debug.h"
+#include "smp.h"
+
+#include "support/pool.h"
+#include "support/optional.h"
+
+//
+// state - FXSAVE area of a process that has used the FPU
+//
+struct state {
+  alignas(16) uint8_t fxsave_area[512];
+};
+
+static void save(state &target);
+static void restore(const state &source);
+
+// Global state
+
+// Indexed by pid, so there's at most one state per process. Processes
+// that never touch the FPU don't get one.
+static p2::fixed_pool<state, 128, proc_handle> states;
+
+// The process whose registers are currently loaded into each CPU's FPU
+static p2::opt<proc_handle> owners[SMP_MAX_CPUS];
+static bool trap_armed[SMP_MAX_CPUS];
+
+static bool fpu_available = false, sse_available = false;
+
+//
+// fpu_init - called on every CPU
+//
+void fpu_init()
+{
+  uint32_t eax, ebx, ecx, edx;
+  cpuid(1, &eax, &ebx, &ecx, &edx);
+
+  if (!(edx & CPUID_FEAT_EDX_FPU) || !(edx & CPUID_FEAT_EDX_FXSR)) {
+    // Without FXSAVE we have no way of switching the state, so let
+    // every FPU instruction fault instead
+    log(fpu, "no fxsr support, fpu disabled");
+    write_cr0(read_cr0() | CR0_EM);
+    return;
+  }
+
+  sse_available = edx & CPUID_FEAT_EDX_SSE;
+  write_cr4(read_cr4() | CR4_OSFXSR | (sse_available ? CR4_OSXMMEXCPT : 0));
+
+  // MP makes WAIT/FWAIT respect TS, NE reports x87 errors using #MF
+  write_cr0((read_cr0() & ~CR0_EM) | CR0_MP | CR0_NE | CR0_TS);
+  trap_armed[smp_cpu_index()] = true;
+  fpu_available = true;
+
+  if (smp_cpu_index() == 0)
+    log(fpu, "lazy fpu switching enabled (sse: %d)", sse_available);
+}
+
+//
+// fpu_switch - called when @pid is about to run. Arms the #NM trap
+// unless @pid already owns the FPU registers
+//
+void fpu_switch(proc_handle pid)
+{
+  if (!fpu_available)
+    return;
+
+  const int cpu = smp_cpu_index();
+  p2::opt<proc_handle> &owner = owners[cpu];
+
+  if (smp_cpu_count() > 1 && owner && *owner != pid) {
+    // The owner might continue on another CPU, which can't reach
+    // these registers. Save them while we still can.
+    save(states[*owner]);
+    owner = {};
+  }
+
+  const bool arm = !owner || *owner != pid;
+  if (arm == trap_armed[cpu])
+    return;
+
+  uint32_t cr0 = read_cr0();
+  write_cr0(arm ? cr0 | CR0_TS : cr0 & ~CR0_TS);
+  trap_armed[cpu] = arm;
+}
+
+void fpu_fork(proc_handle parent_pid, proc_handle child_pid)
+{
+  if (states.valid(child_pid))
+    states.erase(child_pid);
+
+  if (!states.valid(parent_pid))
+    return;
+
+  if (p2::opt<proc_handle> &owner = owners[smp_cpu_index()]; owner && *owner == parent_pid) {
+    // The live registers are newer than the saved area. FXSAVE
+    // doesn't fault on TS as we're the owner, so it's cleared.
+    save(states[parent_pid]);
+  }
+
+  states.emplace(child_pid, states[parent_pid]);
+}
+
+void fpu_release(proc_handle pid)
+{
+  for (auto &owner : owners) {
+    if (owner && *owner == pid) {
+      // Nobody needs the registers anymore, don't save them on the next trap
+      owner = {};
+    }
+  }
+
+  if (states.valid(pid))
+    states.erase(pid);
+
+  // A process calling exec keeps running on the old image's registers,
+  // so make its next FPU instruction trap and start from a clean slate
+  const int cpu = smp_cpu_index();
+  auto current_pid = proc_current_pid();
+
+  if (fpu_available && current_pid && *current_pid == pid && !trap_armed[cpu]) {
+    write_cr0(read_cr0() | CR0_TS);
+    trap_armed[cpu] = true;
+  }
+}
+
+extern "C" void int_devnotavail(isr_registers *)
+{
+  if (!fpu_available) {
+    panic("device not available");
+  }
+
+  asm volatile("clts");
+  const int cpu = smp_cpu_index();
+  p2::opt<proc_handle> &owner = owners[cpu];
+  trap_armed[cpu] = false;
+
+  proc_handle pid = *proc_current_pid();
+  if (owner && *owner == pid)
+    return;
+
+  if (owner) {
+    save(states[*owner]);
+  }
+
+  if (states.valid(pid)) {
+    restore(states[pid]);
+  }
+  else {
+    // First FPU instruction of this process, start from a clean slate
+    dbg_puts(fpu, "allocating fpu state for %d", pid);
+    states.emplace(pid);
+
+    asm volatile("fninit");
+
+    if (sse_available) {
+      uint32_t mxcsr = 0x1F80;  // All exceptions masked, round to nearest
+      asm volatile("ldmxcsr %0" : : "m"(mxcsr));
+    }
+  }
+
+  owner = pid;
+}
+
+static void save(state &target)
+{
+  asm volatile("fxsave [%0]" : : "r"(target.fxsave_area) : "memory");
+}
+
+static void restore(const state &source)
+{
+  asm volatile("fxrstor [%0]" : : "r"(source.fxsave_area) : "memory");
+}
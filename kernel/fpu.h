@@ -0,0 +1,25 @@
+// -*- c++ -*-
+//
+// Lazy FPU/SSE context switching. The register state is only saved
+// and restored when a process actually executes an FPU/SSE
+// instruction; the first one after a context switch traps into #NM
+// because CR0.TS is set.
+//
+
+#ifndef PEOS2_FPU_H
+#define PEOS2_FPU_H
+
+#include "process.h"
+
+void fpu_init();
+void fpu_switch(proc_handle pid);
+void fpu_fork(proc_handle parent_pid, proc_handle child_pid);
+
+//
+// fpu_release - forgets the FPU state of @pid, on exit and exec. If
+// @pid is the running process, its next FPU instruction gets a fresh
+// state.
+//
+void fpu_release(proc_handle pid);
+
+#endif // !PEOS2_FPU_H
@@ -0,0 +1,107 @@
+#include "futex.h"
+#include "process.h"
+#include "memory.h"
+#include "locks.h"
+#include "syscalls.h"
+#include "syscall_utils.h"
+#include "debug.h"
+
+#include "support/unordered_map.h"
+
+// Declarations
+static int syscall_futex_wait(uint32_t *addr, uint32_t expected, int timeout);
+static int syscall_futex_wake(uint32_t *addr, int count);
+static p2::opt<uintptr_t> futex_key(uint32_t *addr);
+
+// Global state
+struct futex_queue {
+  condition_variable<16> waiters;
+  int users = 0;  // Processes inside `futex_wait`, the last one out removes the queue
+};
+
+// Only words that somebody is waiting on have a queue
+static p2::unordered_map<uintptr_t, futex_queue, 64> queues;
+
+// Definitions
+void futex_init()
+{
+  syscall_register(SYSCALL_NUM_FUTEX_WAIT, (syscall_fun)syscall_futex_wait);
+  syscall_register(SYSCALL_NUM_FUTEX_WAKE, (syscall_fun)syscall_futex_wake);
+}
+
+static int syscall_futex_wait(uint32_t *addr, uint32_t expected, int timeout)
+{
+  verify_ptr(futex, addr);
+
+  if ((uintptr_t)addr & 3)
+    return EINVVAL;
+
+  // Syscalls run with the kernel lock held, so nobody can call
+  // `futex_wake` between this comparison and the wait below
+  if (*(volatile uint32_t *)addr != expected)
+    return EBUSY;
+
+  if (timeout == 0)
+    return ETIMEOUT;
+
+  auto key = futex_key(addr);
+  if (!key)
+    return EINCONSTATE;
+
+  auto it = queues.find(*key);
+
+  if (it == queues.end()) {
+    if (queues.full()) {
+      log(futex, "out of futex queues");
+      return ENOSPACE;
+    }
+
+    queues.insert(*key, futex_queue());
+    it = queues.find(*key);
+  }
+
+  futex_queue &queue = it->value;
+
+  if (queue.waiters.full())
+    return ENOSPACE;
+
+  queue.users++;
+  int ret = queue.waiters.wait_timeout(timeout < 0 ? -1 : timeout);
+
+  if (--queue.users == 0)
+    queues.erase(it);
+
+  return ret < 0 ? ret : 0;
+}
+
+static int syscall_futex_wake(uint32_t *addr, int count)
+{
+  verify_ptr(futex, addr);
+
+  if ((uintptr_t)addr & 3)
+    return EINVVAL;
+
+  auto key = futex_key(addr);
+  if (!key)
+    return 0;
+
+  auto it = queues.find(*key);
+  if (it == queues.end())
+    return 0;
+
+  int woken = 0;
+
+  while (woken < count && it->value.waiters.notify_one())
+    ++woken;
+
+  return woken;
+}
+
+//
+// futex_key - the physical address of @addr. Only valid after @addr
+// has been accessed, otherwise the page might not be mapped yet.
+//
+static p2::opt<uintptr_t> futex_key(uint32_t *addr)
+{
+  return mem_physical_address(proc_get_space(*proc_current_pid()), (uintptr_t)addr);
+}
@@ -0,0 +1,13 @@
+// -*- c++ -*-
+//
+// Futexes - lets userspace block on a memory word until someone wakes
+// it up. Waiters are keyed on the physical address of the word, so
+// processes sharing a page can synchronize through it as well.
+//
+
+#ifndef PEOS2_FUTEX_H
+#define PEOS2_FUTEX_H
+
+void futex_init();
+
+#endif // !PEOS2_FUTEX_H
@@ -3,7 +3,6 @@
 #include "screen.h"
 #include "memareas.h"
 #include "memory.h"
-#include "tar.h"
 #include "process.h"
 #include "support/result.h"
 #include "support/format.h"
@@ -31,8 +30,6 @@ static int verify(int retval)
 }
 
 static void load_multiboot_modules();
-static void extract_tar(const char *filename);
-static void setup_std_fds(const char *stdout_filename);
 
 //
 // Kernel kicks off execution of this user space program "as soon as
@@ -53,12 +50,9 @@ extern "C" int init_main(int argc, const char **argv)
   (void)argc;
   (void)argv;
 
+  // init.tar itself is served by /initrd, without unpacking
   load_multiboot_modules();
 
-  // TODO: enumerate files in /ramfs/modules and execute extract_tar
-  // on those ending with .tar
-  extract_tar("/ramfs/modules/init.tar");
-
   // TODO: launch whatever's on the command line
   const char *command_line = (const char *)PHYS2KERNVIRT(multiboot_header->cmd_line);
   assert(command_line);
@@ -67,19 +61,17 @@ extern "C" int init_main(int argc, const char **argv)
   const char *init_command = attributes["init"];
   assert(init_command);
 
+  uint64_t boot_time = 0;
+  verify(syscall1(currenttime, &boot_time));
+  puts_sys(kernout, p2::format<64>("init: %d ms since boot\n", (uint32_t)boot_time));
   puts_sys(kernout, p2::format<256>("executing '%s'...\n", init_command));
 
-  int child_pid = syscall0(fork);
+  const char *child_argv[] = {init_command, command_line, nullptr};
+  const int fd_map[] = {kernout, kernout, kernout};
+  int child_pid = verify(syscall4(spawn, init_command, child_argv, fd_map, ARRAY_SIZE(fd_map)));
 
-  if (child_pid == 0) {
-    setup_std_fds("/dev/term0");
-    const char *argv[] = {init_command, command_line, nullptr};
-    verify(syscall2(exec, init_command, argv));
-  }
-  else {
-    syscall1(wait, child_pid);
-    syscall0(shutdown);
-  }
+  syscall1(wait, child_pid);
+  syscall0(shutdown);
 
   return 0;
 }
@@ -107,68 +99,3 @@ void load_multiboot_modules()
     write_info("/modules/", (const char *)PHYS2KERNVIRT(modules[i].string_addr), PHYS2KERNVIRT(modules[i].mod_start), modules[i].mod_end - modules[i].mod_start);
   }
 }
-
-void extract_tar(const char *filename)
-{
-  const p2::string<6> expected_magic("ustar");
-  int fd = verify(syscall2(open, filename, 0));
-
-  tar_entry hdr;
-  assert(sizeof(hdr) == 512);
-
-  uint32_t file_mem_start = 0, file_mem_size = 0;
-  verify(syscall4(control, fd, CTRL_RAMFS_GET_FILE_RANGE, (uintptr_t)&file_mem_start, (uintptr_t)&file_mem_size));
-  // TODO: looping read
-  while (verify(syscall3(read, fd, (char *)&hdr, sizeof(hdr))) == sizeof(hdr)) {
-    if (hdr.name[0] == '\0') {
-      // NUL block, two of these symbolize end of archive
-      continue;
-    }
-
-    // TODO: do the string comparison without copying the string first
-    if (p2::string<6>(hdr.magic, sizeof(hdr.magic)) != expected_magic) {
-      panic("incorrect tar magic");
-    }
-
-    if (hdr.name[99] != '\0') {
-      panic("not null-terminated name");
-    }
-
-    p2::string<101> entry_name(hdr.name, 100);
-    uint32_t size = tar_parse_octal(hdr.size, sizeof(hdr.size));
-
-    int cur_pos = 0;
-    verify(syscall2(tell, fd, &cur_pos));
-
-    if (hdr.type == '0' || hdr.type == '\0') {
-      // If we can't rely on continuous memory anymore, change this into a write
-      write_info("/", entry_name.c_str(), file_mem_start + cur_pos, size);
-    }
-    else if (hdr.type == '5') {
-      char buf[128];
-      p2::format(buf, "/ramfs/%s", entry_name.c_str());
-      verify(syscall1(mkdir, buf));
-    }
-
-    verify(syscall3(seek, fd, ALIGN_UP(size, 512), SEEK_CUR));
-  }
-
-  verify(syscall1(close, fd));
-}
-
-static void setup_term_at(const char *filename, int dest_fd)
-{
-  int source_fd = verify(syscall2(open, filename, OPEN_RETAIN_EXEC));
-
-  if (source_fd != dest_fd) {
-    verify(syscall2(dup2, source_fd, dest_fd));
-    verify(syscall1(close, source_fd));
-  }
-}
-
-static void setup_std_fds(const char *stdout_filename)
-{
-  setup_term_at(stdout_filename, 0);
-  setup_term_at(stdout_filename, 1);
-  setup_term_at(stdout_filename, 2);
-}
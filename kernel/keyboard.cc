@@ -3,6 +3,9 @@
 #include "screen.h"
 #include "protected_mode.h"
 #include "terminal.h"
+#include "workqueue.h"
+#include "locks.h"
+#include "trace.h"
 
 #define KBD_DATA   0x60
 #define KBD_CMD    0x64
@@ -102,13 +105,18 @@ static scancode_mapping scancode_set1_map[0xFF] =
 
 static bool shift_depressed = false, ctrl_depressed = false;
 
+static void keypress_work(uintptr_t key_code);
 
 extern "C" void int_kbd(isr_registers *regs)
 {
+  tracepoint(TRACE_IRQ, IRQ_KEYBOARD, 0);
   bool gray_keys = false;
   (void)gray_keys;
   (void)regs;
 
+  int16_t key_codes[4];
+  int key_count = 0;
+
   for (int i = 0; i < 4 && (inb(KBD_STATUS) & 0x01); ++i) {
     uint16_t scancode = inb(0x60);
 
@@ -162,14 +170,24 @@ extern "C" void int_kbd(isr_registers *regs)
       }
 
       if (key_code) {
-        irq_eoi(IRQ_KEYBOARD);
-        term_keypress(key_code);  // Can take a while to return if a context switch happens
-        return;
+        key_codes[key_count++] = key_code;
       }
     }
   }
 
   irq_eoi(IRQ_KEYBOARD);
+
+  // Line editing and printing is done by the worker thread. Scheduling
+  // can cause a context switch so it's done after EOI.
+  for (int i = 0; i < key_count; ++i) {
+    workq_schedule(keypress_work, (uint16_t)key_codes[i]);
+  }
+}
+
+static void keypress_work(uintptr_t key_code)
+{
+  interrupt_guard guard;
+  term_keypress(key_code);
 }
 
 extern "C" void isr_kbd(isr_registers *);
@@ -6,55 +6,190 @@
 #include <stddef.h>
 
 #include "support/pool.h"
+#include "support/utils.h"
 #include "process.h"
+#include "x86.h"
+#include "smp.h"
 
+//
+// interrupt_guard - disables interrupts and holds the kernel lock for
+// the lifetime of the guard, then restores the previous state.
+//
+// Mutual exclusion in the kernel is based on IF being cleared and the
+// kernel lock being held, which is always the case for interrupt
+// handlers and syscalls. Kernel threads run with interrupts enabled
+// and without the lock, so they need to use the guard when touching
+// state shared with them.
+//
+class interrupt_guard : p2::non_copyable {
+public:
+  interrupt_guard()
+  {
+    asm volatile("pushfd\n"
+                 "pop %0\n"
+                 "cli" : "=r"(_eflags) : : "memory");
+    kernel_lock_acquire();
+  }
+
+  ~interrupt_guard()
+  {
+    kernel_lock_release();
+
+    if (_eflags & EFLAGS_IF)
+      asm volatile("sti" : : : "memory");
+  }
+
+private:
+  uint32_t _eflags;
+};
+
+//
+// wake_policy - what a notifier does after making waiters runnable
+//
+enum wake_policy {
+  WAKE_DEFERRED,        // Keep running, the waiters get scheduled later
+  WAKE_PREEMPT_HIGHER,  // Switch to a woken waiter if it has a higher priority
+};
+
+//
+// condition_variable - waiters are woken in the order they started
+// waiting. Notifying only makes waiters runnable, so a `notify_all`
+// from an interrupt handler costs no context switches unless the
+// policy asks for it.
+//
 template<size_t _MaxWaiters>
 class condition_variable {
 public:
+  condition_variable(wake_policy policy = WAKE_DEFERRED)
+    : _policy(policy)
+  {}
+
   int wait()
   {
-    // TODO: verify that we're not already on the list
-    int idx = _waiting_procs.emplace_anywhere(*proc_current_pid());
-    int ret = proc_block(*proc_current_pid());
-
-    if (ret < 0 && _waiting_procs.valid(idx))
-      _waiting_procs.erase(idx);
-
-    return ret;
+    return enqueue_and_block({});
   }
 
-  void notify_one()
+  //
+  // wait_timeout - like `wait` but gives up after @timeout ms (-1 for
+  // never) no matter what timeout the process has set
+  //
+  int wait_timeout(int timeout)
   {
-    // TODO: make this more fair?
-    for (size_t i = 0; i < _waiting_procs.watermark(); ++i) {
-      if (!_waiting_procs.valid(i))
-        continue;
+    return enqueue_and_block(timeout);
+  }
 
-      notify(i);
-      break;
+  //
+  // notify_one - wakes the oldest waiter. Waiters that already timed
+  // out or were killed are skipped. Returns false if nobody was woken.
+  //
+  bool notify_one()
+  {
+    while (_head != _waiters.end_sentinel()) {
+      if (auto pid = notify(_head)) {
+        preempt_if_higher(*pid);
+        return true;
+      }
     }
+
+    return false;
   }
 
   void notify_all()
   {
-    // TODO: make this more fair?
-    for (size_t i = 0; i < _waiting_procs.watermark(); ++i) {
-      if (!_waiting_procs.valid(i))
-        continue;
+    p2::opt<proc_handle> highest;
 
-      notify(i);
+    while (_head != _waiters.end_sentinel()) {
+      auto pid = notify(_head);
+
+      if (pid && (!highest || proc_priority(*pid) > proc_priority(*highest)))
+        highest = pid;
     }
+
+    if (highest)
+      preempt_if_higher(*highest);
+  }
+
+  void set_policy(wake_policy policy)
+  {
+    _policy = policy;
+  }
+
+  bool has_waiters() const
+  {
+    return _head != _waiters.end_sentinel();
+  }
+
+  bool full() const
+  {
+    return _waiters.full();
   }
 
 private:
-  void notify(size_t idx)
+  struct waiter {
+    proc_handle pid;
+    uint16_t next, prev;
+  };
+
+  int enqueue_and_block(p2::opt<int> timeout)
   {
-    // TODO: what if the process has exited?
-    proc_unblock_and_switch(_waiting_procs[idx], 1);
-    _waiting_procs.erase(idx);
+    // TODO: verify that we're not already on the list
+    proc_handle pid = *proc_current_pid();
+    uint16_t idx = _waiters.emplace_anywhere(waiter{pid, _waiters.end_sentinel(), _tail});
+
+    if (_tail != _waiters.end_sentinel())
+      _waiters[_tail].next = idx;
+    else
+      _head = idx;
+
+    _tail = idx;
+
+    int ret = timeout ? proc_block_timeout(pid, *timeout) : proc_block(pid);
+
+    // Timeouts and kills return without a notification, so we're
+    // still on the list
+    if (ret < 0 && _waiters.valid(idx) && _waiters[idx].pid == pid)
+      unlink(idx);
+
+    return ret;
+  }
+
+  p2::opt<proc_handle> notify(uint16_t idx)
+  {
+    proc_handle pid = _waiters[idx].pid;
+    unlink(idx);
+
+    if (!proc_wake(pid, 1))
+      return {};
+
+    return pid;
+  }
+
+  void preempt_if_higher(proc_handle pid)
+  {
+    if (_policy == WAKE_PREEMPT_HIGHER)
+      proc_preempt(pid);
+  }
+
+  void unlink(uint16_t idx)
+  {
+    waiter &entry = _waiters[idx];
+
+    if (entry.prev != _waiters.end_sentinel())
+      _waiters[entry.prev].next = entry.next;
+    else
+      _head = entry.next;
+
+    if (entry.next != _waiters.end_sentinel())
+      _waiters[entry.next].prev = entry.prev;
+    else
+      _tail = entry.prev;
+
+    _waiters.erase(idx);
   }
 
-  p2::fixed_pool<proc_handle, _MaxWaiters> _waiting_procs;
+  p2::fixed_pool<waiter, _MaxWaiters> _waiters;
+  uint16_t _head = _waiters.end_sentinel(), _tail = _waiters.end_sentinel();
+  wake_policy _policy;
 };
 
 #endif // !PEOS2_LOCKS_H
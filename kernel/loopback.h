@@ -0,0 +1,16 @@
+// -*- c++ -*-
+//
+// /dev/loopback - a character device where everything written can be
+// read back, in order. Readers block while it's empty and writers
+// block while it's full, so it works as a producer/consumer channel
+// between processes. CTRL_LOOPBACK_WAKE_POLICY picks what its
+// notifications do, see `wake_policy`. It's a global switch affecting
+// every opener, meant for benchmarks like cvbench.
+//
+
+#ifndef PEOS2_LOOPBACK_H
+#define PEOS2_LOOPBACK_H
+
+void loopback_init();
+
+#endif // !PEOS2_LOOPBACK_H
@@ -15,19 +15,33 @@
 #include "pci.h"
 #include "rtl8139.h"
 #include "timer.h"
+#include "fpu.h"
+#include "workqueue.h"
+#include "smp.h"
+#include "loopback.h"
+#include "futex.h"
+#include "procfs.h"
+#include "ring.h"
+#include "profiler.h"
+#include "trace.h"
+#include "tarfs.h"
+#include "blockdev.h"
+#include "ata.h"
+#include "pipe.h"
 
 #include "syscall_decls.h"
 
 #include "support/string.h"
 #include "support/format.h"
 #include "support/panic.h"
+#include "support/keyvalue.h"
 
 extern char stack_top;
 extern "C" int init_main();
 
-char debug_out_buffer[128];
+static void configure_serial();
 
-extern void idle_main();
+char debug_out_buffer[128];
 
 extern "C" void kernel_main(uint32_t multiboot_magic, multiboot_info *multiboot_hdr)
 {
@@ -46,9 +60,16 @@ extern "C" void kernel_main(uint32_t multiboot_magic, multiboot_info *multiboot_
     panic("Expecting a memory map in the multiboot header");
   }
 
+  configure_serial();
+
+  // Held by all kernel code; the first process releases it on its
+  // way to user space
+  kernel_lock_acquire();
+
   // x86 basic stuff setup
   enter_protected_mode();
   int_init();
+  fpu_init();  // deps: int
   pic_init();
   syscalls_init();
   timer_init(); // deps: syscalls
@@ -56,11 +77,15 @@ extern "C" void kernel_main(uint32_t multiboot_magic, multiboot_info *multiboot_
   asm volatile("int 3");  // Test debug int
 
   kbd_init();
-  com_setup_rx();
+  com_setup_irq();
 
   log(main, "initializing subsystems");
   mem_init();  // deps: arch
-  proc_init();  // deps: mem
+  smp_init();  // deps: mem
+  proc_init();  // deps: mem, smp
+  workq_init();  // deps: proc
+  futex_init();  // deps: proc, syscalls
+  ring_init();  // deps: syscalls
   pci_init();
 
   vfs_init();
@@ -70,13 +95,50 @@ extern "C" void kernel_main(uint32_t multiboot_magic, multiboot_info *multiboot_
 
   term_init();  // deps: vfs
   ramfs_init();  // deps: vfs
+  bdev_init();  // deps: vfs, timer, proc
+  ata_init();  // deps: bdev
+  tarfs_init();  // deps: vfs, ata
+  loopback_init();  // deps: vfs
+  pipe_init();  // deps: vfs, syscalls
+  procfs_init();  // deps: vfs, proc
+  prof_init();  // deps: vfs
+  trace_init();  // deps: vfs
   rtl8139_init();  // deps: pci
 
   log(main, "initializing init");
   proc_handle init_pid = proc_create(PROC_USER_SPACE|PROC_KERNEL_ACCESSIBLE, (uintptr_t)init_main);
+  proc_set_name(init_pid, "init");
 
   const char *args[] = {nullptr};
   proc_setup_user_stack(init_pid, 0, args);
   proc_enqueue(init_pid);
+
+  smp_start_aps();  // deps: proc, all of the above
   proc_run();
 }
+
+//
+// configure_serial - applies `baud=<rate>` from the kernel command line
+//
+static void configure_serial()
+{
+  if (!(multiboot_header->flags & MULTIBOOT_INFO_CMDLINE))
+    return;
+
+  p2::keyvalue<256> attributes((const char *)PHYS2KERNVIRT(multiboot_header->cmd_line));
+  const char *value = attributes["baud"];
+
+  if (!value)
+    return;
+
+  uint32_t baud = 0;
+  for (; *value >= '0' && *value <= '9'; ++value)
+    baud = baud * 10 + (*value - '0');
+
+  if (!com_set_baud(baud)) {
+    log(main, "unsupported baud rate %d, staying at %d", baud, COM_DEFAULT_BAUD);
+    return;
+  }
+
+  log(main, "serial at %d baud", baud);
+}
@@ -3,8 +3,22 @@
 
 #define USER_SPACE_STACK_BASE   0xB0000000  // User stack initial SP (growing down)
 #define KERNEL_VIRTUAL_BASE     0xC0000000  // Code and data for kernel
-#define PROC_KERNEL_STACK_BASE  0xD0000000  // Process' kernel stack initial SP (growing down)
+#define KERNEL_STACKS_BASE      0xD0000000  // Kernel stacks of all processes, mapped in every space
+#define KERNEL_STACKS_END       0xD0800000
+#define KERNEL_PAGES_BASE       0xD0800000  // Pages allocated for kernel data, mapped in every space
+#define KERNEL_PAGES_END        0xD2800000
 #define KERNEL_SCRATCH_BASE     0xE0000000  // Temporary mappings
+#define FIRMWARE_VIRTUAL_BASE   0xF0000000  // ACPI/MP tables, only mapped in the kernel space
+#define FIRMWARE_VIRTUAL_END    0xF0400000
+
+#define LAPIC_VIRTUAL_BASE      0xCFC00000
+
+// Each kernel stack gets a slot in the kernel stack region. The pages
+// in a slot below the stack are never mapped, so an overflow faults
+// instead of corrupting the neighbouring stack.
+#define KERNEL_STACK_SIZE       (0x1000 * 10)
+#define KERNEL_STACK_STRIDE     (0x1000 * 16)
+#define KERNEL_STACK_SLOTS      ((KERNEL_STACKS_END - KERNEL_STACKS_BASE) / KERNEL_STACK_STRIDE)
 
 #define PHYS2KERNVIRT(value) ((value) + KERNEL_VIRTUAL_BASE)
 #define KERNVIRT2PHYS(value) ((value) - KERNEL_VIRTUAL_BASE)
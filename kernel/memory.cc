@@ -10,6 +10,8 @@
 #include "syscall_utils.h"
 #include "filesystem.h"
 #include "memory_private.h"
+#include "smp.h"
+#include "trace.h"
 
 #include "support/page_alloc.h"
 #include "support/pool.h"
@@ -38,8 +40,34 @@ static p2::internal_page_allocator<sizeof(page_table_entry) * 1024 * 100, 0x1000
 static p2::page_allocator *user_space_allocator;
 
 static p2::fixed_pool<space_info, 128, mem_space> spaces;
-static mem_space current_space = spaces.end_sentinel();
+static mem_space current_spaces[SMP_MAX_CPUS];
 static mem_space start_space;
+static mem_stats total_stats;
+
+// Device registers that are mapped into every space, see
+// `mem_map_kernel_device`
+struct kernel_device_map {
+  uintptr_t virt_address, phys_address;
+  size_t length;
+};
+
+static p2::fixed_pool<kernel_device_map, 4> kernel_devices;
+
+// Page tables for the kernel stack region. The same tables are
+// referenced by every page directory, and never freed.
+static page_table_entry *kernel_stack_tables[(KERNEL_STACKS_END - KERNEL_STACKS_BASE) >> 22];
+static uint32_t kernel_stack_used[KERNEL_STACK_SLOTS / 32];  // Bit per slot
+static uintptr_t firmware_watermark = FIRMWARE_VIRTUAL_BASE;
+
+// Page tables for the kernel page region, shared the same way. They're
+// static so they don't eat into the page table allocator.
+alignas(0x1000) static page_table_entry kernel_page_tables[(KERNEL_PAGES_END - KERNEL_PAGES_BASE) >> 22][1024];
+static uint32_t kernel_page_used[((KERNEL_PAGES_END - KERNEL_PAGES_BASE) >> 12) / 32];  // Bit per page
+
+static inline mem_space &current_space()
+{
+  return current_spaces[smp_cpu_index()];
+}
 
 
 void mem_init()
@@ -95,6 +123,13 @@ void mem_init()
   static p2::page_allocator alloc{{largest_region.start, largest_region.end}, KERNEL_VIRTUAL_BASE};
   user_space_allocator = &alloc;
 
+  for (auto &space_handle : current_spaces)
+    space_handle = spaces.end_sentinel();
+
+  // Before the first space is created, so that all spaces get them
+  for (auto &table : kernel_stack_tables)
+    table = (page_table_entry *)page_table_allocator.alloc_page_zero();
+
   start_space = mem_create_space();
   mem_map_kernel(start_space, MEM_AREA_READWRITE);
   mem_activate_space(start_space);
@@ -109,6 +144,19 @@ void mem_init()
 mem_space mem_create_space()
 {
   page_dir_entry *page_dir = (page_dir_entry *)page_dir_allocator.alloc_page_zero();
+
+  for (size_t i = 0; i < ARRAY_SIZE(kernel_stack_tables); ++i) {
+    page_dir_entry &pde = page_dir[(KERNEL_STACKS_BASE >> 22) + i];
+    pde.table_11_31 = KERNVIRT2PHYS((uintptr_t)kernel_stack_tables[i]) >> 12;
+    pde.flags = MEM_PE_P|MEM_PE_RW;
+  }
+
+  for (size_t i = 0; i < ARRAY_SIZE(kernel_page_tables); ++i) {
+    page_dir_entry &pde = page_dir[(KERNEL_PAGES_BASE >> 22) + i];
+    pde.table_11_31 = KERNVIRT2PHYS((uintptr_t)kernel_page_tables[i]) >> 12;
+    pde.flags = MEM_PE_P|MEM_PE_RW;
+  }
+
   mem_space space_handle = spaces.emplace_anywhere(page_dir);
   dbg_puts(mem, "created space %d with page dir %p", space_handle, (uintptr_t)page_dir);
   return space_handle;
@@ -117,7 +165,7 @@ mem_space mem_create_space()
 
 void mem_destroy_space(mem_space space_handle)
 {
-  assert(space_handle != current_space && "cannot destroy current space");
+  assert(space_handle != current_space() && "cannot destroy current space");
   space_info *space = &spaces[space_handle];
 
   for (size_t i = 0; i < space->areas.watermark(); ++i) {
@@ -134,6 +182,11 @@ void mem_destroy_space(mem_space space_handle)
       continue;
     }
 
+    if (i >= (int)(KERNEL_STACKS_BASE >> 22) && i < (int)(KERNEL_PAGES_END >> 22)) {
+      // Kernel stacks and pages, shared by all spaces
+      continue;
+    }
+
     dbg_puts(mem, "deleting page table %p", PHYS2KERNVIRT(space->page_dir[i].table_11_31 << 12));
     page_table_allocator.free_page((void *)PHYS2KERNVIRT(space->page_dir[i].table_11_31 << 12));
     space->page_dir[i].table_11_31 = 0;
@@ -285,10 +338,7 @@ p2::res<mem_space> mem_fork_space(mem_space space_handle)
 
 void mem_activate_space(mem_space space_handle)
 {
-  // TODO: get rid of this function! it shouldn't be used now when we
-  // don't have all kernel stacks mapped in all spaces
-
-  current_space = space_handle;
+  current_space() = space_handle;
   space_info *space = &spaces[space_handle];
   uintptr_t page_dir_phys = KERNVIRT2PHYS((uintptr_t)space->page_dir);
   asm volatile("mov cr3, %0" :: "a"(page_dir_phys) : "memory");
@@ -297,7 +347,16 @@ void mem_activate_space(mem_space space_handle)
 
 void mem_set_current_space(mem_space space_handle)
 {
-  current_space = space_handle;
+  current_space() = space_handle;
+}
+
+//
+// mem_kernel_space - the space setup during boot. Only contains the
+// kernel, so it's shared by all kernel threads.
+//
+mem_space mem_kernel_space()
+{
+  return start_space;
 }
 
 uintptr_t mem_page_dir(mem_space space_handle)
@@ -378,9 +437,9 @@ void mem_write_page(mem_space space_handle, uintptr_t virt_addr, const void *dat
 
   assert(size <= 0x1000);
   const uintptr_t mapped_address = KERNEL_SCRATCH_BASE;
-  map_page(current_space, mapped_address, pte_frame(pte), MEM_PE_P|MEM_PE_RW|MEM_PE_W|MEM_PE_D);
+  map_page(current_space(), mapped_address, pte_frame(pte), MEM_PE_P|MEM_PE_RW|MEM_PE_W|MEM_PE_D);
   memcpy((void *)mapped_address, data, size);
-  map_page(current_space, mapped_address, 0, 0);
+  map_page(current_space(), mapped_address, 0, 0);
 }
 
 int mem_map_portal(uintptr_t virt_address, size_t length, mem_space dest_space, uintptr_t dest_virt_address, uint16_t flags)
@@ -400,7 +459,7 @@ int mem_map_portal(uintptr_t virt_address, size_t length, mem_space dest_space,
   for (uintptr_t offset = 0; offset < length; offset += 0x1000) {
     if (auto *pte = find_pte(dest_space_, dest_virt_address + offset); pte && pte->flags & MEM_PE_P) {
       // Page already exists, so let's point to its address
-      map_page(current_space, virt_address + offset, pte_frame(pte), page_flags(flags));
+      map_page(current_space(), virt_address + offset, pte_frame(pte), page_flags(flags));
     }
     else {
       // Page doesn't exist. Map it in source using the area's flags
@@ -409,7 +468,7 @@ int mem_map_portal(uintptr_t virt_address, size_t length, mem_space dest_space,
       // TODO: maybe we should call the page fault handler instead of
       // just assuming it's an ALLOC area?
       uintptr_t phys_address = (uintptr_t)alloc_page();
-      map_page(current_space, virt_address + offset, phys_address, page_flags(flags));
+      map_page(current_space(), virt_address + offset, phys_address, page_flags(flags));
       map_page(dest_space, dest_virt_address + offset, phys_address, page_flags(dest_area.flags));
     }
   }
@@ -420,24 +479,20 @@ int mem_map_portal(uintptr_t virt_address, size_t length, mem_space dest_space,
 void mem_unmap_portal(uintptr_t virt_address, size_t length)
 {
   for (uintptr_t offset = 0; offset < length; offset += 0x1000) {
-    map_page(current_space, virt_address + offset, 0xDEAD0000, 0);
+    map_page(current_space(), virt_address + offset, 0xDEAD0000, 0);
   }
 }
 
-static inline void invlpg(uintptr_t addr)
-{
-  asm volatile("invlpg [%0]" :: "a"(addr) : "memory");
-}
-
 void map_page(mem_space space_handle, uint32_t virt, uint32_t phys, uint16_t flags)
 {
+  tracepoint(TRACE_MEM_MAP, virt, phys);
   assert((virt & 0xFFF) == 0 && "can only map on page boundaries");
   assert((phys & 0xFFF) == 0 && "can only map on page boundaries");
 
   page_dir_entry *page_dir = spaces[space_handle].page_dir;
   page_table_entry *page_table = nullptr;
   int directory_idx = virt >> 22;
-  uint16_t pde_flags = flags & ~(MEM_PDE_S|MEM_PTE_D);
+  uint16_t pde_flags = flags & ~(MEM_PDE_S|MEM_PTE_D|MEM_PTE_BORROWED);
 
   if (!(page_dir[directory_idx].flags & MEM_PE_P)) {
     // Don't create a page dir if we want to unmap the page
@@ -455,12 +510,27 @@ void map_page(mem_space space_handle, uint32_t virt, uint32_t phys, uint16_t fla
   }
 
   int table_idx = (virt >> 12) & 0x3FF;
+  const bool was_present = page_table[table_idx].flags & MEM_PE_P;
   page_table[table_idx].frame_11_31 = (phys >> 12);
   page_table[table_idx].flags = flags;
 
-  if (space_handle == current_space) {
+  if (space_handle == current_space()) {
     invlpg(virt);
   }
+
+  if (was_present) {
+    // Other CPUs running in the same space might have cached the old
+    // translation. A page that wasn't present can't be in any TLB.
+    uint32_t cpu_mask = 0;
+
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; ++cpu) {
+      if (cpu != smp_cpu_index() && current_spaces[cpu] == space_handle)
+        cpu_mask |= 1 << cpu;
+    }
+
+    if (cpu_mask)
+      smp_tlb_shootdown(cpu_mask, virt);
+  }
 }
 
 void mem_map_kernel(mem_space space_handle, uint16_t flags)
@@ -510,6 +580,193 @@ void mem_map_kernel(mem_space space_handle, uint16_t flags)
     current_address = segments[i].virt_address;
     last_flags = segments[i].flags;
   }
+
+  for (auto &device : kernel_devices) {
+    mem_map_linear_eager(space_handle,
+                         device.virt_address,
+                         device.virt_address + device.length,
+                         device.phys_address,
+                         MEM_AREA_READWRITE|MEM_AREA_CACHE_DISABLED|MEM_AREA_RETAIN_EXEC);
+  }
+}
+
+//
+// mem_map_kernel_device - maps device registers at @virt_address in
+// all current and future spaces. For registers that have to be
+// reachable no matter which space is active, like the local APIC.
+//
+void mem_map_kernel_device(uintptr_t virt_address, uintptr_t phys_address, size_t length)
+{
+  assert(!(virt_address & 0xFFF) && !(phys_address & 0xFFF));
+  length = ALIGN_UP(length, 0x1000);
+  kernel_devices.emplace_anywhere(kernel_device_map{virt_address, phys_address, length});
+
+  for (int i = 0; i < spaces.watermark(); ++i) {
+    if (!spaces.valid(i))
+      continue;
+
+    mem_map_linear_eager(i,
+                         virt_address,
+                         virt_address + length,
+                         phys_address,
+                         MEM_AREA_READWRITE|MEM_AREA_CACHE_DISABLED|MEM_AREA_RETAIN_EXEC);
+  }
+}
+
+//
+// mem_map_firmware - makes @length bytes of physical memory at
+// @phys_address readable in the kernel space. Meant for reading
+// firmware tables during boot, the mappings are never removed.
+//
+const void *mem_map_firmware(uintptr_t phys_address, size_t length)
+{
+  uintptr_t phys_start = ALIGN_DOWN(phys_address, 0x1000);
+  uintptr_t phys_end = ALIGN_UP(phys_address + length, 0x1000);
+  uintptr_t virt_start = firmware_watermark;
+
+  if (virt_start + (phys_end - phys_start) > FIRMWARE_VIRTUAL_END)
+    panic("out of address space for firmware tables");
+
+  mem_map_linear_eager(start_space, virt_start, virt_start + (phys_end - phys_start), phys_start, 0);
+  firmware_watermark += phys_end - phys_start;
+  return (const void *)(virt_start + (phys_address - phys_start));
+}
+
+uintptr_t mem_alloc_kernel_stack()
+{
+  for (size_t slot = 0; slot < KERNEL_STACK_SLOTS; ++slot) {
+    if (kernel_stack_used[slot / 32] & (1u << (slot % 32)))
+      continue;
+
+    kernel_stack_used[slot / 32] |= 1u << (slot % 32);
+    const uintptr_t stack_base = KERNEL_STACKS_BASE + (slot + 1) * KERNEL_STACK_STRIDE;
+
+    // Pages of a slot that has been used before are still mapped. A
+    // page that wasn't present can't be cached in any TLB, so there's
+    // no need to invalidate anything.
+    for (uintptr_t address = stack_base - KERNEL_STACK_SIZE; address < stack_base; address += 0x1000) {
+      const uintptr_t offset = address - KERNEL_STACKS_BASE;
+      page_table_entry &pte = kernel_stack_tables[offset >> 22][(offset >> 12) & 0x3FF];
+
+      if (!(pte.flags & MEM_PE_P)) {
+        pte.frame_11_31 = (uintptr_t)alloc_page() >> 12;
+        pte.flags = MEM_PE_P|MEM_PE_RW;
+      }
+    }
+
+    dbg_puts(mem, "allocated kernel stack %d at %p", slot, stack_base);
+    return stack_base;
+  }
+
+  panic("out of kernel stacks");
+}
+
+//
+// mem_free_kernel_stack - releases the slot but keeps its pages
+// mapped. Unmapping would require a TLB shootdown on every CPU, and
+// the pages are needed again by the next process anyway.
+//
+void mem_free_kernel_stack(uintptr_t stack_base)
+{
+  const size_t slot = (stack_base - KERNEL_STACKS_BASE) / KERNEL_STACK_STRIDE - 1;
+  assert(slot < KERNEL_STACK_SLOTS);
+  assert((kernel_stack_used[slot / 32] & (1u << (slot % 32))) && "kernel stack isn't allocated");
+  kernel_stack_used[slot / 32] &= ~(1u << (slot % 32));
+}
+
+void *mem_alloc_kernel_page()
+{
+  if (user_space_allocator->free_pages() == 0)
+    return nullptr;
+
+  for (size_t word = 0; word < ARRAY_SIZE(kernel_page_used); ++word) {
+    if (kernel_page_used[word] == 0xFFFFFFFF)
+      continue;
+
+    const size_t slot = word * 32 + __builtin_ctz(~kernel_page_used[word]);
+    const uintptr_t offset = slot << 12;
+    page_table_entry &pte = kernel_page_tables[offset >> 22][(offset >> 12) & 0x3FF];
+
+    // Free slots aren't present, so no TLB can have them cached
+    kernel_page_used[word] |= 1u << (slot % 32);
+    pte.frame_11_31 = (uintptr_t)alloc_page() >> 12;
+    pte.flags = MEM_PE_P|MEM_PE_RW;
+
+    void *page = (void *)(KERNEL_PAGES_BASE + offset);
+    memset(page, 0, 0x1000);
+    return page;
+  }
+
+  return nullptr;
+}
+
+static page_table_entry &kernel_page_pte(void *page)
+{
+  const uintptr_t offset = (uintptr_t)page - KERNEL_PAGES_BASE;
+  const size_t slot = offset >> 12;
+  assert(!(offset & 0xFFF) && slot < ARRAY_SIZE(kernel_page_used) * 32);
+  assert((kernel_page_used[slot / 32] & (1u << (slot % 32))) && "kernel page isn't allocated");
+
+  return kernel_page_tables[offset >> 22][(offset >> 12) & 0x3FF];
+}
+
+static void flush_kernel_page(void *page)
+{
+  invlpg((uintptr_t)page);
+
+  // Every CPU might have it cached, whatever space they're in
+  uint32_t cpu_mask = 0;
+
+  for (int cpu = 0; cpu < smp_cpu_count(); ++cpu) {
+    if (cpu != smp_cpu_index() && smp_cpu_online(cpu))
+      cpu_mask |= 1 << cpu;
+  }
+
+  if (cpu_mask)
+    smp_tlb_shootdown(cpu_mask, (uintptr_t)page);
+}
+
+void mem_free_kernel_page(void *page)
+{
+  page_table_entry &pte = kernel_page_pte(page);
+  const uintptr_t phys_address = pte_frame(&pte);
+  pte.frame_11_31 = 0;
+  pte.flags = 0;
+  flush_kernel_page(page);
+
+  const size_t slot = ((uintptr_t)page - KERNEL_PAGES_BASE) >> 12;
+  kernel_page_used[slot / 32] &= ~(1u << (slot % 32));
+  free_page((void *)phys_address);
+}
+
+bool mem_swap_page(uintptr_t virt_address, void *page)
+{
+  assert(!(virt_address & 0xFFF));
+
+  auto area_handle = mem_find_area(current_space(), virt_address);
+  if (!area_handle)
+    return false;
+
+  space_info &space = spaces[current_space()];
+  const area_info &area = space.areas[*area_handle];
+  const uint16_t required = MEM_AREA_USER|MEM_AREA_READWRITE;
+
+  if (area.type == AREA_LINEAR_MAP || (area.flags & required) != required)
+    return false;
+
+  // Not faulted in yet there's nothing to give back, and borrowed
+  // frames aren't ours to give
+  page_table_entry *user_pte = find_pte(space, virt_address);
+  if (!user_pte || (user_pte->flags & MEM_PTE_BORROWED))
+    return false;
+
+  page_table_entry &kernel_pte = kernel_page_pte(page);
+  const uintptr_t user_frame = pte_frame(user_pte);
+
+  map_page(current_space(), virt_address, pte_frame(&kernel_pte), page_flags(area.flags));
+  kernel_pte.frame_11_31 = user_frame >> 12;
+  flush_kernel_page(page);
+  return true;
 }
 
 static bool overlaps_existing_area(mem_space space_handle, uintptr_t start, uintptr_t end)
@@ -592,6 +849,11 @@ mem_area mem_map_fd(mem_space space_handle,
   return space.areas.emplace_anywhere(area_info{start, end, AREA_FILE, flags, map_handle});
 }
 
+void mem_unmap_area(mem_space space_handle, mem_area area_handle)
+{
+  unmap_area(space_handle, area_handle);
+}
+
 p2::opt<mem_area> mem_find_area(mem_space space_handle, uintptr_t address)
 {
   space_info &space = spaces[space_handle];
@@ -616,15 +878,57 @@ p2::opt<uint16_t> mem_area_flags(mem_space space_handle, const void *address)
     return {};
 }
 
+//
+// mem_physical_address - translates @virt_address using the page
+// tables of @space. Returns nothing if the page isn't present.
+//
+p2::opt<uintptr_t> mem_physical_address(mem_space space_handle, uintptr_t virt_address)
+{
+  if (auto *pte = find_pte(spaces[space_handle], virt_address))
+    return pte_frame(pte) | (virt_address & 0xFFF);
+
+  return {};
+}
+
+//
+// mem_get_stats - the fault counters of @space and how many of its
+// pages are currently present, not counting the kernel mappings
+//
+void mem_get_stats(mem_space space_handle, mem_stats *stats)
+{
+  const space_info &space = spaces[space_handle];
+  *stats = space.stats;
+  stats->resident_pages = 0;
+
+  for (uintptr_t pde_idx = 0; pde_idx < (KERNEL_VIRTUAL_BASE >> 22); ++pde_idx) {
+    const page_dir_entry &pde = space.page_dir[pde_idx];
+    if (!(pde.flags & MEM_PE_P))
+      continue;
+
+    const page_table_entry *page_table = (const page_table_entry *)PHYS2KERNVIRT(pde.table_11_31 << 12);
+
+    for (int pte_idx = 0; pte_idx < 1024; ++pte_idx) {
+      if (page_table[pte_idx].flags & MEM_PE_P)
+        stats->resident_pages++;
+    }
+  }
+}
+
+void mem_get_total_stats(mem_stats *stats)
+{
+  *stats = total_stats;
+  stats->free_pages = user_space_allocator->free_pages();
+}
+
 typedef void (*page_fault_handler)(area_info &area, uintptr_t faulted_address);
 
 static void page_fault_linear_map(area_info &area, uintptr_t faulted_address)
 {
-  linear_map_info &lm_info = spaces[current_space].linear_maps[area.info_handle];
+  linear_map_info &lm_info = spaces[current_space()].linear_maps[area.info_handle];
   uintptr_t page_address = ALIGN_DOWN(faulted_address, 0x1000);
   ptrdiff_t area_offset = page_address - area.start;
   dbg_puts(mem, "linear map; mapping %p to %p", page_address, lm_info.phys_start + area_offset);
-  map_page(current_space, page_address, lm_info.phys_start + area_offset, page_flags(area.flags));
+  map_page(current_space(), page_address, lm_info.phys_start + area_offset, page_flags(area.flags));
 }
 
 static void page_fault_alloc(area_info &area, uintptr_t faulted_address)
@@ -635,23 +939,57 @@ static void page_fault_alloc(area_info &area, uintptr_t faulted_address)
 
   uint16_t writable = area.flags & MEM_AREA_READWRITE;
   // Temporarily set the page to readwrite so we can null the page
-  map_page(current_space, page_address, phys_block, page_flags(area.flags | MEM_AREA_READWRITE));
+  map_page(current_space(), page_address, phys_block, page_flags(area.flags | MEM_AREA_READWRITE));
   memset((void *)page_address, 0, 0x1000);
 
   // Then turn it back to readonly
   if (!writable)
-    map_page(current_space, page_address, phys_block, page_flags(area.flags & ~MEM_AREA_READWRITE));
+    map_page(current_space(), page_address, phys_block, page_flags(area.flags & ~MEM_AREA_READWRITE));
+}
+
+//
+// map_file_frame - maps the page of the file itself at @page_address
+// if the driver can point it out. Only for read-only areas, and only
+// for pages that are completely within the mapped part of the file,
+// the rest of a partial page has to read as zeroes.
+//
+static bool map_file_frame(area_info &area, uintptr_t page_address)
+{
+  if (area.flags & MEM_AREA_READWRITE)
+    return false;
+
+  file_map_info &fm_info = spaces[current_space()].file_maps[area.info_handle];
+  uint32_t area_offset = page_address - area.start;
+
+  if (area_offset >= fm_info.size || fm_info.size - area_offset < 0x1000)
+    return false;
+
+  uintptr_t phys_address = 0;
+
+  if (vfs_frame(proc_get_file_context(*proc_current_pid()), fm_info.fd, fm_info.offset + area_offset, &phys_address) < 0)
+    return false;
+
+  dbg_puts(mem, "file map; mapping file page %p at %p. fd is %d", phys_address, page_address, fm_info.fd);
+  map_page(current_space(), page_address, phys_address, page_flags(area.flags)|MEM_PTE_BORROWED);
+  return true;
 }
 
 static void page_fault_file(area_info &area, uintptr_t faulted_address)
 {
   uintptr_t page_address = ALIGN_DOWN(faulted_address, 0x1000);
+
+  if (map_file_frame(area, page_address)) {
+    spaces[current_space()].stats.shared_faults++;
+    total_stats.shared_faults++;
+    return;
+  }
+
   uintptr_t phys_block = (uintptr_t)alloc_page();
   uint16_t writable = area.flags & MEM_AREA_READWRITE;
-  map_page(current_space, page_address, phys_block, page_flags(area.flags | MEM_AREA_READWRITE));
+  map_page(current_space(), page_address, phys_block, page_flags(area.flags | MEM_AREA_READWRITE));
   memset((void *)page_address, 0, 0x1000);
 
-  file_map_info &fm_info = spaces[current_space].file_maps[area.info_handle];
+  file_map_info &fm_info = spaces[current_space()].file_maps[area.info_handle];
   ptrdiff_t area_offset = page_address - area.start;
   uint32_t file_offset = area_offset + fm_info.offset;
 
@@ -672,7 +1010,7 @@ static void page_fault_file(area_info &area, uintptr_t faulted_address)
 
   // Turn the page back to readonly if needed
   if (!writable)
-    map_page(current_space, page_address, phys_block, page_flags(area.flags & ~MEM_AREA_READWRITE));
+    map_page(current_space(), page_address, phys_block, page_flags(area.flags & ~MEM_AREA_READWRITE));
 }
 
 static void unmap_area(mem_space space_handle, mem_area area_handle)
@@ -685,7 +1023,8 @@ static void unmap_area(mem_space space_handle, mem_area area_handle)
        page_address += 0x1000) {
 
     if (auto *pte = find_pte(space, page_address); pte && pte->flags & MEM_PE_P) {
-      if (area.type == AREA_ALLOC || area.type == AREA_FILE) {
+      // Borrowed frames are still used by their file
+      if ((area.type == AREA_ALLOC || area.type == AREA_FILE) && !(pte->flags & MEM_PTE_BORROWED)) {
         free_page((void *)pte_frame(pte));
       }
 
@@ -700,6 +1039,7 @@ extern "C" void int_page_fault(isr_registers *regs)
 {
   uint32_t faulted_address = 0;
   asm volatile("mov eax, cr2" : "=a"(faulted_address));
+  tracepoint(TRACE_MEM_FAULT, faulted_address, regs->error_code);
 
   if (regs->error_code & 1) {
     const char *access_type = "read";
@@ -716,12 +1056,12 @@ extern "C" void int_page_fault(isr_registers *regs)
     return;
   }
 
-  p2::optional<mem_area> area_handle = mem_find_area(current_space, faulted_address);
+  p2::optional<mem_area> area_handle = mem_find_area(current_space(), faulted_address);
 
   if (!area_handle) {
     dbg_puts(mem, "process tried to access un-mapped area at %p in space %d (esp: %p, eip: %p)",
              faulted_address,
-             current_space,
+             current_space(),
              regs->user_esp,
              regs->eip);
     dbg_break();
@@ -731,20 +1071,27 @@ extern "C" void int_page_fault(isr_registers *regs)
 
   dbg_puts(mem, "page fault (error %x) at %p, area %d", regs->error_code, faulted_address, *area_handle);
 
-  area_info &area = spaces[current_space].areas[*area_handle];
+  space_info &space = spaces[current_space()];
+  area_info &area = space.areas[*area_handle];
   page_fault_handler handler = nullptr;
 
   switch (area.type) {
   case AREA_LINEAR_MAP:
     handler = page_fault_linear_map;
+    space.stats.linear_faults++;
+    total_stats.linear_faults++;
     break;
 
   case AREA_ALLOC:
     handler = page_fault_alloc;
+    space.stats.alloc_faults++;
+    total_stats.alloc_faults++;
     break;
 
   case AREA_FILE:
     handler = page_fault_file;
+    space.stats.file_faults++;
+    total_stats.file_faults++;
     break;
 
   default:
@@ -758,7 +1105,7 @@ static int syscall_mmap(void *start, void *end, int fd, uint32_t offset, uint8_t
 {
   // TODO: check that the pointers are in valid space
   // TODO: add parameter for size!
-  mem_map_fd(current_space,
+  mem_map_fd(current_space(),
              (uintptr_t)start,
              (uintptr_t)end,
              fd,
@@ -773,6 +1120,7 @@ static void *alloc_page()
 {
   assert(user_space_allocator);
   void *mem = user_space_allocator->alloc_page();
+  total_stats.resident_pages++;
   dbg_puts(mem, "allocated 4k page at %p, pages left: %d", (uintptr_t)mem, user_space_allocator->free_pages());
   return mem;
 }
@@ -781,5 +1129,6 @@ static void free_page(void *page)
 {
   assert(user_space_allocator);
   user_space_allocator->free_page(page);
+  total_stats.resident_pages--;
   dbg_puts(mem, "freed 4k page at %p, pages left: %d", (uintptr_t)page, user_space_allocator->free_pages());
 }
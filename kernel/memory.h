@@ -28,6 +28,18 @@ struct region {
 typedef uint16_t mem_space;
 typedef uint16_t mem_area;
 
+//
+// mem_stats - page fault and page counters, for a space or in total
+//
+struct mem_stats {
+  uint32_t linear_faults;   // Faults in linearly mapped areas
+  uint32_t alloc_faults;    // Faults that allocated a zeroed page
+  uint32_t file_faults;     // Faults that read a page from a file
+  uint32_t shared_faults;   // File faults that mapped the file's own page, without copying
+  uint32_t resident_pages;  // Pages mapped below the kernel, or allocated pages in total
+  uint32_t free_pages;      // Only set in total
+};
+
 void       mem_init();
 
 // Address space management
@@ -39,6 +51,7 @@ p2::res<mem_space> mem_fork_space(mem_space space_handle);
 void               mem_print_space(mem_space space_handle);
 uintptr_t          mem_page_dir(mem_space space_handle);
 void               mem_set_current_space(mem_space space_handle);
+mem_space          mem_kernel_space();
 
 //
 // mem_map_kernel - directly maps the kernel's memory into the space.
@@ -53,6 +66,36 @@ mem_area mem_map_linear(mem_space space, uintptr_t start, uintptr_t end, uintptr
 mem_area mem_map_linear_eager(mem_space space, uintptr_t start, uintptr_t end, uintptr_t phys_start, uint16_t flags);
 mem_area mem_map_alloc(mem_space space, uintptr_t start, uintptr_t end, uint16_t flags);
 mem_area mem_map_fd(mem_space space, uintptr_t start, uintptr_t end, int fd, uint32_t offset, uint32_t file_size, uint16_t flags);
+void     mem_unmap_area(mem_space space, mem_area area);
+void     mem_map_kernel_device(uintptr_t virt_address, uintptr_t phys_address, size_t length);
+const void *mem_map_firmware(uintptr_t phys_address, size_t length);
+
+//
+// mem_alloc_kernel_stack - returns the initial SP of a kernel stack of
+// KERNEL_STACK_SIZE bytes. The stack is at the same address in all
+// spaces, so it can be written no matter which space is active.
+//
+uintptr_t mem_alloc_kernel_stack();
+void      mem_free_kernel_stack(uintptr_t stack_base);
+
+//
+// mem_alloc_kernel_page - allocates a zeroed page for kernel data,
+// like file contents, mapped at the same address in every space.
+// Returns nullptr when out of memory.
+//
+void     *mem_alloc_kernel_page();
+void      mem_free_kernel_page(void *page);
+
+//
+// mem_swap_page - exchanges the frame behind the user page at
+// @virt_address in the current space with the one behind the kernel
+// page @page, so a page of data changes hands without being copied.
+// The user page has to be present in a writable ALLOC or file area,
+// where every frame belongs to the space.
+//
+// Returns false, changing nothing, if it isn't.
+//
+bool      mem_swap_page(uintptr_t virt_address, void *page);
 
 void     mem_write_page(mem_space space_handle, uintptr_t virt_addr, const void *data, size_t size);
 
@@ -75,6 +118,10 @@ int mem_map_portal(uintptr_t virt_address,
 void mem_unmap_portal(uintptr_t virt_address, size_t length);
 
 p2::opt<uint16_t> mem_area_flags(mem_space space, const void *address);
+p2::opt<uintptr_t> mem_physical_address(mem_space space, uintptr_t virt_address);
+
+void mem_get_stats(mem_space space, mem_stats *stats);
+void mem_get_total_stats(mem_stats *stats);
 p2::opt<mem_area> mem_find_area(mem_space space_handle, uintptr_t address);
 
 #endif // !PEOS2_MEMORY_H
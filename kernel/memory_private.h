@@ -3,6 +3,8 @@
 #ifndef PEOS2_MEMORY_PRIVATE_H
 #define PEOS2_MEMORY_PRIVATE_H
 
+#include "memory.h"
+
 #include "support/pool.h"
 
 #define AREA_LINEAR_MAP 1
@@ -20,6 +22,7 @@
 
 #define MEM_PTE_D  0x0040  // Dirty
 #define MEM_PTE_G  0x0080  // Global
+#define MEM_PTE_BORROWED 0x0200  // Available to software: the frame belongs to a file, don't free it
 
 // Structs
 struct page_dir_entry {
@@ -54,6 +57,7 @@ struct space_info {
   p2::fixed_pool<area_info, 32> areas;
   p2::fixed_pool<linear_map_info, 16> linear_maps;
   p2::fixed_pool<file_map_info, 16> file_maps;
+  mem_stats stats = {};  // resident_pages is counted on demand
 };
 
 #endif // !PEOS2_MEMORY_PRIVATE_H
@@ -6,6 +6,7 @@
 #include <stdint.h>
 
 #define MULTIBOOT_MAGIC         0x2BADB002
+#define MULTIBOOT_INFO_CMDLINE  0x00000004
 #define MULTIBOOT_INFO_MEM_MAP  0x00000040
 
 #define MULTIBOOT_MEMORY_AVAILABLE              1
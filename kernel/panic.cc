@@ -1,5 +1,6 @@
 #include "support/panic.h"
 #include "screen.h"
+#include "serial.h"
 #include "process.h"
 #include "syscall_utils.h"
 #include "syscall_decls.h"
@@ -27,6 +28,9 @@ void panic(const char *explanation) {
     }
   }
   else {
+    // Whatever happens next, the message should get out
+    com_set_synchronous();
+
     if (proc_current_pid()) {
       // This might be an interrupt from a user space process, but it
       // might also be something else.
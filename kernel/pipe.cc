@@ -0,0 +1,363 @@
+#include "pipe.h"
+#include "filesystem.h"
+#include "memory.h"
+#include "process.h"
+#include "locks.h"
+#include "syscalls.h"
+#include "syscall_utils.h"
+#include "debug.h"
+
+#include "support/pool.h"
+#include "support/utils.h"
+
+// Declarations
+#define PIPE_PAGES      16     // Capacity of a pipe, 64 KiB
+#define PIPE_PAGE_SIZE  0x1000
+
+#define PIPE_READ_END   0
+#define PIPE_WRITE_END  1
+
+static int syscall_pipe(int *fds);
+
+static int write(int handle, const char *data, int length);
+static int read(int handle, char *data, int length);
+static int close(int handle);
+static int seek(int handle, int offset, int relative);
+static uint32_t poll(int handle, uint32_t events);
+static int view(int handle, const char **data);
+
+//
+// pipe_buffer - the unread part of one page of the ring
+//
+struct pipe_buffer {
+  uint16_t start, end;
+};
+
+//
+// pipe - buffer N of the ring always lives in page N. Pages are
+// allocated when the ring first reaches them and kept until the pipe
+// is freed, as the ring keeps coming back to them.
+//
+struct pipe {
+  char        *pages[PIPE_PAGES] = {};
+  pipe_buffer buffers[PIPE_PAGES] = {};
+  uint8_t     head = 0, count = 0;     // Buffers with unread data
+  bool        read_open = true, write_open = true;
+  condition_variable<8> readable, writable;
+};
+
+// Global state
+static p2::fixed_pool<pipe, 64> pipes;
+static vfs_node_handle pipe_driver;
+static pipe_stats stats;
+
+// Definitions
+void pipe_init()
+{
+  static vfs_device_driver interface =
+  {
+    .write = write,
+    .read = read,
+    .open = nullptr,
+    .close = close,
+    .control = nullptr,
+    .seek = seek,
+    .tell = nullptr,
+    .mkdir = nullptr,
+    .poll = poll,
+    .readv = nullptr,
+    .writev = nullptr,
+    .readdir = nullptr,
+    .frame = nullptr,
+    .view = view,
+    .advise = nullptr
+  };
+
+  // Pipes have no path, their fds are handed out by `pipe`
+  pipe_driver = vfs_create_node(VFS_CHAR_DEVICE);
+  vfs_set_driver(pipe_driver, &interface, nullptr);
+
+  syscall_register(SYSCALL_NUM_PIPE, (syscall_fun)syscall_pipe);
+}
+
+void pipe_get_stats(pipe_stats *out)
+{
+  *out = stats;
+}
+
+static int syscall_pipe(int *fds)
+{
+  verify_buf(pipe, fds, 2 * sizeof(int));
+
+  if (pipes.full())
+    return ENOSPACE;
+
+  const int index = pipes.emplace_anywhere();
+  vfs_context context = proc_get_file_context(*proc_current_pid());
+
+  // Failing to install an end closes it, the other end is closed here
+  p2::res<vfs_fd> read_fd = vfs_open_handle(context, pipe_driver, index << 1 | PIPE_READ_END, OPEN_READ);
+
+  if (!read_fd) {
+    close(index << 1 | PIPE_WRITE_END);
+    return read_fd.error();
+  }
+
+  p2::res<vfs_fd> write_fd = vfs_open_handle(context, pipe_driver, index << 1 | PIPE_WRITE_END, OPEN_READWRITE);
+
+  if (!write_fd) {
+    vfs_close(context, *read_fd);
+    return write_fd.error();
+  }
+
+  dbg_puts(pipe, "pipe %d at fds %d and %d", index, *read_fd, *write_fd);
+  fds[0] = *read_fd;
+  fds[1] = *write_fd;
+  return 0;
+}
+
+static pipe_buffer *last_buffer(pipe &pipe_)
+{
+  if (pipe_.count == 0)
+    return nullptr;
+
+  return &pipe_.buffers[(pipe_.head + pipe_.count - 1) % PIPE_PAGES];
+}
+
+// room - bytes that can be written without blocking
+static int room(pipe &pipe_)
+{
+  const pipe_buffer *last = last_buffer(pipe_);
+  return (PIPE_PAGES - pipe_.count) * PIPE_PAGE_SIZE + (last ? PIPE_PAGE_SIZE - last->end : 0);
+}
+
+static void pop_buffer(pipe &pipe_)
+{
+  pipe_.head = (pipe_.head + 1) % PIPE_PAGES;
+  --pipe_.count;
+}
+
+//
+// append - copies as much of @data as fits into the ring. Returns the
+// number of bytes copied.
+//
+static int append(pipe &pipe_, const char *data, int length)
+{
+  int bytes_written = 0;
+
+  while (bytes_written < length) {
+    pipe_buffer *last = last_buffer(pipe_);
+
+    if (!last || last->end == PIPE_PAGE_SIZE) {
+      if (pipe_.count == PIPE_PAGES)
+        break;
+
+      const int slot = (pipe_.head + pipe_.count) % PIPE_PAGES;
+
+      if (!pipe_.pages[slot] && !(pipe_.pages[slot] = (char *)mem_alloc_kernel_page()))
+        break;
+
+      pipe_.buffers[slot] = {0, 0};
+      ++pipe_.count;
+      last = &pipe_.buffers[slot];
+    }
+
+    char *page = pipe_.pages[last - pipe_.buffers];
+    const int chunk = p2::min(length - bytes_written, PIPE_PAGE_SIZE - last->end);
+
+    memcpy(page + last->end, data + bytes_written, chunk);
+    last->end += chunk;
+    bytes_written += chunk;
+  }
+
+  return bytes_written;
+}
+
+//
+// write - blocks until all of @data is written or the read end is
+// closed. Writes of up to a page wait until they fit in one go, so
+// they aren't interleaved with other writers.
+//
+static int write(int handle, const char *data, int length)
+{
+  if ((handle & 1) != PIPE_WRITE_END)
+    return ENOSUPPORT;
+
+  pipe &pipe_ = pipes[handle >> 1];
+  int bytes_written = 0;
+
+  while (bytes_written < length) {
+    while (pipe_.read_open && room(pipe_) < p2::min(length - bytes_written, PIPE_PAGE_SIZE)) {
+      if (pipe_.writable.full())
+        return bytes_written > 0 ? bytes_written : EBUSY;
+
+      if (int ret = pipe_.writable.wait(); ret < 0)
+        return bytes_written > 0 ? bytes_written : ret;
+    }
+
+    if (!pipe_.read_open)
+      return bytes_written > 0 ? bytes_written : EPIPE;
+
+    // Only fails when out of memory
+    const int appended = append(pipe_, data + bytes_written, length - bytes_written);
+
+    if (appended == 0)
+      return bytes_written > 0 ? bytes_written : ENOSPACE;
+
+    bytes_written += appended;
+    stats.bytes_written += appended;
+
+    // One reader is enough; it passes the baton on if it leaves data
+    pipe_.readable.notify_one();
+    vfs_poll_notify();
+  }
+
+  if (room(pipe_) >= PIPE_PAGE_SIZE)
+    pipe_.writable.notify_one();
+
+  return bytes_written;
+}
+
+static int read(int handle, char *data, int length)
+{
+  if ((handle & 1) != PIPE_READ_END)
+    return ENOSUPPORT;
+
+  if (length == 0)
+    return 0;
+
+  pipe &pipe_ = pipes[handle >> 1];
+
+  while (pipe_.count == 0) {
+    // Nothing more will come
+    if (!pipe_.write_open)
+      return 0;
+
+    if (pipe_.readable.full())
+      return EBUSY;
+
+    if (int ret = pipe_.readable.wait(); ret < 0)
+      return ret;
+  }
+
+  int bytes_read = 0;
+
+  while (bytes_read < length && pipe_.count > 0) {
+    pipe_buffer &buffer = pipe_.buffers[pipe_.head];
+    char *page = pipe_.pages[pipe_.head];
+    char *destination = data + bytes_read;
+    const int chunk = p2::min(length - bytes_read, buffer.end - buffer.start);
+
+    // A whole page going to a whole page changes hands instead. The
+    // reader's old frame becomes the pipe's page.
+    if (chunk == PIPE_PAGE_SIZE && !((uintptr_t)destination & 0xFFF) && mem_swap_page((uintptr_t)destination, page))
+      ++stats.pages_moved;
+    else
+      memcpy(destination, page + buffer.start, chunk);
+
+    buffer.start += chunk;
+    bytes_read += chunk;
+
+    if (buffer.start == buffer.end)
+      pop_buffer(pipe_);
+  }
+
+  pipe_.writable.notify_one();
+  vfs_poll_notify();
+
+  if (pipe_.count > 0)
+    pipe_.readable.notify_one();
+
+  return bytes_read;
+}
+
+//
+// seek - only skips forward, dropping data. This is how `sendfile`
+// moves past what it took through `view`.
+//
+static int seek(int handle, int offset, int relative)
+{
+  if ((handle & 1) != PIPE_READ_END || relative != SEEK_CUR || offset < 0)
+    return EINVVAL;
+
+  pipe &pipe_ = pipes[handle >> 1];
+
+  while (offset > 0 && pipe_.count > 0) {
+    pipe_buffer &buffer = pipe_.buffers[pipe_.head];
+    const int skipped = p2::min(offset, buffer.end - buffer.start);
+
+    buffer.start += skipped;
+    offset -= skipped;
+
+    if (buffer.start == buffer.end)
+      pop_buffer(pipe_);
+  }
+
+  if (offset > 0)
+    return EINVVAL;
+
+  pipe_.writable.notify_one();
+  vfs_poll_notify();
+  return 0;
+}
+
+static int view(int handle, const char **data)
+{
+  if ((handle & 1) != PIPE_READ_END)
+    return ENOSUPPORT;
+
+  pipe &pipe_ = pipes[handle >> 1];
+
+  // Let `read` do the blocking
+  if (pipe_.count == 0)
+    return pipe_.write_open ? EBUSY : 0;
+
+  const pipe_buffer &buffer = pipe_.buffers[pipe_.head];
+  *data = pipe_.pages[pipe_.head] + buffer.start;
+  return buffer.end - buffer.start;
+}
+
+static uint32_t poll(int handle, uint32_t events)
+{
+  pipe &pipe_ = pipes[handle >> 1];
+  uint32_t ready = 0;
+
+  // A closed other end makes the operation return immediately
+  if ((handle & 1) == PIPE_READ_END && (pipe_.count > 0 || !pipe_.write_open))
+    ready |= POLL_IN;
+
+  if ((handle & 1) == PIPE_WRITE_END && (room(pipe_) >= PIPE_PAGE_SIZE || !pipe_.read_open))
+    ready |= POLL_OUT;
+
+  return ready & events;
+}
+
+static int close(int handle)
+{
+  const int index = handle >> 1;
+  pipe &pipe_ = pipes[index];
+
+  if ((handle & 1) == PIPE_READ_END) {
+    pipe_.read_open = false;
+    pipe_.writable.notify_all();
+  }
+  else {
+    pipe_.write_open = false;
+    pipe_.readable.notify_all();
+  }
+
+  vfs_poll_notify();
+
+  if (pipe_.read_open || pipe_.write_open)
+    return 0;
+
+  dbg_puts(pipe, "freeing pipe %d", index);
+
+  for (char *page : pipe_.pages) {
+    if (page)
+      mem_free_kernel_page(page);
+  }
+
+  pipes.erase(index);
+  return 0;
+}
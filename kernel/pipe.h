@@ -0,0 +1,23 @@
+// -*- c++ -*-
+//
+// Pipes - one-way byte streams between processes, created by the
+// `pipe` syscall as a read end and a write end. The data is kept in a
+// ring of pages: writes are copied in, appending to the last page
+// while it has room, and reads of whole pages into page aligned
+// buffers swap the page into the reader instead of copying it out.
+//
+
+#ifndef PEOS2_PIPE_H
+#define PEOS2_PIPE_H
+
+#include <stdint.h>
+
+struct pipe_stats {
+  uint32_t bytes_written;
+  uint32_t pages_moved;    // Handed to readers without being copied
+};
+
+void pipe_init();
+void pipe_get_stats(pipe_stats *stats);
+
+#endif // !PEOS2_PIPE_H
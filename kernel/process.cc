@@ -10,11 +10,17 @@
 #include "elf.h"
 #include "syscall_utils.h"
 #include "timer.h"
+#include "fpu.h"
+#include "smp.h"
+#include "ring.h"
+#include "trace.h"
+#include "serial.h"
 
 #include "support/pool.h"
 #include "support/format.h"
 #include "support/limits.h"
 #include "support/assert.h"
+#include "support/filesystem.h"
 
 #include "process_private.h"
 
@@ -26,29 +32,65 @@ static uint32_t    syscall_exit(int exit_code);
 static uint32_t    syscall_kill(uint32_t pid);
 static int         syscall_exec(const char *filename, const char **argv);
 static int         syscall_fork(uint32_t, uint32_t, uint32_t, uint32_t, uint32_t, isr_registers *regs);
+static int         syscall_spawn(const char *filename, const char **argv, const int *fd_map, int fd_count);
 static int         syscall_shutdown();
 static int         syscall_wait(int pid);
 static int         syscall_set_timeout(int timeout);
 static int         syscall_get_timeout();
+static int         syscall_sched_stats(sched_stats_t *stats_out);
+static int         syscall_set_priority(int priority);
+static int         syscall_thread_create(uintptr_t start, uintptr_t fun, uintptr_t arg);
+static int         syscall_thread_join(int tid);
 
 static proc_handle decide_next_process();
 static void        destroy_process(proc_handle pid);
+static uint16_t    create_thread_group();
+static bool        same_thread_group(proc_handle pid, proc_handle other_pid);
+static void        reap_other_threads(proc_handle pid);
+static void        wait_for_exit(proc_handle waiter_pid, proc_handle pid);
 static void        switch_process(proc_handle pid);
 
 static void        enqueue_front(proc_handle pid, proc_handle *head);
 static void        dequeue(proc_handle pid, proc_handle *head);
+static void        migrate(proc_handle pid, int cpu);
+static bool        idle_process(proc_handle pid);
 
-static void        idle_main();
+static void        idle_main(uintptr_t);
+static void        account_cycles(process &proc);
+static void        set_name_from_path(proc_handle pid, const char *path);
 static void        on_timer_tick(int milliseconds);
 
 // Global state
 static p2::fixed_pool<process, 128, proc_handle> processes;
 
-static proc_handle current_pid = processes.end_sentinel();
-static proc_handle running_head = processes.end_sentinel(), suspended_head = processes.end_sentinel();
-static proc_handle idle_process = processes.end_sentinel();
+//
+// cpu_state - scheduling state of one CPU. Each CPU has its own run
+// queue and idle thread; suspended processes are shared.
+//
+struct cpu_state {
+  proc_handle current_pid;
+  proc_handle running_head;
+  proc_handle idle_pid;
+  int         queue_length;
+  uint64_t    account_tsc;   // When cycles were last charged to a process
+};
+
+static cpu_state cpus[SMP_MAX_CPUS];
+static proc_handle suspended_head = processes.end_sentinel();
+
+//
+// thread_group - the threads sharing a space and file context. These
+// are released together with the last thread.
+//
+struct thread_group {
+  int      threads;
+  uint32_t used_slots;  // Bit per stack slot in use
+};
+
+static p2::fixed_pool<thread_group, 128> thread_groups;
 
 static uint64_t tick_count;
+static sched_stats_t sched_stats;
 
 // Definitions
 void proc_init()
@@ -59,16 +101,35 @@ void proc_init()
   syscall_register(SYSCALL_NUM_KILL,        (syscall_fun)syscall_kill);
   syscall_register(SYSCALL_NUM_EXEC,        (syscall_fun)syscall_exec);
   syscall_register(SYSCALL_NUM_FORK,        (syscall_fun)syscall_fork);
+  syscall_register(SYSCALL_NUM_SPAWN,       (syscall_fun)syscall_spawn);
   syscall_register(SYSCALL_NUM_SHUTDOWN,    (syscall_fun)syscall_shutdown);
   syscall_register(SYSCALL_NUM_WAIT,        (syscall_fun)syscall_wait);
   syscall_register(SYSCALL_NUM_SET_TIMEOUT, (syscall_fun)syscall_set_timeout);
   syscall_register(SYSCALL_NUM_GET_TIMEOUT, (syscall_fun)syscall_get_timeout);
+  syscall_register(SYSCALL_NUM_SCHED_STATS, (syscall_fun)syscall_sched_stats);
+  syscall_register(SYSCALL_NUM_THREAD_CREATE, (syscall_fun)syscall_thread_create);
+  syscall_register(SYSCALL_NUM_THREAD_JOIN, (syscall_fun)syscall_thread_join);
+  syscall_register(SYSCALL_NUM_SET_PRIORITY, (syscall_fun)syscall_set_priority);
 
   // Timer for preemptive task switching
   timer_register_tick_callback(on_timer_tick);
 
-  idle_process = proc_create(PROC_KERNEL_ACCESSIBLE, (uintptr_t)idle_main);
-  // TODO: support for kernel stack arguments
+  for (int cpu = 0; cpu < SMP_MAX_CPUS; ++cpu) {
+    cpus[cpu].current_pid = cpus[cpu].running_head = cpus[cpu].idle_pid = processes.end_sentinel();
+    cpus[cpu].queue_length = 0;
+    cpus[cpu].account_tsc = 0;
+  }
+
+  for (int cpu = 0; cpu < smp_cpu_count(); ++cpu) {
+    cpus[cpu].idle_pid = proc_create_kernel_thread(idle_main, cpu);
+    processes[cpus[cpu].idle_pid].cpu = cpu;
+    proc_set_name(cpus[cpu].idle_pid, "idle");
+  }
+}
+
+static inline cpu_state &this_cpu()
+{
+  return cpus[smp_cpu_index()];
 }
 
 proc_handle proc_create(uint32_t flags, uintptr_t entrypoint)
@@ -88,6 +149,8 @@ proc_handle proc_create(uint32_t flags, uintptr_t entrypoint)
   proc_handle pid = processes.emplace_anywhere(space_handle,
                                                *vfs_create_context(),
                                                flags);
+  processes[pid].thread_group = create_thread_group();
+
   if (flags & PROC_USER_SPACE) {
     isr_registers regs = {};
     regs.cs = USER_CODE_SEL;
@@ -108,6 +171,51 @@ proc_handle proc_create(uint32_t flags, uintptr_t entrypoint)
   return pid;
 }
 
+//
+// proc_create_kernel_thread - creates a process that runs
+// @entrypoint(@arg) in supervisor mode in the kernel space. It's not
+// enqueued, and @entrypoint must never return. Kernel threads are created while initializing, so running
+// out of processes or kernel stacks (see mem_alloc_kernel_stack)
+// panics rather than leaving a subsystem without its thread.
+//
+proc_handle proc_create_kernel_thread(void (*entrypoint)(uintptr_t), uintptr_t arg)
+{
+  if (processes.full())
+    panic("out of processes for kernel threads");
+
+  proc_handle pid = processes.emplace_anywhere(mem_kernel_space(),
+                                               *vfs_create_context(),
+                                               PROC_KERNEL_THREAD);
+  processes[pid].setup_kernel_thread_stack((uintptr_t)entrypoint, arg);
+  processes[pid].name = "kthread";
+
+  dbg_puts(proc, "created kernel thread %d", pid);
+  return pid;
+}
+
+void proc_set_name(proc_handle pid, const char *name)
+{
+  processes[pid].name = name;
+}
+
+const char *proc_get_name(proc_handle pid)
+{
+  if (!processes.valid(pid))
+    return nullptr;
+
+  return processes[pid].name.c_str();
+}
+
+void proc_set_priority(proc_handle pid, int priority)
+{
+  processes[pid].priority = priority;
+}
+
+int proc_priority(proc_handle pid)
+{
+  return processes[pid].priority;
+}
+
 void proc_setup_user_stack(proc_handle pid, int argc, const char *argv[])
 {
   processes[pid].setup_user_stack(argc, argv);
@@ -121,22 +229,77 @@ void proc_set_syscall_ret(proc_handle pid, uintptr_t ip)
 void proc_enqueue(proc_handle pid)
 {
   // TODO: check status and that it's not on a queue already
-  enqueue_front(pid, &running_head);
+  // New processes go to the least loaded CPU
+  int target_cpu = 0;
+
+  for (int cpu = 1; cpu < smp_cpu_count(); ++cpu) {
+    if (smp_cpu_online(cpu) && cpus[cpu].queue_length < cpus[target_cpu].queue_length)
+      target_cpu = cpu;
+  }
+
+  processes[pid].cpu = target_cpu;
+  enqueue_front(pid, &cpus[target_cpu].running_head);
+  cpus[target_cpu].queue_length++;
 }
 
 static void destroy_process(proc_handle pid)
 {
   process &proc = processes[pid];
-  proc.destroy();
+  bool last_thread = true;
+
+  if (proc.thread_group) {
+    thread_group &group = thread_groups[*proc.thread_group];
+    group.used_slots &= ~(1u << proc.thread_slot);
+    last_thread = --group.threads == 0;
+
+    if (last_thread)
+      thread_groups.erase(*proc.thread_group);
+  }
+
+  proc.destroy(last_thread);
+  fpu_release(pid);
+  ring_release(pid);
 
   // TODO: we might want to keep the PCB around for a while so we can
   // read the exit status, detect dangling references, etc...
   processes.erase(pid);
 }
 
+static uint16_t create_thread_group()
+{
+  return thread_groups.emplace_anywhere(thread_group{1, 1u});
+}
+
+static bool same_thread_group(proc_handle pid, proc_handle other_pid)
+{
+  const auto &group = processes[pid].thread_group, &other_group = processes[other_pid].thread_group;
+  return group && other_group && *group == *other_group;
+}
+
+//
+// reap_other_threads - kills and destroys all threads sharing space
+// with @pid
+//
+static void reap_other_threads(proc_handle pid)
+{
+  for (proc_handle other_pid = 0; other_pid < processes.watermark(); ++other_pid) {
+    if (other_pid == pid || !processes.valid(other_pid) || !same_thread_group(pid, other_pid))
+      continue;
+
+    if (!processes[other_pid].terminating)
+      proc_kill(other_pid, processes[pid].exit_status);
+
+    while (processes[other_pid].on_cpu)
+      kernel_lock_relax();
+
+    destroy_process(other_pid);
+  }
+}
+
 
 p2::opt<proc_handle> proc_current_pid()
 {
+  proc_handle current_pid = this_cpu().current_pid;
   if (current_pid != processes.end_sentinel())
     return current_pid;
 
@@ -154,12 +317,20 @@ void proc_run()
   while (true) {}
 }
 
+//
+// on_timer_tick - wakes timed out processes on every tick but only
+// preempts once per quantum, so a faster timer (the profiler) doesn't
+// shorten time slices
+//
 void on_timer_tick(int delta_ms)
 {
+  static int ms_since_yield = 0;
   proc_handle proc = suspended_head;
 
   while (proc != processes.end_sentinel()) {
     process &process_ = processes[proc];
+    // Waking moves the process to a run queue
+    proc_handle next_proc = process_.next_process;
 
     if (process_.suspension_timeout > 0) {
       process_.suspension_timeout -= delta_ms;
@@ -167,14 +338,19 @@ void on_timer_tick(int delta_ms)
       if (process_.suspension_timeout <= 0) {
         // The timeout reached 0 so wake it up
         dbg_puts(proc, "unblocking %d due to timeout", proc);
-        proc_unblock_and_switch(proc, ETIMEOUT);
+        proc_wake(proc, ETIMEOUT);
       }
     }
 
-    proc = process_.next_process;
+    proc = next_proc;
   }
 
-  proc_yield();
+  ms_since_yield += delta_ms;
+
+  if (ms_since_yield >= 1000 / TIMER_DEFAULT_HZ) {
+    ms_since_yield = 0;
+    proc_yield();
+  }
 }
 
 void proc_switch(proc_handle pid)
@@ -185,6 +361,11 @@ void proc_switch(proc_handle pid)
   process &proc = processes[pid];
   assert(!proc.suspended && "please resume the process before switching to it");
 
+  if (proc.on_cpu) {
+    // It's already running on another CPU
+    return;
+  }
+
   if (proc.terminating) {
     dbg_puts(proc, "trying to switch to terminating process %d", pid);
     // The process has been terminated, so we cannot run it. This can
@@ -192,6 +373,9 @@ void proc_switch(proc_handle pid)
     // else asked to kill it.
     pid = decide_next_process();
   }
+  else if (proc.cpu != smp_cpu_index()) {
+    migrate(pid, smp_cpu_index());
+  }
 
   switch_process(pid);
 }
@@ -205,12 +389,33 @@ static void switch_process(proc_handle pid)
   // Update last_tick so the scheduler will work correctly
   proc.last_tick = tick_count;
 
-  if (current_pid == pid) {
+  cpu_state &cpu = this_cpu();
+  if (cpu.current_pid == pid) {
     return;
   }
 
-  process *previous_proc = processes.valid(current_pid) ? &processes[current_pid] : nullptr;
-  current_pid = pid;
+  tracepoint(TRACE_SCHED_SWITCH, cpu.current_pid, pid);
+
+  process *previous_proc = processes.valid(cpu.current_pid) ? &processes[cpu.current_pid] : nullptr;
+  if (previous_proc) {
+    account_cycles(*previous_proc);
+
+    // Other CPUs can't pick it up until we release the kernel lock
+    // on the other side of the switch
+    previous_proc->on_cpu = false;
+    previous_proc->lock_depth = kernel_lock_depth();
+  }
+  else {
+    // Nobody to charge the time since the last switch to
+    cpu.account_tsc = rdtsc();
+  }
+
+  cpu.current_pid = pid;
+  proc.on_cpu = true;
+  proc.switches++;
+  sched_stats.context_switches++;
+  fpu_switch(pid);
+  kernel_lock_set_depth(proc.lock_depth);
   proc.activate(previous_proc);
 }
 
@@ -220,27 +425,67 @@ int proc_yield()
   tick_count++;
   // Increase tick count so we get more fair sharing
 
-  if (processes.valid(current_pid))
-    processes[current_pid].last_tick = tick_count;
+  if (auto current_pid = proc_current_pid())
+    processes[*current_pid].last_tick = tick_count;
 
   proc_switch(decide_next_process());
-  return processes[current_pid].unblock_status;
+  return processes[*proc_current_pid()].unblock_status;
 }
 
 int proc_block(proc_handle pid)
 {
+  tracepoint(TRACE_SCHED_BLOCK, pid, processes[pid].suspension_timeout);
   proc_suspend(pid);
   int ret = proc_yield();
   return ret;
 }
 
-void proc_unblock_and_switch(proc_handle pid, int status)
+//
+// proc_block_timeout - like `proc_block` but uses @timeout (ms, -1 for
+// none) instead of the timeout set by the process itself
+//
+int proc_block_timeout(proc_handle pid, int timeout)
 {
-  if (processes.valid(pid)) {
-    processes[pid].unblock_status = status;
-    proc_resume(pid);
-    proc_switch(pid);
+  int32_t previous_timeout = processes[pid].suspension_timeout;
+  processes[pid].suspension_timeout = timeout;
+  int ret = proc_block(pid);
+  processes[pid].suspension_timeout = previous_timeout;
+  return ret;
+}
+
+//
+// proc_wake - makes a blocked process runnable without switching to
+// it. Its `proc_block` returns @status once it's scheduled. Returns
+// false if the process wasn't blocked.
+//
+bool proc_wake(proc_handle pid, int status)
+{
+  if (!processes.valid(pid) || !processes[pid].suspended || processes[pid].terminating)
+    return false;
+
+  tracepoint(TRACE_SCHED_WAKE, pid, status);
+  processes[pid].unblock_status = status;
+  proc_resume(pid);
+  sched_stats.wakeups++;
+  return true;
+}
+
+//
+// proc_preempt - switches to @pid if it's runnable and has a higher
+// priority than the current process
+//
+void proc_preempt(proc_handle pid)
+{
+  if (!processes.valid(pid) || processes[pid].suspended || processes[pid].on_cpu)
+    return;
+
+  if (auto current_pid = proc_current_pid();
+      current_pid && processes[pid].priority <= processes[*current_pid].priority) {
+    return;
   }
+
+  sched_stats.preemptions++;
+  proc_switch(pid);
 }
 
 void proc_suspend(proc_handle pid)
@@ -251,7 +496,8 @@ void proc_suspend(proc_handle pid)
   }
 
   dbg_puts(proc, "suspending %d", pid);
-  dequeue(pid, &running_head);
+  dequeue(pid, &cpus[proc.cpu].running_head);
+  cpus[proc.cpu].queue_length--;
   enqueue_front(pid, &suspended_head);
   proc.suspended = true;
 }
@@ -263,9 +509,15 @@ void proc_resume(proc_handle pid)
     return;
   }
 
+  if (proc.terminating) {
+    // It was killed while blocked, so it's not on any queue
+    return;
+  }
+
   dbg_puts(proc, "resuming %d", pid);
   dequeue(pid, &suspended_head);
-  enqueue_front(pid, &running_head);
+  enqueue_front(pid, &cpus[proc.cpu].running_head);
+  cpus[proc.cpu].queue_length++;
   proc.suspended = false;
 }
 
@@ -298,17 +550,28 @@ static void dequeue(proc_handle pid, proc_handle *head)
   }
 }
 
-static proc_handle decide_next_process()
+//
+// pick_from_queue - the best candidate in @cpu's run queue that isn't
+// executing on another CPU
+//
+static proc_handle pick_from_queue(int cpu)
 {
   // TODO: this algorithm has a bias towards the front of the list due
   // to the < comparison. Make it more fair.
+  int maximum_priority = PROC_PRIORITY_NORMAL;
   uint64_t minimum_tick = p2::numeric_limits<uint64_t>::max();
   proc_handle minimum_pid = processes.end_sentinel();
-  proc_handle node = running_head;
+  proc_handle current_pid = this_cpu().current_pid;
+  proc_handle node = cpus[cpu].running_head;
 
   while (node != processes.end_sentinel()) {
     process &proc = processes[node];
-    if (proc.last_tick < minimum_tick) {
+
+    // Higher priorities always win, the tick only decides within a priority
+    if ((!proc.on_cpu || node == current_pid) &&
+        (proc.priority > maximum_priority ||
+         (proc.priority == maximum_priority && proc.last_tick < minimum_tick))) {
+      maximum_priority = proc.priority;
       minimum_tick = proc.last_tick;
       minimum_pid = node;
     }
@@ -316,11 +579,63 @@ static proc_handle decide_next_process()
     node = proc.next_process;
   }
 
-  if (minimum_pid == processes.end_sentinel()) {
-    return idle_process;
+  return minimum_pid;
+}
+
+static proc_handle decide_next_process()
+{
+  const int this_cpu_idx = smp_cpu_index();
+  proc_handle next_pid = pick_from_queue(this_cpu_idx);
+
+  if (next_pid != processes.end_sentinel()) {
+    return next_pid;
+  }
+
+  // Nothing to do here, steal work from the busiest CPU before idling
+  int busiest_cpu = -1;
+
+  for (int cpu = 0; cpu < smp_cpu_count(); ++cpu) {
+    if (cpu != this_cpu_idx && cpus[cpu].queue_length > 0 &&
+        (busiest_cpu < 0 || cpus[cpu].queue_length > cpus[busiest_cpu].queue_length)) {
+      busiest_cpu = cpu;
+    }
   }
 
-  return minimum_pid;
+  if (busiest_cpu >= 0) {
+    next_pid = pick_from_queue(busiest_cpu);
+
+    if (next_pid != processes.end_sentinel()) {
+      dbg_puts(proc, "stealing %d from cpu %d", next_pid, busiest_cpu);
+      migrate(next_pid, this_cpu_idx);
+      return next_pid;
+    }
+  }
+
+  return this_cpu().idle_pid;
+}
+
+static void migrate(proc_handle pid, int cpu)
+{
+  process &proc = processes[pid];
+
+  if (!proc.suspended) {
+    dequeue(pid, &cpus[proc.cpu].running_head);
+    cpus[proc.cpu].queue_length--;
+    enqueue_front(pid, &cpus[cpu].running_head);
+    cpus[cpu].queue_length++;
+  }
+
+  proc.cpu = cpu;
+}
+
+static bool idle_process(proc_handle pid)
+{
+  for (auto &cpu : cpus) {
+    if (cpu.idle_pid == pid)
+      return true;
+  }
+
+  return false;
 }
 
 static uint32_t syscall_yield()
@@ -331,7 +646,7 @@ static uint32_t syscall_yield()
 
 void proc_kill(proc_handle pid, uint32_t exit_status)
 {
-  assert(pid != idle_process && "trying to kill the idle process");
+  assert(!idle_process(pid) && "trying to kill the idle process");
 
   if (!processes.valid(pid)) {
     dbg_puts(proc, "pid %d is invalid", pid);
@@ -341,7 +656,13 @@ void proc_kill(proc_handle pid, uint32_t exit_status)
   process &proc = processes[pid];
 
   // Remove the process so it won't get picked for execution
-  dequeue(pid, proc.suspended ? &suspended_head : &running_head);
+  if (proc.suspended) {
+    dequeue(pid, &suspended_head);
+  }
+  else {
+    dequeue(pid, &cpus[proc.cpu].running_head);
+    cpus[proc.cpu].queue_length--;
+  }
 
   // Mark the process as terminating, but don't clean it up. Some
   // other process should be waiting on this process, and it needs to
@@ -349,6 +670,17 @@ void proc_kill(proc_handle pid, uint32_t exit_status)
   // address space
   proc.exit(exit_status);
   dbg_puts(proc, "pid %d exited with status %d", pid, exit_status);
+
+  // The process ends with its main thread. The other threads get
+  // destroyed when someone waits for the process.
+  if (proc.thread_group && proc.thread_slot == 0 && thread_groups[*proc.thread_group].threads > 1) {
+    for (proc_handle other_pid = 0; other_pid < processes.watermark(); ++other_pid) {
+      if (other_pid != pid && processes.valid(other_pid) && same_thread_group(pid, other_pid) &&
+          !processes[other_pid].terminating) {
+        proc_kill(other_pid, exit_status);
+      }
+    }
+  }
 }
 
 mem_space proc_get_space(proc_handle pid)
@@ -399,6 +731,12 @@ static int syscall_exec(const char *filename, const char *argv[])
 
   dbg_puts(proc, "execing process with image '%s'", filename);
 
+  if (processes[*proc_current_pid()].thread_slot != 0) {
+    // The new image would have to start on the main thread's stacks
+    dbg_puts(proc, "exec is only supported in the main thread");
+    return ENOSUPPORT;
+  }
+
   vfs_context file_context = proc_get_file_context(*proc_current_pid());
   mem_space space = proc_get_space(*proc_current_pid());
 
@@ -418,6 +756,9 @@ static int syscall_exec(const char *filename, const char *argv[])
   int argc = copy_argvs(argv, arg_arena, arg_ptrs, ARRAY_SIZE(arg_ptrs));
   arg_ptrs[argc + 1] = nullptr;
 
+  // Other threads would continue executing in the new image
+  reap_other_threads(*proc_current_pid());
+
   // Remove existing user space mappings so there won't be any
   // collisions. This is where the old stack goes away.
   mem_unmap_not_matching(space, MEM_AREA_RETAIN_EXEC);
@@ -425,6 +766,12 @@ static int syscall_exec(const char *filename, const char *argv[])
   // Keep files like stdout and mmap'd binaries
   vfs_close_not_matching(file_context, OPEN_RETAIN_EXEC);
 
+  // The new image starts with a fresh FPU state on first use
+  fpu_release(*proc_current_pid());
+
+  // Rings point into the old image
+  ring_release(*proc_current_pid());
+
   if (int result = elf_map_process(*proc_current_pid(), image_path.c_str()); result < 0) {
     return result;
   }
@@ -434,23 +781,85 @@ static int syscall_exec(const char *filename, const char *argv[])
 
   mem_print_space(space);
 
+  set_name_from_path(*proc_current_pid(), image_path.c_str());
   dbg_puts(proc, "exec successful");
 
   return 0;
 }
 
+static int syscall_spawn(const char *filename, const char **argv, const int *fd_map, int fd_count)
+{
+  verify_ptr(proc, filename);   // TODO: verify whole filename
+  verify_ptr(proc, argv);
+
+  // The child can't have more fds than this anyway
+  if (fd_count < 0 || fd_count > VFS_MAX_FDS)
+    return EINVVAL;
+
+  if (fd_count > 0)
+    verify_buf(proc, fd_map, fd_count * sizeof(fd_map[0]));
+
+  if (processes.full())
+    return ENOSPACE;
+
+  dbg_puts(proc, "spawning process with image '%s'", filename);
+
+  const char *arg_ptrs[32];
+  p2::string<1024> arg_arena;
+  int argc = copy_argvs(argv, arg_arena, arg_ptrs, ARRAY_SIZE(arg_ptrs));
+
+  // The entrypoint is set when the image is mapped
+  proc_handle child_pid = proc_create(PROC_USER_SPACE, 0);
+  vfs_context parent_context = proc_get_file_context(*proc_current_pid());
+
+  for (int fd = 0; fd < fd_count; ++fd) {
+    if (fd_map[fd] < 0)
+      continue;
+
+    if (int result = vfs_alias_fd(parent_context, fd_map[fd], proc_get_file_context(child_pid), fd); result < 0) {
+      destroy_process(child_pid);
+      return result;
+    }
+  }
+
+  if (int result = elf_map_process(child_pid, filename); result < 0) {
+    destroy_process(child_pid);
+    return result;
+  }
+
+  proc_setup_user_stack(child_pid, argc, arg_ptrs);
+  set_name_from_path(child_pid, filename);
+  proc_enqueue(child_pid);
+
+  dbg_puts(proc, "... spawned child pid: %d", child_pid);
+  return child_pid;
+}
+
 static int syscall_fork(uint32_t, uint32_t, uint32_t, uint32_t, uint32_t, isr_registers *regs)
 {
   proc_handle parent_pid = *proc_current_pid();
   dbg_puts(proc, "forking process %d", parent_pid);
 
+  if (processes[parent_pid].thread_slot != 0) {
+    // Thread stacks aren't copied to the child
+    dbg_puts(proc, "fork is only supported in the main thread");
+    return ENOSUPPORT;
+  }
+
+  if (processes.full())
+    return ENOSPACE;
+
   mem_space space_handle = *mem_fork_space(proc_get_space(parent_pid));
   vfs_context file_context = *vfs_fork_context(proc_get_file_context(parent_pid));
 
+  // Only the calling thread is forked, it's the main thread of the child
   proc_handle child_pid = processes.emplace_anywhere(space_handle, file_context, 0);
+  processes[child_pid].thread_group = create_thread_group();
+  processes[child_pid].name = processes[parent_pid].name;
   dbg_puts(proc, "... forked child pid: %d", child_pid);
 
   processes[child_pid].setup_kernel_stack(regs);
+  fpu_fork(parent_pid, child_pid);
   proc_enqueue(child_pid);
   return child_pid;
 }
@@ -460,6 +869,7 @@ static int syscall_shutdown()
   // TODO: destroy all processes
   // TODO: correct ACPI, this just works for emulators...
   dbg_puts(proc, "shutting down...");
+  com_flush();
   outw(0xB004, 0x2000); // Bochs and older versions of QEMU
   outw(0x604, 0x2000);  // Newer versions of QEMU
   outw(0x4004, 0x3400); // Virtualbox
@@ -476,21 +886,96 @@ static int syscall_wait(int pid)
   }
 
   if (auto parent_pid = proc_current_pid()) {
-    if (!processes[pid].terminating) {
-      proc_suspend(*parent_pid);
-      processes[pid].waiting_process = *parent_pid;
-      proc_yield();
-      dbg_puts(proc, "came back after wait");
-      assert(processes[pid].terminating && "woke up without pid terminating");
-    }
+    wait_for_exit(*parent_pid, pid);
 
     // TODO: save exit status
+    reap_other_threads(pid);
     destroy_process(pid);
   }
 
   return 1;
 }
 
+//
+// wait_for_exit - blocks @waiter_pid until @pid has terminated and
+// isn't executing anymore
+//
+static void wait_for_exit(proc_handle waiter_pid, proc_handle pid)
+{
+  if (!processes[pid].terminating) {
+    proc_suspend(waiter_pid);
+    processes[pid].waiting_process = waiter_pid;
+    proc_yield();
+    dbg_puts(proc, "came back after wait");
+    assert(processes[pid].terminating && "woke up without pid terminating");
+  }
+
+  // The process might have been killed while running on another
+  // CPU, which needs to switch away from it before it's destroyed
+  while (processes[pid].on_cpu)
+    kernel_lock_relax();
+}
+
+static int syscall_thread_create(uintptr_t start, uintptr_t fun, uintptr_t arg)
+{
+  proc_handle parent_pid = *proc_current_pid();
+  process &parent = processes[parent_pid];
+
+  if (!parent.thread_group)
+    return ENOSUPPORT;
+
+  thread_group &group = thread_groups[*parent.thread_group];
+  int slot = 1;
+
+  while (slot < max_threads_per_process && (group.used_slots & (1u << slot)))
+    ++slot;
+
+  // Threads of all processes share the process pool
+  if (slot == max_threads_per_process || processes.full())
+    return ENOSPACE;
+
+  proc_handle tid = processes.emplace_anywhere(parent.space_handle,
+                                               parent.file_context,
+                                               0);
+  process &thread = processes[tid];
+  thread.thread_group = parent.thread_group;
+  thread.thread_slot = slot;
+  thread.priority = parent.priority;
+  thread.name = parent.name;
+  group.used_slots |= 1u << slot;
+  group.threads++;
+
+  isr_registers regs = {};
+  regs.cs = USER_CODE_SEL;
+  regs.ds = USER_DATA_SEL;
+  regs.eip = start;
+
+  thread.setup_kernel_stack(&regs);
+  thread.setup_thread_stack(slot, fun, arg);
+
+  dbg_puts(proc, "created thread %d in slot %d for %d", tid, slot, parent_pid);
+  proc_enqueue(tid);
+  return tid;
+}
+
+static int syscall_thread_join(int tid)
+{
+  proc_handle pid = *proc_current_pid();
+
+  // The main thread can't be joined, the process ends with it
+  if (!processes.valid(tid) || tid == pid || !same_thread_group(pid, tid) || processes[tid].thread_slot == 0)
+    return EINVVAL;
+
+  if (processes[tid].waiting_process)
+    return EBUSY;
+
+  wait_for_exit(pid, tid);
+
+  int exit_status = processes[tid].exit_status;
+  destroy_process(tid);
+  return exit_status;
+}
+
 static int syscall_set_timeout(int timeout)
 {
   if (auto pid = proc_current_pid()) {
@@ -509,18 +994,171 @@ static int syscall_get_timeout()
   return 0;
 }
 
+static int syscall_sched_stats(sched_stats_t *stats_out)
+{
+  verify_ptr(proc, stats_out);
+  *stats_out = sched_stats;
+  return 0;
+}
+
+static int syscall_set_priority(int priority)
+{
+  static_assert(PRIORITY_NORMAL == PROC_PRIORITY_NORMAL && PRIORITY_RAISED == PROC_PRIORITY_RAISED, "userspace priorities");
+
+  // PROC_PRIORITY_HIGH is kept for the kernel, so user processes can't
+  // hold off its bottom halves
+  if (priority != PROC_PRIORITY_NORMAL && priority != PROC_PRIORITY_RAISED)
+    return EINVVAL;
+
+  proc_set_priority(*proc_current_pid(), priority);
+  return 0;
+}
+
 //
-// Idling process: when there's nothing else to do.
+// Idling kernel thread: when there's nothing else to do.
 //
-static void idle_main()
+static void idle_main(uintptr_t cpu)
 {
-  static int count = 0;
+  int count = 0;
 
   while (true) {
-    *(volatile char *)PHYS2KERNVIRT(0xB8000) = 'A' + count;
+    // One spinning character per CPU in the top left corner
+    *(volatile char *)PHYS2KERNVIRT(0xB8000 + cpu * 2) = 'A' + count;
     count = (count + 1) % 26;
-    asm volatile("sti\nhlt");
+    asm volatile("hlt");
+  }
+}
+
+//
+// Kernel threads return here from their entrypoint. Nobody waits for
+// them and they'd be freeing the stack they run on, so they loop
+// forever instead and returning is a bug.
+//
+extern "C" void _kernel_thread_exit()
+{
+  asm volatile("cli");
+  kernel_lock_acquire();
+  panic("kernel thread returned");
+}
+
+static void set_name_from_path(proc_handle pid, const char *path)
+{
+  p2::string<128> dir, base;
+  p2::dirname(p2::string<128>(path), &dir, &base);
+  processes[pid].name = base.c_str();
+}
+
+//
+// account_cycles - charges the cycles since the last charge on this
+// CPU to @proc, as kernel or user time depending on where it executes
+//
+static void account_cycles(process &proc)
+{
+  cpu_state &cpu = this_cpu();
+  uint64_t now = rdtsc();
+  uint64_t elapsed = cpu.account_tsc ? now - cpu.account_tsc : 0;
+  cpu.account_tsc = now;
+
+  if (proc.in_kernel)
+    proc.kernel_cycles += elapsed;
+  else
+    proc.user_cycles += elapsed;
+}
+
+void proc_account_syscall_enter()
+{
+  auto pid = proc_current_pid();
+  if (!pid || processes[*pid].kernel_thread())
+    return;
+
+  process &proc = processes[*pid];
+  account_cycles(proc);
+  proc.in_kernel = true;
+  proc.syscall_start_cycles = proc.kernel_cycles;
+}
+
+void proc_account_syscall_exit(int number)
+{
+  auto pid = proc_current_pid();
+  if (!pid || processes[*pid].kernel_thread())
+    return;
+
+  process &proc = processes[*pid];
+  account_cycles(proc);
+  proc.in_kernel = false;
+
+  proc_syscall_stat *stat = nullptr;
+
+  for (auto &entry : proc.syscall_stats) {
+    if (entry.number == number) {
+      stat = &entry;
+      break;
+    }
+  }
+
+  if (!stat) {
+    // Rarely used syscalls aren't accounted once the table is full
+    if (proc.syscall_stats.full())
+      return;
+
+    stat = &proc.syscall_stats[proc.syscall_stats.emplace_anywhere(proc_syscall_stat{(uint16_t)number, 0, 0})];
+  }
+
+  stat->count++;
+  stat->cycles += proc.kernel_cycles - proc.syscall_start_cycles;
+}
+
+//
+// proc_find_next - the first existing process with a pid of at least
+// @pid, for iterating over all processes
+//
+p2::opt<proc_handle> proc_find_next(int pid)
+{
+  for (; pid < processes.watermark(); ++pid) {
+    if (processes.valid(pid))
+      return pid;
   }
 
-  // NB: this should *never* return -- the CPU will just continue and execute random stuff
+  return {};
+}
+
+bool proc_get_stat(proc_handle pid, proc_stat *stat)
+{
+  if (!processes.valid(pid))
+    return false;
+
+  process &proc = processes[pid];
+
+  // Include the cycles of the current time slice
+  if (pid == this_cpu().current_pid)
+    account_cycles(proc);
+
+  *stat = {};
+  stat->pid = pid;
+  strncpy(stat->name, proc.name.c_str(), sizeof(stat->name) - 1);
+  stat->state = proc.terminating ? 'Z' : (proc.suspended ? 'S' : 'R');
+  stat->cpu = proc.cpu;
+  stat->priority = proc.priority;
+  stat->kernel_thread = proc.kernel_thread();
+  stat->user_cycles = proc.user_cycles;
+  stat->kernel_cycles = proc.kernel_cycles;
+  stat->switches = proc.switches;
+
+  mem_get_stats(proc.space_handle, &stat->memory);
+
+  for (const auto &entry : proc.syscall_stats)
+    stat->syscalls[stat->syscall_count++] = entry;
+
+  return true;
+}
+
+void proc_get_sched_stats(sched_stats_t *stats)
+{
+  *stats = sched_stats;
+}
+
+uint64_t proc_idle_cycles(int cpu)
+{
+  proc_handle idle_pid = cpus[cpu].idle_pid;
+  return processes.valid(idle_pid) ? processes[idle_pid].kernel_cycles : 0;
 }
@@ -10,15 +10,49 @@
 #include <stdint.h>
 #include "memory.h"
 #include "filesystem.h"
+#include "syscall_decls.h"
 #include "support/optional.h"
 
 #define PROC_USER_SPACE          0x01
 #define PROC_KERNEL_ACCESSIBLE   0x02
+#define PROC_KERNEL_THREAD       0x04  // Supervisor mode in the shared kernel space
+
+#define PROC_PRIORITY_NORMAL     0
+#define PROC_PRIORITY_RAISED     1     // The highest user processes can ask for
+#define PROC_PRIORITY_HIGH       2     // Kernel workers, always picked before lower priorities
 
 typedef uint16_t proc_handle;
 
+#define PROC_MAX_SYSCALL_STATS   24    // Distinct syscall numbers accounted per process
+
+struct proc_syscall_stat {
+  uint16_t number;
+  uint32_t count;
+  uint64_t cycles;                     // In the kernel, not counting time spent blocked
+};
+
+//
+// proc_stat - accounting of a process, exported in /proc/<pid>/stat
+//
+struct proc_stat {
+  proc_handle       pid;
+  char              name[32];
+  char              state;             // R(unnable), S(uspended) or Z(ombie)
+  int               cpu;
+  int               priority;
+  bool              kernel_thread;
+  uint64_t          user_cycles;
+  uint64_t          kernel_cycles;
+  uint32_t          switches;          // Times the process was switched to
+  mem_stats         memory;
+  int               syscall_count;
+  proc_syscall_stat syscalls[PROC_MAX_SYSCALL_STATS];
+};
+
 void                 proc_init();
 proc_handle          proc_create(uint32_t flags, uintptr_t entrypoint);
+proc_handle          proc_create_kernel_thread(void (*entrypoint)(uintptr_t), uintptr_t arg);
+void                 proc_set_priority(proc_handle pid, int priority);
 void                 proc_enqueue(proc_handle pid);
 void                 proc_switch(proc_handle pid);
 void                 proc_suspend(proc_handle pid);
@@ -27,12 +61,25 @@ int                  proc_yield();
 p2::opt<proc_handle> proc_current_pid();
 void                 proc_run();
 int                  proc_block(proc_handle pid);
-void                 proc_unblock_and_switch(proc_handle pid, int status);
+int                  proc_block_timeout(proc_handle pid, int timeout);
+bool                 proc_wake(proc_handle pid, int status);
+void                 proc_preempt(proc_handle pid);
+int                  proc_priority(proc_handle pid);
 
 void                 proc_kill(proc_handle pid, uint32_t exit_status);
+void                 proc_set_name(proc_handle pid, const char *name);
+const char           *proc_get_name(proc_handle pid);
 mem_space            proc_get_space(proc_handle pid);
 vfs_context          proc_get_file_context(proc_handle pid);
 void                 proc_set_syscall_ret(proc_handle pid, uintptr_t ip);
 void                 proc_setup_user_stack(proc_handle pid, int argc, const char *argv[]);
 
+// Accounting
+p2::opt<proc_handle> proc_find_next(int pid);
+bool                 proc_get_stat(proc_handle pid, proc_stat *stat);
+void                 proc_get_sched_stats(sched_stats_t *stats);
+uint64_t             proc_idle_cycles(int cpu);
+void                 proc_account_syscall_enter();
+void                 proc_account_syscall_exit(int number);
+
 #endif // !PEOS2_PROCESS_H
@@ -9,42 +9,92 @@
 
 #include "support/utils.h"
 #include "support/optional.h"
+#include "support/string.h"
 
 // Externs
 extern "C" void switch_task_iret();
 extern "C" void switch_task(uint32_t *old_esp, uint32_t new_esp, uintptr_t page_dir);
 extern "C" void _user_proc_cleanup();
+extern "C" void _kernel_thread_exit();
 
 // Constants
-static const uint16_t kernel_stack_flags = MEM_AREA_READWRITE|MEM_AREA_NO_FORK|MEM_AREA_RETAIN_EXEC;
 static const uint16_t user_stack_flags = MEM_AREA_READWRITE|MEM_AREA_USER|MEM_AREA_SYSCALL;
 
-static const size_t kernel_initial_stack_size = 0x1000 * 10;
 static const size_t user_initial_stack_size = 0x1000;
 
+// Threads of a process get a user stack slot each. Slot 0 is the
+// main thread, which uses the regular stack.
+static const int    max_threads_per_process = 32;
+static const size_t thread_user_stack_size = 0x1000 * 256;
+static const size_t thread_user_stack_stride = 0x1000 * 2048;    // Leaves unmapped guard pages
+
 //
 // process - contains state and resources that belong to a process
 //
 class process : p2::non_copyable {
 public:
-  process(mem_space space_handle, vfs_context file_context, uint32_t flags)
-    : space_handle(space_handle), file_context(file_context), _flags(flags) {}
+  process(mem_space space_handle,
+          vfs_context file_context,
+          uint32_t flags)
+    : space_handle(space_handle),
+      file_context(file_context),
+      in_kernel(flags & PROC_KERNEL_THREAD),
+      _flags(flags),
+      _kernel_stack_base(mem_alloc_kernel_stack())
+  {}
 
   // Sets up the kernel stack so that it'll return to user space with
   // iretd
   void setup_kernel_stack(isr_registers *regs)
   {
-    const size_t stack_area_size = 0x1000 * 10;
+    _kernel_stack_sp = write_kernel_stack(regs);
+  }
 
-    // TODO: kernel stacks cannot actually grow using page faults,
-    // because the page fault will be pushed on the kernel stack,
-    // causing another page fault, then the tripple fault is a fact
-    mem_map_alloc(space_handle,
-                  PROC_KERNEL_STACK_BASE - stack_area_size,
-                  PROC_KERNEL_STACK_BASE,
-                  kernel_stack_flags);
+  //
+  // setup_thread_stack - maps a user stack for stack slot @slot and
+  // prepares it so that the thread starts executing with @fun and @arg
+  // as arguments. Returning from the start function faults, so it has
+  // to exit the thread itself.
+  //
+  void setup_thread_stack(int slot, uintptr_t fun, uintptr_t arg)
+  {
+    const uintptr_t stack_base = USER_SPACE_STACK_BASE - slot * thread_user_stack_stride;
+    _user_stack_area = mem_map_alloc(space_handle,
+                                     stack_base - thread_user_stack_size,
+                                     stack_base,
+                                     user_stack_flags|MEM_AREA_NO_FORK);
+
+    stack_portal user_stack(space_handle, stack_base, user_initial_stack_size);
+    user_stack.push(arg);
+    user_stack.push(fun);
+    user_stack.push(0);                                        // Return address
+
+    update_userspace_sp(user_stack.target_address(user_stack.current_pointer()));
+  }
 
-    _kernel_stack_sp = write_kernel_stack(regs);
+  //
+  // setup_kernel_thread_stack - sets up the kernel stack so that
+  // switching to the process calls @entrypoint(@arg) in supervisor
+  // mode. Returning from @entrypoint ends up in `_kernel_thread_exit`,
+  // which panics.
+  //
+  void setup_kernel_thread_stack(uintptr_t entrypoint, uintptr_t arg)
+  {
+    uint32_t *sp = (uint32_t *)_kernel_stack_base;
+    // An IRET to the same privilege level doesn't pop SS:ESP, so the
+    // two topmost values become the call frame of the entrypoint
+    *--sp = arg;                                               // 1st argument
+    *--sp = (uint32_t)_kernel_thread_exit;                     // Return address
+    *--sp = 0x202;                                             // EFLAGS, IF
+    *--sp = KERNEL_CODE_SEL;                                   // CS
+    *--sp = entrypoint;                                        // Return EIP from switch_task_iret
+    *--sp = KERNEL_DATA_SEL;                                   // DS, ES, FS, GS
+    *--sp = (uint32_t)switch_task_iret;                        // Return EIP from switch_task
+
+    for (int i = 0; i < 8; ++i)
+      *--sp = 0;                                               // GPRs for popal
+
+    _kernel_stack_sp = (uintptr_t)sp;
   }
 
   //
@@ -77,14 +127,39 @@ public:
     }
   }
 
-  void destroy()
+  //
+  // destroy - releases the resources of the process. @last_thread is
+  // false when other threads still share the space and files, then
+  // only the stacks are unmapped.
+  //
+  void destroy(bool last_thread)
   {
     dbg_puts(proc, "destroying process");
-    vfs_destroy_context(file_context);
-    mem_destroy_space(space_handle);
+
+    // The process has been switched away from, so nothing is
+    // executing on the stack anymore
+    mem_free_kernel_stack(_kernel_stack_base);
+
+    if (_flags & PROC_KERNEL_THREAD) {
+      // The space is shared between all kernel threads
+      vfs_destroy_context(file_context);
+    }
+    else if (last_thread) {
+      vfs_destroy_context(file_context);
+      mem_destroy_space(space_handle);
+    }
+    else if (_user_stack_area) {
+      mem_unmap_area(space_handle, *_user_stack_area);
+    }
+
     // TODO: invalidate handles
   }
 
+  bool kernel_thread() const
+  {
+    return _flags & PROC_KERNEL_THREAD;
+  }
+
   //
   // activate - executes a full context switch
   //
@@ -99,7 +174,7 @@ public:
       current_task_esp_ptr = (uint32_t **)&previous_proc->_kernel_stack_sp;
     }
 
-    tss_set_kernel_stack((uintptr_t)PROC_KERNEL_STACK_BASE);
+    tss_set_kernel_stack(_kernel_stack_base);
     uintptr_t page_dir = mem_page_dir(space_handle);
     mem_set_current_space(space_handle);
     switch_task((uint32_t *)current_task_esp_ptr, _kernel_stack_sp, page_dir);
@@ -110,7 +185,7 @@ public:
   //
   void set_syscall_ret_ip(uintptr_t ip)
   {
-    stack_portal kernel_stack(space_handle, PROC_KERNEL_STACK_BASE, 0x1000);
+    uint32_t *kernel_stack = (uint32_t *)_kernel_stack_base;
     assert(kernel_stack[-1] == USER_DATA_SEL);
     assert(kernel_stack[-4] == USER_CODE_SEL);
     kernel_stack[-5] = ip;
@@ -130,39 +205,57 @@ public:
 
   uint64_t    last_tick = 0;
   int32_t     suspension_timeout = -1;
+  int         priority = PROC_PRIORITY_NORMAL;
+
+  int         cpu = 0;            // Run queue the process is on
+  bool        on_cpu = false;     // Currently executing on `cpu`
+  int         lock_depth = 1;     // Kernel lock depth when switched out
+
+  p2::opt<uint16_t> thread_group; // Shared with the other threads of the process
+  int         thread_slot = 0;    // Which stacks the thread uses, 0 for the main thread
+
+  // Accounting
+  p2::string<32> name;
+  bool        in_kernel;          // Cycles are charged as kernel time
+  uint64_t    user_cycles = 0, kernel_cycles = 0;
+  uint64_t    syscall_start_cycles = 0;
+  uint32_t    switches = 0;
+  p2::fixed_pool<proc_syscall_stat, PROC_MAX_SYSCALL_STATS> syscall_stats;
 
 private:
   uint32_t _flags;
+  uintptr_t _kernel_stack_base;
   uintptr_t _kernel_stack_sp;
+  p2::opt<mem_area> _user_stack_area;
 
   //
   // write_kernel_stack - uses @regs if non-null. Returns the new
-  // stack pointer in target address space
+  // stack pointer
   //
   uintptr_t write_kernel_stack(isr_registers *regs)
   {
-    stack_portal kernel_stack(space_handle, PROC_KERNEL_STACK_BASE, kernel_initial_stack_size);
+    uint32_t *sp = (uint32_t *)_kernel_stack_base;
     // We need a stack that can invoke iret as soon as possible, without
     // invoking any gcc function epilogues or prologues.  First, we need
     // a stack good for `switch_task`. As we set the return address to
     // be `switch_task_iret`, we also need to push values for IRET.
-    kernel_stack.push(regs ? regs->ds : USER_DATA_SEL);        // SS (only user space)
-    kernel_stack.push(regs ? regs->user_esp : 0);              // ESP (only user space)
-    kernel_stack.push(0x202);                                  // EFLAGS, IF
-    kernel_stack.push(regs ? regs->cs : USER_CODE_SEL);        // CS
-    kernel_stack.push(regs ? regs->eip : 0);                   // Return EIP from switch_task_iret
-    kernel_stack.push(regs ? regs->ds : USER_DATA_SEL);        // DS, ES, FS, GS, SS
-    kernel_stack.push((uint32_t)switch_task_iret);             // Return EIP from switch_task
-    kernel_stack.push(0);                                      // EAX
-    kernel_stack.push(regs ? regs->ecx : 0);                   // ECX
-    kernel_stack.push(regs ? regs->edx : 0);                   // EDX
-    kernel_stack.push(regs ? regs->ebx : 0);                   // EBX
-    kernel_stack.push(0);                                      // ESP temp
-    kernel_stack.push(regs ? regs->ebp : 0);                   // EBP
-    kernel_stack.push(regs ? regs->esi : 0);                   // ESI
-    kernel_stack.push(regs ? regs->edi : 0);                   // EDI
-
-    return kernel_stack.target_address(kernel_stack.current_pointer());
+    *--sp = regs ? regs->ds : USER_DATA_SEL;                   // SS (only user space)
+    *--sp = regs ? regs->user_esp : 0;                         // ESP (only user space)
+    *--sp = 0x202;                                             // EFLAGS, IF
+    *--sp = regs ? regs->cs : USER_CODE_SEL;                   // CS
+    *--sp = regs ? regs->eip : 0;                              // Return EIP from switch_task_iret
+    *--sp = regs ? regs->ds : USER_DATA_SEL;                   // DS, ES, FS, GS, SS
+    *--sp = (uint32_t)switch_task_iret;                        // Return EIP from switch_task
+    *--sp = 0;                                                 // EAX
+    *--sp = regs ? regs->ecx : 0;                              // ECX
+    *--sp = regs ? regs->edx : 0;                              // EDX
+    *--sp = regs ? regs->ebx : 0;                              // EBX
+    *--sp = 0;                                                 // ESP temp
+    *--sp = regs ? regs->ebp : 0;                              // EBP
+    *--sp = regs ? regs->esi : 0;                              // ESI
+    *--sp = regs ? regs->edi : 0;                              // EDI
+
+    return (uintptr_t)sp;
   }
 
   //
@@ -198,7 +291,7 @@ private:
 
   void update_userspace_sp(uintptr_t user_stack_ptr)
   {
-    stack_portal kernel_stack(space_handle, PROC_KERNEL_STACK_BASE, 0x1000);
+    uint32_t *kernel_stack = (uint32_t *)_kernel_stack_base;
     assert(kernel_stack[-1] == USER_DATA_SEL);
     kernel_stack[-2] = user_stack_ptr;
   }
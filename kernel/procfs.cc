@@ -0,0 +1,322 @@
+#include "procfs.h"
+#include "filesystem.h"
+#include "process.h"
+#include "memory.h"
+#include "smp.h"
+#include "x86.h"
+#include "syscalls.h"
+#include "debug.h"
+#include "dcache.h"
+#include "blockdev.h"
+#include "pipe.h"
+
+#include "support/format.h"
+#include "support/pool.h"
+#include "support/string.h"
+
+// Declarations
+enum procfs_file_type {
+  PROCFS_ROOT_DIR,   // "stat" and one directory per process
+  PROCFS_PID_DIR,    // "stat"
+  PROCFS_STAT_FILE,  // Text generated on open
+};
+
+struct procfs_file {
+  procfs_file_type type;
+  int position;
+  p2::string<2048> text;
+};
+
+static int read(int handle, char *data, int length);
+static int open(vfs_device *device, const char *path, uint32_t flags);
+static int close(int handle);
+static int seek(int handle, int offset, int relative);
+static int tell(int handle, int *position);
+
+static void write_system_stat(p2::string<2048> &text);
+static bool write_process_stat(proc_handle pid, p2::string<2048> &text);
+
+// Global state
+static p2::fixed_pool<procfs_file, 8> opened_files;
+
+// Definitions
+void procfs_init()
+{
+  static vfs_device_driver interface = {
+    .write = nullptr,
+    .read = read,
+    .open = open,
+    .close = close,
+    .control = nullptr,
+    .seek = seek,
+    .tell = tell,
+    .mkdir = nullptr,
+    .poll = nullptr,
+    .readv = nullptr,
+    .writev = nullptr,
+    .readdir = nullptr,
+    .frame = nullptr,
+    .view = nullptr,
+    .advise = nullptr
+  };
+
+  vfs_node_handle mountpoint = vfs_create_node(VFS_FILESYSTEM);
+  vfs_set_driver(mountpoint, &interface, nullptr);
+  vfs_add_dirent(vfs_lookup("/"), "proc", mountpoint);
+}
+
+static bool path_is(const char *path, const char *str)
+{
+  return strncmp(path, str, strlen(str) + 1) == 0;
+}
+
+static int parse_pid(const char *str, const char **end)
+{
+  int pid = 0;
+  const char *pos = str;
+
+  for (; *pos >= '0' && *pos <= '9'; ++pos)
+    pid = pid * 10 + (*pos - '0');
+
+  *end = pos;
+  return pos == str ? -1 : pid;
+}
+
+static int open(vfs_device *, const char *path, uint32_t flags)
+{
+  if (flags & OPEN_CREATE)
+    return ENOSUPPORT;
+
+  if (opened_files.full())
+    return ENOSPACE;
+
+  procfs_file file = {PROCFS_ROOT_DIR, 0, {}};
+
+  if (!*path || path_is(path, "/")) {
+    file.type = PROCFS_ROOT_DIR;
+  }
+  else if (path_is(path, "/stat")) {
+    file.type = PROCFS_STAT_FILE;
+    write_system_stat(file.text);
+  }
+  else {
+    const char *rest = nullptr;
+    int pid = parse_pid(path + 1, &rest);
+
+    if (pid < 0 || !proc_find_next(pid) || *proc_find_next(pid) != pid)
+      return ENOENT;
+
+    if (!*rest || path_is(rest, "/")) {
+      file.type = PROCFS_PID_DIR;
+    }
+    else if (path_is(rest, "/stat")) {
+      file.type = PROCFS_STAT_FILE;
+
+      if (!write_process_stat(pid, file.text))
+        return ENOENT;
+    }
+    else {
+      return ENOENT;
+    }
+  }
+
+  return opened_files.emplace_anywhere(file);
+}
+
+//
+// dir_entry - name of entry @idx in a directory, or false if there
+// are no more entries
+//
+static bool dir_entry(procfs_file_type type, int idx, p2::string<16> &name)
+{
+  if (idx == 0) {
+    name = "stat";
+    return true;
+  }
+
+  if (type == PROCFS_PID_DIR)
+    return false;
+
+  // The rest are processes in pid order
+  p2::opt<proc_handle> pid = proc_find_next(0);
+
+  for (int i = 1; pid && i < idx; ++i)
+    pid = proc_find_next(*pid + 1);
+
+  if (!pid)
+    return false;
+
+  name.clear();
+  name.append((uint64_t)*pid);
+  return true;
+}
+
+static int read_dir(procfs_file &file, char *data, int length)
+{
+  int bytes_written = 0;
+  p2::string<16> name;
+
+  while (length > 0 && dir_entry(file.type, file.position / sizeof(dirent_t), name)) {
+    int block_offset = file.position % sizeof(dirent_t);
+    int copy_length = p2::min((int)sizeof(dirent_t) - block_offset, length);
+
+    dirent_t block = {};
+    memcpy(block.name, name.c_str(), name.size() + 1);
+    memcpy(data, (char *)&block + block_offset, copy_length);
+
+    data += copy_length;
+    file.position += copy_length;
+    length -= copy_length;
+    bytes_written += copy_length;
+  }
+
+  return bytes_written;
+}
+
+static int read(int handle, char *data, int length)
+{
+  procfs_file &file = opened_files[handle];
+
+  if (file.type != PROCFS_STAT_FILE)
+    return read_dir(file, data, length);
+
+  const int bytes_to_copy = p2::min(file.position + length, file.text.size()) - file.position;
+  memcpy(data, file.text.c_str() + file.position, bytes_to_copy);
+  file.position += bytes_to_copy;
+  return bytes_to_copy;
+}
+
+static int close(int handle)
+{
+  opened_files.erase(handle);
+  return 0;
+}
+
+static int seek(int handle, int offset, int relative)
+{
+  procfs_file &file = opened_files[handle];
+
+  if (relative == SEEK_CUR)
+    file.position += offset;
+  else if (relative == SEEK_BEG)
+    file.position = offset;
+  else
+    return EINVVAL;
+
+  file.position = p2::max(file.position, 0);
+
+  if (file.type == PROCFS_STAT_FILE)
+    file.position = p2::min(file.position, file.text.size());
+
+  return 0;
+}
+
+static int tell(int handle, int *position)
+{
+  *position = opened_files[handle].position;
+  return 0;
+}
+
+static void write_system_stat(p2::string<2048> &text)
+{
+  sched_stats_t sched;
+  proc_get_sched_stats(&sched);
+
+  mem_stats memory;
+  mem_get_total_stats(&memory);
+
+  dcache_stats dentries;
+  dcache_get_stats(&dentries);
+
+  bcache_stats blocks;
+  bcache_get_stats(&blocks);
+
+  pipe_stats pipes;
+  pipe_get_stats(&pipes);
+
+  int processes = 0;
+  uint32_t syscalls = 0;
+
+  for (auto pid = proc_find_next(0); pid; pid = proc_find_next(*pid + 1)) {
+    proc_stat stat;
+
+    if (proc_get_stat(*pid, &stat)) {
+      ++processes;
+
+      for (int i = 0; i < stat.syscall_count; ++i)
+        syscalls += stat.syscalls[i].count;
+    }
+  }
+
+  text.append(p2::format<256>("cycles=%d cpus=%d processes=%d switches=%d wakeups=%d preemptions=%d ",
+                              rdtsc(),
+                              smp_cpu_count(),
+                              processes,
+                              sched.context_switches,
+                              sched.wakeups,
+                              sched.preemptions).str().c_str());
+
+  text.append(p2::format<256>("syscalls=%d linear_faults=%d alloc_faults=%d file_faults=%d shared_faults=%d allocated_pages=%d free_pages=%d ",
+                              syscalls,
+                              memory.linear_faults,
+                              memory.alloc_faults,
+                              memory.file_faults,
+                              memory.shared_faults,
+                              memory.resident_pages,
+                              memory.free_pages).str().c_str());
+
+  text.append(p2::format<128>("dcache_hits=%d dcache_negative_hits=%d dcache_misses=%d ",
+                              dentries.hits,
+                              dentries.negative_hits,
+                              dentries.misses).str().c_str());
+
+  text.append(p2::format<256>("bcache_hits=%d bcache_misses=%d block_requests=%d readahead_blocks=%d readahead_hits=%d readahead_wasted=%d writebacks=%d ",
+                              blocks.hits,
+                              blocks.misses,
+                              blocks.requests,
+                              blocks.readahead_blocks,
+                              blocks.readahead_hits,
+                              blocks.readahead_wasted,
+                              blocks.writebacks).str().c_str());
+
+  text.append(p2::format<64>("pipe_bytes=%d pipe_pages_moved=%d\n",
+                             pipes.bytes_written,
+                             pipes.pages_moved).str().c_str());
+
+  for (int cpu = 0; cpu < smp_cpu_count(); ++cpu)
+    text.append(p2::format<64>("cpu=%d idle_cycles=%d\n", cpu, proc_idle_cycles(cpu)).str().c_str());
+}
+
+static bool write_process_stat(proc_handle pid, p2::string<2048> &text)
+{
+  proc_stat stat;
+
+  if (!proc_get_stat(pid, &stat))
+    return false;
+
+  text.append(p2::format<256>("pid=%d name=%s state=%s cpu=%d priority=%d user_cycles=%d kernel_cycles=%d ",
+                              stat.pid,
+                              stat.name,
+                              stat.state == 'Z' ? "Z" : (stat.state == 'S' ? "S" : "R"),
+                              stat.cpu,
+                              stat.priority,
+                              stat.user_cycles,
+                              stat.kernel_cycles).str().c_str());
+
+  text.append(p2::format<256>("switches=%d linear_faults=%d alloc_faults=%d file_faults=%d shared_faults=%d resident_pages=%d\n",
+                              stat.switches,
+                              stat.memory.linear_faults,
+                              stat.memory.alloc_faults,
+                              stat.memory.file_faults,
+                              stat.memory.shared_faults,
+                              stat.memory.resident_pages).str().c_str());
+
+  for (int i = 0; i < stat.syscall_count; ++i) {
+    text.append(p2::format<64>("syscall=%d count=%d cycles=%d\n",
+                               stat.syscalls[i].number,
+                               stat.syscalls[i].count,
+                               stat.syscalls[i].cycles).str().c_str());
+  }
+
+  return true;
+}
@@ -0,0 +1,17 @@
+// -*- c++ -*-
+//
+// /proc - read-only files with accounting, generated when opened:
+//
+//   /proc/stat        system wide counters
+//   /proc/<pid>/stat  CPU time, faults and syscalls of a process
+//
+// The first line of each file is "key=value" pairs separated by
+// spaces, following lines are details. CPU time is in TSC cycles.
+//
+
+#ifndef PEOS2_PROCFS_H
+#define PEOS2_PROCFS_H
+
+void procfs_init();
+
+#endif // !PEOS2_PROCFS_H
@@ -0,0 +1,255 @@
+#include "profiler.h"
+#include "filesystem.h"
+#include "process.h"
+#include "timer.h"
+#include "smp.h"
+#include "debug.h"
+
+#include "support/format.h"
+#include "support/string.h"
+
+// Declarations
+#define PROF_SAMPLES_PER_CPU 4096
+#define PROF_MAX_NAMES       64     // Fits the name index of a record
+#define PROF_DEFAULT_HZ      1000
+
+struct prof_record {
+  uint32_t eip;
+  uint16_t pid;
+  uint8_t  cpl;
+  int8_t   name;                   // Index in `names`, -1 if unknown
+};
+
+//
+// prof_cpu - samples of one CPU. Only written by that CPU's timer
+// interrupt and drained by `read`, both with the kernel lock held.
+//
+struct prof_cpu {
+  prof_record samples[PROF_SAMPLES_PER_CPU];
+  uint32_t head, tail;
+  uint32_t dropped;
+  int last_name;                   // Index in `names` of the last sampled pid
+};
+
+struct prof_name {
+  uint16_t pid;
+  char name[32];
+};
+
+static int read(int handle, char *data, int length);
+static int open(vfs_device *device, const char *path, uint32_t flags);
+static int control(int handle, uint32_t function, uint32_t param1, uint32_t param2);
+
+// Global state
+static prof_cpu cpus[SMP_MAX_CPUS];
+static prof_name names[PROF_MAX_NAMES];
+static int name_count = 0, names_written = 0;
+static volatile bool running = false;
+
+// The line being read, for reads that end in the middle of it
+static p2::string<64> pending_line;
+static int pending_position = 0;
+
+// Definitions
+void prof_init()
+{
+  static vfs_device_driver interface = {
+    .write = nullptr,
+    .read = read,
+    .open = open,
+    .close = nullptr,
+    .control = control,
+    .seek = nullptr,
+    .tell = nullptr,
+    .mkdir = nullptr,
+    .poll = nullptr,
+    .readv = nullptr,
+    .writev = nullptr,
+    .readdir = nullptr,
+    .frame = nullptr,
+    .view = nullptr,
+    .advise = nullptr
+  };
+
+  vfs_node_handle prof_driver = vfs_create_node(VFS_CHAR_DEVICE);
+  vfs_set_driver(prof_driver, &interface, nullptr);
+  vfs_add_dirent(vfs_lookup("/dev/"), "prof", prof_driver);
+}
+
+//
+// remember_name - keeps the name of @pid so the samples can be
+// symbolized after the process is gone. `exec` changes the name of a
+// pid, so a pid gets a new entry when its name has changed. Returns
+// the index of the entry, or -1 if the name isn't known.
+//
+static int remember_name(prof_cpu &cpu, int pid)
+{
+  const char *name = proc_get_name(pid);
+
+  if (!name)
+    return -1;
+
+  // Most samples are of the same process as the previous one
+  if (cpu.last_name >= 0 && names[cpu.last_name].pid == pid &&
+      strncmp(names[cpu.last_name].name, name, sizeof(names[0].name)) == 0) {
+    return cpu.last_name;
+  }
+
+  for (int i = name_count - 1; i >= 0; --i) {
+    if (names[i].pid != pid)
+      continue;
+
+    if (strncmp(names[i].name, name, sizeof(names[0].name)) == 0)
+      return cpu.last_name = i;
+
+    break;
+  }
+
+  if (name_count == PROF_MAX_NAMES)
+    return -1;
+
+  prof_name &entry = names[name_count];
+  entry.pid = pid;
+  strncpy(entry.name, name, sizeof(entry.name) - 1);
+  entry.name[sizeof(entry.name) - 1] = '\0';
+  return cpu.last_name = name_count++;
+}
+
+void prof_sample(const isr_registers *regs)
+{
+  if (!running)
+    return;
+
+  prof_cpu &cpu = cpus[smp_cpu_index()];
+  p2::opt<proc_handle> pid = proc_current_pid();
+  const int name = pid ? remember_name(cpu, *pid) : -1;
+
+  if (cpu.head - cpu.tail == PROF_SAMPLES_PER_CPU) {
+    ++cpu.dropped;
+    return;
+  }
+
+  cpu.samples[cpu.head % PROF_SAMPLES_PER_CPU] = prof_record{regs->eip, pid.value_or(-1u), (uint8_t)(regs->cs & 3), (int8_t)name};
+  ++cpu.head;
+}
+
+static void start(int hz)
+{
+  for (int i = 0; i < SMP_MAX_CPUS; ++i) {
+    cpus[i].head = cpus[i].tail = cpus[i].dropped = 0;
+    cpus[i].last_name = -1;
+  }
+
+  name_count = names_written = 0;
+  pending_line.clear();
+  pending_position = 0;
+
+  // Every CPU samples at the same rate so they weigh the same
+  timer_set_frequency(hz);
+  smp_set_timer_frequency(hz);
+  running = true;
+  log(prof, "started at %d Hz", hz);
+}
+
+static void stop()
+{
+  running = false;
+  timer_set_frequency(TIMER_DEFAULT_HZ);
+  smp_set_timer_frequency(TIMER_DEFAULT_HZ);
+  log(prof, "stopped");
+}
+
+//
+// next_line - formats the next line to read into `pending_line`.
+// Names go before samples so a sample never refers to an unknown name.
+// Samples carry the index of their name, as a pid has several names
+// when it execs while the profiler runs.
+// Returns false when everything has been read.
+//
+static bool next_line()
+{
+  if (names_written < name_count) {
+    const prof_name &entry = names[names_written++];
+    pending_line = p2::format<64>("P %d %d %s\n", names_written - 1, entry.pid, entry.name).str();
+    return true;
+  }
+
+  for (int i = 0; i < smp_cpu_count(); ++i) {
+    prof_cpu &cpu = cpus[i];
+
+    if (cpu.dropped > 0) {
+      pending_line = p2::format<64>("D %d %d\n", i, cpu.dropped).str();
+      cpu.dropped = 0;
+      return true;
+    }
+
+    if (cpu.tail != cpu.head) {
+      const prof_record &record = cpu.samples[cpu.tail % PROF_SAMPLES_PER_CPU];
+      pending_line = p2::format<64>("S %d %d %d %p %d\n", i, record.pid, record.cpl, record.eip, record.name).str();
+      ++cpu.tail;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static int read(int, char *data, int length)
+{
+  int bytes_read = 0;
+
+  while (bytes_read < length) {
+    if (pending_position == pending_line.size()) {
+      pending_position = 0;
+
+      if (!next_line()) {
+        pending_line.clear();
+        break;
+      }
+    }
+
+    int bytes = p2::min(length - bytes_read, pending_line.size() - pending_position);
+    memcpy(data + bytes_read, pending_line.c_str() + pending_position, bytes);
+    pending_position += bytes;
+    bytes_read += bytes;
+  }
+
+  return bytes_read;
+}
+
+static int open(vfs_device *, const char *path, uint32_t)
+{
+  if (*path)
+    return ENOENT;
+
+  return 0;
+}
+
+static int control(int, uint32_t function, uint32_t param1, uint32_t)
+{
+  switch (function) {
+  case CTRL_PROF_START: {
+    int hz = param1 ? param1 : PROF_DEFAULT_HZ;
+
+    // The timer counts whole milliseconds per tick
+    if (hz < TIMER_DEFAULT_HZ || hz > 1000 || 1000 % hz != 0)
+      return EINVVAL;
+
+    if (running)
+      return EBUSY;
+
+    start(hz);
+    return 0;
+  }
+
+  case CTRL_PROF_STOP:
+    if (!running)
+      return EINCONSTATE;
+
+    stop();
+    return 0;
+
+  default:
+    return ENOSUPPORT;
+  }
+}
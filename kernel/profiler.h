@@ -0,0 +1,29 @@
+// -*- c++ -*-
+//
+// /dev/prof - sampling profiler. While started, every timer interrupt
+// records where the CPU was (EIP, CPL and pid) in a ring buffer of
+// that CPU. Reading the device drains the rings as text lines:
+//
+//   P <index> <pid> <name>  name of a pid, before its first sample
+//   S <cpu> <pid> <cpl> <eip> <name index>
+//   D <cpu> <count>         samples dropped because the ring was full
+//
+// The PIT drives sampling on the BSP and the local timers on the other
+// CPUs, all at the requested rate. `symbolize-profile`
+// turns the output into a flat profile or folded stacks.
+//
+
+#ifndef PEOS2_PROFILER_H
+#define PEOS2_PROFILER_H
+
+#include "x86.h"
+
+void prof_init();
+
+//
+// prof_sample - records the interrupted context @regs if the profiler
+// is running. Called from timer interrupts.
+//
+void prof_sample(const isr_registers *regs);
+
+#endif // !PEOS2_PROFILER_H
@@ -1,13 +1,17 @@
 #include "protected_mode.h"
 #include "x86.h"
+#include "smp.h"
 #include "support/assert.h"
 #include "debug.h"
 
-static volatile tss_entry tss;
+// Each CPU gets its own TSS and GDT. The GDTs are identical except
+// for the TSS descriptor, so the task register tells which CPU
+// we're on (see `smp_cpu_index`).
+static volatile tss_entry tss[SMP_MAX_CPUS];
+static gdt_descriptor gdts[SMP_MAX_CPUS][TSS_GDT_INDEX + SMP_MAX_CPUS] alignas(16);
 
 static bool a20_enabled();
 static void enable_a20();
-static void setup_gdt();
 
 extern "C" void load_gdt(const gdtr *gdt, uint32_t data_segsel);
 
@@ -19,22 +23,26 @@ void enter_protected_mode()
   if (!a20_enabled()) {
     enable_a20();
   }
-  setup_gdt();
+  gdt_init_cpu(0);
 }
 
-void setup_gdt()
+//
+// gdt_init_cpu - loads the GDT and task register of @cpu on the
+// executing CPU
+//
+void gdt_init_cpu(int cpu)
 {
-  static const gdt_descriptor descriptors[] alignas(16) = {
-    {0x0, 0x0, 0x0, 0x0},
-    {0x0, 0x000FFFFF, GDT_FLAGS_G|GDT_FLAGS_DB, GDT_TYPE_CODE|GDT_TYPE_P|GDT_TYPE_R},
-    {0x0, 0x000FFFFF, GDT_FLAGS_G|GDT_FLAGS_DB, GDT_TYPE_DATA|GDT_TYPE_P|GDT_TYPE_W},
-    {0x0, 0x000FFFFF, GDT_FLAGS_G|GDT_FLAGS_DB, GDT_TYPE_CODE|GDT_TYPE_P|GDT_TYPE_DPL3|GDT_TYPE_R},
-    {0x0, 0x000FFFFF, GDT_FLAGS_G|GDT_FLAGS_DB, GDT_TYPE_DATA|GDT_TYPE_P|GDT_TYPE_DPL3|GDT_TYPE_W},
+  assert(cpu < SMP_MAX_CPUS);
+  gdt_descriptor *descriptors = gdts[cpu];
 
-    {(uint32_t)&tss, sizeof(tss), 0, GDT_TYPE_32TSS_A|GDT_TYPE_DPL3|GDT_TYPE_P}
-  };
+  descriptors[0] = {0x0, 0x0, 0x0, 0x0};
+  descriptors[1] = {0x0, 0x000FFFFF, GDT_FLAGS_G|GDT_FLAGS_DB, GDT_TYPE_CODE|GDT_TYPE_P|GDT_TYPE_R};
+  descriptors[2] = {0x0, 0x000FFFFF, GDT_FLAGS_G|GDT_FLAGS_DB, GDT_TYPE_DATA|GDT_TYPE_P|GDT_TYPE_W};
+  descriptors[3] = {0x0, 0x000FFFFF, GDT_FLAGS_G|GDT_FLAGS_DB, GDT_TYPE_CODE|GDT_TYPE_P|GDT_TYPE_DPL3|GDT_TYPE_R};
+  descriptors[4] = {0x0, 0x000FFFFF, GDT_FLAGS_G|GDT_FLAGS_DB, GDT_TYPE_DATA|GDT_TYPE_P|GDT_TYPE_DPL3|GDT_TYPE_W};
+  descriptors[TSS_GDT_INDEX + cpu] = {(uint32_t)&tss[cpu], sizeof(tss[cpu]), 0, GDT_TYPE_32TSS_A|GDT_TYPE_DPL3|GDT_TYPE_P};
 
-  static const gdtr gdt = {sizeof(descriptors) - 1, reinterpret_cast<uint32_t>(descriptors)};
+  const gdtr gdt = {sizeof(gdts[cpu]) - 1, reinterpret_cast<uint32_t>(descriptors)};
   assert(sizeof(&descriptors[0]) == sizeof(gdt.base));
 
   // TODO: make the switch work when coming from real mode -- the code
@@ -43,15 +51,15 @@ void setup_gdt()
 
   asm volatile("mov ax, %0\n"
                "ltr ax\n"
-               : : "i" (TSS_SEL) : "eax", "memory");
-  tss.ss0 = KERNEL_DATA_SEL;
-  tss.cs = GDT_SEGSEL(3, 1);
-  tss.ss = tss.ds = tss.es = tss.fs = tss.gs = GDT_SEGSEL(3, 2);
+               : : "r" ((uint16_t)TSS_SEL(cpu)) : "eax", "memory");
+  tss[cpu].ss0 = KERNEL_DATA_SEL;
+  tss[cpu].cs = GDT_SEGSEL(3, 1);
+  tss[cpu].ss = tss[cpu].ds = tss[cpu].es = tss[cpu].fs = tss[cpu].gs = GDT_SEGSEL(3, 2);
 }
 
 void tss_set_kernel_stack(uint32_t esp)
 {
-  tss.esp0 = esp;
+  tss[smp_cpu_index()].esp0 = esp;
 }
 
 bool a20_enabled()
@@ -5,42 +5,63 @@
 #include "screen.h"
 #include "debug.h"
 #include "syscall_utils.h"
+#include "dcache.h"
+#include "memory.h"
+#include "memareas.h"
 
 #include "support/format.h"
 #include "support/pool.h"
+#include "support/slab.h"
 #include "support/filesystem.h"
 
 #include "ramfs_private.h"
 
 // Statics
 static int read(int handle, char *data, int length);
+static int write(int handle, const char *data, int length);
+static int readdir(int handle, dirent_t *entries, int count);
 static int open(vfs_device *device, const char *path, uint32_t flags);
 static int control(int handle, uint32_t function, uint32_t param1, uint32_t param2);
 static int close(int handle);
 static int seek(int handle, int offset, int relative);
 static int tell(int handle, int *position);
 static int mkdir(const char *path);
+static uint32_t poll(int handle, uint32_t events);
+static int frame(int handle, uint32_t offset, uintptr_t *phys_address);
+static int view(int handle, const char **data);
 
-static p2::fixed_pool<mem_range_file, 64, file_handle> mem_range_files;
-static p2::fixed_pool<dirent, 16, file_handle> directories;
-static p2::fixed_pool<file_node, 64, node_handle> nodes;
+#define RADIX_BITS          10
+#define RADIX_SLOTS         (1 << RADIX_BITS)  // Pointers in a node page
+#define PAGE_FILE_MAX_SIZE  0x40000000
+
+static p2::fixed_pool<mem_range_file, 256, file_handle> mem_range_files;
+static p2::fixed_pool<page_file, 2048, file_handle> page_files;
+static p2::fixed_pool<dirent, 2048, file_handle> directories;
+static p2::fixed_pool<file_node, 2048, node_handle> nodes;
 
 static node_handle root;
 
-// To remember file descriptor states (position etc)
-static p2::fixed_pool<ramfs_opened_file, 32, file_handle> opened_files;
+// To remember file descriptor states (position etc), grows with use
+static p2::slab_pool<ramfs_opened_file, 64, file_handle> opened_files(mem_alloc_kernel_page);
 
 void ramfs_init()
 {
   static vfs_device_driver interface = {
-    .write = nullptr,
+    .write = write,
     .read = read,
     .open = open,
     .close = close,
     .control = control,
     .seek = seek,
     .tell = tell,
-    .mkdir = mkdir
+    .mkdir = mkdir,
+    .poll = poll,
+    .readv = nullptr,
+    .writev = nullptr,
+    .readdir = readdir,
+    .frame = frame,
+    .view = view,
+    .advise = nullptr
   };
 
   vfs_node_handle mountpoint = vfs_create_node(VFS_FILESYSTEM);
@@ -50,7 +71,7 @@ void ramfs_init()
   root = nodes.emplace_anywhere(TYPE_DIRECTORY, directories.end_sentinel());
 }
 
-static dirent *find_dirent(node_handle dir_node, const p2::string<16> &name)
+static dirent *find_dirent(node_handle dir_node, const dcache_name &name)
 {
   const file_node &node = nodes[dir_node];
   if (node.type != TYPE_DIRECTORY)
@@ -61,8 +82,8 @@ static dirent *find_dirent(node_handle dir_node, const p2::string<16> &name)
   while (dirent_idx != directories.end_sentinel()) {
     dirent &entry = directories[dirent_idx];
 
-    // TODO: compare strings without doing a copy
-    if (entry.name == name)
+    if (entry.name.size() == (int)name.length &&
+        strncmp(entry.name.c_str(), name.data, name.length) == 0)
       return &entry;
 
     dirent_idx = entry.next_dirent;
@@ -71,36 +92,199 @@ static dirent *find_dirent(node_handle dir_node, const p2::string<16> &name)
   return nullptr;
 }
 
+//
+// lookup_child - resolves @name in the directory @parent through the
+// dentry cache
+//
+static node_handle lookup_child(node_handle parent, dcache_name name)
+{
+  node_handle child;
+
+  // Names are stored truncated, so they're compared that way too
+  if (name.length > RAMFS_NAME_MAX)
+    name = dcache_name(name.data, RAMFS_NAME_MAX);
+
+  switch (dcache_lookup(&nodes, parent, name, &child)) {
+  case DCACHE_FOUND:
+    return child;
+
+  case DCACHE_NOT_FOUND:
+    return nodes.end_sentinel();
+
+  case DCACHE_MISS:
+    break;
+  }
+
+  const dirent *entry = find_dirent(parent, name);
+  dcache_insert(&nodes, parent, name, entry ? entry->node : DCACHE_NEGATIVE);
+  return entry ? entry->node : nodes.end_sentinel();
+}
+
 static node_handle lookup(node_handle parent, const char *path)
 {
-  // Empty string or / references the parent
-  if (!*path || (path[0] == '/' && path[1] == '\0')) {
-    return parent;
+  while (true) {
+    // Empty string or / references the parent
+    if (!*path || (path[0] == '/' && path[1] == '\0')) {
+      return parent;
+    }
+
+    assert(path[0] == '/');
+
+    parent = lookup_child(parent, path_segment(path, &path));
+    if (parent == nodes.end_sentinel())
+      return parent;
   }
+}
 
-  assert(path[0] == '/');
+static int read_dir(ramfs_opened_file &fd, char *data, int length)
+{
+  int bytes_written = 0;
 
-  // TODO: cleanup string handling using string_view or similar
-  const char *seg_start = path + 1;
-  const char *next_segment = strchr((char *)seg_start, '/');
+  // `cursor` is the entry that `position` is in
+  while (fd.cursor != directories.end_sentinel() && length > 0) {
+    const dirent &entry = directories[fd.cursor];
+    int block_offset = fd.position % sizeof(dirent_t);
+    int copy_length = p2::min((int)sizeof(dirent_t) - block_offset, length);
 
-  if (!next_segment)
-    next_segment = strchr((char *)path, '\0');
+    dirent_t block = {};
+    memcpy(block.name, entry.name.c_str(), entry.name.size() + 1);
+    memcpy(data, (char *)&block + block_offset, copy_length);
 
-  const p2::string<16> segment(seg_start, next_segment - seg_start);
+    data += copy_length;
+    fd.position += copy_length;
+    length -= copy_length;
+    bytes_written += copy_length;
 
-  if (const dirent *entry = find_dirent(parent, segment)) {
-    return lookup(entry->node, next_segment);
+    if (fd.position % sizeof(dirent_t) == 0)
+      fd.cursor = entry.next_dirent;
   }
 
-  return nodes.end_sentinel();
+  return bytes_written;
+}
+
+static uint32_t max_index(uint8_t height)
+{
+  return height == 0 ? 0 : (1u << (RADIX_BITS * height)) - 1;
+}
+
+//
+// find_slot - returns where the page at @index of @file is pointed to,
+// or nullptr if there's no such slot. With @create, the tree grows and
+// missing nodes are allocated on the way; nullptr then means that
+// memory ran out.
+//
+static void **find_slot(page_file &file, uint32_t index, bool create)
+{
+  while (index > max_index(file.height)) {
+    if (!create)
+      return nullptr;
+
+    if (file.root) {
+      void **node = (void **)mem_alloc_kernel_page();
+      if (!node)
+        return nullptr;
+
+      node[0] = file.root;
+      file.root = node;
+    }
+
+    ++file.height;
+  }
+
+  void **slot = &file.root;
+
+  for (int level = file.height; level > 0; --level) {
+    if (!*slot) {
+      if (!create)
+        return nullptr;
+
+      if (!(*slot = mem_alloc_kernel_page()))
+        return nullptr;
+    }
+
+    void **node = (void **)*slot;
+    slot = &node[(index >> (RADIX_BITS * (level - 1))) & (RADIX_SLOTS - 1)];
+  }
+
+  return slot;
+}
+
+//
+// free_pages - frees the pages from index @first on in the subtree at
+// @slot, which is at @level and starts at index @base
+//
+static void free_pages(void **slot, int level, uint32_t base, uint32_t first)
+{
+  if (!*slot)
+    return;
+
+  if (level > 0) {
+    void **node = (void **)*slot;
+    const uint32_t span = 1u << (RADIX_BITS * (level - 1));
+
+    for (uint32_t i = 0; i < RADIX_SLOTS; ++i) {
+      if (base + (i + 1) * span > first)
+        free_pages(&node[i], level - 1, base + i * span, first);
+    }
+  }
+
+  if (base >= first) {
+    mem_free_kernel_page(*slot);
+    *slot = nullptr;
+  }
+}
+
+static void truncate(page_file &file, uint32_t size)
+{
+  if (size < file.size) {
+    free_pages(&file.root, file.height, 0, ALIGN_UP(size, 0x1000) >> 12);
+
+    // The end of the last page reads as zeroes if the file grows again
+    void **slot = find_slot(file, size >> 12, false);
+
+    if ((size & 0xFFF) && slot && *slot)
+      memset((char *)*slot + (size & 0xFFF), 0, 0x1000 - (size & 0xFFF));
+  }
+
+  file.size = size;
+}
+
+static int read_pages(ramfs_opened_file &fd, page_file &file, char *data, int length)
+{
+  if (fd.position >= file.size)
+    return 0;
+
+  const int bytes_to_copy = p2::min<uint32_t>(file.size - fd.position, length);
+  int bytes_copied = 0;
+
+  while (bytes_copied < bytes_to_copy) {
+    const uint32_t page_offset = fd.position & 0xFFF;
+    const int chunk = p2::min<int>(0x1000 - page_offset, bytes_to_copy - bytes_copied);
+    void **slot = find_slot(file, fd.position >> 12, false);
+
+    if (slot && *slot)
+      memcpy(data + bytes_copied, (char *)*slot + page_offset, chunk);
+    else
+      memset(data + bytes_copied, 0, chunk);
+
+    bytes_copied += chunk;
+    fd.position += chunk;
+  }
+
+  return bytes_copied;
 }
 
 static int read(int handle, char *data, int length)
 {
-  // TODO: verify that the file is in fact a mem range file
   ramfs_opened_file &fd = opened_files[handle];
   file_node &node = nodes[fd.node];
+
+  if (node.type == TYPE_DIRECTORY)
+    return read_dir(fd, data, length);
+
+  if (node.type == TYPE_PAGE_FILE)
+    return read_pages(fd, page_files[node.file], data, length);
+
   mem_range_file &file = mem_range_files[node.file];
 
   const int bytes_to_copy = p2::min(fd.position + length, file.size) - fd.position;
@@ -111,6 +295,69 @@ static int read(int handle, char *data, int length)
   return bytes_to_copy;
 }
 
+static int write(int handle, const char *data, int length)
+{
+  ramfs_opened_file &fd = opened_files[handle];
+  file_node &node = nodes[fd.node];
+
+  // Memory range files are windows over modules, which are read-only
+  if (node.type != TYPE_PAGE_FILE)
+    return ENOSUPPORT;
+
+  page_file &file = page_files[node.file];
+  length = p2::min<uint32_t>(length, PAGE_FILE_MAX_SIZE - p2::min<uint32_t>(fd.position, PAGE_FILE_MAX_SIZE));
+  int bytes_written = 0;
+
+  while (bytes_written < length) {
+    const uint32_t page_offset = fd.position & 0xFFF;
+    const int chunk = p2::min<int>(0x1000 - page_offset, length - bytes_written);
+    void **slot = find_slot(file, fd.position >> 12, true);
+
+    if (slot && !*slot)
+      *slot = mem_alloc_kernel_page();
+
+    if (!slot || !*slot)
+      break;
+
+    memcpy((char *)*slot + page_offset, data + bytes_written, chunk);
+    bytes_written += chunk;
+    fd.position += chunk;
+  }
+
+  file.size = p2::max(file.size, fd.position);
+
+  if (bytes_written == 0 && length != 0)
+    return ENOSPACE;
+
+  return bytes_written;
+}
+
+static int readdir(int handle, dirent_t *entries, int count)
+{
+  ramfs_opened_file &fd = opened_files[handle];
+
+  if (nodes[fd.node].type != TYPE_DIRECTORY)
+    return ENODIR;
+
+  if (fd.position % sizeof(dirent_t) != 0 && fd.cursor != directories.end_sentinel()) {
+    fd.cursor = directories[fd.cursor].next_dirent;
+    fd.position += sizeof(dirent_t) - fd.position % sizeof(dirent_t);
+  }
+
+  int filled = 0;
+
+  while (fd.cursor != directories.end_sentinel() && filled < count) {
+    const dirent &entry = directories[fd.cursor];
+    dirent_t &out = entries[filled++];
+
+    memcpy(out.name, entry.name.c_str(), entry.name.size() + 1);
+    fd.cursor = entry.next_dirent;
+    fd.position += sizeof(dirent_t);
+  }
+
+  return filled;
+}
+
 static int create_file(const char *parent_path, const char *filename, uint8_t type)
 {
   node_handle parent = lookup(root, parent_path);
@@ -128,8 +375,8 @@ static int create_file(const char *parent_path, const char *filename, uint8_t ty
   if (type == TYPE_DIRECTORY) {
     file = directories.end_sentinel();
   }
-  else if (type == TYPE_MEM_RANGE_FILE) {
-    file = mem_range_files.emplace_anywhere(0, 0);
+  else if (type == TYPE_PAGE_FILE) {
+    file = page_files.emplace_anywhere();
   }
   else {
     panic("invalid type");
@@ -139,6 +386,9 @@ static int create_file(const char *parent_path, const char *filename, uint8_t ty
   file_handle dir_entry = directories.emplace_anywhere(filename, file_node, parent_node.file);
   parent_node.file = dir_entry;
 
+  const p2::string<RAMFS_NAME_MAX + 1> &name = directories[dir_entry].name;
+  dcache_insert(&nodes, parent, dcache_name(name.c_str(), name.size()), file_node);
+
   return file_node;
 }
 
@@ -154,7 +404,7 @@ static int open(vfs_device *, const char *path, uint32_t flags)
     p2::string<128> dir, base;
     p2::dirname(p2::string<128>(path), &dir, &base);
 
-    int retval = create_file(dir.c_str(), base.c_str(), TYPE_MEM_RANGE_FILE);
+    int retval = create_file(dir.c_str(), base.c_str(), TYPE_PAGE_FILE);
     if (retval < 0)
       return retval;
 
@@ -162,7 +412,14 @@ static int open(vfs_device *, const char *path, uint32_t flags)
     dbg_puts(ramfs, "created file '%s' in '%s' as node %d", base.c_str(), dir.c_str(), node);
   }
 
-  return opened_files.emplace_anywhere(node, 0);
+  const file_node &opened = nodes[node];
+
+  if ((flags & OPEN_TRUNCATE) && opened.type == TYPE_PAGE_FILE)
+    truncate(page_files[opened.file], 0);
+
+  file_handle cursor = opened.type == TYPE_DIRECTORY ? opened.file : directories.end_sentinel();
+  file_handle handle = opened_files.emplace_anywhere(node, 0, cursor);
+  return handle == opened_files.end_sentinel() ? ENOSPACE : handle;
 }
 
 static int control(int handle, uint32_t function, uint32_t param1, uint32_t param2)
@@ -173,6 +430,16 @@ static int control(int handle, uint32_t function, uint32_t param1, uint32_t para
   // protection that it actually points somewhere good, so be careful.
 
   if (function == CTRL_RAMFS_SET_FILE_RANGE) {
+    if (node.type == TYPE_PAGE_FILE) {
+      // Turn the file into a window over memory, like a module
+      if (page_files[node.file].size != 0)
+        return EBUSY;
+
+      page_files.erase(node.file);
+      node.type = TYPE_MEM_RANGE_FILE;
+      node.file = mem_range_files.emplace_anywhere(0, 0);
+    }
+
     assert(node.type == TYPE_MEM_RANGE_FILE);
     mem_range_file &file = mem_range_files[node.file];
     assert(file.size == 0);
@@ -181,7 +448,9 @@ static int control(int handle, uint32_t function, uint32_t param1, uint32_t para
     return 0;
   }
   else if (function == CTRL_RAMFS_GET_FILE_RANGE) {
-    assert(node.type == TYPE_MEM_RANGE_FILE);
+    if (node.type != TYPE_MEM_RANGE_FILE)
+      return ENOSUPPORT;
+
     mem_range_file &file = mem_range_files[node.file];
     // TODO: check that it's a RAM contiguous file
     uint32_t *start_ptr = (uint32_t *)param1;
@@ -199,10 +468,62 @@ static int control(int handle, uint32_t function, uint32_t param1, uint32_t para
 
     return 0;
   }
+  else if (function == CTRL_RAMFS_TRUNCATE) {
+    if (node.type != TYPE_PAGE_FILE)
+      return ENOSUPPORT;
+
+    if (param1 > PAGE_FILE_MAX_SIZE)
+      return EINVVAL;
+
+    truncate(page_files[node.file], param1);
+    return 0;
+  }
 
   return -1;
 }
 
+//
+// frame - only range files qualify. Page files can be truncated while
+// mapped, freeing their pages.
+//
+static int frame(int handle, uint32_t offset, uintptr_t *phys_address)
+{
+  const file_node &node = nodes[opened_files[handle].node];
+
+  if (node.type != TYPE_MEM_RANGE_FILE)
+    return ENOSUPPORT;
+
+  // Modules are in the kernel's linear mapping of low memory
+  const mem_range_file &file = mem_range_files[node.file];
+  const uintptr_t address = file.start + offset;
+
+  if (file.start < KERNEL_VIRTUAL_BASE || (address & 0xFFF) || offset >= file.size || file.size - offset < 0x1000)
+    return ENOSUPPORT;
+
+  *phys_address = KERNVIRT2PHYS(address);
+  return 0;
+}
+
+//
+// view - only range files, for the same reason as `frame`
+//
+static int view(int handle, const char **data)
+{
+  const ramfs_opened_file &fd = opened_files[handle];
+  const file_node &node = nodes[fd.node];
+
+  if (node.type != TYPE_MEM_RANGE_FILE)
+    return ENOSUPPORT;
+
+  const mem_range_file &file = mem_range_files[node.file];
+
+  if (fd.position >= file.size)
+    return 0;
+
+  *data = (const char *)(file.start + fd.position);
+  return file.size - fd.position;
+}
+
 static int close(int handle)
 {
   // TODO: verify handle
@@ -215,7 +536,11 @@ static int seek(int handle, int offset, int relative)
   // TODO: verify file type
   ramfs_opened_file &fd = opened_files[handle];
   file_node &node = nodes[fd.node];
-  mem_range_file &file = mem_range_files[node.file];
+
+  // Page files can be written past the end, leaving a hole
+  const uint32_t max_position = node.type == TYPE_PAGE_FILE ?
+    PAGE_FILE_MAX_SIZE :
+    mem_range_files[node.file].size;
 
   if (relative == SEEK_CUR) {
     fd.position += offset;
@@ -228,7 +553,7 @@ static int seek(int handle, int offset, int relative)
     panic("invalid relative value");
   }
 
-  fd.position = p2::clamp<uint32_t>(fd.position, 0u, file.size);
+  fd.position = p2::clamp<uint32_t>(fd.position, 0u, max_position);
   dbg_puts(ramfs, "seek to %d", fd.position);
   // TODO: clean up overflow issues
   return 0;
@@ -261,3 +586,9 @@ static int mkdir(const char *pathname)
 
   return ret;
 }
+
+static uint32_t poll(int, uint32_t events)
+{
+  // Files are in memory, so reads return immediately
+  return events & POLL_IN;
+}
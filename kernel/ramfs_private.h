@@ -5,15 +5,20 @@
 
 #define TYPE_MEM_RANGE_FILE  1
 #define TYPE_DIRECTORY       2
+#define TYPE_PAGE_FILE       3
+
+#define RAMFS_NAME_MAX       15  // Longer names are truncated
 
 typedef uint16_t file_handle;
 typedef uint16_t node_handle;
 
 struct ramfs_opened_file {
-  ramfs_opened_file(node_handle node, uint32_t position) : node(node), position(position) {}
+  ramfs_opened_file(node_handle node, uint32_t position, file_handle cursor)
+    : node(node), position(position), cursor(cursor) {}
 
   node_handle node;
   uint32_t position;
+  file_handle cursor;  // Dirent at `position` when reading a directory
 };
 
 struct mem_range_file {
@@ -23,12 +28,26 @@ struct mem_range_file {
   size_t size;
 };
 
+//
+// page_file - a writable file whose contents are in pages allocated on
+// write. Pages are found through a radix tree indexed by page number,
+// with 1024 slots per node; height 1 covers 4 MB and height 2 covers
+// 4 GB. Missing pages are holes that read as zeroes.
+//
+struct page_file {
+  page_file() : root(nullptr), height(0), size(0) {}
+
+  void *root;      // The first page at height 0, otherwise a node
+  uint8_t height;
+  uint32_t size;
+};
+
 struct dirent {
   dirent(const char *name, node_handle node, file_handle next_dirent)
     : name(name), node(node), next_dirent(next_dirent)
   {}
 
-  p2::string<16> name;
+  p2::string<RAMFS_NAME_MAX + 1> name;
   node_handle node;
   file_handle next_dirent;
 };
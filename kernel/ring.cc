@@ -0,0 +1,293 @@
+#include "ring.h"
+#include "process.h"
+#include "filesystem.h"
+#include "timer.h"
+#include "syscalls.h"
+#include "syscall_utils.h"
+#include "debug.h"
+
+#include "support/pool.h"
+#include "support/queue.h"
+#include "support/string.h"
+
+// Declarations
+static int syscall_ring_setup(ring_t *ring);
+static int syscall_ring_enter(int ring_id, uint32_t to_submit, uint32_t min_complete);
+
+struct pending_timeout {
+  uint32_t user_data;
+  uint64_t submitted, deadline;
+};
+
+//
+// ring_state - the kernel's copy of a registered ring. Sizes and
+// addresses are copied on setup so userspace can't change them
+// afterwards, and the indices the kernel writes are kept here too.
+// Only these copies are used for indexing, what's on the ring is
+// written for userspace to read.
+//
+struct ring_state {
+  proc_handle owner;
+  ring_t      *ring;
+  ring_sqe_t  *sqes;
+  ring_cqe_t  *cqes;
+  uint32_t    mask;
+  uint32_t    sq_head, cq_tail;
+
+  p2::queue<ring_sqe_t, 16> pending_reads;
+  p2::fixed_pool<pending_timeout, 16> pending_timeouts;
+};
+
+// Global state
+static p2::fixed_pool<ring_state, 16> rings;
+
+// Definitions
+void ring_init()
+{
+  syscall_register(SYSCALL_NUM_RING_SETUP, (syscall_fun)syscall_ring_setup);
+  syscall_register(SYSCALL_NUM_RING_ENTER, (syscall_fun)syscall_ring_enter);
+}
+
+void ring_release(proc_handle pid)
+{
+  for (int i = 0; i < rings.watermark(); ++i) {
+    if (rings.valid(i) && rings[i].owner == pid)
+      rings.erase(i);
+  }
+}
+
+static int syscall_ring_setup(ring_t *ring)
+{
+  verify_buf(ring, ring, sizeof(*ring));
+
+  const uint32_t entries = ring->entries;
+
+  if (entries == 0 || entries > RING_MAX_ENTRIES || (entries & (entries - 1)) != 0)
+    return EINVVAL;
+
+  static_assert(RING_MAX_ENTRIES <= SIZE_MAX / sizeof(ring_sqe_t), "ring size can't overflow");
+
+  verify_buf(ring, ring->sqes, entries * sizeof(ring_sqe_t));
+  verify_buf(ring, ring->cqes, entries * sizeof(ring_cqe_t));
+
+  if (rings.full())
+    return ENOSPACE;
+
+  ring->sq_head = ring->sq_tail = 0;
+  ring->cq_head = ring->cq_tail = 0;
+
+  ring_state state = {};
+  state.owner = *proc_current_pid();
+  state.ring = ring;
+  state.sqes = ring->sqes;
+  state.cqes = ring->cqes;
+  state.mask = entries - 1;
+
+  int ring_id = rings.emplace_anywhere(state);
+  dbg_puts(ring, "set up ring %d with %d entries", ring_id, entries);
+  return ring_id;
+}
+
+static bool completion_space(const ring_state &state)
+{
+  return state.cq_tail - state.ring->cq_head <= state.mask;
+}
+
+static void complete(ring_state &state, uint32_t user_data, int result)
+{
+  state.cqes[state.cq_tail++ & state.mask] = ring_cqe_t{user_data, result};
+  __atomic_store_n(&state.ring->cq_tail, state.cq_tail, __ATOMIC_RELEASE);
+}
+
+//
+// copy_iovec - copies the iovecs of a vectored operation so userspace
+// can't change them while they're used. Returns false if any of them
+// are invalid.
+//
+static bool copy_iovec(iovec_t *dest, const ring_sqe_t &sqe)
+{
+  if (sqe.length < 1 || sqe.length > IOV_MAX || !valid_buffer((const void *)sqe.addr, sqe.length * sizeof(iovec_t)))
+    return false;
+
+  memcpy(dest, (const void *)sqe.addr, sqe.length * sizeof(iovec_t));
+  return valid_iovec(dest, sqe.length);
+}
+
+//
+// submit - starts the operation and returns true if it completed
+// right away
+//
+static bool submit(ring_state &state, const ring_sqe_t &sqe, vfs_context context)
+{
+  switch (sqe.opcode) {
+  case RING_OP_NOP:
+    complete(state, sqe.user_data, 0);
+    return true;
+
+  case RING_OP_WRITE:
+    if (!valid_buffer((const void *)sqe.addr, sqe.length))
+      complete(state, sqe.user_data, EINVVAL);
+    else
+      complete(state, sqe.user_data, vfs_write(context, sqe.fd, (const char *)sqe.addr, sqe.length));
+    return true;
+
+  case RING_OP_WRITEV: {
+    iovec_t iov[IOV_MAX];
+
+    if (!copy_iovec(iov, sqe))
+      complete(state, sqe.user_data, EINVVAL);
+    else
+      complete(state, sqe.user_data, vfs_writev(context, sqe.fd, iov, sqe.length));
+    return true;
+  }
+
+  case RING_OP_CONTROL:
+    complete(state, sqe.user_data, vfs_control(context, sqe.fd, sqe.function, sqe.addr, sqe.length));
+    return true;
+
+  case RING_OP_READ:
+  case RING_OP_READV: {
+    // The iovecs can change, so they're copied again for the read
+    iovec_t iov[IOV_MAX];
+    const bool valid = sqe.opcode == RING_OP_READ ? valid_buffer((const void *)sqe.addr, sqe.length) : copy_iovec(iov, sqe);
+
+    if (!valid) {
+      complete(state, sqe.user_data, EINVVAL);
+      return true;
+    }
+
+    if (!state.pending_reads.push_back(sqe)) {
+      complete(state, sqe.user_data, ENOSPACE);
+      return true;
+    }
+
+    return false;
+  }
+
+  case RING_OP_TIMEOUT: {
+    if (state.pending_timeouts.full()) {
+      complete(state, sqe.user_data, ENOSPACE);
+      return true;
+    }
+
+    const uint64_t now = timer_current_time();
+    state.pending_timeouts.emplace_anywhere(pending_timeout{sqe.user_data, now, now + sqe.length});
+    return false;
+  }
+
+  default:
+    complete(state, sqe.user_data, ENOSUPPORT);
+    return true;
+  }
+}
+
+//
+// expire_timeouts - completes the timeouts that have passed. Returns
+// ms until the next one expires, or -1 if there are none left.
+//
+static int expire_timeouts(ring_state &state, uint32_t *completed)
+{
+  const uint64_t now = timer_current_time();
+  int next_timeout = -1;
+
+  for (int i = 0; i < state.pending_timeouts.watermark(); ++i) {
+    if (!state.pending_timeouts.valid(i))
+      continue;
+
+    const pending_timeout &timeout = state.pending_timeouts[i];
+
+    if (timeout.deadline <= now) {
+      if (!completion_space(state))
+        return 0;
+
+      complete(state, timeout.user_data, now - timeout.submitted);
+      state.pending_timeouts.erase(i);
+      ++*completed;
+    }
+    else if (next_timeout == -1 || (int)(timeout.deadline - now) < next_timeout) {
+      next_timeout = timeout.deadline - now;
+    }
+  }
+
+  return next_timeout;
+}
+
+//
+// complete_ready_reads - does the pending reads whose fds won't block,
+// the others are kept in the same order. Returns the number completed.
+//
+static uint32_t complete_ready_reads(ring_state &state, vfs_context context)
+{
+  uint32_t completed = 0;
+
+  for (int i = state.pending_reads.size(); i > 0 && completion_space(state); --i) {
+    const ring_sqe_t sqe = state.pending_reads.pop_front();
+
+    if (!(vfs_poll(context, sqe.fd, POLL_IN) & (POLL_IN|POLL_NVAL))) {
+      state.pending_reads.push_back(sqe);
+      continue;
+    }
+
+    if (sqe.opcode == RING_OP_READV) {
+      iovec_t iov[IOV_MAX];
+      complete(state, sqe.user_data, copy_iovec(iov, sqe) ? vfs_readv(context, sqe.fd, iov, sqe.length) : EINVVAL);
+    }
+    else {
+      p2::res<size_t> result = vfs_read(context, sqe.fd, (char *)sqe.addr, sqe.length);
+      complete(state, sqe.user_data, result ? (int)*result : result.error());
+    }
+    ++completed;
+  }
+
+  return completed;
+}
+
+static int syscall_ring_enter(int ring_id, uint32_t to_submit, uint32_t min_complete)
+{
+  proc_handle pid = *proc_current_pid();
+
+  if (ring_id < 0 || ring_id >= rings.watermark() || !rings.valid(ring_id) || rings[ring_id].owner != pid)
+    return EINVVAL;
+
+  ring_state &state = rings[ring_id];
+  ring_t *ring = state.ring;
+  vfs_context context = proc_get_file_context(pid);
+  uint32_t submitted = 0, completed = 0;
+
+  // Leave submissions on the ring if there's no space for their
+  // completions; the caller has to reap completions first
+  while (submitted < to_submit && state.sq_head != __atomic_load_n(&ring->sq_tail, __ATOMIC_ACQUIRE)) {
+    if (!completion_space(state))
+      break;
+
+    // Copy the entry so userspace can't change it while we're using it
+    const ring_sqe_t sqe = state.sqes[state.sq_head++ & state.mask];
+    ring->sq_head = state.sq_head;
+    ++submitted;
+
+    if (submit(state, sqe, context))
+      ++completed;
+  }
+
+  while (completed < min_complete && completion_space(state)) {
+    int next_timeout = expire_timeouts(state, &completed);
+
+    if (completed >= min_complete || !completion_space(state))
+      break;
+
+    if (uint32_t reads = complete_ready_reads(state, context); reads > 0) {
+      completed += reads;
+      continue;
+    }
+
+    // Nothing in flight that could complete
+    if (state.pending_reads.size() == 0 && next_timeout == -1)
+      break;
+
+    // Sleep until a driver has new data or the next timeout is due
+    if (int ret = vfs_poll_wait(next_timeout); ret < 0 && ret != ETIMEOUT)
+      return ret;
+  }
+
+  return submitted;
+}
@@ -0,0 +1,22 @@
+// -*- c++ -*-
+//
+// Submission/completion rings - batches I/O syscalls. Userspace fills
+// in a submission ring in its own memory and the kernel processes the
+// whole batch in one `ring_enter`, writing results to a completion
+// ring. See syscall_decls.h for the layout.
+//
+
+#ifndef PEOS2_RING_H
+#define PEOS2_RING_H
+
+#include "process.h"
+
+void ring_init();
+
+//
+// ring_release - forgets the rings of @pid, called when its memory
+// goes away
+//
+void ring_release(proc_handle pid);
+
+#endif // !PEOS2_RING_H
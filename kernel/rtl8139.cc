@@ -4,6 +4,9 @@
 // DMA. The interrupt handler will advance the current tx state and
 // the producing side needs to wait if there's no more space.
 //
+// Received frames are copied out of the RX ring by deferred work in
+// the worker thread, the interrupt handler only acknowledges.
+//
 
 #include <stddef.h>
 
@@ -17,6 +20,9 @@
 #include "process.h"
 #include "syscall_decls.h"
 #include "syscall_utils.h"
+#include "workqueue.h"
+#include "locks.h"
+#include "trace.h"
 
 #include "support/utils.h"
 #include "support/optional.h"
@@ -88,6 +94,7 @@ static pci_device *dev;
 static const uint16_t rx_ring_size = 8 * 1024;
 static uint8_t rx_buffer[rx_ring_size + 16 + 1500] alignas(uint32_t);
 static uint16_t rx_pos;
+static volatile bool rx_work_scheduled = false;
 
 // Tx state
 static uint8_t tx_buffers[4][1516];
@@ -102,13 +109,17 @@ static p2::ring_buffer<10 * 1024> pending_tx;
 // Declarations
 extern "C" void isr_rtl8139(isr_registers *);
 static void receive(pci_device *dev);
-static int transmit(pci_device *dev, const char *data, size_t length);
+static void receive_work(uintptr_t);
+static int transmit(pci_device *dev, const iovec_t *parts, int count, size_t skip);
+static bool transmit_whole_packet(const iovec_t *iov, int count, size_t total);
 static void print_hwaddress();
 
 static int open(vfs_device *device, const char *path, uint32_t flags);
 static int close(int handle);
 static int read(int handle, char *data, int length);
 static int write(int handle, const char *data, int length);
+static int writev(int handle, const iovec_t *iov, int count);
+static uint32_t poll(int handle, uint32_t events);
 static int control(int handle, uint32_t function, uint32_t param1, uint32_t param2);
 
 void rtl8139_init()
@@ -160,7 +171,14 @@ void rtl8139_init()
     .control = control,
     .seek = nullptr,
     .tell = nullptr,
-    .mkdir = nullptr
+    .mkdir = nullptr,
+    .poll = poll,
+    .readv = nullptr,
+    .writev = writev,
+    .readdir = nullptr,
+    .frame = nullptr,
+    .view = nullptr,
+    .advise = nullptr
   };
 
   vfs_node_handle mountpoint = vfs_create_node(VFS_FILESYSTEM);
@@ -170,6 +188,7 @@ void rtl8139_init()
 
 extern "C" void int_rtl8139(isr_registers */*regs*/)
 {
+  tracepoint(TRACE_IRQ, dev->irq, 0);
   uint16_t status = inw(dev->iobase + ISR);
   outw(dev->iobase + ISR, status);
 
@@ -191,10 +210,6 @@ extern "C" void int_rtl8139(isr_registers */*regs*/)
     }
   }
 
-  if (status & IMR_ROK) {
-    receive(dev);
-  }
-
   // Normalize cursors
   if (tx_cur_send >= 4) {
     tx_cur_send -= 4;
@@ -203,11 +218,26 @@ extern "C" void int_rtl8139(isr_registers */*regs*/)
 
   outd(dev->iobase + ISR, 0xFFFF);  // Clear all ints
   irq_eoi(dev->irq);
+
+  // Scheduling can cause a context switch, so it's done after EOI
+  if ((status & IMR_ROK) && !rx_work_scheduled) {
+    rx_work_scheduled = workq_schedule(receive_work, 0);
+  }
+}
+
+static void receive_work(uintptr_t)
+{
+  // Frames arriving from now on need another round of work
+  rx_work_scheduled = false;
+  receive(dev);
 }
 
 static void receive(pci_device *dev)
 {
+  // Only the worker thread touches the RX ring, but the FIFO is shared
+  // with readers. Interrupts are enabled between frames.
   while (!(inb(dev->iobase + CR) & CR_BUFE)) {
+    interrupt_guard guard;
     uint32_t packet_header = *(uint32_t *)(rx_buffer + rx_pos);
     uint16_t packet_status = packet_header & 0xFFFF;
     uint16_t packet_size = packet_header >> 16;
@@ -223,6 +253,7 @@ static void receive(pci_device *dev)
     }
     else {
       uint16_t data_size = packet_size - 4;  // 2 = header size, 4 = trailing CRC
+      tracepoint(TRACE_NET_RX, data_size, 0);
       dbg_puts(rtl8139, "rx valid packet rx_pos=%d,size=%d,datasz=%d",
                rx_pos,
                packet_size,
@@ -231,7 +262,7 @@ static void receive(pci_device *dev)
       if (process_opened) {
         // TODO: check that the buffer has space for both the header and the data first
         // TODO: send a hint to the fifo that we're going to push more, so don't
-        //       context switch. We shouldn't really context switch here anyway!
+        //       context switch.
         if (read_fifo.push_back((const char *)&data_size, 2) <= 0)
           dbg_puts(rtl8139, "failed to write size");
 
@@ -246,7 +277,33 @@ static void receive(pci_device *dev)
   }
 }
 
-static int transmit(pci_device *dev, const char *data, size_t length)
+//
+// gather - copies up to @capacity bytes from @parts to @dest, skipping
+// the first @skip bytes. Returns the number of bytes copied.
+//
+static size_t gather(char *dest, size_t capacity, const iovec_t *parts, int count, size_t skip)
+{
+  size_t copied = 0;
+
+  for (int i = 0; i < count && copied < capacity; ++i) {
+    size_t length = parts[i].length;
+    const char *data = (const char *)parts[i].base;
+
+    if (skip >= length) {
+      skip -= length;
+      continue;
+    }
+
+    size_t part_bytes = p2::min<size_t>(length - skip, capacity - copied);
+    memcpy(dest + copied, data + skip, part_bytes);
+    copied += part_bytes;
+    skip = 0;
+  }
+
+  return copied;
+}
+
+static int transmit(pci_device *dev, const iovec_t *parts, int count, size_t skip)
 {
   if (tx_cur_write >= tx_cur_send + 4) {
     //dbg_puts(rtl8139, "waiting for free packet slot...");
@@ -268,14 +325,16 @@ static int transmit(pci_device *dev, const char *data, size_t length)
     return -1;
   }
 
+  // The frame is gathered straight into the DMA buffer
   uint8_t *buffer = tx_buffers[write_desc];
-  memcpy(buffer, data, p2::min<size_t>(length, 1500));
+  size_t length = gather((char *)buffer, 1500, parts, count, skip);
 
   // Pad the buffer, NIC will add 4 bytes for CRC
   while (length < 60) {
     buffer[length++] = '\0';
   }
 
+  tracepoint(TRACE_NET_TX, length, 0);
   dbg_puts(rtl8139, "writing to desc %d", write_desc);
   uint32_t new_desc_status = length & 0x1FFF;
   new_desc_status |= (9 << 16);  // TX FIFO thresh 264 bytes
@@ -324,16 +383,81 @@ static int close(int /*handle*/)
   return 0;
 }
 
+static uint32_t poll(int /*handle*/, uint32_t events)
+{
+  // Writes are buffered or dropped, they never block
+  uint32_t ready = events & POLL_OUT;
+
+  if ((events & POLL_IN) && read_fifo.size() > 0)
+    ready |= POLL_IN;
+
+  return ready;
+}
+
 static int read(int /*handle*/, char *data, int length)
 {
   return read_fifo.pop_front(data, length);
 }
 
+//
+// transmit_whole_packet - sends the packet directly if @iov holds
+// exactly one length prefixed packet (@total bytes) and nothing is buffered in
+// `pending_tx`. Returns false if the stream path has to be used.
+//
+static bool transmit_whole_packet(const iovec_t *iov, int count, size_t total)
+{
+  if (pending_tx.size() > 0)
+    return false;
+
+  uint16_t packet_size = 0;
+
+  if (gather((char *)&packet_size, sizeof(packet_size), iov, count, 0) != sizeof(packet_size))
+    return false;
+
+  if (total != sizeof(packet_size) + packet_size)
+    return false;
+
+  dbg_puts(rtl8139, "sending packet size=%d", packet_size);
+  transmit(dev, iov, count, sizeof(packet_size));
+  return true;
+}
+
+static int writev(int handle, const iovec_t *iov, int count)
+{
+  size_t total = 0;
+  for (int i = 0; i < count; ++i)
+    total += iov[i].length;
+
+  if (transmit_whole_packet(iov, count, total))
+    return total;
+
+  // Partial packets are reassembled through `pending_tx`
+  int written = 0;
+
+  for (int i = 0; i < count; ++i) {
+    if (iov[i].length == 0)
+      continue;
+
+    int ret = write(handle, (const char *)iov[i].base, iov[i].length);
+    written += ret;
+
+    if ((uint32_t)ret < iov[i].length)
+      break;
+  }
+
+  return written;
+}
+
 static int write(int /*handle*/, const char *data, int length)
 {
   static char buf[1600];  // TODO/NB: global state
   assert(length > 0);
 
+  const iovec_t packet = {(void *)data, (uint32_t)length};
+
+  if (transmit_whole_packet(&packet, 1, length))
+    return length;
+
   // pending_tx contains an unfinished outgoing packet, the packet is
   // prefixed with a 16 bit length (like what the user writes on the
   // fd)
@@ -368,8 +492,9 @@ static int write(int /*handle*/, const char *data, int length)
     size_t consumed_payload = pending_tx.read_front(buf, packet_size);
     assert(consumed_payload == packet_size && "failed to consume pending tx payload");
 
+    const iovec_t buffered = {buf, packet_size};
     dbg_puts(rtl8139, "sending packet size=%d", packet_size);
-    transmit(dev, buf, packet_size);
+    transmit(dev, &buffered, 1, 0);
   }
 
   return bytes_writable;
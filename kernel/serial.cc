@@ -7,25 +7,75 @@
 // etc, so this file adapts the VT102-esque behavior to what the rest
 // of the system expects. Remember that we're not aiming for full
 // terminal support; that should be implemented at another layer later.
+//
+// Output is queued in `tx_buffer` and moved to the UART's 16 byte
+// FIFO by the transmitter holding register empty interrupt, so
+// logging doesn't stall the caller for the time it takes to send
+// it. Until interrupts are set up, and after `com_set_synchronous`,
+// every byte is sent by polling the line status.
 
 #include "serial.h"
 #include "x86.h"
 #include "protected_mode.h"
 #include "debug.h"
 #include "terminal.h"
+#include "trace.h"
+#include "locks.h"
+
+#include "support/ring_buffer.h"
+#include "support/format.h"
 
+// Declarations
 #define COM1_PORT_BASE 0x3F8
+#define COM_CLOCK      115200  // Baud rate at divisor 1
+#define COM_FIFO_SIZE  16
+
+#define IER_RX_AVAILABLE 0x01
+#define IER_TX_EMPTY     0x02
+
+#define IIR_NONE_PENDING 0x01
+#define IIR_ID_MASK      0x0E
+#define IIR_MODEM_STATUS 0x00
+#define IIR_TX_EMPTY     0x02
+#define IIR_RX_AVAILABLE 0x04
+#define IIR_LINE_STATUS  0x06
+#define IIR_RX_TIMEOUT   0x0C
+
+static void set_divisor(uint16_t divisor);
 
+// Global state
+static p2::ring_buffer<16 * 1024> tx_buffer;
+static bool tx_buffered = false;       // Interrupts drain `tx_buffer`
+static uint8_t interrupts_enabled = 0; // Shadow of the IER
+static uint32_t tx_dropped = 0;        // Bytes dropped since the buffer was full
+
+// Definitions
 void com_init()
 {
-  outb(COM1_PORT_BASE + 3, 0x80);  // DLAB on
-  outb(COM1_PORT_BASE + 0, 0x03);  // Baud divisor low byte, 38400
-  outb(COM1_PORT_BASE + 1, 0x00);  // High byte
-  outb(COM1_PORT_BASE + 3, 0x03);  // DLAB off, 8 bits, no parity
+  set_divisor(COM_CLOCK / COM_DEFAULT_BAUD);
   outb(COM1_PORT_BASE + 2, 0xC7);  // FIFO
   outb(COM1_PORT_BASE + 4, 0x0B);
 }
 
+static void set_divisor(uint16_t divisor)
+{
+  outb(COM1_PORT_BASE + 3, 0x80);  // DLAB on
+  outb(COM1_PORT_BASE + 0, divisor & 0xFF);
+  outb(COM1_PORT_BASE + 1, divisor >> 8);
+  outb(COM1_PORT_BASE + 3, 0x03);  // DLAB off, 8 bits, no parity
+}
+
+bool com_set_baud(uint32_t baud)
+{
+  if (baud == 0 || baud > COM_CLOCK || COM_CLOCK % baud != 0)
+    return false;
+
+  // Changing the rate mid-character garbles it
+  com_flush();
+  set_divisor(COM_CLOCK / baud);
+  return true;
+}
+
 static inline bool free_to_transmit()
 {
   return (inb(COM1_PORT_BASE + 5) & 0x20) != 0;
@@ -36,13 +86,41 @@ static inline bool free_to_receive()
   return (inb(COM1_PORT_BASE + 5) & 0x01) != 0;
 }
 
+static void set_interrupts(uint8_t mask)
+{
+  if (mask != interrupts_enabled) {
+    interrupts_enabled = mask;
+    outb(COM1_PORT_BASE + 1, mask);
+  }
+}
+
 void send_char(char c)
 {
   while (!free_to_transmit());
   outb(COM1_PORT_BASE, c);
 }
 
-void com_send(const char *data, int count)
+//
+// fill_fifo - moves what fits of `tx_buffer` to the UART, and stops the
+// TX interrupt once there's nothing more to send
+//
+static void fill_fifo()
+{
+  if (free_to_transmit()) {
+    char data[COM_FIFO_SIZE];
+    size_t count = tx_buffer.read_front(data, sizeof(data));
+
+    for (size_t i = 0; i < count; ++i)
+      outb(COM1_PORT_BASE, data[i]);
+  }
+
+  if (tx_buffer.size() > 0)
+    set_interrupts(interrupts_enabled | IER_TX_EMPTY);
+  else
+    set_interrupts(interrupts_enabled & ~IER_TX_EMPTY);
+}
+
+static void send_sync(const char *data, int count)
 {
   for (int i = 0; i < count; ++i) {
     switch (data[i]) {
@@ -57,9 +135,70 @@ void com_send(const char *data, int count)
   }
 }
 
+static void send_buffered(const char *data, int count)
+{
+  if (tx_dropped > 0) {
+    // Tell the reader that there's a gap, once there's room for it
+    p2::format<48> notice("\r\n[serial: %d bytes dropped]\r\n", tx_dropped);
+
+    if (tx_buffer.write(notice.str().c_str(), notice.str().size()))
+      tx_dropped = 0;
+  }
+
+  for (int i = 0; i < count; ++i) {
+    bool written;
+
+    switch (data[i]) {
+    case '\n':
+      written = tx_buffer.write("\r\n", 2);
+      break;
+
+    default:
+      written = tx_buffer.write(&data[i], 1);
+    }
+
+    if (!written)
+      ++tx_dropped;
+  }
+
+  fill_fifo();
+}
+
+void com_send(const char *data, int count)
+{
+  if (!tx_buffered) {
+    send_sync(data, count);
+    return;
+  }
+
+  // Kernel threads log with interrupts enabled
+  interrupt_guard guard;
+  send_buffered(data, count);
+}
+
+void com_flush()
+{
+  if (!tx_buffered)
+    return;
+
+  interrupt_guard guard;
+  char c;
+
+  while (tx_buffer.read_front(&c, 1))
+    send_char(c);
+
+  set_interrupts(interrupts_enabled & ~IER_TX_EMPTY);
+}
+
+void com_set_synchronous()
+{
+  com_flush();
+  tx_buffered = false;
+}
+
 extern "C" void isr_com1(isr_registers *);
 
-void com_setup_rx()
+void com_setup_irq()
 {
   int_register(IRQ_BASE_INTERRUPT + IRQ_COM1,
                isr_com1,
@@ -67,12 +206,12 @@ void com_setup_rx()
                IDT_TYPE_INTERRUPT|IDT_TYPE_D|IDT_TYPE_P|IDT_TYPE_DPL3);
 
   irq_enable(IRQ_COM1);
-  outb(COM1_PORT_BASE + 1, 0x01);
+  set_interrupts(IER_RX_AVAILABLE);
+  tx_buffered = true;
 }
 
-extern "C" void int_com1(volatile isr_registers *)
+static void receive()
 {
-  // TODO: check which com port actually triggered this IRQ
   while (free_to_receive()) {
     char c = (char)inb(COM1_PORT_BASE);
 
@@ -89,6 +228,35 @@ extern "C" void int_com1(volatile isr_registers *)
       term_keypress(c);
     }
   }
+}
+
+extern "C" void int_com1(volatile isr_registers *)
+{
+  tracepoint(TRACE_IRQ, IRQ_COM1, 0);
+
+  // TODO: check which com port actually triggered this IRQ
+  uint8_t iir;
+
+  while (!((iir = inb(COM1_PORT_BASE + 2)) & IIR_NONE_PENDING)) {
+    switch (iir & IIR_ID_MASK) {
+    case IIR_TX_EMPTY:
+      fill_fifo();
+      break;
+
+    case IIR_RX_AVAILABLE:
+    case IIR_RX_TIMEOUT:
+      receive();
+      break;
+
+    case IIR_LINE_STATUS:
+      inb(COM1_PORT_BASE + 5);
+      break;
+
+    case IIR_MODEM_STATUS:
+      inb(COM1_PORT_BASE + 6);
+      break;
+    }
+  }
 
   irq_eoi(IRQ_COM1);
 }
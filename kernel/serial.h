@@ -6,8 +6,32 @@
 #include <stdint.h>
 #include <stddef.h>
 
+#define COM_DEFAULT_BAUD 38400
+
 void com_init();
 void com_send(const char *data, int count);
-void com_setup_rx();
+
+//
+// com_setup_irq - enables the COM1 interrupt; received characters go
+// to the terminal and output is buffered from now on
+//
+void com_setup_irq();
+
+//
+// com_set_baud - sets the line speed, @baud has to divide 115200.
+// Returns false if it doesn't.
+//
+bool com_set_baud(uint32_t baud);
+
+//
+// com_flush - sends all buffered output, waiting for the UART
+//
+void com_flush();
+
+//
+// com_set_synchronous - flushes, then sends everything by polling.
+// For panics, when there might not be any more interrupts.
+//
+void com_set_synchronous();
 
 #endif // !PEOS2_SERIAL_H
@@ -0,0 +1,585 @@
+#include "smp.h"
+#include "apic.h"
+#include "x86.h"
+#include "memory.h"
+#include "memareas.h"
+#include "multiboot.h"
+#include "process.h"
+#include "fpu.h"
+#include "profiler.h"
+#include "timer.h"
+#include "debug.h"
+
+#include "support/utils.h"
+#include "support/assert.h"
+
+// Externs
+extern "C" void isr_lapic_timer(isr_registers *);
+extern "C" void isr_tlb_shootdown(isr_registers *);
+extern "C" void isr_spurious(isr_registers *);
+extern "C" char smp_trampoline_start, smp_trampoline_end;
+extern "C" uint32_t smp_trampoline_cr3, smp_trampoline_stack, smp_trampoline_entry;
+
+//
+// ACPI tables
+//
+struct acpi_rsdp {
+  char     signature[8];
+  uint8_t  checksum;
+  char     oem_id[6];
+  uint8_t  revision;
+  uint32_t rsdt_address;
+} __attribute__((packed));
+
+struct acpi_sdt_header {
+  char     signature[4];
+  uint32_t length;
+  uint8_t  revision;
+  uint8_t  checksum;
+  char     oem_id[6];
+  char     oem_table_id[8];
+  uint32_t oem_revision;
+  uint32_t creator_id;
+  uint32_t creator_revision;
+} __attribute__((packed));
+
+struct acpi_madt {
+  acpi_sdt_header header;
+  uint32_t lapic_address;
+  uint32_t flags;
+} __attribute__((packed));
+
+struct acpi_madt_entry {
+  uint8_t type;
+  uint8_t length;
+} __attribute__((packed));
+
+struct acpi_madt_lapic {
+  acpi_madt_entry entry;
+  uint8_t  processor_id;
+  uint8_t  apic_id;
+  uint32_t flags;
+} __attribute__((packed));
+
+struct acpi_madt_lapic_override {
+  acpi_madt_entry entry;
+  uint16_t reserved;
+  uint64_t lapic_address;
+} __attribute__((packed));
+
+#define ACPI_MADT_LAPIC           0
+#define ACPI_MADT_LAPIC_OVERRIDE  5
+#define ACPI_MADT_LAPIC_ENABLED   0x01
+
+//
+// Intel MultiProcessor Specification tables
+//
+struct mp_floating_pointer {
+  char     signature[4];
+  uint32_t config_address;
+  uint8_t  length;
+  uint8_t  revision;
+  uint8_t  checksum;
+  uint8_t  features[5];
+} __attribute__((packed));
+
+struct mp_config_header {
+  char     signature[4];
+  uint16_t length;
+  uint8_t  revision;
+  uint8_t  checksum;
+  char     oem_id[8];
+  char     product_id[12];
+  uint32_t oem_table;
+  uint16_t oem_table_size;
+  uint16_t entry_count;
+  uint32_t lapic_address;
+  uint16_t extended_length;
+  uint8_t  extended_checksum;
+  uint8_t  reserved;
+} __attribute__((packed));
+
+struct mp_processor_entry {
+  uint8_t  type;
+  uint8_t  apic_id;
+  uint8_t  apic_version;
+  uint8_t  flags;
+  uint32_t signature;
+  uint32_t features;
+  uint64_t reserved;
+} __attribute__((packed));
+
+#define MP_ENTRY_PROCESSOR     0
+#define MP_PROCESSOR_ENABLED   0x01
+
+struct cpu_info {
+  uint8_t       apic_id;
+  volatile bool online;
+  int           timer_hz;        // What the local timer runs at
+  int           ticks_since_yield;
+};
+
+// Statics
+static bool find_cpus_acpi(uintptr_t *lapic_address);
+static bool find_cpus_mp(uintptr_t *lapic_address);
+static void add_cpu(uint8_t apic_id);
+static p2::opt<uintptr_t> find_trampoline_page();
+static void ap_main();
+static void handle_shootdown(int cpu);
+
+// Global state
+static cpu_info cpus[SMP_MAX_CPUS];
+static int cpu_count = 1;
+static volatile int ap_timer_hz = TIMER_DEFAULT_HZ;
+
+// Found in the tables, the BSP is moved to index 0 once we can ask
+// the local APIC who we are
+static uint8_t found_apic_ids[SMP_MAX_CPUS];
+static int found_count = 0;
+
+static uint8_t ap_stacks[SMP_MAX_CPUS][0x2000] alignas(16);
+static volatile int booting_cpu;
+
+static volatile int lock_owner = -1;
+static int lock_depth = 0;
+
+static volatile uint32_t shootdown_pending;
+static volatile uintptr_t shootdown_address;
+
+
+void smp_init()
+{
+  uintptr_t lapic_address = 0;
+
+  if (!find_cpus_acpi(&lapic_address) && !find_cpus_mp(&lapic_address)) {
+    log(smp, "no multiprocessor tables found");
+    return;
+  }
+
+  if (found_count <= 1) {
+    log(smp, "uniprocessor system");
+    return;
+  }
+
+  lapic_init(lapic_address);
+  lapic_enable(true);
+  lapic_calibrate_timer();
+
+  // The BSP goes first so CPU indices match the task registers
+  uint8_t bsp_apic_id = lapic_id();
+  cpus[0].apic_id = bsp_apic_id;
+  cpus[0].online = true;
+
+  for (int i = 0; i < found_count; ++i) {
+    if (found_apic_ids[i] != bsp_apic_id)
+      add_cpu(found_apic_ids[i]);
+  }
+
+  int_register(LAPIC_TIMER_VECTOR,     isr_lapic_timer,   KERNEL_CODE_SEL, IDT_TYPE_INTERRUPT|IDT_TYPE_D|IDT_TYPE_P);
+  int_register(LAPIC_SHOOTDOWN_VECTOR, isr_tlb_shootdown, KERNEL_CODE_SEL, IDT_TYPE_INTERRUPT|IDT_TYPE_D|IDT_TYPE_P);
+  int_register(LAPIC_SPURIOUS_VECTOR,  isr_spurious,      KERNEL_CODE_SEL, IDT_TYPE_INTERRUPT|IDT_TYPE_D|IDT_TYPE_P);
+
+  log(smp, "%d cpus, bsp has apic id %d", cpu_count, bsp_apic_id);
+}
+
+int smp_cpu_count()
+{
+  return cpu_count;
+}
+
+bool smp_cpu_online(int cpu)
+{
+  return cpu == 0 || (cpu < cpu_count && cpus[cpu].online);
+}
+
+//
+// smp_start_aps - boots the other CPUs one at a time using the
+// INIT-SIPI-SIPI sequence. Expects the scheduler to be ready, every
+// AP goes straight into its idle thread.
+//
+void smp_start_aps()
+{
+  if (cpu_count <= 1)
+    return;
+
+  auto trampoline_phys = find_trampoline_page();
+  if (!trampoline_phys) {
+    log(smp, "no free page for the ap trampoline, staying on one cpu");
+    cpu_count = 1;
+    return;
+  }
+
+  // The trampoline enables paging before jumping into the kernel, so
+  // it has to be reachable at its physical address as well
+  mem_space space = mem_kernel_space();
+  mem_area identity_map = mem_map_linear_eager(space,
+                                               *trampoline_phys,
+                                               *trampoline_phys + 0x1000,
+                                               *trampoline_phys,
+                                               MEM_AREA_READWRITE|MEM_AREA_EXECUTABLE);
+
+  char *trampoline = (char *)PHYS2KERNVIRT(*trampoline_phys);
+  memcpy(trampoline, &smp_trampoline_start, &smp_trampoline_end - &smp_trampoline_start);
+
+  auto field = [&](uint32_t &symbol) -> volatile uint32_t & {
+    return *(volatile uint32_t *)(trampoline + ((char *)&symbol - &smp_trampoline_start));
+  };
+
+  field(smp_trampoline_cr3) = mem_page_dir(space);
+  field(smp_trampoline_entry) = (uintptr_t)ap_main;
+
+  for (int cpu = 1; cpu < cpu_count; ++cpu) {
+    field(smp_trampoline_stack) = (uintptr_t)ap_stacks[cpu] + sizeof(ap_stacks[cpu]);
+    booting_cpu = cpu;
+
+    lapic_send_init(cpus[cpu].apic_id);
+    lapic_delay_us(10000);
+
+    // The spec asks for a second STARTUP if the first one didn't take
+    for (int attempt = 0; attempt < 2 && !cpus[cpu].online; ++attempt) {
+      lapic_send_startup(cpus[cpu].apic_id, *trampoline_phys);
+
+      for (int waited_ms = 0; waited_ms < 100 && !cpus[cpu].online; ++waited_ms)
+        lapic_delay_us(1000);
+    }
+
+    if (!cpus[cpu].online)
+      log(smp, "cpu %d (apic %d) didn't start", cpu, cpus[cpu].apic_id);
+  }
+
+  mem_unmap_area(space, identity_map);
+}
+
+//
+// Entry point of the APs, on the boot stack from the trampoline
+//
+static void ap_main()
+{
+  int cpu = booting_cpu;
+
+  gdt_init_cpu(cpu);  // Makes smp_cpu_index() work
+  int_init_cpu();
+  tss_set_kernel_stack((uintptr_t)ap_stacks[cpu] + sizeof(ap_stacks[cpu]));
+  mem_set_current_space(mem_kernel_space());
+  lapic_enable(false);
+  fpu_init();
+
+  __atomic_store_n(&cpus[cpu].online, true, __ATOMIC_RELEASE);
+
+  kernel_lock_acquire();
+  log(smp, "cpu %d (apic %d) online", cpu, lapic_id());
+
+  // The PIT is only connected to the BSP, so the APs preempt using
+  // their local timer
+  cpus[cpu].timer_hz = ap_timer_hz;
+  lapic_start_timer(cpus[cpu].timer_hz);
+  proc_run();
+}
+
+extern "C" void int_lapic_timer(isr_registers *regs)
+{
+  const int cpu = smp_cpu_index();
+  cpu_info &info = cpus[cpu];
+
+  lapic_eoi();
+
+  // The local timer can only be reprogrammed from its own CPU
+  if (info.timer_hz != ap_timer_hz) {
+    info.timer_hz = ap_timer_hz;
+    info.ticks_since_yield = 0;
+    lapic_start_timer(info.timer_hz);
+  }
+
+  prof_sample(regs);
+
+  // Same quantum as the BSP whatever the timer runs at
+  if (++info.ticks_since_yield >= info.timer_hz / TIMER_DEFAULT_HZ) {
+    info.ticks_since_yield = 0;
+    proc_yield();
+  }
+}
+
+//
+// smp_set_timer_frequency - makes the APs' local timers tick at @hz,
+// which takes effect on their next tick
+//
+void smp_set_timer_frequency(int hz)
+{
+  ap_timer_hz = hz;
+}
+
+void smp_tlb_shootdown(uint32_t cpu_mask, uintptr_t virt_address)
+{
+  // Only one shootdown at a time as we're holding the kernel lock
+  shootdown_address = virt_address;
+  __atomic_store_n(&shootdown_pending, cpu_mask, __ATOMIC_RELEASE);
+
+  for (int cpu = 0; cpu < cpu_count; ++cpu) {
+    if (cpu_mask & (1 << cpu))
+      lapic_send_ipi(cpus[cpu].apic_id, LAPIC_SHOOTDOWN_VECTOR);
+  }
+
+  while (__atomic_load_n(&shootdown_pending, __ATOMIC_ACQUIRE))
+    cpu_relax();
+}
+
+static void handle_shootdown(int cpu)
+{
+  const uint32_t cpu_bit = 1 << cpu;
+
+  if (__atomic_load_n(&shootdown_pending, __ATOMIC_ACQUIRE) & cpu_bit) {
+    invlpg(shootdown_address);
+    __atomic_fetch_and(&shootdown_pending, ~cpu_bit, __ATOMIC_RELEASE);
+  }
+}
+
+//
+// Doesn't take the kernel lock; the sender is holding it.
+//
+extern "C" void int_tlb_shootdown(isr_registers *)
+{
+  handle_shootdown(smp_cpu_index());
+  lapic_eoi();
+}
+
+extern "C" void kernel_lock_acquire()
+{
+  const int cpu = smp_cpu_index();
+
+  if (lock_owner == cpu) {
+    ++lock_depth;
+    return;
+  }
+
+  while (true) {
+    int expected = -1;
+    if (__atomic_compare_exchange_n(&lock_owner, &expected, cpu, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      break;
+
+    // The owner might be waiting for us to flush the TLB, and we
+    // can't take the IPI as interrupts are disabled
+    while (__atomic_load_n(&lock_owner, __ATOMIC_RELAXED) != -1) {
+      handle_shootdown(cpu);
+      cpu_relax();
+    }
+  }
+
+  lock_depth = 1;
+}
+
+extern "C" void kernel_lock_release()
+{
+  assert(lock_owner == smp_cpu_index() && "releasing a lock owned by another cpu");
+
+  if (--lock_depth == 0)
+    __atomic_store_n(&lock_owner, -1, __ATOMIC_RELEASE);
+}
+
+int kernel_lock_depth()
+{
+  return lock_depth;
+}
+
+//
+// kernel_lock_set_depth - the depth belongs to the kernel stack that
+// took the lock, so it follows the process through a context switch
+//
+void kernel_lock_set_depth(int depth)
+{
+  assert(lock_owner == smp_cpu_index());
+  lock_depth = depth;
+}
+
+void kernel_lock_relax()
+{
+  const int depth = lock_depth;
+  lock_depth = 1;
+  kernel_lock_release();
+
+  for (int i = 0; i < 100; ++i)
+    cpu_relax();
+
+  kernel_lock_acquire();
+  lock_depth = depth;
+}
+
+static void add_cpu(uint8_t apic_id)
+{
+  if (cpu_count >= SMP_MAX_CPUS) {
+    log(smp, "ignoring cpu with apic id %d", apic_id);
+    return;
+  }
+
+  cpus[cpu_count].apic_id = apic_id;
+  cpus[cpu_count].online = false;
+  cpu_count++;
+}
+
+static void found_cpu(uint8_t apic_id)
+{
+  if (found_count < SMP_MAX_CPUS)
+    found_apic_ids[found_count++] = apic_id;
+}
+
+static bool valid_checksum(const void *data, size_t length)
+{
+  uint8_t sum = 0;
+  for (size_t i = 0; i < length; ++i)
+    sum += ((const uint8_t *)data)[i];
+
+  return sum == 0;
+}
+
+//
+// scan_bios_memory - looks for a 16 byte aligned structure starting
+// with @signature in the places the specs tell us to
+//
+static const void *scan_bios_memory(const char *signature, size_t length)
+{
+  const uintptr_t ebda = *(const uint16_t *)PHYS2KERNVIRT(0x40E) << 4;
+
+  const region regions[] = {
+    {ebda, ebda + 0x400},       // First KB of the EBDA
+    {0x9FC00, 0xA0000},         // Last KB of base memory
+    {0xE0000, 0x100000},        // BIOS ROM
+  };
+
+  for (auto &region : regions) {
+    if (!region.start)
+      continue;
+
+    for (uintptr_t address = region.start; address + length <= region.end; address += 16) {
+      const char *candidate = (const char *)PHYS2KERNVIRT(address);
+
+      if (!memcmp(candidate, signature, strlen(signature)) && valid_checksum(candidate, length))
+        return candidate;
+    }
+  }
+
+  return nullptr;
+}
+
+static const acpi_sdt_header *map_sdt(uintptr_t phys_address)
+{
+  auto *header = (const acpi_sdt_header *)mem_map_firmware(phys_address, sizeof(acpi_sdt_header));
+  return (const acpi_sdt_header *)mem_map_firmware(phys_address, header->length);
+}
+
+static bool find_cpus_acpi(uintptr_t *lapic_address)
+{
+  auto *rsdp = (const acpi_rsdp *)scan_bios_memory("RSD PTR ", sizeof(acpi_rsdp));
+  if (!rsdp)
+    return false;
+
+  // The 32 bit RSDT is always there, no need for the XSDT on i386
+  const acpi_sdt_header *rsdt = map_sdt(rsdp->rsdt_address);
+  if (memcmp(rsdt->signature, "RSDT", 4) || !valid_checksum(rsdt, rsdt->length))
+    return false;
+
+  const uint32_t *tables = (const uint32_t *)(rsdt + 1);
+  size_t table_count = (rsdt->length - sizeof(*rsdt)) / sizeof(tables[0]);
+
+  for (size_t i = 0; i < table_count; ++i) {
+    const acpi_sdt_header *table = map_sdt(tables[i]);
+    if (memcmp(table->signature, "APIC", 4) || !valid_checksum(table, table->length))
+      continue;
+
+    const acpi_madt *madt = (const acpi_madt *)table;
+    *lapic_address = madt->lapic_address;
+
+    const char *entry_ptr = (const char *)(madt + 1);
+    const char *entries_end = (const char *)madt + madt->header.length;
+
+    while (entry_ptr + sizeof(acpi_madt_entry) <= entries_end) {
+      auto *entry = (const acpi_madt_entry *)entry_ptr;
+      if (entry->length < sizeof(acpi_madt_entry))
+        break;
+
+      if (entry->type == ACPI_MADT_LAPIC) {
+        auto *lapic = (const acpi_madt_lapic *)entry;
+        if (lapic->flags & ACPI_MADT_LAPIC_ENABLED)
+          found_cpu(lapic->apic_id);
+      }
+      else if (entry->type == ACPI_MADT_LAPIC_OVERRIDE) {
+        *lapic_address = ((const acpi_madt_lapic_override *)entry)->lapic_address;
+      }
+
+      entry_ptr += entry->length;
+    }
+
+    log(smp, "found %d cpus in the madt", found_count);
+    return found_count > 0;
+  }
+
+  return false;
+}
+
+static bool find_cpus_mp(uintptr_t *lapic_address)
+{
+  auto *floating = (const mp_floating_pointer *)scan_bios_memory("_MP_", sizeof(mp_floating_pointer));
+  if (!floating || !floating->config_address)
+    return false;
+
+  // TODO: support the default configurations (features[0] != 0)
+  auto *config = (const mp_config_header *)mem_map_firmware(floating->config_address, sizeof(mp_config_header));
+  config = (const mp_config_header *)mem_map_firmware(floating->config_address, config->length);
+
+  if (memcmp(config->signature, "PCMP", 4) || !valid_checksum(config, config->length))
+    return false;
+
+  *lapic_address = config->lapic_address;
+  const uint8_t *entry = (const uint8_t *)(config + 1);
+
+  for (int i = 0; i < config->entry_count; ++i) {
+    if (*entry == MP_ENTRY_PROCESSOR) {
+      auto *processor = (const mp_processor_entry *)entry;
+      if (processor->flags & MP_PROCESSOR_ENABLED)
+        found_cpu(processor->apic_id);
+
+      entry += sizeof(mp_processor_entry);
+    }
+    else {
+      // All other entry types are 8 bytes
+      entry += 8;
+    }
+  }
+
+  log(smp, "found %d cpus in the mp tables", found_count);
+  return found_count > 0;
+}
+
+static bool overlaps(uintptr_t start, uintptr_t end, uintptr_t other_start, uintptr_t other_end)
+{
+  return start < other_end && end > other_start;
+}
+
+//
+// find_trampoline_page - a page in conventional memory that doesn't
+// contain anything we need later, like the multiboot information
+// which is read by init
+//
+static p2::opt<uintptr_t> find_trampoline_page()
+{
+  const uintptr_t candidates[] = {0x8000, 0x70000, 0x7000};
+  const multiboot_info *mbhdr = multiboot_header;
+  const multiboot_mod *mods = (const multiboot_mod *)PHYS2KERNVIRT(mbhdr->mods_addr);
+  const uintptr_t header_phys = KERNVIRT2PHYS((uintptr_t)mbhdr);
+
+  for (uintptr_t page : candidates) {
+    const uintptr_t page_end = page + 0x1000;
+    bool in_use = overlaps(page, page_end, header_phys, header_phys + sizeof(*mbhdr)) ||
+      overlaps(page, page_end, mbhdr->mods_addr, mbhdr->mods_addr + sizeof(multiboot_mod) * mbhdr->mods_count) ||
+      overlaps(page, page_end, mbhdr->mmap_addr, mbhdr->mmap_addr + mbhdr->mmap_length);
+
+    for (size_t i = 0; i < mbhdr->mods_count && !in_use; ++i) {
+      const char *name = (const char *)PHYS2KERNVIRT(mods[i].string_addr);
+      in_use = overlaps(page, page_end, mods[i].mod_start, mods[i].mod_end) ||
+        overlaps(page, page_end, mods[i].string_addr, mods[i].string_addr + strlen(name) + 1);
+    }
+
+    if (!in_use)
+      return page;
+  }
+
+  return {};
+}
@@ -0,0 +1,59 @@
+// -*- c++ -*-
+//
+// Symmetric multiprocessing: finds the CPUs using the ACPI MADT (or
+// the older MP tables), starts the application processors and
+// provides the big kernel lock.
+//
+// All kernel code runs with the kernel lock held. It's taken by the
+// interrupt entry stubs and released when returning to user space,
+// so the single-CPU assumption of "IF=0 means exclusive access" holds
+// across all CPUs. Kernel threads running with IF=1 take it through
+// `interrupt_guard`.
+//
+
+#ifndef PEOS2_SMP_H
+#define PEOS2_SMP_H
+
+#include <stdint.h>
+
+#include "protected_mode.h"
+
+#define SMP_MAX_CPUS 8
+
+void smp_init();
+void smp_start_aps();
+int  smp_cpu_count();
+bool smp_cpu_online(int cpu);
+void smp_set_timer_frequency(int hz);
+
+//
+// smp_cpu_index - the executing CPU, where 0 is the BSP. Each CPU
+// has loaded its own TSS descriptor, so the task register tells us
+// without touching memory.
+//
+inline int smp_cpu_index()
+{
+  uint16_t selector;
+  asm volatile("str %0" : "=r"(selector));
+  return selector ? (selector >> 3) - TSS_GDT_INDEX : 0;
+}
+
+//
+// smp_tlb_shootdown - invalidates @virt_address on the CPUs in
+// @cpu_mask and waits until they're done
+//
+void smp_tlb_shootdown(uint32_t cpu_mask, uintptr_t virt_address);
+
+// Big kernel lock, recursive per CPU
+extern "C" void kernel_lock_acquire();
+extern "C" void kernel_lock_release();
+int             kernel_lock_depth();
+void            kernel_lock_set_depth(int depth);
+
+//
+// kernel_lock_relax - lets other CPUs into the kernel for a moment.
+// Used when waiting for another CPU to make progress.
+//
+void            kernel_lock_relax();
+
+#endif // !PEOS2_SMP_H
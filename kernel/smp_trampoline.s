@@ -0,0 +1,89 @@
+//
+// Application processor entry. Copied to a page below 1 MB by
+// `smp_start_aps` and started with a STARTUP IPI, so the CPU begins
+// in real mode with CS = page number << 8 and IP = 0. Everything is
+// addressed relative to the start of the copy.
+//
+// The BSP fills in cr3, stack and entry before each start.
+//
+
+.set TRAMPOLINE_CODE_SEL, 0x08
+.set TRAMPOLINE_DATA_SEL, 0x10
+
+.section .text
+.code16
+.global smp_trampoline_start
+smp_trampoline_start:
+        cli
+        cld
+        mov %cs, %ax
+        mov %ax, %ds
+
+        // EBX = linear address of the trampoline, kept across the
+        // switch to protected mode
+        xor %ebx, %ebx
+        mov %cs, %bx
+        shl $4, %ebx
+
+        // Patch the absolute addresses now that we know where we are
+        lea (trampoline_gdt - smp_trampoline_start)(%ebx), %eax
+        mov %eax, (trampoline_gdtr - smp_trampoline_start + 2)
+        lea (trampoline_32 - smp_trampoline_start)(%ebx), %eax
+        mov %eax, (trampoline_far_ptr - smp_trampoline_start)
+
+        lgdtl (trampoline_gdtr - smp_trampoline_start)
+
+        mov %cr0, %eax
+        or $1, %eax
+        mov %eax, %cr0
+
+        ljmpl *(trampoline_far_ptr - smp_trampoline_start)
+
+.code32
+trampoline_32:
+        mov $TRAMPOLINE_DATA_SEL, %ax
+        mov %ax, %ds
+        mov %ax, %es
+        mov %ax, %fs
+        mov %ax, %gs
+        mov %ax, %ss
+
+        // Same paging setup as the BSP (see `map_high_mem`). The
+        // trampoline page is identity mapped in the space for now.
+        mov (smp_trampoline_cr3 - smp_trampoline_start)(%ebx), %eax
+        mov %eax, %cr3
+        mov %cr0, %eax
+        or $0x80010000, %eax
+        mov %eax, %cr0
+
+        mov (smp_trampoline_stack - smp_trampoline_start)(%ebx), %esp
+        mov (smp_trampoline_entry - smp_trampoline_start)(%ebx), %eax
+        jmp *%eax
+
+        .align 8
+trampoline_gdt:
+        .quad 0x0000000000000000
+        .quad 0x00CF9A000000FFFF  // Flat code, same as KERNEL_CODE_SEL
+        .quad 0x00CF92000000FFFF  // Flat data, same as KERNEL_DATA_SEL
+
+trampoline_gdtr:
+        .word 3 * 8 - 1
+        .long 0
+
+trampoline_far_ptr:
+        .long 0
+        .word TRAMPOLINE_CODE_SEL
+
+        .align 4
+.global smp_trampoline_cr3
+smp_trampoline_cr3:
+        .long 0
+.global smp_trampoline_stack
+smp_trampoline_stack:
+        .long 0
+.global smp_trampoline_entry
+smp_trampoline_entry:
+        .long 0
+
+.global smp_trampoline_end
+smp_trampoline_end:
@@ -11,6 +11,7 @@
 
 #include "process.h"
 #include "locks.h"
+#include "filesystem.h"
 #include "support/queue.h"
 #include "debug.h"
 
@@ -42,6 +43,7 @@ namespace p2 {
       // As a single consumer might not read everything we've written,
       // we're notifying all of them
       _pushed_data_signal.notify_all();
+      vfs_poll_notify();
       return bytes_written;
     }
 
@@ -88,6 +90,12 @@ namespace p2 {
       return _queue.full();
     }
 
+    // Bytes that can be read without blocking
+    size_t size() const
+    {
+      return _queue.size();
+    }
+
   private:
     p2::queue<char, _MaxLen> _queue;
     condition_variable<16> _pushed_data_signal;
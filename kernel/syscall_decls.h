@@ -24,16 +24,32 @@
 #define SYSCALL_NUM_TELL        107
 #define SYSCALL_NUM_MKDIR       108
 #define SYSCALL_NUM_DUP2        109
+#define SYSCALL_NUM_RING_SETUP  110
+#define SYSCALL_NUM_RING_ENTER  111
+#define SYSCALL_NUM_POLL        112
+#define SYSCALL_NUM_READV       113
+#define SYSCALL_NUM_WRITEV      114
+#define SYSCALL_NUM_READDIR     115
+#define SYSCALL_NUM_SENDFILE    116
+#define SYSCALL_NUM_FADVISE     117
+#define SYSCALL_NUM_PIPE        118
 
 #define SYSCALL_NUM_YIELD       200
 #define SYSCALL_NUM_EXIT        201
 #define SYSCALL_NUM_KILL        202
+#define SYSCALL_NUM_SPAWN       203
 #define SYSCALL_NUM_EXEC        204
 #define SYSCALL_NUM_FORK        205
 #define SYSCALL_NUM_SHUTDOWN    206
 #define SYSCALL_NUM_WAIT        207
 #define SYSCALL_NUM_SET_TIMEOUT 208
 #define SYSCALL_NUM_GET_TIMEOUT 209
+#define SYSCALL_NUM_SCHED_STATS 210
+#define SYSCALL_NUM_FUTEX_WAIT  211
+#define SYSCALL_NUM_FUTEX_WAKE  212
+#define SYSCALL_NUM_THREAD_CREATE 213
+#define SYSCALL_NUM_THREAD_JOIN 214
+#define SYSCALL_NUM_SET_PRIORITY 215
 
 #define SYSCALL_NUM_MMAP        300
 
@@ -45,11 +61,23 @@
 #define OPEN_READ             0x01
 #define OPEN_READWRITE        0x02
 #define OPEN_CREATE           0x04
+#define OPEN_TRUNCATE         0x08  // Empty the file, if the filesystem supports writing
 #define OPEN_RETAIN_EXEC      0x10  // Keep the fd open after `exec`
 
 #define SEEK_CUR              1
 #define SEEK_BEG              2
 
+#define POLL_IN               0x01  // Reading won't block
+#define POLL_OUT              0x04  // Writing won't block
+#define POLL_NVAL             0x20  // Not an open fd, only set in `revents`
+
+#define IOV_MAX               16    // Max number of iovecs per readv/writev
+
+#define FADV_NORMAL           0     // No expectations, adapt to how it's read
+#define FADV_SEQUENTIAL       1     // Read ahead as far as possible
+#define FADV_RANDOM           2     // Don't read ahead
+#define FADV_WILLNEED         3     // Start reading the range in the background
+
 // Errors
 #define ENOSUPPORT   -100  // Invalid operation/not supported
 #define ENOENT       -200  // Some component of the given path is missing
@@ -60,11 +88,25 @@
 #define EINVVAL      -205  // Invalid value
 #define EBUSY        -206  // Resource busy
 #define ETIMEOUT     -207  // Timed out
+#define EIO          -208  // The device reported an error
+#define EPIPE        -209  // Nobody is reading the other end
 
 // Control numbers
 #define CTRL_NET_HW_ADDR          0x0010      // uint8[6]
 #define CTRL_RAMFS_SET_FILE_RANGE 0x0100      // (start_addr, size)
+#define CTRL_RAMFS_TRUNCATE       0x0101      // (size)
 #define CTRL_RAMFS_GET_FILE_RANGE 0x0200      // (*start_addr, *size)
+#define CTRL_PROF_START           0x0300      // (hz or 0 for the default)
+#define CTRL_PROF_STOP            0x0301
+#define CTRL_TRACE_START          0x0400
+#define CTRL_TRACE_STOP           0x0401
+#define CTRL_BLOCK_SYNC           0x0500      // Write back dirty blocks
+#define CTRL_BLOCK_DROP_CACHE     0x0501      // Sync, then forget cached blocks
+#define CTRL_LOOPBACK_WAKE_POLICY 0x0600      // (WAKE_POLICY_*), global, for benchmarks
+
+// Loopback wake policies
+#define WAKE_POLICY_DEFERRED        0         // Woken processes run when scheduled
+#define WAKE_POLICY_PREEMPT_HIGHER  1         // Switch to woken processes of higher priority
 
 
 // System definitions
@@ -81,7 +123,170 @@ SYSCALL_DEF2(tell,        SYSCALL_NUM_TELL, int, int *);
 SYSCALL_DEF1(mkdir,       SYSCALL_NUM_MKDIR, const char *);
 SYSCALL_DEF2(dup2,        SYSCALL_NUM_DUP2, int, int);
 
+typedef struct {
+  int      fd;
+  uint16_t events;            // POLL_* to wait for
+  uint16_t revents;           // Set to the ready subset of `events`
+} pollfd_t;
+
+//
+// poll - waits until at least one of the @count fds in @fds is ready
+// for its `events`, or @timeout ms have passed (-1 to wait forever).
+// Returns the number of entries with non-zero `revents`, 0 on timeout.
+//
+SYSCALL_DEF3(poll,        SYSCALL_NUM_POLL, pollfd_t *, int, int);
+
+typedef struct {
+  void     *base;
+  uint32_t length;
+} iovec_t;
+
+//
+// readv, writev - like read and write but scatter to or gather from
+// @count (at most IOV_MAX) buffers in one call. Drivers that can take
+// the whole vector at once do so, otherwise the buffers are processed
+// in order until one of them is transferred short. readv only blocks
+// before the first byte.
+//
+SYSCALL_DEF3(readv,       SYSCALL_NUM_READV, int, const iovec_t *, int);
+SYSCALL_DEF3(writev,      SYSCALL_NUM_WRITEV, int, const iovec_t *, int);
+
+typedef struct {
+  char name[64];
+} dirent_t;
+
+//
+// readdir - fills up to @count entries of the directory opened as @fd,
+// continuing after the ones returned by the previous call. Returns the
+// number of entries filled in, 0 at the end of the directory.
+// ENOSUPPORT for filesystems that only list directories through read,
+// EINVVAL if @count entries don't fit in the address space.
+//
+SYSCALL_DEF3(readdir,     SYSCALL_NUM_READDIR, int, dirent_t *, int);
+
+//
+// sendfile - copies up to @count bytes from @in_fd to @out_fd without
+// passing them through userspace. Reads from *@offset and updates it
+// if @offset is set, leaving the position of @in_fd as it was,
+// otherwise reads from and advances the position. Returns the number
+// of bytes written to @out_fd, 0 at the end of @in_fd.
+//
+SYSCALL_DEF4(sendfile,    SYSCALL_NUM_SENDFILE, int, int, int *, int);
+
+//
+// fadvise - tells how @fd is going to be read, FADV_*. FADV_WILLNEED
+// applies to @length bytes at @offset, or the rest of the file if
+// @length is 0, the others to the whole file. It's only a hint:
+// filesystems that have no use for it ignore it and return 0.
+//
+SYSCALL_DEF4(fadvise,     SYSCALL_NUM_FADVISE, int, int, int, int);
+
+//
+// pipe - creates a pipe and sets @fds[0] to its read end and @fds[1]
+// to its write end. Reads block while it's empty and return 0 once
+// every write end is closed. Writes block until everything is written
+// and fail with EPIPE once every read end is closed. Writes of up to
+// a page are never interleaved with other writes.
+//
+// Reads of whole pages into page aligned buffers take the pipe's pages
+// instead of copying them.
+//
+SYSCALL_DEF1(pipe,        SYSCALL_NUM_PIPE, int *);
+
+//
+// Submission and completion rings, for doing many operations with a
+// single syscall. Userspace owns the memory of both rings; it appends
+// entries to the submission ring and bumps `sq_tail`, the kernel
+// consumes them during `ring_enter` and appends a completion for each.
+//
+#define RING_OP_NOP      0
+#define RING_OP_READ     1  // read(fd, addr, length)
+#define RING_OP_WRITE    2  // write(fd, addr, length)
+#define RING_OP_CONTROL  3  // control(fd, function, addr, length)
+#define RING_OP_TIMEOUT  4  // Completes after `length` ms with the elapsed ms
+#define RING_OP_READV    5  // readv(fd, addr, length)
+#define RING_OP_WRITEV   6  // writev(fd, addr, length)
+
+#define RING_MAX_ENTRIES 4096
+
+typedef struct {
+  uint8_t  opcode;
+  uint8_t  reserved[3];
+  int      fd;
+  uint32_t addr;
+  uint32_t length;
+  uint32_t function;
+  uint32_t user_data;         // Copied to the completion
+} ring_sqe_t;
+
+typedef struct {
+  uint32_t user_data;
+  int      result;            // What the corresponding syscall would return
+} ring_cqe_t;
+
+typedef struct {
+  volatile uint32_t sq_head;  // Written by the kernel
+  volatile uint32_t sq_tail;  // Written by userspace
+  volatile uint32_t cq_head;  // Written by userspace
+  volatile uint32_t cq_tail;  // Written by the kernel
+  uint32_t    entries;        // Size of both rings, a power of two up to RING_MAX_ENTRIES
+  ring_sqe_t *sqes;
+  ring_cqe_t *cqes;
+} ring_t;
+
+//
+// ring_setup - registers @ring with the kernel. Returns a ring id for
+// `ring_enter`. The ring belongs to the calling thread and is released
+// when it exits or calls `exec`.
+//
+SYSCALL_DEF1(ring_setup,  SYSCALL_NUM_RING_SETUP, ring_t *);
+
+//
+// ring_enter - consumes up to @to_submit submissions and then waits
+// until at least @min_complete of the operations have completed.
+//
+// Writes and controls complete immediately. Reads and timeouts are
+// kept until they complete; reads complete when their fds become
+// readable (see `poll`), in submission order per fd. The iovecs of
+// vectored operations are read when the operation is carried out.
+// Returns the number of submissions consumed.
+//
+SYSCALL_DEF3(ring_enter,  SYSCALL_NUM_RING_ENTER, int, uint32_t, uint32_t);
+
+//
+// Trace records, read from /dev/trace. Timestamps are TSC cycles; a
+// TRACE_CLOCK record is written when tracing starts and stops so the
+// cycles can be converted to time.
+//
+#define TRACE_CLOCK            0  // ms since boot, low and high half
+#define TRACE_SCHED_SWITCH     1  // previous pid, next pid
+#define TRACE_SCHED_WAKE       2  // woken pid
+#define TRACE_SCHED_BLOCK      3  // blocking pid, timeout
+#define TRACE_MEM_FAULT        4  // address, error code
+#define TRACE_MEM_MAP          5  // virtual address, physical address
+#define TRACE_SYSCALL_ENTER    6  // syscall number
+#define TRACE_SYSCALL_EXIT     7  // syscall number, return value
+#define TRACE_IRQ              8  // irq
+#define TRACE_NET_RX           9  // frame length
+#define TRACE_NET_TX          10  // frame length
+
+typedef struct {
+  uint64_t tsc;
+  uint16_t event;             // TRACE_*
+  uint8_t  cpu;
+  uint8_t  reserved;
+  uint16_t pid;               // 0xFFFF if no process is running
+  uint16_t reserved2;
+  uint32_t arg0, arg1;
+} trace_record_t;
+
 // Process definitions
+typedef struct {
+  uint32_t context_switches;  // Switches between two different processes
+  uint32_t wakeups;           // Blocked processes made runnable
+  uint32_t preemptions;       // Wakeups that switched to the woken process
+} sched_stats_t;
+
 SYSCALL_DEF0(yield,       SYSCALL_NUM_YIELD);
 SYSCALL_DEF1(exit,        SYSCALL_NUM_EXIT, int);
 SYSCALL_DEF0(fork,        SYSCALL_NUM_FORK);
@@ -89,6 +294,52 @@ SYSCALL_DEF0(shutdown,    SYSCALL_NUM_SHUTDOWN);
 SYSCALL_DEF1(wait,        SYSCALL_NUM_WAIT, int);
 SYSCALL_DEF1(set_timeout, SYSCALL_NUM_SET_TIMEOUT, int);
 SYSCALL_DEF0(get_timeout, SYSCALL_NUM_GET_TIMEOUT);
+SYSCALL_DEF1(sched_stats, SYSCALL_NUM_SCHED_STATS, sched_stats_t *);
+
+//
+// set_priority - sets the priority of the calling thread. Runnable
+// threads of PRIORITY_RAISED are picked before PRIORITY_NORMAL, but
+// never before the kernel's workers.
+//
+#define PRIORITY_NORMAL 0
+#define PRIORITY_RAISED 1
+SYSCALL_DEF1(set_priority, SYSCALL_NUM_SET_PRIORITY, int);
+
+//
+// thread_create - starts a thread sharing address space and files with
+// the caller. It gets its own user and kernel stack and starts in
+// @start(@fun, @arg), which must end with `exit` as it has nowhere to
+// return to. Returns the thread id, or ENOSPACE when the process has
+// too many threads or the system too many processes.
+//
+// `exit` in the main thread ends the whole process, in other threads
+// only the calling thread.
+//
+typedef void (*thread_start_fun)(void *, void *);
+SYSCALL_DEF3(thread_create, SYSCALL_NUM_THREAD_CREATE, thread_start_fun, void *, void *);
+
+//
+// thread_join - waits for a thread of the same process to exit and
+// returns its exit status
+//
+SYSCALL_DEF1(thread_join, SYSCALL_NUM_THREAD_JOIN, int);
+
+//
+// futex_wait - blocks until woken by `futex_wake` on the same word
+// @addr: 4 byte aligned word, keyed on its physical address
+// @expected: only block if *addr still contains this value
+// @timeout: ms to wait before giving up with ETIMEOUT, -1 to wait forever
+//
+// Returns EBUSY immediately if *addr != @expected, which means that
+// the value changed before we could go to sleep.
+//
+SYSCALL_DEF3(futex_wait,  SYSCALL_NUM_FUTEX_WAIT, volatile uint32_t *, uint32_t, int);
+
+//
+// futex_wake - wakes up to @count waiters on @addr, oldest first.
+// Returns the number of woken waiters.
+//
+SYSCALL_DEF2(futex_wake,  SYSCALL_NUM_FUTEX_WAKE, volatile uint32_t *, int);
 
 //
 // exec - rewrites the current process so that it'll run `filename`
@@ -105,15 +356,23 @@ SYSCALL_DEF0(get_timeout, SYSCALL_NUM_GET_TIMEOUT);
 //
 SYSCALL_DEF2(exec, SYSCALL_NUM_EXEC, const char *, const char **);
 
+//
+// spawn - starts `filename` in a new process without copying the caller
+// @filename: path to an ELF executable
+// @argv: null-terminated list of pointers to arguments
+// @fd_map: caller's fd to install as fd N in the child, or -1 for none
+// @fd_count: number of entries in @fd_map, at most 4096
+//
+// Other file descriptors aren't inherited. Returns the pid of the new
+// process, which can be waited for like a forked child, or ENOSPACE
+// when there are too many processes.
+//
+SYSCALL_DEF4(spawn, SYSCALL_NUM_SPAWN, const char *, const char **, const int *, int);
+
 
 // Memory definitions
 SYSCALL_DEF5(mmap,    SYSCALL_NUM_MMAP, void *, void *, int, uint32_t, uint8_t);
 
 SYSCALL_DEF1(currenttime, SYSCALL_NUM_CURRENTTIME, uint64_t *);
 
-// Structs
-typedef struct {
-  char name[64];
-} dirent_t;
-
 #endif // !PEOS2_SYSCALL_DECLS_H
@@ -34,6 +34,16 @@ static inline bool valid_buffer(const void *address, size_t length)
   return *start_area == *end_area;
 }
 
+static inline bool valid_iovec(const iovec_t *iov, int count)
+{
+  for (int i = 0; i < count; ++i) {
+    if (!valid_buffer(iov[i].base, iov[i].length))
+      return false;
+  }
+
+  return true;
+}
+
 #define verify_ptr(module, address)                                                           \
   if (!valid_pointer((address))) {                                                            \
     dbg_puts(module, "parameter '" TOSTRING(address) "' (%p) invalid", (uintptr_t)(address)); \
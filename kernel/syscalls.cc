@@ -4,6 +4,8 @@
 #include "screen.h"
 #include "debug.h"
 #include "syscall_utils.h"
+#include "process.h"
+#include "trace.h"
 
 #include "support/format.h"
 #include "support/utils.h"
@@ -34,7 +36,12 @@ extern "C" void int_syscall(volatile isr_registers *regs)
 
   syscall_fun handler = (syscall_fun)syscalls[syscall_num];
   assert(handler);
+
+  tracepoint(TRACE_SYSCALL_ENTER, syscall_num, 0);
+  proc_account_syscall_enter();
   regs->eax = handler(regs->ebx, regs->ecx, regs->edx, regs->esi, regs->edi, regs);
+  proc_account_syscall_exit(syscall_num);
+  tracepoint(TRACE_SYSCALL_EXIT, syscall_num, regs->eax);
 }
 
 void syscall_register(int num, syscall_fun handler)
@@ -83,6 +90,10 @@ static int syscall_strerror(int code, char *buf, int len)
     message = "Resource busy";
     break;
 
+  case EPIPE:
+    message = "Nobody is reading the other end";
+    break;
+
   default:
     return -1;
   }
@@ -0,0 +1,515 @@
+#include "tarfs.h"
+#include "filesystem.h"
+#include "blockdev.h"
+#include "multiboot.h"
+#include "memareas.h"
+#include "memory.h"
+#include "timer.h"
+#include "dcache.h"
+#include "tar.h"
+#include "debug.h"
+
+#include "support/slab.h"
+#include "support/utils.h"
+
+// Declarations
+#define TARFS_MAX_ARCHIVES 2
+#define TARFS_MAX_ENTRIES  1024
+#define TARFS_HASH_SLOTS   2048    // Power of two
+#define TARFS_NONE         0xFFFF
+
+#define TARFS_FILE         1
+#define TARFS_DIRECTORY    2
+
+//
+// tarfs_entry - a member of the archive, or a directory that's only
+// implied by the paths of other members. Paths are relative to the
+// root and aren't terminated. They point into the headers of archives
+// in memory, and into copies for archives on block devices.
+//
+struct tarfs_entry {
+  const char *path;
+  uint16_t path_length;
+  uint8_t type;
+  uint32_t hash;
+  uint32_t offset;  // Of the data, from the start of the archive
+  uint32_t size;
+  uint16_t first_child, next_sibling;
+  uint16_t next_in_slot;  // Chain of entries with the same hash slot
+};
+
+//
+// tarfs_archive - one mounted archive, either in memory or on a block
+// device
+//
+struct tarfs_archive {
+  const char *memory;
+  block_device *device;
+  uint32_t size;
+  bool indexed;
+
+  tarfs_entry entries[TARFS_MAX_ENTRIES];
+  uint16_t entry_count;
+  uint16_t slots[TARFS_HASH_SLOTS];
+
+  char *names;  // Page that copied paths are appended to
+  uint32_t names_used;
+};
+
+struct tarfs_opened_file {
+  tarfs_opened_file(tarfs_archive *archive, uint16_t entry, uint16_t cursor)
+    : archive(archive), entry(entry), position(0), cursor(cursor)
+  {
+    const tarfs_entry &member = archive->entries[entry];
+    readahead = {member.offset, member.offset + member.size, 0, 0, FADV_NORMAL};
+  }
+
+  tarfs_archive *archive;
+  uint16_t entry;
+  uint32_t position;
+  uint16_t cursor;  // Child at `position` when reading a directory
+  bdev_readahead readahead;  // For archives on block devices
+};
+
+static int read(int handle, char *data, int length);
+static int readdir(int handle, dirent_t *entries, int count);
+static int open(vfs_device *device, const char *path, uint32_t flags);
+static int close(int handle);
+static int seek(int handle, int offset, int relative);
+static int tell(int handle, int *position);
+static int frame(int handle, uint32_t offset, uintptr_t *phys_address);
+static int view(int handle, const char **data);
+static int advise(int handle, uint32_t offset, uint32_t length, int advice);
+
+// Global state
+static tarfs_archive archives[TARFS_MAX_ARCHIVES];
+static int archive_count = 0;
+
+static p2::slab_pool<tarfs_opened_file, 16> opened_files(mem_alloc_kernel_page);
+
+// Definitions
+static void mount(const char *name, const char *memory, block_device *device, uint32_t size)
+{
+  static vfs_device_driver interface = {
+    .write = nullptr,
+    .read = read,
+    .open = open,
+    .close = close,
+    .control = nullptr,
+    .seek = seek,
+    .tell = tell,
+    .mkdir = nullptr,
+    .poll = nullptr,
+    .readv = nullptr,
+    .writev = nullptr,
+    .readdir = readdir,
+    .frame = frame,
+    .view = view,
+    .advise = advise
+  };
+
+  assert(archive_count < TARFS_MAX_ARCHIVES);
+  tarfs_archive &archive = archives[archive_count++];
+  archive.memory = memory;
+  archive.device = device;
+  archive.size = size;
+
+  vfs_node_handle mountpoint = vfs_create_node(VFS_FILESYSTEM);
+  vfs_set_driver(mountpoint, &interface, &archive);
+  vfs_add_dirent(vfs_lookup("/"), name, mountpoint);
+}
+
+void tarfs_init()
+{
+  const multiboot_mod *modules = (const multiboot_mod *)PHYS2KERNVIRT(multiboot_header->mods_addr);
+  bool found = false;
+
+  for (uint32_t i = 0; i < multiboot_header->mods_count && !found; ++i) {
+    if (strncmp((const char *)PHYS2KERNVIRT(modules[i].string_addr), "init.tar", 9) == 0) {
+      mount("initrd", (const char *)PHYS2KERNVIRT(modules[i].mod_start), nullptr, modules[i].mod_end - modules[i].mod_start);
+      found = true;
+    }
+  }
+
+  if (!found) {
+    log(tarfs, "no init.tar module, not mounting /initrd");
+  }
+
+  // Whatever is on the disk is only looked at when /disk is first used
+  if (block_device *disk = bdev_find("hda"))
+    mount("disk", nullptr, disk, p2::min<uint64_t>((uint64_t)disk->block_count * BLOCK_SIZE, 0xFFFFFFFF));
+}
+
+static uint16_t find_entry(const tarfs_archive &archive, const dcache_name &name)
+{
+  for (uint16_t idx = archive.slots[name.hash & (TARFS_HASH_SLOTS - 1)]; idx != TARFS_NONE; idx = archive.entries[idx].next_in_slot) {
+    const tarfs_entry &entry = archive.entries[idx];
+
+    if (entry.hash == name.hash && entry.path_length == name.length && strncmp(entry.path, name.data, name.length) == 0)
+      return idx;
+  }
+
+  return TARFS_NONE;
+}
+
+//
+// add_entry - adds @path to the index and to its parent directory,
+// adding the parent first if the archive didn't have it. Returns the
+// entry, which already existed if the path was added before.
+//
+static uint16_t add_entry(tarfs_archive &archive, const char *path, size_t length, uint8_t type)
+{
+  const dcache_name name(path, length);
+
+  if (uint16_t existing = find_entry(archive, name); existing != TARFS_NONE)
+    return existing;
+
+  if (archive.entry_count == TARFS_MAX_ENTRIES)
+    return TARFS_NONE;
+
+  uint16_t parent = TARFS_NONE;
+
+  if (length > 0) {
+    size_t parent_length = length;
+
+    while (parent_length > 0 && path[parent_length - 1] != '/')
+      --parent_length;
+
+    parent = add_entry(archive, path, parent_length > 0 ? parent_length - 1 : 0, TARFS_DIRECTORY);
+
+    if (parent == TARFS_NONE || archive.entries[parent].type != TARFS_DIRECTORY || archive.entry_count == TARFS_MAX_ENTRIES)
+      return TARFS_NONE;
+  }
+
+  const uint16_t idx = archive.entry_count++;
+  tarfs_entry &entry = archive.entries[idx];
+  entry = {path, (uint16_t)length, type, name.hash, 0, 0, TARFS_NONE, TARFS_NONE, TARFS_NONE};
+
+  uint16_t &slot = archive.slots[name.hash & (TARFS_HASH_SLOTS - 1)];
+  entry.next_in_slot = slot;
+  slot = idx;
+
+  if (parent != TARFS_NONE) {
+    entry.next_sibling = archive.entries[parent].first_child;
+    archive.entries[parent].first_child = idx;
+  }
+
+  return idx;
+}
+
+//
+// normalize - strips leading "./" and slashes and trailing slashes
+// from the first @length characters of @path
+//
+static const char *normalize(const char *path, size_t *length)
+{
+  while (*length > 0 && (path[0] == '/' || (path[0] == '.' && *length > 1 && path[1] == '/'))) {
+    const size_t skip = path[0] == '/' ? 1 : 2;
+    path += skip;
+    *length -= skip;
+  }
+
+  while (*length > 0 && path[*length - 1] == '/')
+    --*length;
+
+  return path;
+}
+
+//
+// keep_path - @path itself for archives in memory. Headers read from
+// block devices are gone after indexing, so their paths are copied.
+//
+static const char *keep_path(tarfs_archive &archive, const char *path, size_t length)
+{
+  if (archive.memory)
+    return path;
+
+  if (!archive.names || archive.names_used + length > 0x1000) {
+    archive.names = (char *)mem_alloc_kernel_page();
+    archive.names_used = 0;
+
+    if (!archive.names)
+      return nullptr;
+  }
+
+  char *copy = archive.names + archive.names_used;
+  memcpy(copy, path, length);
+  archive.names_used += length;
+  return copy;
+}
+
+static const tar_entry *read_header(const tarfs_archive &archive, uint32_t offset, tar_entry *buffer)
+{
+  if (archive.memory)
+    return (const tar_entry *)(archive.memory + offset);
+
+  if (bdev_read(archive.device, offset, (char *)buffer, sizeof(*buffer), nullptr) != sizeof(*buffer))
+    return nullptr;
+
+  return buffer;
+}
+
+//
+// build_index - walks the headers once. Called on the first lookup, so
+// an archive that's never used costs nothing at boot.
+//
+static void build_index(tarfs_archive &archive)
+{
+  const uint64_t start_time = timer_current_time();
+
+  for (auto &slot : archive.slots)
+    slot = TARFS_NONE;
+
+  add_entry(archive, "", 0, TARFS_DIRECTORY);
+  archive.indexed = true;
+
+  uint32_t offset = 0;
+
+  while (offset + sizeof(tar_entry) <= archive.size) {
+    tar_entry buffer;
+    const tar_entry *hdr = read_header(archive, offset, &buffer);
+
+    // NUL blocks end the archive
+    if (!hdr || hdr->name[0] == '\0')
+      break;
+
+    if (strncmp(hdr->magic, "ustar", 5) != 0) {
+      log(tarfs, "bad header at offset %d, ignoring the rest", offset);
+      break;
+    }
+
+    const uint32_t size = tar_parse_octal(hdr->size, sizeof(hdr->size));
+    const uint32_t data_offset = offset + sizeof(tar_entry);
+
+    if (size > archive.size - data_offset) {
+      log(tarfs, "truncated member at offset %d", offset);
+      break;
+    }
+
+    size_t length = 0;
+    while (length < sizeof(hdr->name) && hdr->name[length])
+      ++length;
+
+    const char *path = normalize(hdr->name, &length);
+
+    if (length > 0 && (hdr->type == '0' || hdr->type == '\0' || hdr->type == '5')) {
+      path = keep_path(archive, path, length);
+      uint16_t idx = path ? add_entry(archive, path, length, hdr->type == '5' ? TARFS_DIRECTORY : TARFS_FILE) : TARFS_NONE;
+
+      if (idx == TARFS_NONE) {
+        log(tarfs, "can't index %d bytes at offset %d", size, offset);
+      }
+      else if (archive.entries[idx].type == TARFS_FILE) {
+        archive.entries[idx].offset = data_offset;
+        archive.entries[idx].size = size;
+      }
+    }
+
+    offset = data_offset + ALIGN_UP(size, sizeof(tar_entry));
+  }
+
+  log(tarfs, "indexed %d entries in %d ms", archive.entry_count, (uint32_t)(timer_current_time() - start_time));
+}
+
+static uint16_t lookup(tarfs_archive &archive, const char *path)
+{
+  if (!archive.indexed)
+    build_index(archive);
+
+  size_t length = strlen(path);
+  path = normalize(path, &length);
+  return find_entry(archive, dcache_name(path, length));
+}
+
+static int open(vfs_device *device, const char *path, uint32_t flags)
+{
+  if (flags & (OPEN_CREATE|OPEN_TRUNCATE))
+    return ENOSUPPORT;
+
+  tarfs_archive *archive = (tarfs_archive *)vfs_get_opaque(device);
+  const uint16_t idx = lookup(*archive, path);
+
+  if (idx == TARFS_NONE)
+    return ENOENT;
+
+  uint16_t handle = opened_files.emplace_anywhere(archive, idx, archive->entries[idx].first_child);
+  return handle == opened_files.end_sentinel() ? ENOSPACE : handle;
+}
+
+static int close(int handle)
+{
+  opened_files.erase(handle);
+  return 0;
+}
+
+//
+// entry_name - the last segment of @entry's path
+//
+static const char *entry_name(const tarfs_entry &entry, size_t *length)
+{
+  size_t start = entry.path_length;
+
+  while (start > 0 && entry.path[start - 1] != '/')
+    --start;
+
+  *length = entry.path_length - start;
+  return entry.path + start;
+}
+
+static void fill_dirent(const tarfs_entry &entry, dirent_t *out)
+{
+  size_t length;
+  const char *name = entry_name(entry, &length);
+  length = p2::min(length, sizeof(out->name) - 1);
+
+  *out = {};
+  memcpy(out->name, name, length);
+}
+
+static int read_dir(tarfs_opened_file &fd, char *data, int length)
+{
+  const tarfs_entry *entries = fd.archive->entries;
+  int bytes_written = 0;
+
+  // `cursor` is the entry that `position` is in
+  while (fd.cursor != TARFS_NONE && length > 0) {
+    const tarfs_entry &entry = entries[fd.cursor];
+    int block_offset = fd.position % sizeof(dirent_t);
+    int copy_length = p2::min((int)sizeof(dirent_t) - block_offset, length);
+
+    dirent_t block;
+    fill_dirent(entry, &block);
+    memcpy(data, (char *)&block + block_offset, copy_length);
+
+    data += copy_length;
+    fd.position += copy_length;
+    length -= copy_length;
+    bytes_written += copy_length;
+
+    if (fd.position % sizeof(dirent_t) == 0)
+      fd.cursor = entry.next_sibling;
+  }
+
+  return bytes_written;
+}
+
+static int read(int handle, char *data, int length)
+{
+  tarfs_opened_file &fd = opened_files[handle];
+  const tarfs_archive &archive = *fd.archive;
+  const tarfs_entry &entry = archive.entries[fd.entry];
+
+  if (entry.type == TARFS_DIRECTORY)
+    return read_dir(fd, data, length);
+
+  int bytes_to_copy = p2::min(fd.position + length, entry.size) - fd.position;
+
+  if (archive.memory)
+    memcpy(data, archive.memory + entry.offset + fd.position, bytes_to_copy);
+  else if (bytes_to_copy = bdev_read(archive.device, entry.offset + fd.position, data, bytes_to_copy, &fd.readahead); bytes_to_copy < 0)
+    return bytes_to_copy;
+
+  fd.position += bytes_to_copy;
+  return bytes_to_copy;
+}
+
+static int readdir(int handle, dirent_t *out, int count)
+{
+  tarfs_opened_file &fd = opened_files[handle];
+  const tarfs_entry *entries = fd.archive->entries;
+
+  if (entries[fd.entry].type != TARFS_DIRECTORY)
+    return ENODIR;
+
+  if (fd.position % sizeof(dirent_t) != 0 && fd.cursor != TARFS_NONE) {
+    fd.cursor = entries[fd.cursor].next_sibling;
+    fd.position += sizeof(dirent_t) - fd.position % sizeof(dirent_t);
+  }
+
+  int filled = 0;
+
+  while (fd.cursor != TARFS_NONE && filled < count) {
+    fill_dirent(entries[fd.cursor], &out[filled++]);
+    fd.cursor = entries[fd.cursor].next_sibling;
+    fd.position += sizeof(dirent_t);
+  }
+
+  return filled;
+}
+
+static int seek(int handle, int offset, int relative)
+{
+  tarfs_opened_file &fd = opened_files[handle];
+  const tarfs_entry &entry = fd.archive->entries[fd.entry];
+
+  if (entry.type != TARFS_FILE)
+    return ENOSUPPORT;
+
+  int position = fd.position;
+
+  if (relative == SEEK_CUR)
+    position += offset;
+  else if (relative == SEEK_BEG)
+    position = offset;
+  else
+    return EINVVAL;
+
+  fd.position = p2::clamp<uint32_t>(p2::max(position, 0), 0u, entry.size);
+  return 0;
+}
+
+static int tell(int handle, int *position)
+{
+  *position = opened_files[handle].position;
+  return 0;
+}
+
+//
+// frame - members whose data happens to start on a page boundary can
+// be mapped without copying. Archives in memory are never freed, but
+// cached blocks of archives on disk are, so those are always copied.
+//
+static int frame(int handle, uint32_t offset, uintptr_t *phys_address)
+{
+  const tarfs_opened_file &fd = opened_files[handle];
+  const tarfs_entry &entry = fd.archive->entries[fd.entry];
+
+  if (!fd.archive->memory || entry.type != TARFS_FILE)
+    return ENOSUPPORT;
+
+  const uintptr_t address = (uintptr_t)fd.archive->memory + entry.offset + offset;
+
+  if ((address & 0xFFF) || offset >= entry.size || entry.size - offset < 0x1000)
+    return ENOSUPPORT;
+
+  *phys_address = KERNVIRT2PHYS(address);
+  return 0;
+}
+
+static int view(int handle, const char **data)
+{
+  const tarfs_opened_file &fd = opened_files[handle];
+  const tarfs_entry &entry = fd.archive->entries[fd.entry];
+
+  if (!fd.archive->memory || entry.type != TARFS_FILE)
+    return ENOSUPPORT;
+
+  *data = fd.archive->memory + entry.offset + fd.position;
+  return entry.size - fd.position;
+}
+
+//
+// advise - archives in memory have nothing to read ahead
+//
+static int advise(int handle, uint32_t offset, uint32_t length, int advice)
+{
+  tarfs_opened_file &fd = opened_files[handle];
+  const tarfs_entry &entry = fd.archive->entries[fd.entry];
+
+  if (fd.archive->memory || entry.type != TARFS_FILE)
+    return 0;
+
+  offset = p2::min(offset, entry.size);
+  length = p2::min(length, entry.size - offset);
+  return bdev_advise(fd.archive->device, &fd.readahead, entry.offset + offset, length, advice);
+}
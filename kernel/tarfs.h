@@ -0,0 +1,16 @@
+// -*- c++ -*-
+//
+// Tar archives as read-only filesystems: the init.tar module at
+// /initrd, and a tar written straight onto the first disk at /disk.
+// Nothing is unpacked: the first lookup walks the headers once and
+// builds a hashed index of paths. Reads, `sendfile` and mmaps of
+// /initrd are served straight from the archive's memory, /disk goes
+// through the buffer cache.
+//
+
+#ifndef PEOS2_TARFS_H
+#define PEOS2_TARFS_H
+
+void tarfs_init();
+
+#endif // !PEOS2_TARFS_H
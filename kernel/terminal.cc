@@ -13,6 +13,7 @@
 static int write(int handle, const char *data, int length);
 static int read(int handle, char *data, int length);
 static int open(vfs_device *device, const char *path, uint32_t flags);
+static uint32_t poll(int handle, uint32_t events);
 static void focus_terminal(uint16_t term_id);
 static void create_terminal(const char *name, screen_buffer buffer);
 
@@ -41,7 +42,14 @@ void create_terminal(const char *name, screen_buffer buffer)
     .control = nullptr,
     .seek = nullptr,
     .tell = nullptr,
-    .mkdir = nullptr
+    .mkdir = nullptr,
+    .poll = poll,
+    .readv = nullptr,
+    .writev = nullptr,
+    .readdir = nullptr,
+    .frame = nullptr,
+    .view = nullptr,
+    .advise = nullptr
   };
 
   uintptr_t term_id = terminals.emplace_anywhere(buffer);
@@ -59,9 +67,8 @@ void create_terminal(const char *name, screen_buffer buffer)
 
 void term_keypress(uint16_t keycode)
 {
-  // TODO: all this code happens in the interrupt handler for the
-  // keyboard. We probably don't want to do this much in there. It
-  // might for example copy the whole screen!
+  // Called from the worker thread with interrupts disabled, this can
+  // take a while as it might for example copy the whole screen
   uint8_t special_code = keycode >> 8;
   if (special_code >= 1 && special_code <= 12) {
     // F1..F12
@@ -77,6 +84,17 @@ static int write(int handle, const char *data, int length)
   return terminals[handle].syscall_write(data, length);
 }
 
+static uint32_t poll(int handle, uint32_t events)
+{
+  // Writing to the screen never blocks
+  uint32_t ready = events & POLL_OUT;
+
+  if ((events & POLL_IN) && terminals[handle].readable())
+    ready |= POLL_IN;
+
+  return ready;
+}
+
 static int read(int handle, char *data, int length)
 {
   return terminals[handle].syscall_read(data, length);
@@ -67,6 +67,12 @@ public:
     return _input_queue.pop_front(data, length);
   }
 
+  // Only complete lines can be read
+  bool readable() const
+  {
+    return _input_queue.size() > 0;
+  }
+
 private:
   screen_buffer _screen_buf;
   p2::string<200> _line_buffer;
@@ -6,6 +6,8 @@
 #include "debug.h"
 #include "syscalls.h"
 #include "syscall_utils.h"
+#include "profiler.h"
+#include "trace.h"
 
 // Externals
 extern "C" void isr_timer(isr_registers *);
@@ -22,9 +24,7 @@ void timer_init()
 {
   // For some reason, frequency = 10 doesn't work good at all, but 100
   // is quite accurate
-  int frequency = 100;
-  pit_set_phase(frequency);
-  milliseconds_per_tick = 1000 / frequency;
+  timer_set_frequency(TIMER_DEFAULT_HZ);
 
   irq_enable(IRQ_SYSTEM_TIMER);
   int_register(IRQ_BASE_INTERRUPT + IRQ_SYSTEM_TIMER, isr_timer, KERNEL_CODE_SEL, IDT_TYPE_INTERRUPT|IDT_TYPE_D|IDT_TYPE_P);
@@ -32,9 +32,11 @@ void timer_init()
   syscall_register(SYSCALL_NUM_CURRENTTIME, (syscall_fun)syscall_currenttime);
 }
 
-extern "C" void int_timer(isr_registers *)
+extern "C" void int_timer(isr_registers *regs)
 {
   irq_eoi(IRQ_SYSTEM_TIMER);
+  tracepoint(TRACE_IRQ, IRQ_SYSTEM_TIMER, 0);
+  prof_sample(regs);
   milliseconds_since_start += milliseconds_per_tick;
 
   for (auto &callback : tick_callbacks) {
@@ -42,11 +44,29 @@ extern "C" void int_timer(isr_registers *)
   }
 }
 
+//
+// timer_set_frequency - reprograms the PIT to @hz, which has to divide
+// 1000 as time is counted in whole milliseconds per tick
+//
+void timer_set_frequency(int hz)
+{
+  pit_set_phase(hz);
+  milliseconds_per_tick = 1000 / hz;
+}
+
 void timer_register_tick_callback(timer_callback callback)
 {
   tick_callbacks.emplace_anywhere(callback);
 }
 
+//
+// timer_current_time - milliseconds since boot
+//
+uint64_t timer_current_time()
+{
+  return milliseconds_since_start;
+}
+
 static int syscall_currenttime(uint64_t *time_out)
 {
   verify_ptr(timer, time_out);
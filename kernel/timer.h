@@ -2,9 +2,15 @@
 #ifndef PEOS2_TIMER_H
 #define PEOS2_TIMER_H
 
+#include <stdint.h>
+
+#define TIMER_DEFAULT_HZ 100
+
 typedef void (*timer_callback)(int milliseconds);
 
 void timer_init();
+void timer_set_frequency(int hz);
 void timer_register_tick_callback(timer_callback callback);
+uint64_t timer_current_time();
 
 #endif // !PEOS2_TIMER_H
@@ -0,0 +1,200 @@
+#include "trace.h"
+#include "filesystem.h"
+#include "process.h"
+#include "timer.h"
+#include "smp.h"
+#include "x86.h"
+#include "debug.h"
+
+#include "support/string.h"
+
+// Declarations
+#define TRACE_RING_SIZE 4096   // Power of two
+
+//
+// trace_slot - a record and its sequence number. The sequence tells
+// whose turn it is: it's the position of the next producer while the
+// slot is free and position + 1 once the record is written. Producers
+// claim positions with a CAS on `head`, so interrupts on any CPU can
+// write without a lock.
+//
+struct trace_slot {
+  volatile uint32_t sequence;
+  trace_record_t record;
+};
+
+static int read(int handle, char *data, int length);
+static int open(vfs_device *device, const char *path, uint32_t flags);
+static int control(int handle, uint32_t function, uint32_t param1, uint32_t param2);
+static uint32_t poll(int handle, uint32_t events);
+
+// Global state
+volatile bool trace_enabled = false;
+
+static trace_slot slots[TRACE_RING_SIZE];
+static volatile uint32_t head = 0, tail = 0;
+static volatile uint32_t dropped = 0;
+
+// Definitions
+void trace_init()
+{
+  for (uint32_t i = 0; i < TRACE_RING_SIZE; ++i)
+    slots[i].sequence = i;
+
+  static vfs_device_driver interface = {
+    .write = nullptr,
+    .read = read,
+    .open = open,
+    .close = nullptr,
+    .control = control,
+    .seek = nullptr,
+    .tell = nullptr,
+    .mkdir = nullptr,
+    .poll = poll,
+    .readv = nullptr,
+    .writev = nullptr,
+    .readdir = nullptr,
+    .frame = nullptr,
+    .view = nullptr,
+    .advise = nullptr
+  };
+
+  vfs_node_handle trace_driver = vfs_create_node(VFS_CHAR_DEVICE);
+  vfs_set_driver(trace_driver, &interface, nullptr);
+  vfs_add_dirent(vfs_lookup("/dev/"), "trace", trace_driver);
+}
+
+void trace_event(uint16_t event, uint32_t arg0, uint32_t arg1)
+{
+  uint32_t position = __atomic_load_n(&head, __ATOMIC_RELAXED);
+  trace_slot *slot;
+
+  while (true) {
+    slot = &slots[position & (TRACE_RING_SIZE - 1)];
+    int32_t diff = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - position;
+
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&head, &position, position + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+    else if (diff < 0) {
+      // The reader hasn't caught up
+      __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+      return;
+    }
+    else {
+      position = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    }
+  }
+
+  trace_record_t &record = slot->record;
+  record.tsc = rdtsc();
+  record.event = event;
+  record.cpu = smp_cpu_index();
+  record.reserved = 0;
+  record.pid = proc_current_pid().value_or(0xFFFF);
+  record.reserved2 = 0;
+  record.arg0 = arg0;
+  record.arg1 = arg1;
+
+  __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+}
+
+//
+// pop - copies the oldest written record to @record. Returns false if
+// there's none, or if the oldest is still being written.
+//
+static bool pop(trace_record_t *record)
+{
+  uint32_t position = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+
+  while (true) {
+    trace_slot &slot = slots[position & (TRACE_RING_SIZE - 1)];
+    int32_t diff = __atomic_load_n(&slot.sequence, __ATOMIC_ACQUIRE) - (position + 1);
+
+    if (diff < 0)
+      return false;
+
+    if (diff == 0 && __atomic_compare_exchange_n(&tail, &position, position + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      *record = slot.record;
+      __atomic_store_n(&slot.sequence, position + TRACE_RING_SIZE, __ATOMIC_RELEASE);
+      return true;
+    }
+
+    if (diff > 0)
+      position = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+  }
+}
+
+static void write_clock()
+{
+  uint64_t now = timer_current_time();
+  trace_event(TRACE_CLOCK, now & 0xFFFFFFFF, now >> 32);
+}
+
+static int read(int, char *data, int length)
+{
+  int bytes_read = 0;
+
+  // Only whole records, so the stream can be parsed in any chunk size
+  while (length - bytes_read >= (int)sizeof(trace_record_t)) {
+    trace_record_t record;
+
+    if (!pop(&record))
+      break;
+
+    memcpy(data + bytes_read, &record, sizeof(record));
+    bytes_read += sizeof(record);
+  }
+
+  return bytes_read;
+}
+
+static uint32_t poll(int, uint32_t events)
+{
+  if (__atomic_load_n(&tail, __ATOMIC_RELAXED) != __atomic_load_n(&head, __ATOMIC_RELAXED))
+    return events & POLL_IN;
+
+  return 0;
+}
+
+static int open(vfs_device *, const char *path, uint32_t)
+{
+  if (*path)
+    return ENOENT;
+
+  return 0;
+}
+
+static int control(int, uint32_t function, uint32_t, uint32_t)
+{
+  switch (function) {
+  case CTRL_TRACE_START: {
+    if (trace_enabled)
+      return EBUSY;
+
+    // Each trace starts with an empty ring
+    trace_record_t record;
+    while (pop(&record));
+
+    dropped = 0;
+    trace_enabled = true;
+    write_clock();
+    return 0;
+  }
+
+  case CTRL_TRACE_STOP:
+    if (!trace_enabled)
+      return EINCONSTATE;
+
+    write_clock();
+    trace_enabled = false;
+
+    if (dropped > 0)
+      log(trace, "%d records dropped, read /dev/trace more often", dropped);
+    return 0;
+
+  default:
+    return ENOSUPPORT;
+  }
+}
@@ -0,0 +1,40 @@
+// -*- c++ -*-
+//
+// /dev/trace - static tracepoints. While tracing is started, each
+// `tracepoint` writes a fixed size `trace_record_t` with a TSC
+// timestamp to a lock-free ring, without formatting or waiting on
+// any device. Reading the device drains whole records; `trace dump`
+// streams them over the console and `trace2json` on the host makes a
+// Chrome trace out of them.
+//
+// Build with -DNOTRACE to compile the tracepoints away.
+//
+
+#ifndef PEOS2_TRACE_H
+#define PEOS2_TRACE_H
+
+#include <stdint.h>
+
+#include "syscall_decls.h"
+
+void trace_init();
+
+//
+// trace_event - appends a record of @event (TRACE_*) to the ring, or
+// drops it if the ring is full. Safe to call from anywhere, including
+// interrupt handlers.
+//
+void trace_event(uint16_t event, uint32_t arg0, uint32_t arg1);
+
+extern volatile bool trace_enabled;
+
+#ifndef NOTRACE
+#define tracepoint(event, arg0, arg1) {                        \
+    if (trace_enabled)                                          \
+      trace_event((event), (uint32_t)(arg0), (uint32_t)(arg1)); \
+  }
+#else
+#define tracepoint(event, arg0, arg1) {}
+#endif
+
+#endif // !PEOS2_TRACE_H
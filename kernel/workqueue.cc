@@ -0,0 +1,59 @@
+#include "workqueue.h"
+#include "process.h"
+#include "locks.h"
+#include "debug.h"
+
+#include "support/queue.h"
+
+struct work {
+  work_fun fun;
+  uintptr_t arg;
+};
+
+static void worker_main(uintptr_t);
+
+// Global state
+static p2::queue<work, 64> pending_work;
+static condition_variable<1> work_scheduled;
+
+void workq_init()
+{
+  proc_handle worker_pid = proc_create_kernel_thread(worker_main, 0);
+  proc_set_priority(worker_pid, PROC_PRIORITY_HIGH);
+  proc_set_name(worker_pid, "workq");
+  proc_enqueue(worker_pid);
+}
+
+bool workq_schedule(work_fun fun, uintptr_t arg)
+{
+  interrupt_guard guard;
+
+  if (!pending_work.push_back(work{fun, arg})) {
+    log(workq, "queue full, dropping work");
+    return false;
+  }
+
+  work_scheduled.notify_one();
+  return true;
+}
+
+static void worker_main(uintptr_t)
+{
+  while (true) {
+    work next;
+
+    {
+      interrupt_guard guard;
+
+      while (pending_work.size() == 0) {
+        work_scheduled.wait();
+      }
+
+      next = pending_work.pop_front();
+    }
+
+    // Interrupts are enabled again, so work functions have to guard
+    // state they share with interrupt handlers and syscalls
+    next.fun(next.arg);
+  }
+}
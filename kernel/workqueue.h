@@ -0,0 +1,25 @@
+// -*- c++ -*-
+//
+// Deferred work ("bottom halves"). Interrupt handlers acknowledge the
+// device, schedule the rest of the work and return. The work is then
+// executed in order by a high priority kernel thread with interrupts
+// enabled.
+//
+
+#ifndef PEOS2_WORKQUEUE_H
+#define PEOS2_WORKQUEUE_H
+
+#include <stdint.h>
+
+typedef void (*work_fun)(uintptr_t arg);
+
+void workq_init();
+
+//
+// workq_schedule - queues @fun(@arg) for execution in the worker
+// thread. Safe to call from interrupt handlers. Returns false if the
+// queue is full and the work was dropped.
+//
+bool workq_schedule(work_fun fun, uintptr_t arg);
+
+#endif // !PEOS2_WORKQUEUE_H
@@ -67,11 +67,6 @@ extern "C" void int_invop(isr_registers *regs)
   (void)regs;
 }
 
-extern "C" void int_devnotavail(isr_registers *)
-{
-  panic("device not available");
-}
-
 extern "C" void int_invtss(isr_registers *)
 {
   panic("invalid tss");
@@ -163,8 +158,7 @@ extern "C" void isr_spurious(isr_registers *);
 
 void int_init()
 {
-  static const gdtr idt_ptr = {sizeof(idt_descriptors) - 1, reinterpret_cast<uint32_t>(idt_descriptors)};
-  asm volatile("lidt [%0]" : : "m"(idt_ptr));
+  int_init_cpu();
 
   int_register(INT_DIVZERO,        isr_divzero,       KERNEL_CODE_SEL, IDT_TYPE_INTERRUPT|IDT_TYPE_D|IDT_TYPE_P|IDT_TYPE_DPL3);
   int_register(INT_DEBUG,          isr_debug,         KERNEL_CODE_SEL, IDT_TYPE_INTERRUPT|IDT_TYPE_D|IDT_TYPE_P|IDT_TYPE_DPL3);
@@ -197,6 +191,16 @@ void int_init()
   tss_set_kernel_stack((uint32_t)&interrupt_stack[interrupt_stack_length - 1]);
 }
 
+//
+// int_init_cpu - loads the IDT on the executing CPU. All CPUs share
+// the same descriptors.
+//
+void int_init_cpu()
+{
+  static const gdtr idt_ptr = {sizeof(idt_descriptors) - 1, reinterpret_cast<uint32_t>(idt_descriptors)};
+  asm volatile("lidt [%0]" : : "m"(idt_ptr));
+}
+
 void int_register(int num, void (*handler)(isr_registers *), uint16_t segment_selector, uint8_t type)
 {
   idt_descriptors[num] = {reinterpret_cast<uint32_t>(handler), segment_selector, type};
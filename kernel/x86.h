@@ -18,6 +18,16 @@
 #define CR0_CD 0x40000000
 #define CR0_PG 0x80000000
 
+#define EFLAGS_IF      0x00000200  // Interrupt enable
+
+#define CR4_OSFXSR     0x00000200  // FXSAVE/FXRSTOR and SSE instructions
+#define CR4_OSXMMEXCPT 0x00000400  // Unmasked SSE exceptions raise #XM
+
+#define CPUID_FEAT_EDX_FPU  0x00000001
+#define CPUID_FEAT_EDX_FXSR 0x01000000
+#define CPUID_FEAT_EDX_SSE  0x02000000
+#define CPUID_FEAT_EDX_SSE2 0x04000000
+
 #define GDT_TYPE_P           0x80  // Segment present
 #define GDT_TYPE_DPL3        0x60  // Descriptor privilege level
 #define GDT_TYPE_A           0x01  // Accessed (data and code)
@@ -84,6 +94,7 @@
 
 struct gdt_descriptor {
   gdt_descriptor(uint32_t base, uint32_t limit, uint8_t flags, uint8_t type);
+  gdt_descriptor() = default;
 
   uint16_t limit_0_15;
   uint16_t base_0_15;
@@ -199,7 +210,67 @@ inline uint16_t inw(uint16_t port)
   return ret;
 }
 
+//
+// insw, outsw - transfer @count 16 bit words between @port and memory
+//
+inline void insw(uint16_t port, void *dest, size_t count)
+{
+  asm volatile("rep insw" : "+D"(dest), "+c"(count) : "d"(port) : "memory");
+}
+
+inline void outsw(uint16_t port, const void *src, size_t count)
+{
+  asm volatile("rep outsw" : "+S"(src), "+c"(count) : "d"(port) : "memory");
+}
+
+inline void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx)
+{
+  asm volatile("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(0));
+}
+
+inline uint32_t read_cr0()
+{
+  uint32_t value;
+  asm volatile("mov %0, cr0" : "=r"(value));
+  return value;
+}
+
+inline void write_cr0(uint32_t value)
+{
+  asm volatile("mov cr0, %0" : : "r"(value) : "memory");
+}
+
+inline uint32_t read_cr4()
+{
+  uint32_t value;
+  asm volatile("mov %0, cr4" : "=r"(value));
+  return value;
+}
+
+inline void write_cr4(uint32_t value)
+{
+  asm volatile("mov cr4, %0" : : "r"(value) : "memory");
+}
+
+inline void invlpg(uintptr_t addr)
+{
+  asm volatile("invlpg [%0]" :: "a"(addr) : "memory");
+}
+
+inline void cpu_relax()
+{
+  asm volatile("pause" : : : "memory");
+}
+
+inline uint64_t rdtsc()
+{
+  uint32_t low, high;
+  asm volatile("rdtsc" : "=a"(low), "=d"(high));
+  return (uint64_t)high << 32 | low;
+}
+
 void int_init();
+void int_init_cpu();
 void int_register(int num, void (*handler)(isr_registers *), uint16_t segment_selector, uint8_t type);
 void pic_init();
 void irq_enable(uint8_t irq_line);
@@ -106,6 +106,18 @@ namespace net::arp {
     }
   }
 
+  int protocol_impl::next_timeout() const
+  {
+    int timeout = -1;
+
+    for (auto &probe : _active_probes) {
+      if (timeout == -1 || probe.value.time_left() < timeout)
+        timeout = probe.value.time_left();
+    }
+
+    return timeout;
+  }
+
   void protocol_impl::write_cache_entry(net::ipv4::address ipaddr, net::ethernet::address hwaddr)
   {
     _mappings.insert(ipaddr, hwaddr);
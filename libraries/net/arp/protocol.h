@@ -39,6 +39,9 @@ namespace net::arp {
     virtual int send(int op, net::ipv4::address tpa, const net::ethernet::address &tha, const net::ethernet::address &next_hop) = 0;
     virtual void tick(uint32_t delta_ms) = 0;
 
+    // Milliseconds until `tick` has something to do, -1 if never
+    virtual int next_timeout() const = 0;
+
     virtual ipv4_lookup_result fetch_cached(net::ipv4::address ipaddr) const = 0;
     virtual void fetch_network(net::ipv4::address ipaddr, probe::await_fun callback) = 0;
   };
@@ -50,6 +53,7 @@ namespace net::arp {
     void on_receive(const net::ethernet::frame_metadata &metadata, const char *data, size_t length) final;
     int  send(int op, net::ipv4::address tpa, const net::ethernet::address &tha, const net::ethernet::address &next_hop) final;
     void tick(uint32_t delta_ms) final;
+    int  next_timeout() const final;
 
     ipv4_lookup_result fetch_cached(net::ipv4::address ipaddr) const final;
     void fetch_network(net::ipv4::address ipaddr, probe::await_fun callback) final;
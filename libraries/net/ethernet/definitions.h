@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
 namespace net::ethernet {
@@ -50,4 +51,11 @@ namespace net::ethernet {
     address *mac_dest;
     address *mac_src;
   };
+
+  // A piece of an outgoing frame. Each layer puts its header in front
+  // of the parts it got from above instead of copying the payload
+  struct frame_part {
+    const char *data;
+    size_t length;
+  };
 }
\ No newline at end of file
@@ -53,20 +53,30 @@ namespace net::ethernet {
 
   int protocol::send(ether_type type, const address &destination, const char *data, size_t length)
   {
-    log_debug("tx pdusz=%d,dst=%s", length, hwaddr_str(destination).c_str());
+    frame_part payload = {data, length};
+    return send(type, destination, &payload, 1);
+  }
 
-    // TODO: looping writes
+  int protocol::send(ether_type type, const address &destination, const frame_part *parts, size_t count)
+  {
     header hdr;
     memcpy(hdr.mac_dest, &destination, 6);
     memcpy(hdr.mac_src, &_hwaddr, 6);
     hdr.type = htons(type);
 
-    char frame[5128]; // TODO: correct size
-    assert(sizeof(hdr) + length <= sizeof(frame));
-    memcpy(frame, &hdr, sizeof(hdr));
-    memcpy(frame + sizeof(hdr), data, length);
+    // The device gathers the frame, so the header is just one more part
+    frame_part frame[4];
+    assert(count < ARRAY_SIZE(frame));
+    frame[0] = {reinterpret_cast<const char *>(&hdr), sizeof(hdr)};
 
-    return _protocols.device().send(frame, sizeof(hdr) + length);
+    size_t length = 0;
+    for (size_t i = 0; i < count; ++i) {
+      frame[i + 1] = parts[i];
+      length += parts[i].length;
+    }
+
+    log_debug("tx pdusz=%d,dst=%s", length, hwaddr_str(destination).c_str());
+    return _protocols.device().send(frame, count + 1);
   }
 
   void protocol::configure(const address &hwaddr)
@@ -17,6 +17,9 @@ namespace net::ethernet {
     void on_receive(const char *data, size_t length);
     int send(ether_type type, const address &destination, const char *data, size_t length);
 
+    // Sends a frame with the payload gathered from @count @parts, max 3
+    int send(ether_type type, const address &destination, const frame_part *parts, size_t count);
+
     const address &hwaddr() const {return _hwaddr; }
 
   private:
@@ -288,17 +288,18 @@ namespace net::ipv4 {
     hdr.dest_addr = htonl(dest_addr);
     hdr.checksum = net::ipv4::checksum(hdr, nullptr, 0);
 
-    char buffer[1500];
     // TODO: fetch MTU from ethernet, but hard code to jumbo frames?
-
-    if (sizeof(hdr) + length > sizeof(buffer)) {
+    if (sizeof(hdr) + length > 1500) {
       log_info("datagram too large for one packet, dropping");
       return;
     }
 
-    memcpy(buffer, &hdr, sizeof(hdr));
-    memcpy(buffer + sizeof(hdr), data, length);
-    _protocols.ethernet().send(net::ethernet::ether_type::ET_IPV4, next_hop, buffer, sizeof(hdr) + length);
+    const net::ethernet::frame_part parts[] = {
+      {reinterpret_cast<const char *>(&hdr), sizeof(hdr)},
+      {data, length}
+    };
+
+    _protocols.ethernet().send(net::ethernet::ether_type::ET_IPV4, next_hop, parts, ARRAY_SIZE(parts));
   }
 
   // Checks whether @dest_addr is an address that local host should respond to
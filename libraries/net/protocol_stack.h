@@ -11,7 +11,8 @@ namespace net {
 
 class device {
 public:
-  virtual int send(const char *data, size_t length) = 0;
+  // Sends one frame gathered from @count @parts
+  virtual int send(const net::ethernet::frame_part *parts, size_t count) = 0;
 };
 
 class protocol_stack {
@@ -25,6 +26,9 @@ public:
   virtual net::icmp::protocol &icmp() = 0;
 
   virtual void tick(uint32_t delta_ms) = 0;
+
+  // Milliseconds until the next timer is due, -1 if there are none
+  virtual int next_timeout() = 0;
 };
 
 // A protocol is part of a protocol stack and is connected to other protocols;
@@ -47,6 +51,11 @@ public:
     arp().tick(delta_ms);
   }
 
+  int next_timeout() final
+  {
+    return arp().next_timeout();
+  }
+
 private:
   net::device *_device;
   net::ethernet::protocol _ethernet;
@@ -36,6 +36,12 @@ public:
     return true;
   }
 
+  // Milliseconds until the next retry
+  int time_left() const
+  {
+    return _retry_timer > 0 ? _retry_timer : 0;
+  }
+
   void reset()
   {
     _retry_timer /= 2;
@@ -0,0 +1,91 @@
+#include <support/unittest.h>
+
+#include "ethernet/protocol.h"
+#include "ethernet/definitions.h"
+
+#include "unittests/testing_utils.h"
+
+#include "utils.h"
+
+#include <string>
+
+namespace {
+  class device_mock : public net::device {
+  public:
+    int send(const net::ethernet::frame_part *parts, size_t count) final
+    {
+      sent_parts.assign(parts, parts + count);
+
+      std::string frame;
+      for (size_t i = 0; i < count; ++i)
+        frame.append(parts[i].data, parts[i].length);
+
+      sent_frames.push_back(frame);
+      return frame.size();
+    }
+
+    std::vector<net::ethernet::frame_part> sent_parts;
+    std::vector<std::string> sent_frames;
+  };
+
+  class mock {
+  public:
+    mock()
+      : ethernet(protocols)
+    {
+      protocols._device = &device;
+      protocols._ethernet = &ethernet;
+      ethernet.configure({{1, 2, 3, 4, 5, 6}});
+    }
+
+    net::protocol_stack_mock protocols;
+    device_mock device;
+    net::ethernet::protocol ethernet;
+  };
+}
+
+TESTSUITE(net::ethernet::protocol) {
+  TESTCASE("send: header is prepended as its own part") {
+    // Given
+    mock m;
+    const char payload[] = "hello";
+
+    // When
+    m.ethernet.send(net::ethernet::ET_IPV4, net::ethernet::broadcast_address(), payload, sizeof(payload));
+
+    // Then
+    ASSERT_EQ(m.device.sent_parts.size(), 2u);
+    ASSERT_EQ(m.device.sent_parts[0].length, sizeof(net::ethernet::header));
+    ASSERT_EQ(m.device.sent_parts[1].data, payload);
+
+    const std::string &frame = m.device.sent_frames.front();
+    ASSERT_EQ(frame.size(), sizeof(net::ethernet::header) + sizeof(payload));
+
+    net::ethernet::header hdr;
+    memcpy(&hdr, frame.data(), sizeof(hdr));
+    ASSERT_EQ(ntohs(hdr.type), net::ethernet::ET_IPV4);
+    ASSERT_EQ(hdr.mac_src[5], 6);
+    ASSERT_EQ(hdr.mac_dest[0], 255);
+  }
+
+  TESTCASE("send: payload parts are passed on without copying") {
+    // Given
+    mock m;
+    const char upper_header[] = "header";
+    const char payload[] = "payload";
+    const net::ethernet::frame_part parts[] = {
+      {upper_header, sizeof(upper_header)},
+      {payload, sizeof(payload)}
+    };
+
+    // When
+    m.ethernet.send(net::ethernet::ET_ARP, net::ethernet::broadcast_address(), parts, 2);
+
+    // Then
+    ASSERT_EQ(m.device.sent_parts.size(), 3u);
+    ASSERT_EQ(m.device.sent_parts[1].data, upper_header);
+    ASSERT_EQ(m.device.sent_parts[2].data, payload);
+    ASSERT_EQ(m.device.sent_frames.front().substr(sizeof(net::ethernet::header)),
+              std::string(upper_header, sizeof(upper_header)) + std::string(payload, sizeof(payload)));
+  }
+}
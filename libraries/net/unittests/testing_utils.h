@@ -19,6 +19,7 @@ namespace net {
     net::icmp::protocol &icmp() final         {assert(_icmp); return *_icmp; }
 
     void tick(uint32_t) final {}
+    int next_timeout() final {return -1; }
 
     net::device *_device = nullptr;
     net::ethernet::protocol *_ethernet = nullptr;
@@ -84,6 +85,7 @@ namespace net::arp {
     void on_receive(const net::ethernet::frame_metadata &, const char *, size_t) final {}
     int send(int, net::ipv4::address, const net::ethernet::address &, const net::ethernet::address &) final {return 0; }
     void tick(uint32_t) final {}
+    int next_timeout() const final {return -1; }
 
     ipv4_lookup_result fetch_cached(net::ipv4::address) const final {return nullptr; }
     void fetch_network(net::ipv4::address, probe::await_fun) final {}
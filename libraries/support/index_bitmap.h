@@ -0,0 +1,91 @@
+// -*- c++ -*-
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "support/assert.h"
+
+namespace p2 {
+  //
+  // index_bitmap - which of `Capacity` indexes are taken. A second
+  // level has a bit per word that's set while the word is full, so
+  // finding the lowest free index looks at Capacity / 1024 summary
+  // words and a single word below, however many are taken.
+  //
+  template<size_t Capacity>
+  class index_bitmap {
+    static_assert(Capacity > 0 && Capacity % 32 == 0);
+
+    static constexpr size_t WORDS = Capacity / 32;
+    static constexpr size_t SUMMARY_WORDS = (WORDS + 31) / 32;
+
+  public:
+    index_bitmap()
+    {
+      // Words past the end count as full, so they're never picked
+      for (size_t word = WORDS; word < SUMMARY_WORDS * 32; ++word)
+        _full[word / 32] |= 1u << (word % 32);
+    }
+
+    // Takes and returns the lowest free index, or -1 if there's none
+    int take_lowest()
+    {
+      for (size_t summary = 0; summary < SUMMARY_WORDS; ++summary) {
+        if (_full[summary] == 0xFFFFFFFF)
+          continue;
+
+        const size_t word = summary * 32 + __builtin_ctz(~_full[summary]);
+        const int index = word * 32 + __builtin_ctz(~_bits[word]);
+        set(index);
+        return index;
+      }
+
+      return -1;
+    }
+
+    void set(size_t index)
+    {
+      assert(index < Capacity);
+      const size_t word = index / 32;
+      _bits[word] |= 1u << (index % 32);
+
+      if (_bits[word] == 0xFFFFFFFF)
+        _full[word / 32] |= 1u << (word % 32);
+    }
+
+    void clear(size_t index)
+    {
+      assert(index < Capacity);
+      const size_t word = index / 32;
+      _bits[word] &= ~(1u << (index % 32));
+      _full[word / 32] &= ~(1u << (word % 32));
+    }
+
+    bool test(size_t index) const
+    {
+      return index < Capacity && (_bits[index / 32] & (1u << (index % 32)));
+    }
+
+    // The lowest taken index at or after @from, or -1 if there's none
+    int next(size_t from) const
+    {
+      for (size_t word = from / 32; word < WORDS; ++word) {
+        uint32_t bits = _bits[word];
+
+        if (word == from / 32)
+          bits &= ~0u << (from % 32);
+
+        if (bits)
+          return word * 32 + __builtin_ctz(bits);
+      }
+
+      return -1;
+    }
+
+  private:
+    uint32_t _bits[WORDS] = {};
+    uint32_t _full[SUMMARY_WORDS] = {};
+  };
+}
@@ -0,0 +1,126 @@
+// -*- c++ -*-
+//
+// Userspace locking on top of the futex syscalls. Taking a free mutex
+// or notifying a condition variable that nobody waits on is only an
+// atomic operation; the kernel is only involved when there's
+// contention.
+//
+
+#ifndef PEOS2_SUPPORT_MUTEX_H
+#define PEOS2_SUPPORT_MUTEX_H
+
+#include <stdint.h>
+#include <kernel/syscall_decls.h>
+
+#include "support/utils.h"
+
+namespace p2 {
+  //
+  // mutex - the state is 0 when unlocked, 1 when locked and 2 when
+  // locked and somebody might be sleeping on it.
+  //
+  class mutex : non_copyable {
+  public:
+    void lock()
+    {
+      uint32_t state = 0;
+      if (__atomic_compare_exchange_n(&_state, &state, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+
+      if (state != 2)
+        state = __atomic_exchange_n(&_state, 2, __ATOMIC_ACQUIRE);
+
+      while (state != 0) {
+        syscall3(futex_wait, &_state, 2, -1);
+        state = __atomic_exchange_n(&_state, 2, __ATOMIC_ACQUIRE);
+      }
+    }
+
+    bool try_lock()
+    {
+      uint32_t state = 0;
+      return __atomic_compare_exchange_n(&_state, &state, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+    }
+
+    void unlock()
+    {
+      if (__atomic_exchange_n(&_state, 0, __ATOMIC_RELEASE) == 2)
+        syscall2(futex_wake, &_state, 1);
+    }
+
+  private:
+    friend class condition_variable;
+
+    // Used after sleeping on a condition variable. We can't know if
+    // there are more waiters, so assume that there are.
+    void lock_contended()
+    {
+      while (__atomic_exchange_n(&_state, 2, __ATOMIC_ACQUIRE) != 0)
+        syscall3(futex_wait, &_state, 2, -1);
+    }
+
+    volatile uint32_t _state = 0;
+  };
+
+  //
+  // lock_guard - holds the mutex for the lifetime of the guard
+  //
+  class lock_guard : non_copyable {
+  public:
+    lock_guard(mutex &m) : _mutex(m) {_mutex.lock(); }
+    ~lock_guard()                    {_mutex.unlock(); }
+
+  private:
+    mutex &_mutex;
+  };
+
+  //
+  // condition_variable - waiters sleep on a sequence number that's
+  // bumped by every notification, so a notification between unlocking
+  // the mutex and going to sleep isn't lost.
+  //
+  class condition_variable : non_copyable {
+  public:
+    //
+    // wait - unlocks @m while sleeping and locks it again before
+    // returning. Returns ETIMEOUT if @timeout ms passed first (-1 to
+    // wait forever). Spurious wakeups are possible, so check the
+    // predicate in a loop.
+    //
+    int wait(mutex &m, int timeout = -1)
+    {
+      uint32_t sequence = __atomic_load_n(&_sequence, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&_waiters, 1, __ATOMIC_RELAXED);
+      m.unlock();
+
+      int ret = syscall3(futex_wait, &_sequence, sequence, timeout);
+
+      __atomic_sub_fetch(&_waiters, 1, __ATOMIC_RELAXED);
+      m.lock_contended();
+
+      return ret == ETIMEOUT ? ETIMEOUT : 0;
+    }
+
+    void notify_one()
+    {
+      __atomic_add_fetch(&_sequence, 1, __ATOMIC_RELEASE);
+
+      if (__atomic_load_n(&_waiters, __ATOMIC_RELAXED) > 0)
+        syscall2(futex_wake, &_sequence, 1);
+    }
+
+    void notify_all()
+    {
+      __atomic_add_fetch(&_sequence, 1, __ATOMIC_RELEASE);
+
+      if (__atomic_load_n(&_waiters, __ATOMIC_RELAXED) > 0)
+        syscall2(futex_wake, &_sequence, INT32_MAX);
+    }
+
+  private:
+    volatile uint32_t _sequence = 0;
+    volatile uint32_t _waiters = 0;
+  };
+}
+
+#endif // !PEOS2_SUPPORT_MUTEX_H
@@ -0,0 +1,95 @@
+// -*- c++ -*-
+//
+// Userspace side of the submission/completion rings. Entries are
+// queued with `prepare` and handed to the kernel in a batch by
+// `enter`, results are picked up with `pop`.
+//
+
+#ifndef PEOS2_SUPPORT_RING_H
+#define PEOS2_SUPPORT_RING_H
+
+#include <stdint.h>
+#include <kernel/syscall_decls.h>
+
+#include "support/utils.h"
+
+namespace p2 {
+  template<uint32_t _Entries>
+  class io_ring : non_copyable {
+    static_assert(_Entries > 0 && (_Entries & (_Entries - 1)) == 0, "size must be a power of two");
+
+  public:
+    // Returns a negative value on error
+    int setup()
+    {
+      _ring.entries = _Entries;
+      _ring.sqes = _sqes;
+      _ring.cqes = _cqes;
+      _id = syscall1(ring_setup, &_ring);
+      return _id;
+    }
+
+    //
+    // prepare - queues an operation, see RING_OP_* for what the
+    // parameters mean. Returns false if the submission ring is full.
+    //
+    bool prepare(uint8_t opcode, int fd, const void *addr, uint32_t length, uint32_t user_data, uint32_t function = 0)
+    {
+      // The kernel only reads the ring during `enter`, so the tail can
+      // be bumped before the entry is filled in
+      const uint32_t tail = _ring.sq_tail;
+
+      if (tail - _ring.sq_head >= _Entries)
+        return false;
+
+      ring_sqe_t &sqe = _sqes[tail & (_Entries - 1)];
+      sqe = {};
+      sqe.opcode = opcode;
+      sqe.fd = fd;
+      sqe.addr = (uintptr_t)addr;
+      sqe.length = length;
+      sqe.function = function;
+      sqe.user_data = user_data;
+
+      __atomic_store_n(&_ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+      return true;
+    }
+
+    // Operations that have been prepared but not yet given to the kernel
+    uint32_t unsubmitted() const
+    {
+      return _ring.sq_tail - _ring.sq_head;
+    }
+
+    //
+    // enter - submits all prepared operations and waits until
+    // @min_complete of them have completed. Returns the number of
+    // submitted operations or an error.
+    //
+    int enter(uint32_t min_complete)
+    {
+      return syscall3(ring_enter, _id, unsubmitted(), min_complete);
+    }
+
+    // Returns false if there are no completions
+    bool pop(ring_cqe_t &cqe)
+    {
+      const uint32_t head = _ring.cq_head;
+
+      if (head == __atomic_load_n(&_ring.cq_tail, __ATOMIC_ACQUIRE))
+        return false;
+
+      cqe = _cqes[head & (_Entries - 1)];
+      _ring.cq_head = head + 1;
+      return true;
+    }
+
+  private:
+    ring_t _ring = {};
+    ring_sqe_t _sqes[_Entries];
+    ring_cqe_t _cqes[_Entries];
+    int _id = -1;
+  };
+}
+
+#endif // !PEOS2_SUPPORT_RING_H
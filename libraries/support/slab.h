@@ -0,0 +1,128 @@
+// -*- c++ -*-
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "support/assert.h"
+#include "support/limits.h"
+#include "support/utils.h"
+
+namespace p2 {
+  //
+  // slab_pool - a pool that grows one slab at a time, up to
+  // `MaxSlabs` slabs of `SlabSize` bytes. Slabs come from the
+  // allocator given to the constructor and are kept once allocated;
+  // erased items go on a free list and are reused first. Items are
+  // addressed by index like in `pool`, so handles stay small and stay
+  // valid while the pool grows.
+  //
+  // NB: no destructors are called
+  //
+  // Time complexity:
+  // emplace:   O(1), plus threading a new slab onto the free list
+  // erase:     O(1)
+  //
+  template<typename T, size_t MaxSlabs, typename _IndexT = uint16_t, size_t SlabSize = 0x1000>
+  class slab_pool {
+    struct slot {
+      _IndexT next_free;
+      bool used;
+      inplace_object<T> value;
+    };
+
+  public:
+    static constexpr size_t SLOTS_PER_SLAB = SlabSize / sizeof(slot);
+
+    static_assert(SLOTS_PER_SLAB > 0, "items don't fit in a slab");
+    static_assert(MaxSlabs * SLOTS_PER_SLAB < p2::numeric_limits<_IndexT>::max(), "max value of _IndexT is reserved as a sentinel");
+
+    // Returns a zeroed, suitably aligned slab, or nullptr
+    typedef void *(*slab_allocator)();
+
+    explicit slab_pool(slab_allocator alloc_slab) : _alloc_slab(alloc_slab) {}
+
+    // Returns `end_sentinel()` if a slab was needed but couldn't be
+    // allocated
+    template<typename... _Args>
+    _IndexT emplace_anywhere(_Args&&... args)
+    {
+      if (_free_list_head == END_SENTINEL && !grow())
+        return END_SENTINEL;
+
+      const _IndexT idx = _free_list_head;
+      slot &item = slot_at(idx);
+      _free_list_head = item.next_free;
+      item.used = true;
+      item.value.construct(forward<_Args>(args)...);
+      ++_count;
+      return idx;
+    }
+
+    void erase(_IndexT idx)
+    {
+      assert(valid(idx));
+      slot &item = slot_at(idx);
+      item.used = false;
+      item.next_free = _free_list_head;
+      _free_list_head = idx;
+      --_count;
+    }
+
+    bool valid(_IndexT idx) const
+    {
+      return idx < watermark() && slot_at(idx).used;
+    }
+
+    T &operator [](_IndexT idx)
+    {
+      assert(valid(idx));
+      return *slot_at(idx).value;
+    }
+
+    const T &operator [](_IndexT idx) const
+    {
+      assert(valid(idx));
+      return *slot_at(idx).value;
+    }
+
+    size_t size() const          {return _count; }
+    size_t slabs() const         {return _slab_count; }
+    _IndexT watermark() const    {return _slab_count * SLOTS_PER_SLAB; }
+    _IndexT end_sentinel() const {return END_SENTINEL; }
+
+  private:
+    bool grow()
+    {
+      if (_slab_count == MaxSlabs)
+        return false;
+
+      slot *slab = reinterpret_cast<slot *>(_alloc_slab());
+      if (!slab)
+        return false;
+
+      // Backwards, so the lowest index is handed out first
+      for (size_t i = SLOTS_PER_SLAB; i-- > 0;) {
+        new (&slab[i]) slot{};
+        slab[i].next_free = _free_list_head;
+        _free_list_head = _slab_count * SLOTS_PER_SLAB + i;
+      }
+
+      _slabs[_slab_count++] = slab;
+      return true;
+    }
+
+    slot &slot_at(_IndexT idx)             {return _slabs[idx / SLOTS_PER_SLAB][idx % SLOTS_PER_SLAB]; }
+    const slot &slot_at(_IndexT idx) const {return _slabs[idx / SLOTS_PER_SLAB][idx % SLOTS_PER_SLAB]; }
+
+    // The highest possible value, useful as a null index due to the
+    // pool being 0-indexed
+    static const _IndexT END_SENTINEL = p2::numeric_limits<_IndexT>::max();
+
+    slab_allocator _alloc_slab;
+    slot *_slabs[MaxSlabs] = {};
+    size_t _slab_count = 0, _count = 0;
+    _IndexT _free_list_head = END_SENTINEL;
+  };
+}
@@ -0,0 +1,41 @@
+// -*- c++ -*-
+//
+// Userspace threads on top of the thread syscalls
+//
+
+#ifndef PEOS2_SUPPORT_THREAD_H
+#define PEOS2_SUPPORT_THREAD_H
+
+#include <kernel/syscall_decls.h>
+
+namespace p2 {
+  typedef int (*thread_fun)(void *arg);
+
+  namespace detail {
+    // Threads have nowhere to return to, so exit with the return value
+    static void thread_start(void *fun, void *arg)
+    {
+      syscall1(exit, ((thread_fun)fun)(arg));
+    }
+  }
+
+  //
+  // thread_create - runs @fun(@arg) in a new thread. Returns the thread
+  // id or an error.
+  //
+  static inline int thread_create(thread_fun fun, void *arg)
+  {
+    return syscall3(thread_create, detail::thread_start, (void *)fun, arg);
+  }
+
+  //
+  // thread_join - waits for thread @tid and returns the value returned
+  // by its thread function
+  //
+  static inline int thread_join(int tid)
+  {
+    return syscall1(thread_join, tid);
+  }
+}
+
+#endif // !PEOS2_SUPPORT_THREAD_H
@@ -0,0 +1,57 @@
+#include "support/unittest.h"
+#include "support/index_bitmap.h"
+
+TESTSUITE(p2::index_bitmap) {
+  TESTCASE("hands out the lowest free index") {
+    p2::index_bitmap<128> bitmap;
+
+    ASSERT_EQ(bitmap.take_lowest(), 0);
+    ASSERT_EQ(bitmap.take_lowest(), 1);
+    ASSERT_EQ(bitmap.take_lowest(), 2);
+
+    bitmap.clear(1);
+    ASSERT_EQ(bitmap.take_lowest(), 1);
+    ASSERT_EQ(bitmap.take_lowest(), 3);
+  }
+
+  TESTCASE("skips full words") {
+    p2::index_bitmap<4096> bitmap;
+
+    for (int i = 0; i < 2000; ++i)
+      bitmap.set(i);
+
+    ASSERT_EQ(bitmap.take_lowest(), 2000);
+
+    bitmap.clear(40);
+    ASSERT_EQ(bitmap.take_lowest(), 40);
+    ASSERT_EQ(bitmap.take_lowest(), 2001);
+  }
+
+  TESTCASE("returns -1 when full") {
+    p2::index_bitmap<64> bitmap;
+
+    for (int i = 0; i < 64; ++i)
+      ASSERT_EQ(bitmap.take_lowest(), i);
+
+    ASSERT_EQ(bitmap.take_lowest(), -1);
+
+    bitmap.clear(63);
+    ASSERT_EQ(bitmap.take_lowest(), 63);
+  }
+
+  TESTCASE("next finds taken indexes in order") {
+    p2::index_bitmap<4096> bitmap;
+    bitmap.set(3);
+    bitmap.set(31);
+    bitmap.set(32);
+    bitmap.set(4095);
+
+    ASSERT_EQ(bitmap.next(0), 3);
+    ASSERT_EQ(bitmap.next(4), 31);
+    ASSERT_EQ(bitmap.next(32), 32);
+    ASSERT_EQ(bitmap.next(33), 4095);
+    ASSERT_EQ(bitmap.next(4096), -1);
+    ASSERT_TRUE(bitmap.test(31));
+    ASSERT_FALSE(bitmap.test(30));
+  }
+}
@@ -0,0 +1,97 @@
+#include "support/unittest.h"
+#include "support/slab.h"
+
+#include <stdlib.h>
+
+namespace {
+  int slabs_allocated = 0;
+  int slabs_allowed = 1000;
+
+  void *alloc_slab()
+  {
+    if (slabs_allocated == slabs_allowed)
+      return nullptr;
+
+    ++slabs_allocated;
+    void *slab = aligned_alloc(0x1000, 0x1000);
+    memset(slab, 0, 0x1000);
+    return slab;
+  }
+
+  struct item {
+    item(int value) : value(value) {}
+    int value;
+    char padding[60];
+  };
+
+  typedef p2::slab_pool<item, 4> item_pool;
+}
+
+TESTSUITE(p2::slab_pool) {
+  TESTCASE("created pool has no slabs") {
+    slabs_allocated = 0;
+    item_pool items(alloc_slab);
+
+    ASSERT_EQ(items.size(), 0u);
+    ASSERT_EQ(items.slabs(), 0u);
+    ASSERT_EQ(slabs_allocated, 0);
+  }
+
+  TESTCASE("continuous indexes are allocated") {
+    item_pool items(alloc_slab);
+
+    ASSERT_EQ(items.emplace_anywhere(1), 0);
+    ASSERT_EQ(items.emplace_anywhere(2), 1);
+    ASSERT_EQ(items.emplace_anywhere(3), 2);
+    ASSERT_EQ(items[1].value, 2);
+  }
+
+  TESTCASE("grows by a slab when the current ones are full") {
+    slabs_allocated = 0;
+    item_pool items(alloc_slab);
+
+    for (size_t i = 0; i < item_pool::SLOTS_PER_SLAB; ++i)
+      items.emplace_anywhere(i);
+
+    ASSERT_EQ(items.slabs(), 1u);
+
+    uint16_t idx = items.emplace_anywhere(1234);
+    ASSERT_EQ(idx, item_pool::SLOTS_PER_SLAB);
+    ASSERT_EQ(items.slabs(), 2u);
+    ASSERT_EQ(items[idx].value, 1234);
+    ASSERT_EQ(items[0].value, 0);
+  }
+
+  TESTCASE("erased items are reused before growing") {
+    slabs_allocated = 0;
+    item_pool items(alloc_slab);
+
+    for (size_t i = 0; i < item_pool::SLOTS_PER_SLAB; ++i)
+      items.emplace_anywhere(i);
+
+    items.erase(5);
+    ASSERT_FALSE(items.valid(5));
+    ASSERT_EQ(items.emplace_anywhere(99), 5);
+    ASSERT_EQ(items.slabs(), 1u);
+    ASSERT_EQ(items.size(), item_pool::SLOTS_PER_SLAB);
+  }
+
+  TESTCASE("returns the sentinel when out of slabs") {
+    item_pool items(alloc_slab);
+
+    for (size_t i = 0; i < 4 * item_pool::SLOTS_PER_SLAB; ++i)
+      ASSERT_NEQ(items.emplace_anywhere(i), items.end_sentinel());
+
+    ASSERT_EQ(items.emplace_anywhere(0), items.end_sentinel());
+  }
+
+  TESTCASE("returns the sentinel when the allocator fails") {
+    slabs_allocated = 0;
+    slabs_allowed = 0;
+    item_pool items(alloc_slab);
+
+    ASSERT_EQ(items.emplace_anywhere(0), items.end_sentinel());
+    ASSERT_EQ(items.size(), 0u);
+    slabs_allowed = 1000;
+  }
+}
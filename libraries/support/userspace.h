@@ -56,11 +56,27 @@ namespace p2 {
 #endif
 
 
+//
+// list_dir - reads up to @count entries of the directory opened as @fd
+//
 static inline int list_dir(int fd, dirent_t *dirents, size_t count)
 {
+  size_t entries = 0;
+  int ret = 0;
+
+  while (entries < count && (ret = syscall3(readdir, fd, dirents + entries, count - entries)) > 0)
+    entries += ret;
+
+  if (entries == count || ret == 0)
+    return entries;
+
+  if (ret != ENOSUPPORT)
+    return ret;
+
+  // The filesystem only lists directories through read
   int bytes_read = 0;
-  char *out = (char *)dirents;
-  size_t bytes_left = count * sizeof(*dirents);
+  char *out = (char *)(dirents + entries);
+  size_t bytes_left = (count - entries) * sizeof(*dirents);
 
   while ((bytes_read = syscall3(read, fd, out, bytes_left)) > 0) {
     bytes_left -= bytes_read;
@@ -0,0 +1,47 @@
+// -*- c++ -*-
+//
+// Helpers shared by the benchmarks
+//
+
+#ifndef PEOS2_BENCH_H
+#define PEOS2_BENCH_H
+
+#include <support/userspace.h>
+#include <kernel/syscall_decls.h>
+
+//
+// parse_number - the positive decimal number in @str, @fallback if
+// there's none
+//
+static inline int parse_number(const char *str, int fallback)
+{
+  if (!str || !*str)
+    return fallback;
+
+  int value = 0;
+  for (; *str >= '0' && *str <= '9'; ++str)
+    value = value * 10 + (*str - '0');
+
+  return value > 0 ? value : fallback;
+}
+
+// current_time - milliseconds since boot
+static inline uint64_t current_time()
+{
+  uint64_t time;
+  p2::verify(syscall1(currenttime, &time));
+  return time;
+}
+
+//
+// next_random - advances @state and returns the next pseudo-random
+// number. The same seed gives the same sequence every run, so random
+// passes are comparable.
+//
+static inline uint32_t next_random(uint32_t &state)
+{
+  state = state * 1103515245 + 12345;
+  return state >> 8;
+}
+
+#endif // !PEOS2_BENCH_H
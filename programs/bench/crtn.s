@@ -0,0 +1,7 @@
+.section .init
+        popl %ebp
+        ret
+
+.section .fini
+        popl %ebp
+        ret
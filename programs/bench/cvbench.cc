@@ -0,0 +1,122 @@
+//
+// cvbench - producer/consumer throughput over /dev/loopback
+//
+// Forks producers that write a fixed amount of data and consumers
+// that read it back, then reports throughput and how many context
+// switches and wakeups the kernel needed. The first pass leaves woken
+// processes to the scheduler, the second runs the consumers at raised
+// priority and has the loopback switch to them as soon as they're
+// woken.
+//
+// Usage: cvbench [producers] [consumers] [kilobytes]
+//
+
+#include <support/string.h>
+#include <support/userspace.h>
+#include <kernel/syscall_decls.h>
+
+#include "bench.h"
+
+using namespace p2;
+
+static int produce(int fd, int bytes)
+{
+  char chunk[256];
+  memset(chunk, 'x', sizeof(chunk));
+
+  while (bytes > 0) {
+    int ret = verify(syscall3(write, fd, chunk, min<int>(bytes, sizeof(chunk))));
+    bytes -= ret;
+  }
+
+  return 0;
+}
+
+static int consume(int fd, int bytes, bool raise_priority)
+{
+  char chunk[256];
+
+  if (raise_priority)
+    verify(syscall1(set_priority, PRIORITY_RAISED));
+
+  while (bytes > 0) {
+    int ret = verify(syscall3(read, fd, chunk, min<int>(bytes, sizeof(chunk))));
+    bytes -= ret;
+  }
+
+  return 0;
+}
+
+static void run_pass(const char *name, int policy, int producers, int consumers, int kilobytes)
+{
+  const int total_bytes = kilobytes * 1024;
+  int fd = verify(syscall2(open, "/dev/loopback", 0));
+  int pids[32];
+  int pid_count = 0;
+
+  verify(syscall4(control, fd, CTRL_LOOPBACK_WAKE_POLICY, policy, 0));
+
+  sched_stats_t stats_before, stats_after;
+  verify(syscall1(sched_stats, &stats_before));
+  uint64_t start_time = current_time();
+
+  // Split the data evenly, the first process of each kind takes the rest
+  for (int i = 0; i < producers; ++i) {
+    int share = total_bytes / producers + (i == 0 ? total_bytes % producers : 0);
+
+    if (int pid = syscall0(fork); pid == 0)
+      syscall1(exit, produce(fd, share));
+    else
+      pids[pid_count++] = pid;
+  }
+
+  for (int i = 0; i < consumers; ++i) {
+    int share = total_bytes / consumers + (i == 0 ? total_bytes % consumers : 0);
+
+    if (int pid = syscall0(fork); pid == 0)
+      syscall1(exit, consume(fd, share, policy == WAKE_POLICY_PREEMPT_HIGHER));
+    else
+      pids[pid_count++] = pid;
+  }
+
+  for (int i = 0; i < pid_count; ++i)
+    syscall1(wait, pids[i]);
+
+  uint32_t elapsed_ms = max<uint32_t>(current_time() - start_time, 1);
+  verify(syscall1(sched_stats, &stats_after));
+
+  // The loopback is shared, leave it as we found it
+  verify(syscall4(control, fd, CTRL_LOOPBACK_WAKE_POLICY, WAKE_POLICY_DEFERRED, 0));
+  syscall1(close, fd);
+
+  uint32_t switches = stats_after.context_switches - stats_before.context_switches;
+  uint32_t wakeups = stats_after.wakeups - stats_before.wakeups;
+  uint32_t preemptions = stats_after.preemptions - stats_before.preemptions;
+
+  puts(1, format<128>("cvbench: %s: %d ms, %d KB/s\n", name, elapsed_ms, (uint32_t)((uint64_t)kilobytes * 1000 / elapsed_ms)));
+  puts(1, format<128>("cvbench: %s: %d switches (%d per MB), %d wakeups, %d preemptions\n",
+                      name,
+                      switches,
+                      (uint32_t)((uint64_t)switches * 1024 / kilobytes),
+                      wakeups,
+                      preemptions));
+}
+
+int main(int argc, char *argv[])
+{
+  const int producers = parse_number(argc > 1 ? argv[1] : nullptr, 1);
+  const int consumers = parse_number(argc > 2 ? argv[2] : nullptr, 1);
+  const int kilobytes = parse_number(argc > 3 ? argv[3] : nullptr, 1024);
+
+  if (producers + consumers > 32) {
+    puts("Too many processes, max is 32");
+    return 1;
+  }
+
+  puts(1, format<128>("cvbench: %d producers, %d consumers, %d KB\n", producers, consumers, kilobytes));
+  run_pass("deferred", WAKE_POLICY_DEFERRED, producers, consumers, kilobytes);
+  run_pass("preempt higher", WAKE_POLICY_PREEMPT_HIGHER, producers, consumers, kilobytes);
+  return 0;
+}
+
+START(main);
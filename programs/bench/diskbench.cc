@@ -0,0 +1,111 @@
+//
+// diskbench - read throughput of a file on the disk, with the buffer
+// cache cold and warm, sequential and in random 4 KiB blocks, with and
+// without fadvise hints. Readahead counters are in /proc/stat.
+//
+// Usage: diskbench [file]
+//
+
+#include <support/userspace.h>
+#include <kernel/syscall_decls.h>
+
+#include "bench.h"
+
+using namespace p2;
+
+static const char *device = "/dev/hda";
+static const int chunk_size = 64 * 1024;
+static const int block_size = 4096;
+
+static char buffer[chunk_size];
+
+static void drop_cache()
+{
+  int fd = verify(syscall2(open, device, 0));
+  verify(syscall4(control, fd, CTRL_BLOCK_DROP_CACHE, 0, 0));
+  syscall1(close, fd);
+}
+
+static int transfer(int fd, int size, bool random)
+{
+  uint32_t state = 1;
+  int total = 0;
+
+  verify(syscall3(seek, fd, 0, SEEK_BEG));
+
+  if (!random) {
+    while (int ret = verify(syscall3(read, fd, buffer, chunk_size)))
+      total += ret;
+
+    return total;
+  }
+
+  const int blocks = size / block_size;
+
+  for (int i = 0; i < blocks; ++i) {
+    verify(syscall3(seek, fd, (next_random(state) % blocks) * block_size, SEEK_BEG));
+    total += verify(syscall3(read, fd, buffer, block_size));
+  }
+
+  return total;
+}
+
+static void measure(const char *name, int fd, int size, bool random, int advice)
+{
+  uint64_t start_time = current_time();
+  verify(syscall4(fadvise, fd, 0, 0, advice));
+  int bytes = transfer(fd, size, random);
+  verify(syscall4(fadvise, fd, 0, 0, FADV_NORMAL));
+
+  uint32_t elapsed_ms = max<uint32_t>(current_time() - start_time, 1);
+  uint32_t kib = bytes / 1024;
+  puts(1, format<128>("diskbench: %s: %d KiB in %d ms, %d KiB/s\n",
+                      name,
+                      kib,
+                      elapsed_ms,
+                      (uint32_t)((uint64_t)kib * 1000 / elapsed_ms)));
+}
+
+int main(int argc, char *argv[])
+{
+  const char *path = argc > 1 ? argv[1] : "/disk/data/random";
+  int fd = syscall2(open, path, 0);
+
+  if (fd < 0) {
+    puts(1, format<128>("diskbench: can't open %s (%d)\n", path, fd));
+    return 1;
+  }
+
+  // Find the size by reading it once
+  drop_cache();
+  const int size = transfer(fd, 0, false);
+
+  drop_cache();
+  measure("sequential read (cold)", fd, size, false, FADV_NORMAL);
+  measure("sequential read (warm)", fd, size, false, FADV_NORMAL);
+
+  drop_cache();
+  measure("sequential read (cold, FADV_SEQUENTIAL)", fd, size, false, FADV_SEQUENTIAL);
+
+  drop_cache();
+  measure("sequential read (cold, FADV_WILLNEED)", fd, size, false, FADV_WILLNEED);
+
+  // The random passes pick whole blocks
+  if (size >= block_size) {
+    drop_cache();
+    measure("random read (cold)", fd, size, true, FADV_NORMAL);
+    measure("random read (warm)", fd, size, true, FADV_NORMAL);
+
+    drop_cache();
+    measure("random read (cold, FADV_RANDOM)", fd, size, true, FADV_RANDOM);
+  }
+  else {
+    puts(1, format<128>("diskbench: %s is smaller than a block, skipping random reads\n", path));
+  }
+
+  syscall1(close, fd);
+  puts(1, format<64>("diskbench: done\n"));
+  return 0;
+}
+
+START(main);
@@ -0,0 +1,104 @@
+//
+// fdstress - opens thousands of files at once across many processes,
+// checking that every open succeeds and that the lowest free fd is
+// handed out
+//
+// Prints "fdstress: FAIL" and what went wrong on errors, and
+// "fdstress: done" when all children have exited.
+//
+// Usage: fdstress [processes] [files per process]
+//
+
+#include <support/userspace.h>
+#include <kernel/syscall_decls.h>
+
+#include "bench.h"
+
+using namespace p2;
+
+static const char *filename = "/initrd/bin/true";
+static const char *command = "/initrd/bin/fdstress";
+
+static int fail(const char *what, int value)
+{
+  puts(1, format<128>("fdstress: FAIL %s (%d)\n", what, value));
+  return 1;
+}
+
+static int run_child(int file_count)
+{
+  static int fds[4096];
+  file_count = min<int>(file_count, ARRAY_SIZE(fds));
+
+  for (int i = 0; i < file_count; ++i) {
+    fds[i] = syscall2(open, filename, 0);
+
+    if (fds[i] < 0)
+      return fail("open", fds[i]);
+
+    if (i > 0 && fds[i] != fds[i - 1] + 1)
+      return fail("fd isn't the lowest free", fds[i]);
+  }
+
+  // Every file is usable, and has its own position
+  for (int i = 0; i < file_count; ++i) {
+    char magic[4];
+
+    if (syscall3(read, fds[i], magic, sizeof(magic)) != sizeof(magic) || magic[1] != 'E')
+      return fail("read", fds[i]);
+  }
+
+  // Holes are filled from the bottom
+  for (int i = 0; i < file_count; i += 2)
+    verify(syscall1(close, fds[i]));
+
+  for (int i = 0; i < file_count; i += 2) {
+    int fd = syscall2(open, filename, 0);
+
+    if (fd != fds[i])
+      return fail("reopened fd isn't the lowest free", fd);
+  }
+
+  // Aliases far above the rest grow the table
+  if (int ret = syscall2(dup2, fds[0], 4000); ret < 0)
+    return fail("dup2", ret);
+
+  verify(syscall1(close, 4000));
+
+  for (int i = 0; i < file_count; ++i)
+    verify(syscall1(close, fds[i]));
+
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc > 2 && strncmp(argv[1], "child", 6) == 0)
+    return run_child(parse_number(argv[2], 256));
+
+  const int process_count = min(parse_number(argc > 1 ? argv[1] : nullptr, 16), 32);
+  const char *file_count = argc > 2 ? argv[2] : "256";
+  const char *child_argv[] = {command, "child", file_count, nullptr};
+  const int fd_map[] = {0, 1, 2};
+  int pids[32];
+
+  // Spawn them all before waiting, so they run side by side
+  for (int i = 0; i < process_count; ++i) {
+    pids[i] = syscall4(spawn, command, child_argv, fd_map, ARRAY_SIZE(fd_map));
+
+    if (pids[i] < 0) {
+      fail("spawn", pids[i]);
+      pids[i] = 0;
+    }
+  }
+
+  for (int i = 0; i < process_count; ++i) {
+    if (pids[i] > 0)
+      syscall1(wait, pids[i]);
+  }
+
+  puts(1, format<64>("fdstress: done\n"));
+  return 0;
+}
+
+START(main);
@@ -0,0 +1,78 @@
+//
+// filebench - throughput of writable ramfs files, sequential and
+// random, in 4 KiB blocks
+//
+// Usage: filebench [size in MiB]
+//
+
+#include <support/userspace.h>
+#include <kernel/syscall_decls.h>
+
+#include "bench.h"
+
+using namespace p2;
+
+static const char *path = "/ramfs/filebench";
+static const int block_size = 4096;
+
+static char block[block_size];
+
+static void transfer(int fd, int blocks, bool write, bool random)
+{
+  uint32_t state = 1;
+
+  if (!random)
+    verify(syscall3(seek, fd, 0, SEEK_BEG));
+
+  for (int i = 0; i < blocks; ++i) {
+    if (random)
+      verify(syscall3(seek, fd, (next_random(state) % blocks) * block_size, SEEK_BEG));
+
+    int ret = write ?
+      syscall3(write, fd, block, block_size) :
+      syscall3(read, fd, block, block_size);
+
+    if (verify(ret) != block_size) {
+      puts("filebench: short transfer");
+      syscall1(exit, 1);
+    }
+  }
+}
+
+static void measure(const char *name, int fd, int blocks, bool write, bool random)
+{
+  uint64_t start_time = current_time();
+  transfer(fd, blocks, write, random);
+
+  uint32_t elapsed_ms = max<uint32_t>(current_time() - start_time, 1);
+  uint32_t kib = blocks * (block_size / 1024);
+  puts(1, format<128>("filebench: %s: %d KiB in %d ms, %d KiB/s\n",
+                      name,
+                      kib,
+                      elapsed_ms,
+                      (uint32_t)((uint64_t)kib * 1000 / elapsed_ms)));
+}
+
+int main(int argc, char *argv[])
+{
+  const int blocks = parse_number(argc > 1 ? argv[1] : nullptr, 4) * 1024 * 1024 / block_size;
+
+  for (int i = 0; i < block_size; ++i)
+    block[i] = (char)i;
+
+  int fd = verify(syscall2(open, path, OPEN_CREATE|OPEN_TRUNCATE));
+
+  // The first pass allocates the pages, the second overwrites them
+  measure("sequential write (allocating)", fd, blocks, true, false);
+  measure("sequential write", fd, blocks, true, false);
+  measure("sequential read", fd, blocks, false, false);
+  measure("random write", fd, blocks, true, true);
+  measure("random read", fd, blocks, false, true);
+
+  // Give the memory back
+  verify(syscall4(control, fd, CTRL_RAMFS_TRUNCATE, 0, 0));
+  syscall1(close, fd);
+  return 0;
+}
+
+START(main);
@@ -0,0 +1,114 @@
+//
+// openbench - latency of `open` + `close` in ramfs, by number of path
+// components and by number of entries in the directory
+//
+// The first open of a path walks the directories and fills the dentry
+// cache, the following ones should be served from it. Opens of a
+// missing name measure the negative entries.
+//
+// Usage: openbench [iterations]
+//
+
+#include <support/string.h>
+#include <support/userspace.h>
+#include <kernel/syscall_decls.h>
+
+#include "bench.h"
+
+using namespace p2;
+
+static const int max_depth = 8;
+static const int directory_sizes[] = {1, 10, 100, 1000};
+
+static uint64_t rdtsc()
+{
+  uint64_t value;
+  asm volatile("rdtsc" : "=A"(value));
+  return value;
+}
+
+static void create_dir(const char *path)
+{
+  int fd = syscall2(open, path, 0);
+
+  if (fd < 0)
+    verify(syscall1(mkdir, path));
+  else
+    syscall1(close, fd);
+}
+
+static void create_file(const char *path)
+{
+  syscall1(close, verify(syscall2(open, path, OPEN_CREATE)));
+}
+
+static uint32_t open_cycles(const char *path)
+{
+  uint64_t start = rdtsc();
+  int fd = syscall2(open, path, 0);
+  uint64_t elapsed = rdtsc() - start;
+
+  if (fd >= 0)
+    syscall1(close, fd);
+
+  return (uint32_t)elapsed;
+}
+
+//
+// measure - prints the cycles of the first open of @path, then the
+// average of @iterations more
+//
+static void measure(const char *label, const char *path, int iterations)
+{
+  uint32_t cold = open_cycles(path);
+  uint64_t total = 0;
+
+  for (int i = 0; i < iterations; ++i)
+    total += open_cycles(path);
+
+  puts(1, format<128>("openbench: %s: first %d cycles, then %d cycles/open\n",
+                      label,
+                      cold,
+                      (uint32_t)(total / iterations)));
+}
+
+int main(int argc, char *argv[])
+{
+  const int iterations = parse_number(argc > 1 ? argv[1] : nullptr, 1000);
+
+  // /ramfs/f, /ramfs/o/f, /ramfs/o/o/f, ...
+  string<64> dir("/ramfs");
+
+  for (int depth = 1; depth <= max_depth; ++depth) {
+    if (depth > 1) {
+      dir.append("/o");
+      create_dir(dir.c_str());
+    }
+
+    string<64> path(dir);
+    path.append("/f");
+    create_file(path.c_str());
+    measure(format<32>("%d components", depth + 1).str().c_str(), path.c_str(), iterations);
+  }
+
+  for (int size : directory_sizes) {
+    string<32> dir = format<32>("/ramfs/s%d", size).str();
+    create_dir(dir.c_str());
+
+    for (int i = 0; i < size; ++i)
+      create_file(format<32>("%s/e%d", dir.c_str(), i).str().c_str());
+
+    // New entries go first in the list, so e0 is the furthest away
+    measure(format<32>("%d entries", size).str().c_str(),
+            format<32>("%s/e0", dir.c_str()).str().c_str(),
+            iterations);
+
+    measure(format<32>("%d entries, missing", size).str().c_str(),
+            format<32>("%s/missing", dir.c_str()).str().c_str(),
+            iterations);
+  }
+
+  return 0;
+}
+
+START(main);
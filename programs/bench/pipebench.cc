@@ -0,0 +1,84 @@
+//
+// pipebench - throughput of a pipe between two processes
+//
+// For each write size from 1 byte to 64 KiB, forks a reader that
+// drains a new pipe into a page aligned buffer while this process
+// writes to it. Whole pages are handed to the reader without being
+// copied, which shows up as pipe_pages_moved in /proc/stat.
+//
+// Usage: pipebench
+//
+
+#include <support/userspace.h>
+#include <kernel/syscall_decls.h>
+
+#include "bench.h"
+
+using namespace p2;
+
+static const int chunk_size = 64 * 1024;
+static const int write_sizes[] = {1, 64, 512, 4096, 16384, 65536};
+
+alignas(0x1000) static char buffer[chunk_size];
+
+static int drain(int fd, int expected)
+{
+  int total = 0;
+
+  while (int ret = verify(syscall3(read, fd, buffer, chunk_size)))
+    total += ret;
+
+  if (total != expected) {
+    puts(1, format<128>("pipebench: FAIL, read %d bytes out of %d\n", total, expected));
+    return 1;
+  }
+
+  return 0;
+}
+
+static void measure(int write_size)
+{
+  // Enough writes to time, but no more than a few MiB
+  const int total = min(max(write_size * 1024, 64 * 1024), 8 * 1024 * 1024);
+  int fds[2];
+  verify(syscall1(pipe, fds));
+
+  int pid = verify(syscall0(fork));
+
+  if (pid == 0) {
+    syscall1(close, fds[1]);
+    syscall1(exit, drain(fds[0], total));
+  }
+
+  syscall1(close, fds[0]);
+  uint64_t start_time = current_time();
+
+  for (int left = total; left > 0;)
+    left -= verify(syscall3(write, fds[1], buffer, min(write_size, left)));
+
+  // The reader stops at the end of the pipe
+  syscall1(close, fds[1]);
+  syscall1(wait, pid);
+
+  uint32_t elapsed_ms = max<uint32_t>(current_time() - start_time, 1);
+  uint32_t kib = total / 1024;
+  puts(1, format<128>("pipebench: %d byte writes: %d KiB in %d ms, %d KiB/s, %d MB/s\n",
+                      write_size,
+                      kib,
+                      elapsed_ms,
+                      (uint32_t)((uint64_t)kib * 1000 / elapsed_ms),
+                      (uint32_t)((uint64_t)total * 1000 / elapsed_ms / (1024 * 1024))));
+}
+
+int main(int, char *[])
+{
+  memset(buffer, 'x', sizeof(buffer));
+
+  for (int write_size : write_sizes)
+    measure(write_size);
+
+  puts(1, format<64>("pipebench: done\n"));
+  return 0;
+}
+
+START(main);
@@ -0,0 +1,61 @@
+//
+// spawnbench - how many trivial commands per second we can start,
+// comparing `fork` + `exec` with `spawn`
+//
+// Usage: spawnbench [iterations]
+//
+
+#include <support/userspace.h>
+#include <kernel/syscall_decls.h>
+
+#include "bench.h"
+
+using namespace p2;
+
+static const char *command = "/initrd/bin/true";
+
+static void run_fork_exec()
+{
+  const char *argv[] = {command, nullptr};
+
+  if (int child_pid = verify(syscall0(fork)); child_pid != 0) {
+    syscall1(wait, child_pid);
+  }
+  else {
+    syscall2(exec, command, argv);
+    syscall1(exit, 127);
+  }
+}
+
+static void run_spawn()
+{
+  const char *argv[] = {command, nullptr};
+  const int fd_map[] = {0, 1, 2};
+  syscall1(wait, verify(syscall4(spawn, command, argv, fd_map, ARRAY_SIZE(fd_map))));
+}
+
+static void measure(const char *name, void (*run)(), int iterations)
+{
+  uint64_t start_time = current_time();
+
+  for (int i = 0; i < iterations; ++i)
+    run();
+
+  uint32_t elapsed_ms = max<uint32_t>(current_time() - start_time, 1);
+  puts(1, format<128>("spawnbench: %s: %d commands in %d ms, %d commands/s\n",
+                      name,
+                      iterations,
+                      elapsed_ms,
+                      (uint32_t)((uint64_t)iterations * 1000 / elapsed_ms)));
+}
+
+int main(int argc, char *argv[])
+{
+  const int iterations = parse_number(argc > 1 ? argv[1] : nullptr, 200);
+
+  measure("fork+exec", run_fork_exec, iterations);
+  measure("spawn", run_spawn, iterations);
+  return 0;
+}
+
+START(main);
@@ -0,0 +1,12 @@
+//
+// true - does nothing, successfully. Used to measure process startup.
+//
+
+#include <support/userspace.h>
+
+int main(int, char *[])
+{
+  return 0;
+}
+
+START(main);
@@ -0,0 +1,57 @@
+//
+// cat - writes files to stdout, or stdin if there are none
+//
+// The contents are moved by `sendfile`, so they never pass through
+// this process.
+//
+// Usage: cat [file]...
+//
+
+#include <support/string.h>
+#include <support/userspace.h>
+#include <kernel/syscall_decls.h>
+
+using namespace p2;
+
+static int send(int fd, const char *filename)
+{
+  int ret;
+  while ((ret = syscall4(sendfile, 1, fd, nullptr, 0x10000)) > 0);
+
+  if (ret < 0) {
+    puts(0, format<128>("cat: %s: failed to send\n", filename));
+    return 1;
+  }
+
+  return 0;
+}
+
+static int send(const char *filename)
+{
+  int fd = syscall2(open, filename, 0);
+
+  if (fd < 0) {
+    puts(0, format<128>("cat: %s: failed to open\n", filename));
+    return 1;
+  }
+
+  int status = send(fd, filename);
+  syscall1(close, fd);
+  return status;
+}
+
+int main(int argc, char *argv[])
+{
+  // Typically the end of a pipe
+  if (argc < 2)
+    return send(0, "stdin");
+
+  int status = 0;
+
+  for (int i = 1; i < argc; ++i)
+    status |= send(argv[i]);
+
+  return status;
+}
+
+START(main);
@@ -1,6 +1,7 @@
 #include <support/logging.h>
 #include <support/userspace.h>
 #include <support/limits.h>
+#include <support/ring.h>
 
 #include <kernel/syscall_decls.h>
 #include <net/protocol_stack.h>
@@ -14,22 +15,61 @@ using namespace p2;
 
 extern "C" void _init();
 static int fetch_hwaddr(int fd, net::ethernet::address *hwaddr);
-static void feed_data(int fd, net::protocol_stack &protocols);
+static void run_event_loop(int fd, net::protocol_stack &protocols);
 static void configure_ethernet(int fd, net::ethernet::protocol &ethernet);
 
+// What a completion belongs to
+enum {
+  EVENT_RECEIVE = 1,
+  EVENT_TICK,
+  EVENT_SEND,
+};
+
+namespace {
+  // Reads, timeouts and sends all go through one ring, so a whole
+  // iteration of the event loop is a single syscall
+  p2::io_ring<64> ring;
+}
+
+//
+// file_device - queues frames on the ring. They're written when the
+// event loop enters the ring next time.
+//
 class file_device : public net::device {
 public:
-  int send(const char *data, size_t length) final
+  int send(const net::ethernet::frame_part *parts, size_t count) final
   {
+    size_t length = 0;
+    for (size_t i = 0; i < count; ++i)
+      length += parts[i].length;
+
     assert(length < p2::numeric_limits<uint16_t>::max());
 
+    if (_buffers_used == ARRAY_SIZE(_buffers) || length > sizeof(_buffers[0]) - sizeof(uint16_t)) {
+      log_error("no transmit buffer for %d bytes", length);
+      return -1;
+    }
+
+    // The write is done when the ring is entered, after the parts are
+    // gone, so this is the one place the frame gets copied. The driver
+    // expects the length prefix and frame in the same write
+    char *buffer = _buffers[_buffers_used];
     uint16_t packet_size = length;
-    int ret = syscall3(write, _fd, reinterpret_cast<char *>(&packet_size), sizeof(packet_size));
+    memcpy(buffer, &packet_size, sizeof(packet_size));
+
+    char *frame = buffer + sizeof(packet_size);
+    for (size_t i = 0; i < count; ++i) {
+      memcpy(frame, parts[i].data, parts[i].length);
+      frame += parts[i].length;
+    }
 
-    if (ret <= 0)
-      return ret;
+    if (!ring.prepare(RING_OP_WRITE, _fd, buffer, sizeof(packet_size) + length, EVENT_SEND)) {
+      log_error("submission ring full");
+      return -1;
+    }
 
-    return syscall3(write, _fd, data, length);
+    ++_buffers_used;
+    return length;
   }
 
   void set_fd(int fd)
@@ -37,8 +77,21 @@ public:
     _fd = fd;
   }
 
+  // Writes complete as soon as the ring is entered
+  size_t pending_sends() const
+  {
+    return _buffers_used;
+  }
+
+  void release_buffers()
+  {
+    _buffers_used = 0;
+  }
+
 private:
   int _fd = -1;
+  char _buffers[16][1520];
+  size_t _buffers_used = 0;
 };
 
 class http_server : public net::tcp::callback {
@@ -92,7 +145,8 @@ int main(int argc, char *argv[])
     protocols.tcp().set_callback(&server);
     protocols.tcp().listen({0, 8080});
 
-    feed_data(fd, protocols);
+    verify(ring.setup());
+    run_event_loop(fd, protocols);
   }
 
   verify(syscall1(close, fd));
@@ -114,48 +168,101 @@ void configure_ethernet(int fd, net::ethernet::protocol &ethernet)
   ethernet.configure(hwaddr);
 }
 
-void feed_data(int fd, net::protocol_stack &protocols)
+//
+// feed_frames - hands the complete frames in @buffer to the stack. The
+// driver's stream is 16 bit lengths each followed by a frame, but a
+// read can end anywhere. Returns the number of bytes consumed.
+//
+static size_t feed_frames(const char *buffer, size_t size, net::protocol_stack &protocols)
 {
-  uint16_t packet_size = 0;
-  const int timeout_duration = 200;
+  size_t consumed = 0;
 
-  uint64_t last_tick = 0;
-  syscall1(currenttime, &last_tick);
+  while (size - consumed >= sizeof(uint16_t)) {
+    uint16_t packet_size = 0;
+    memcpy(&packet_size, buffer + consumed, sizeof(packet_size));
 
-  while (true) {
-    verify(syscall1(set_timeout, timeout_duration));
-    int ret = read(fd, (char *)&packet_size, 2);
+    if (size - consumed - sizeof(packet_size) < packet_size)
+      break;
 
-    // TODO: can we skip the syscall here? let the kernel write to the
-    // variable immediately somehow?
-    uint64_t this_tick = 0;
-    syscall1(currenttime, &this_tick);
+    protocols.ethernet().on_receive(buffer + consumed + sizeof(packet_size), packet_size);
+    consumed += sizeof(packet_size) + packet_size;
+  }
 
-    int tick_delta_ms = this_tick - last_tick;
-    last_tick = this_tick;
-    protocols.tick(tick_delta_ms);
+  return consumed;
+}
 
-    if (ret == ETIMEOUT) {
-      continue;
-    }
-    else if (ret < 0) {
-      log_error("read from ethernet file descriptor failed, error=%d", ret);
-      return;
+//
+// run_event_loop - keeps a read in flight, and a timeout when the
+// stack has a timer running, and feeds the stack whatever completes.
+// Frames sent while handling completions are submitted together with
+// the next wait.
+//
+void run_event_loop(int fd, net::protocol_stack &protocols)
+{
+  static char rx_buffer[4096];
+  size_t rx_size = 0;
+  bool timer_armed = false;
+
+  ring.prepare(RING_OP_READ, fd, rx_buffer, sizeof(rx_buffer), EVENT_RECEIVE);
+
+  while (true) {
+    // Sleep until the next protocol timer, or until input if there
+    // are no timers
+    if (int timeout = protocols.next_timeout(); !timer_armed && timeout >= 0) {
+      ring.prepare(RING_OP_TIMEOUT, -1, nullptr, p2::max(timeout, 1), EVENT_TICK);
+      timer_armed = true;
     }
 
-    char pdu[1518];
-    ret = read(fd, pdu, packet_size);
+    // Wait for something besides our own sends
+    int ret = ring.enter(device.pending_sends() + 1);
 
     if (ret < 0) {
-      log_error("read failed with error=%d", ret);
+      log_error("entering ring failed, error=%d", ret);
       return;
     }
-    else if (ret != packet_size) {
-      log_error("read failed to read all bytes, ret=%d", ret);
-      continue;
-    }
 
-    protocols.ethernet().on_receive(pdu, packet_size);
+    assert(ring.unsubmitted() == 0);
+    device.release_buffers();
+
+    ring_cqe_t cqe;
+
+    while (ring.pop(cqe)) {
+      switch (cqe.user_data) {
+      case EVENT_RECEIVE:
+        if (cqe.result < 0) {
+          log_error("read from ethernet file descriptor failed, error=%d", cqe.result);
+          return;
+        }
+
+        rx_size += cqe.result;
+
+        if (size_t consumed = feed_frames(rx_buffer, rx_size, protocols); consumed > 0) {
+          // Move the start of an incomplete frame to the front
+          rx_size -= consumed;
+
+          for (size_t i = 0; i < rx_size; ++i)
+            rx_buffer[i] = rx_buffer[consumed + i];
+        }
+        else if (rx_size == sizeof(rx_buffer)) {
+          log_error("frame larger than the receive buffer, dropping data");
+          rx_size = 0;
+        }
+
+        ring.prepare(RING_OP_READ, fd, rx_buffer + rx_size, sizeof(rx_buffer) - rx_size, EVENT_RECEIVE);
+        break;
+
+      case EVENT_TICK:
+        // The result is how long the timeout took
+        timer_armed = false;
+        protocols.tick(cqe.result);
+        break;
+
+      case EVENT_SEND:
+        if (cqe.result < 0)
+          log_error("write to ethernet file descriptor failed, error=%d", cqe.result);
+        break;
+      }
+    }
   }
 }
 
@@ -26,8 +26,15 @@ int main(int argc, char *argv[])
     syscall1(exit, 1);
   }
 
+  // Batches, so there's no limit on the size of the directory
   dirent_t entries[32];
-  int num_entries = list_dir(fd, entries, ARRAY_SIZE(entries));
+  int num_entries;
+
+  while ((num_entries = list_dir(fd, entries, ARRAY_SIZE(entries))) > 0) {
+    for (int i = 0; i < num_entries; ++i) {
+      puts(entries[i].name);
+    }
+  }
 
   if (num_entries < 0) {
     // TODO: print which error
@@ -36,11 +43,6 @@ int main(int argc, char *argv[])
   }
 
   syscall1(close, fd);
-
-  for (int i = 0; i < num_entries; ++i) {
-    puts(entries[i].name);
-  }
-
   return 0;
 }
 
@@ -0,0 +1,103 @@
+//
+// prof - controls the sampling profiler in /dev/prof
+//
+// Samples are written to stdout as text, capture the console and feed
+// it to `symbolize-profile` on the host.
+//
+// Usage: prof start [hz]
+//        prof stop
+//        prof dump
+//        prof run <program> [args...]
+//
+
+#include <support/string.h>
+#include <support/userspace.h>
+#include <kernel/syscall_decls.h>
+
+using namespace p2;
+
+static int parse_number(const char *str)
+{
+  int value = 0;
+  for (; str && *str >= '0' && *str <= '9'; ++str)
+    value = value * 10 + (*str - '0');
+
+  return value;
+}
+
+static void dump(int fd)
+{
+  char buffer[512];
+
+  print("--- prof begin ---\n");
+
+  while (int ret = verify(syscall3(read, fd, buffer, sizeof(buffer)))) {
+    verify(syscall3(write, 1, buffer, ret));
+  }
+
+  print("--- prof end ---\n");
+}
+
+//
+// run - profiles @argv[0] from start to exit, with our stdin, stdout
+// and stderr
+//
+static int run(int fd, const char *argv[])
+{
+  const int fd_map[] = {0, 1, 2};
+
+  verify(syscall4(control, fd, CTRL_PROF_START, 0, 0));
+  int pid = syscall4(spawn, argv[0], argv, fd_map, ARRAY_SIZE(fd_map));
+
+  if (pid == ENOENT) {
+    string<128> filename("/initrd/bin/");
+    filename.append(argv[0]);
+    pid = syscall4(spawn, filename.c_str(), argv, fd_map, ARRAY_SIZE(fd_map));
+  }
+
+  if (pid > 0)
+    syscall1(wait, pid);
+
+  verify(syscall4(control, fd, CTRL_PROF_STOP, 0, 0));
+
+  if (pid < 0) {
+    puts("prof: failed to spawn program");
+    return 1;
+  }
+
+  dump(fd);
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc < 2) {
+    puts("Usage: prof start [hz] | stop | dump | run <program> [args...]");
+    return 1;
+  }
+
+  int fd = verify(syscall2(open, "/dev/prof", 0));
+  const char *command = argv[1];
+
+  if (strncmp(command, "start", 6) == 0) {
+    verify(syscall4(control, fd, CTRL_PROF_START, parse_number(argc > 2 ? argv[2] : nullptr), 0));
+  }
+  else if (strncmp(command, "stop", 5) == 0) {
+    verify(syscall4(control, fd, CTRL_PROF_STOP, 0, 0));
+  }
+  else if (strncmp(command, "dump", 5) == 0) {
+    dump(fd);
+  }
+  else if (strncmp(command, "run", 4) == 0 && argc > 2) {
+    return run(fd, (const char **)argv + 2);
+  }
+  else {
+    puts("prof: unknown command");
+    return 1;
+  }
+
+  syscall1(close, fd);
+  return 0;
+}
+
+START(main);
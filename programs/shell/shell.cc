@@ -9,7 +9,9 @@ using namespace p2;
 
 static int read_line(char *out, size_t length);
 static void parse_command(char *command);
-static int execute(const command_line &line);
+static void run_pipeline(const command_line &line);
+static int execute(const command_line &line, size_t first, size_t last, const int *fd_map);
+static void print_error(int error);
 
 static char input_buffer[512];
 static size_t input_buffer_size;
@@ -93,46 +95,102 @@ static void parse_command(char *command)
     syscall1(exit, 0);
   }
   else {
-    // It's a binary, so fork and exec
-    if (int child_pid = syscall0(fork); child_pid != 0) {
-      // TODO: read exit code
-      syscall1(wait, child_pid);
+    run_pipeline(line);
+  }
+}
+
+//
+// run_pipeline - spawns the commands separated by "|", connecting the
+// stdout of each to the stdin of the next through a pipe, and waits
+// for all of them. The first and last use our stdin and stdout.
+//
+static void run_pipeline(const command_line &line)
+{
+  int child_pids[16];
+  size_t child_count = 0;
+  int input_fd = 0;
+
+  for (size_t first = 0; first < line.num_arguments();) {
+    size_t last = first;
+
+    while (last < line.num_arguments() && strncmp(line.argument(last), "|", 2) != 0)
+      ++last;
+
+    if (last == first) {
+      puts("Missing command in pipeline");
+      break;
     }
-    else {
-      syscall1(exit, execute(line));
+
+    const bool piped = last < line.num_arguments();
+    int fds[2] = {-1, -1};
+
+    if (piped) {
+      if (int ret = syscall1(pipe, fds); ret < 0) {
+        print_error(ret);
+        break;
+      }
     }
+
+    const int fd_map[] = {input_fd, piped ? fds[1] : 1, 2};
+
+    if (int child_pid = execute(line, first, last, fd_map); child_pid > 0 && child_count < ARRAY_SIZE(child_pids))
+      child_pids[child_count++] = child_pid;
+
+    // The children hold their own ends now. Readers only see the end of
+    // a pipe once every write end is closed, ours included.
+    if (input_fd != 0)
+      syscall1(close, input_fd);
+
+    if (piped)
+      syscall1(close, fds[1]);
+
+    input_fd = piped ? fds[0] : 0;
+    first = last + 1;
   }
+
+  if (input_fd != 0)
+    syscall1(close, input_fd);
+
+  // TODO: read exit codes
+  for (size_t i = 0; i < child_count; ++i)
+    syscall1(wait, child_pids[i]);
 }
 
-static int execute(const command_line &line)
+//
+// execute - spawns the command in arguments [@first, @last) with the
+// fds in @fd_map as its stdin, stdout and stderr
+//
+static int execute(const command_line &line, size_t first, size_t last, const int *fd_map)
 {
   const char *argv[32];
   size_t i = 0;
-  for (; i < line.num_arguments(); ++i) {
-    argv[i] = line.argument(i);
+  for (; first + i < last; ++i) {
+    argv[i] = line.argument(first + i);
   }
 
   argv[i] = nullptr;
 
-  int retval = syscall2(exec, line.argument(0), argv);
+  int retval = syscall4(spawn, argv[0], argv, fd_map, 3);
 
   if (retval == ENOENT) {
     // Try again but with a prefix path
-    p2::string<128> new_filename("/ramfs/bin/");
-    new_filename.append(line.argument(0));
-    retval = syscall2(exec, new_filename.c_str(), argv);
+    p2::string<128> new_filename("/initrd/bin/");
+    new_filename.append(argv[0]);
+    retval = syscall4(spawn, new_filename.c_str(), argv, fd_map, 3);
   }
 
-  if (retval < 0) {
-    char message_buf[128];
+  if (retval < 0)
+    print_error(retval);
 
-    if (int ret = syscall3(strerror, retval, message_buf, sizeof(message_buf) - 1); ret >= 0) {
-      message_buf[sizeof(message_buf) - 1] = '\0';
-      puts(message_buf);
-    }
+  return retval;
+}
 
-    return 127;
-  }
+static void print_error(int error)
+{
+  char message_buf[128];
 
-  return 0;
+  if (int ret = syscall3(strerror, error, message_buf, sizeof(message_buf) - 1); ret >= 0) {
+    message_buf[sizeof(message_buf) - 1] = '\0';
+    puts(message_buf);
+  }
 }
@@ -9,7 +9,6 @@
 
 using namespace p2;
 
-static void setup_std_fds(const char *terminal_filename);
 static void list_terminals(pool<string<32>> *terminals);
 
 int main(int, char *[])
@@ -24,16 +23,12 @@ int main(int, char *[])
     const char *filename = term_name.c_str();
     puts(0, format<64>("starting shell for %s\n", filename));
 
-    int child_pid = syscall0(fork);
+    int term_fd = verify(syscall2(open, filename, 0));
+    const int fd_map[] = {term_fd, term_fd, term_fd};
+    const char *argv[] = {"/initrd/bin/shell", nullptr};
 
-    if (child_pid != 0) {
-      child_pids.emplace_anywhere(child_pid);
-    }
-    else {
-      setup_std_fds(filename);
-      const char *argv[] = {"/ramfs/bin/shell", nullptr};
-      verify(syscall2(exec, "/ramfs/bin/shell", argv));
-    }
+    child_pids.emplace_anywhere(verify(syscall4(spawn, "/initrd/bin/shell", argv, fd_map, ARRAY_SIZE(fd_map))));
+    verify(syscall1(close, term_fd));
   }
 
   for (int child_pid : child_pids) {
@@ -48,23 +43,6 @@ int main(int, char *[])
 
 START(main);
 
-static void setup_term_at(const char *filename, int dest_fd)
-{
-  int source_fd = verify(syscall2(open, filename, OPEN_RETAIN_EXEC));
-
-  if (source_fd != dest_fd) {
-    verify(syscall2(dup2, source_fd, dest_fd));
-    verify(syscall1(close, source_fd));
-  }
-}
-
-static void setup_std_fds(const char *terminal_filename)
-{
-  setup_term_at(terminal_filename, 0);
-  setup_term_at(terminal_filename, 1);
-  setup_term_at(terminal_filename, 2);
-}
-
 static void list_terminals(pool<string<32>> *terminals)
 {
   assert(terminals);
@@ -0,0 +1,193 @@
+//
+// top - CPU time, context switches and memory usage per process
+//
+// Reads /proc twice, an interval apart, and shows how much of the
+// interval each process spent running. Percentages are of the total
+// capacity of all CPUs, so the TSC doesn't have to be calibrated.
+//
+// Usage: top [interval ms] [iterations]
+//
+
+#include <support/string.h>
+#include <support/keyvalue.h>
+#include <support/userspace.h>
+#include <kernel/syscall_decls.h>
+
+using namespace p2;
+
+#define MAX_PROCESSES 32
+
+struct process_sample {
+  int pid;
+  string<32> name;
+  string<2> state;
+  uint64_t cycles;
+  uint32_t switches;
+  uint32_t faults;
+  uint32_t resident_pages;
+};
+
+struct sample {
+  uint64_t tsc;
+  int cpus;
+  uint32_t switches;
+  uint32_t free_pages, allocated_pages;
+  int process_count;
+  process_sample processes[MAX_PROCESSES];
+};
+
+static uint64_t parse_number(const char *str)
+{
+  uint64_t value = 0;
+
+  if (!str)
+    return 0;
+
+  for (; *str >= '0' && *str <= '9'; ++str)
+    value = value * 10 + (*str - '0');
+
+  return value;
+}
+
+//
+// read_first_line - reads the key=value line at the start of @path
+//
+static bool read_first_line(const char *path, char *buf, size_t length)
+{
+  int fd = syscall2(open, path, 0);
+
+  if (fd < 0)
+    return false;
+
+  int bytes_read = read(fd, buf, length - 1);
+  syscall1(close, fd);
+
+  if (bytes_read < 0)
+    return false;
+
+  buf[bytes_read] = '\0';
+
+  for (char *pos = buf; *pos; ++pos) {
+    if (*pos == '\n') {
+      *pos = '\0';
+      break;
+    }
+  }
+
+  return true;
+}
+
+static void take_sample(sample &out)
+{
+  char line[512];
+  out = {};
+
+  verify(read_first_line("/proc/stat", line, sizeof(line)) ? 0 : -1);
+
+  {
+    keyvalue<512> values(line);
+    out.tsc = parse_number(values["cycles"]);
+    out.cpus = max<int>(parse_number(values["cpus"]), 1);
+    out.switches = parse_number(values["switches"]);
+    out.free_pages = parse_number(values["free_pages"]);
+    out.allocated_pages = parse_number(values["allocated_pages"]);
+  }
+
+  int fd = verify(syscall2(open, "/proc", 0));
+  dirent_t entries[MAX_PROCESSES + 1];
+  int num_entries = verify(list_dir(fd, entries, ARRAY_SIZE(entries)));
+  syscall1(close, fd);
+
+  for (int i = 0; i < num_entries && out.process_count < MAX_PROCESSES; ++i) {
+    if (entries[i].name[0] < '0' || entries[i].name[0] > '9')
+      continue;
+
+    // The process might be gone by now
+    if (!read_first_line(format<64>("/proc/%s/stat", entries[i].name).str().c_str(), line, sizeof(line)))
+      continue;
+
+    keyvalue<512> values(line);
+    process_sample &process = out.processes[out.process_count++];
+    process.pid = parse_number(values["pid"]);
+    process.name = values["name"] ? values["name"] : "?";
+    process.state = values["state"] ? values["state"] : "?";
+    process.cycles = parse_number(values["user_cycles"]) + parse_number(values["kernel_cycles"]);
+    process.switches = parse_number(values["switches"]);
+    process.faults = parse_number(values["linear_faults"]) +
+      parse_number(values["alloc_faults"]) +
+      parse_number(values["file_faults"]);
+    process.resident_pages = parse_number(values["resident_pages"]);
+  }
+}
+
+static const process_sample *find_process(const sample &in, int pid)
+{
+  for (int i = 0; i < in.process_count; ++i) {
+    if (in.processes[i].pid == pid)
+      return &in.processes[i];
+  }
+
+  return nullptr;
+}
+
+static void print_delta(const sample &before, const sample &after)
+{
+  const uint64_t capacity = max<uint64_t>((after.tsc - before.tsc) * after.cpus, 1);
+
+  puts(1, format<128>("%d processes, %d CPUs, %d switches, %d KB used, %d KB free\n",
+                      after.process_count,
+                      after.cpus,
+                      after.switches - before.switches,
+                      after.allocated_pages * 4,
+                      after.free_pages * 4));
+
+  print("  PID NAME                 S  %CPU SWITCHES   FAULTS      RSS\n");
+
+  for (int i = 0; i < after.process_count; ++i) {
+    const process_sample &process = after.processes[i];
+    const process_sample *previous = find_process(before, process.pid);
+
+    // Processes started during the interval are measured from zero
+    uint64_t cycles = process.cycles - (previous ? previous->cycles : 0);
+    uint32_t switches = process.switches - (previous ? previous->switches : 0);
+    uint32_t permille = min<uint64_t>(cycles * 1000 / capacity, 1000);
+
+    string<32> name = process.name;
+    while (name.size() < 20)
+      name.append(' ');
+
+    puts(1, format<128>("% 5d %s %s % 3d.%d % 8d % 8d % 7dK\n",
+                        process.pid,
+                        name.c_str(),
+                        process.state.c_str(),
+                        permille / 10,
+                        permille % 10,
+                        switches,
+                        process.faults,
+                        process.resident_pages * 4));
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  const int interval = max<int>(parse_number(argc > 1 ? argv[1] : nullptr), 0) ?: 1000;
+  const int iterations = max<int>(parse_number(argc > 2 ? argv[2] : nullptr), 0) ?: 1;
+
+  static sample samples[2];
+  volatile uint32_t sleep_word = 0;
+
+  take_sample(samples[0]);
+
+  for (int i = 0; i < iterations; ++i) {
+    syscall3(futex_wait, &sleep_word, 0, interval);
+
+    sample &before = samples[i % 2];
+    sample &after = samples[(i + 1) % 2];
+    take_sample(after);
+    print_delta(before, after);
+  }
+
+  return 0;
+}
+
+START(main);
@@ -0,0 +1,162 @@
+//
+// trace - controls the tracepoints in /dev/trace
+//
+// Records are written to stdout as hex lines, capture the console and
+// feed it to `trace2json` on the host to get a Chrome trace.
+//
+// Usage: trace start
+//        trace stop
+//        trace dump
+//        trace run <program> [args...]
+//
+
+#include <support/string.h>
+#include <support/thread.h>
+#include <support/userspace.h>
+#include <kernel/syscall_decls.h>
+
+using namespace p2;
+
+#define MAX_RECORDS 16384
+
+// Records drained while a program runs, so the kernel's ring doesn't
+// overflow
+static trace_record_t records[MAX_RECORDS];
+static volatile int record_count = 0;
+static volatile bool program_done = false;
+
+static int drain(int fd)
+{
+  int space = MAX_RECORDS - record_count;
+
+  if (space == 0)
+    return 0;
+
+  int ret = verify(syscall3(read, fd, (char *)&records[record_count], space * sizeof(trace_record_t)));
+  record_count = record_count + ret / sizeof(trace_record_t);
+  return ret;
+}
+
+static void print_records(const trace_record_t *first, int count)
+{
+  static const char digits[] = "0123456789abcdef";
+  char line[2 + sizeof(trace_record_t) * 2 + 1] = "T ";
+
+  for (int i = 0; i < count; ++i) {
+    const uint8_t *bytes = (const uint8_t *)&first[i];
+
+    for (size_t j = 0; j < sizeof(trace_record_t); ++j) {
+      line[2 + j * 2] = digits[bytes[j] >> 4];
+      line[2 + j * 2 + 1] = digits[bytes[j] & 0xF];
+    }
+
+    line[sizeof(line) - 1] = '\n';
+    verify(syscall3(write, 1, line, sizeof(line)));
+  }
+}
+
+static void dump(int fd)
+{
+  print("--- trace begin ---\n");
+
+  while (true) {
+    trace_record_t chunk[32];
+    int ret = verify(syscall3(read, fd, (char *)chunk, sizeof(chunk)));
+
+    if (ret == 0)
+      break;
+
+    print_records(chunk, ret / sizeof(trace_record_t));
+  }
+
+  print("--- trace end ---\n");
+}
+
+static int drain_thread(void *arg)
+{
+  int fd = (int)(uintptr_t)arg;
+  pollfd_t pfd = {fd, POLL_IN, 0};
+
+  while (!program_done) {
+    // Nobody notifies on new records, so this is a periodic drain
+    syscall3(poll, &pfd, 1, 50);
+    drain(fd);
+  }
+
+  return 0;
+}
+
+//
+// run - traces @argv[0] from start to exit, with our stdin, stdout
+// and stderr. Records are kept in memory until the program is done
+// so writing them doesn't show up in the trace.
+//
+static int run(int fd, const char *argv[])
+{
+  const int fd_map[] = {0, 1, 2};
+
+  verify(syscall4(control, fd, CTRL_TRACE_START, 0, 0));
+  int tid = verify(thread_create(drain_thread, (void *)(uintptr_t)fd));
+  int pid = syscall4(spawn, argv[0], argv, fd_map, ARRAY_SIZE(fd_map));
+
+  if (pid == ENOENT) {
+    string<128> filename("/initrd/bin/");
+    filename.append(argv[0]);
+    pid = syscall4(spawn, filename.c_str(), argv, fd_map, ARRAY_SIZE(fd_map));
+  }
+
+  if (pid > 0)
+    syscall1(wait, pid);
+
+  verify(syscall4(control, fd, CTRL_TRACE_STOP, 0, 0));
+  program_done = true;
+  thread_join(tid);
+  drain(fd);
+
+  if (pid < 0) {
+    puts("trace: failed to spawn program");
+    return 1;
+  }
+
+  print("--- trace begin ---\n");
+  print_records(records, record_count);
+  print("--- trace end ---\n");
+
+  if (record_count == MAX_RECORDS)
+    puts("trace: buffer full, the end of the trace is missing");
+
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc < 2) {
+    puts("Usage: trace start | stop | dump | run <program> [args...]");
+    return 1;
+  }
+
+  int fd = verify(syscall2(open, "/dev/trace", 0));
+  const char *command = argv[1];
+
+  if (strncmp(command, "start", 6) == 0) {
+    verify(syscall4(control, fd, CTRL_TRACE_START, 0, 0));
+  }
+  else if (strncmp(command, "stop", 5) == 0) {
+    verify(syscall4(control, fd, CTRL_TRACE_STOP, 0, 0));
+  }
+  else if (strncmp(command, "dump", 5) == 0) {
+    dump(fd);
+  }
+  else if (strncmp(command, "run", 4) == 0 && argc > 2) {
+    return run(fd, (const char **)argv + 2);
+  }
+  else {
+    puts("trace: unknown command");
+    return 1;
+  }
+
+  syscall1(close, fd);
+  return 0;
+}
+
+START(main);
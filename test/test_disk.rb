@@ -0,0 +1,64 @@
+KERNEL_BUILDS = [
+  make_kernel('OPT_FLAGS' => '-O0'),
+  make_kernel('OPT_FLAGS' => '-O3')
+]
+
+scenario "disk" do
+  it "reads files from the tar on the disk" do
+    successfully_expects <<~'EOS'
+      expect "> "
+      send "/initrd/bin/cat /disk/data/hello.txt\r"
+
+      expect {
+        "read from the disk" {}
+        timeout { exit 1 }
+      }
+
+      expect "> "
+      send "exit\r"
+      expect eof
+    EOS
+  end
+
+  it "benchmarks cold and warm reads" do
+    successfully_expects <<~'EOS'
+      expect "> "
+      send "/initrd/bin/diskbench\r"
+
+      expect {
+        "diskbench: can't open" { exit 1 }
+        "diskbench: done" {}
+        timeout { exit 1 }
+      }
+
+      expect "> "
+      send "exit\r"
+      expect eof
+    EOS
+  end
+
+  it "reads ahead of sequential readers" do
+    successfully_expects <<~'EOS'
+      expect "> "
+      send "/initrd/bin/diskbench\r"
+      expect "diskbench: done"
+      expect "> "
+      send "/initrd/bin/cat /proc/stat\r"
+
+      expect {
+        -re {readahead_hits=[1-9]} {}
+        timeout { exit 1 }
+      }
+
+      expect "> "
+      send "exit\r"
+      expect eof
+    EOS
+  end
+end
+
+scenario "qemu i386 multiboot" do
+  builds KERNEL_BUILDS
+  command "./run-qemu test-shell"
+  it_successfully_runs "disk"
+end
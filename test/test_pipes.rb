@@ -0,0 +1,59 @@
+KERNEL_BUILDS = [
+  make_kernel('OPT_FLAGS' => '-O0'),
+  make_kernel('OPT_FLAGS' => '-O3')
+]
+
+scenario "pipes" do
+  it "connects a pipeline" do
+    successfully_expects <<~'EOS'
+      expect "> "
+      send "/initrd/bin/cat /proc/stat | /initrd/bin/cat | /initrd/bin/cat\r"
+
+      expect {
+        -re {pipe_bytes=[0-9]+} {}
+        timeout { exit 1 }
+      }
+
+      expect "> "
+      send "exit\r"
+      expect eof
+    EOS
+  end
+
+  it "benchmarks writes of every size" do
+    successfully_expects <<~'EOS'
+      expect "> "
+      send "/initrd/bin/pipebench | /initrd/bin/cat\r"
+
+      expect {
+        "pipebench: FAIL" { exit 1 }
+        "pipebench: done" {}
+        timeout { exit 1 }
+      }
+
+      expect "> "
+      send "/initrd/bin/cat /proc/stat\r"
+
+      expect {
+        -re {pipe_pages_moved=[1-9]} {}
+        timeout { exit 1 }
+      }
+
+      expect "> "
+      send "exit\r"
+      expect eof
+    EOS
+  end
+end
+
+scenario "qemu i386 multiboot" do
+  builds KERNEL_BUILDS
+  command "./run-qemu test-shell"
+  it_successfully_runs "pipes"
+end
+
+scenario "qemu i386 multiboot smp" do
+  builds KERNEL_BUILDS
+  command "./run-qemu test-shell-smp"
+  it_successfully_runs "pipes"
+end
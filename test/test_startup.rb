@@ -10,6 +10,25 @@ scenario "startup" do
       expect "WELCOME TO SHELL" { exit 0 }
     EOS
   end
+
+  it "reports the boot-to-shell time" do
+    successfully_expects <<~'EOS'
+      set start [clock milliseconds]
+
+      expect {
+        -re {init: ([0-9]+) ms since boot} { set kernel_ms $expect_out(1,string) }
+        timeout { exit 1 }
+      }
+
+      expect {
+        "WELCOME TO SHELL" {}
+        timeout { exit 1 }
+      }
+
+      send_user "\nboot to shell: [expr {[clock milliseconds] - $start}] ms wall, init reached after $kernel_ms ms\n"
+      exit 0
+    EOS
+  end
 end
 
 scenario "qemu i386 image" do
@@ -0,0 +1,35 @@
+KERNEL_BUILDS = [
+  make_kernel('OPT_FLAGS' => '-O0'),
+  make_kernel('OPT_FLAGS' => '-O3')
+]
+
+scenario "file descriptor stress test" do
+  it "opens thousands of files across many processes" do
+    successfully_expects <<~'EOS'
+      expect "> "
+      send "/initrd/bin/fdstress 16 256\r"
+
+      expect {
+        "fdstress: FAIL" { exit 1 }
+        "fdstress: done" {}
+        timeout { exit 1 }
+      }
+
+      expect "> "
+      send "exit\r"
+      expect eof
+    EOS
+  end
+end
+
+scenario "qemu i386 multiboot" do
+  builds KERNEL_BUILDS
+  command "./run-qemu test-shell"
+  it_successfully_runs "file descriptor stress test"
+end
+
+scenario "qemu i386 multiboot smp" do
+  builds KERNEL_BUILDS
+  command "./run-qemu test-shell-smp"
+  it_successfully_runs "file descriptor stress test"
+end
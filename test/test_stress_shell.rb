@@ -22,7 +22,7 @@ scenario "simple shell stress test" do
         for {set a 0} {$a < 9} {incr a 1} {
           expect "> "
           sleep 0.001
-          send "/ramfs/bin/shell\r"
+          send "/initrd/bin/shell\r"
           expect "WELCOME TO SHELL"
         }
 
@@ -45,6 +45,12 @@ scenario "qemu i386 multiboot" do
   it_successfully_runs "simple shell stress test"
 end
 
+scenario "qemu i386 multiboot smp" do
+  builds KERNEL_BUILDS
+  command "./run-qemu test-shell-smp"
+  it_successfully_runs "simple shell stress test"
+end
+
 scenario "qemu i386 image" do
   builds KERNEL_BUILDS
   command "./run-qemu test-cdrom"